@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "pHash.h"
+
+// BK-tree queries against the linear scan they replace. Range queries are
+// timed against phash_scan_within and nearest queries against phash_knn
+// with k = 1, on uniformly random hashes (the worst case for the tree)
+// and on clusters of near copies. Times are microseconds per query.
+//
+// Usage: bench_phash [count] [queries]
+
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Random hashes, or copies of count / 64 random centers with about 4 bits
+// flipped each
+static void fill_hashes(uint64_t* hashes, size_t count, int clustered, uint64_t seed) {
+    uint64_t state = seed;
+    const size_t centers = count / 64 ? count / 64 : 1;
+    for (size_t i = 0; i < count; i++) {
+        const uint64_t r = next_random(&state);
+        if (!clustered || i < centers) {
+            hashes[i] = r;
+        } else {
+            const uint64_t noise = next_random(&state);
+            hashes[i] = hashes[r % centers] ^ (noise & noise >> 13 & noise >> 29 & noise >> 43);
+        }
+    }
+}
+
+static int check(PhashError err, const char* what) {
+    if (err == PHASH_OK) return 0;
+    fprintf(stderr, "%s: %s\n", what, phash_error_string(err));
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    static const int radii[] = { 0, 2, 4, 10 };
+    static const char* const data_names[] = { "random", "clustered" };
+    const size_t count = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1000000;
+    const size_t queries = (argc > 2) ? strtoul(argv[2], NULL, 10) : 200;
+    PhashError err;
+
+    if (!count || !queries) {
+        printf("Usage: %s [count] [queries]\n", argv[0]);
+        return 1;
+    }
+    if (check(phash_initialize(), "phash_initialize")) return 1;
+
+    uint64_t* hashes = malloc(count * sizeof(uint64_t));
+    uint64_t* probes = malloc(queries * sizeof(uint64_t));
+    size_t* indices = malloc(count * sizeof(size_t));
+    PhashMatch* matches = malloc(count * sizeof(PhashMatch));
+    if (!hashes || !probes || !indices || !matches) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    printf("%zu hashes, %zu queries, microseconds per query\n\n", count, queries);
+    printf("%-10s %-8s %12s %12s %12s\n", "data", "query", "linear scan", "bktree",
+           "optimized");
+
+    for (int data = 0; data < 2; data++) {
+        PhashBkTree* tree = NULL;
+        uint64_t state = 0x9E3779B97F4A7C15ULL;
+        fill_hashes(hashes, count, data, 0x2545F4914F6CDD1DULL);
+        // Stored hashes with one bit flipped
+        for (size_t q = 0; q < queries; q++) {
+            probes[q] = hashes[next_random(&state) % count] ^ (1ULL << (q % 64));
+        }
+
+        if (check(phash_bktree_create(&tree), "phash_bktree_create")) return 1;
+        for (size_t i = 0; i < count; i++) {
+            if (check(phash_bktree_insert(tree, hashes[i], i), "phash_bktree_insert"))
+                return 1;
+        }
+
+        // Range queries; columns 1 and 2 are the tree before and after
+        // phash_bktree_optimize, which is applied after the first pass
+        double range_us[4][3] = { { 0 } };
+        double nearest_us[3] = { 0 };
+        for (int pass = 0; pass < 2; pass++) {
+            if (pass == 1 && check(phash_bktree_optimize(tree), "phash_bktree_optimize"))
+                return 1;
+
+            // Untimed: the tree and the scan must agree
+            for (int r = 0; r < 4; r++) {
+                for (size_t q = 0; q < queries; q++) {
+                    size_t found = 0, scanned = 0;
+                    err = phash_bktree_query(tree, probes[q], radii[r], matches, count, &found);
+                    if (check(err, "phash_bktree_query")) return 1;
+                    err = phash_scan_within(probes[q], hashes, count, radii[r], indices,
+                                            &scanned);
+                    if (check(err, "phash_scan_within")) return 1;
+                    if (found != scanned) {
+                        fprintf(stderr, "bktree found %zu, scan %zu\n", found, scanned);
+                        return 1;
+                    }
+                }
+            }
+
+            for (int r = 0; r < 4; r++) {
+                const double start = now_us();
+                for (size_t q = 0; q < queries; q++) {
+                    size_t found = 0;
+                    err = phash_bktree_query(tree, probes[q], radii[r], matches, count, &found);
+                    if (check(err, "phash_bktree_query")) return 1;
+                }
+                range_us[r][1 + pass] = (now_us() - start) / queries;
+            }
+
+            const double start = now_us();
+            for (size_t q = 0; q < queries; q++) {
+                PhashMatch nearest;
+                err = phash_bktree_nearest(tree, probes[q], &nearest);
+                if (check(err, "phash_bktree_nearest")) return 1;
+            }
+            nearest_us[1 + pass] = (now_us() - start) / queries;
+        }
+
+        for (int r = 0; r < 4; r++) {
+            const double start = now_us();
+            for (size_t q = 0; q < queries; q++) {
+                size_t scanned = 0;
+                err = phash_scan_within(probes[q], hashes, count, radii[r], indices, &scanned);
+                if (check(err, "phash_scan_within")) return 1;
+            }
+            range_us[r][0] = (now_us() - start) / queries;
+        }
+
+        const double start = now_us();
+        for (size_t q = 0; q < queries; q++) {
+            size_t id, found = 0;
+            uint8_t distance;
+            err = phash_knn(probes[q], hashes, count, 1, &id, &distance, &found);
+            if (check(err, "phash_knn")) return 1;
+        }
+        nearest_us[0] = (now_us() - start) / queries;
+
+        for (int r = 0; r < 4; r++) {
+            char label[16];
+            snprintf(label, sizeof(label), "r = %d", radii[r]);
+            printf("%-10s %-8s %12.1f %12.1f %12.1f\n", data_names[data], label,
+                   range_us[r][0], range_us[r][1], range_us[r][2]);
+        }
+        printf("%-10s %-8s %12.1f %12.1f %12.1f\n", data_names[data], "nearest",
+               nearest_us[0], nearest_us[1], nearest_us[2]);
+        phash_bktree_destroy(tree);
+    }
+
+    free(matches);
+    free(indices);
+    free(probes);
+    free(hashes);
+    return 0;
+}
@@ -2,8 +2,16 @@
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #if defined(__x86_64__) || defined(_M_X64)
 #include <immintrin.h>
+#include <cpuid.h>
 #elif defined(__aarch64__) || defined(_M_ARM64)
 #include <arm_neon.h>
 #endif
@@ -11,445 +19,6299 @@
 // Internal constants
 #define MIN_DCT_SIZE 8
 #define MAX_DCT_SIZE 64
+#define MAX_HASH_SIZE 32                   // hash_size^2 - 1 bits fit PHASH_MAX_HASH_BITS
+#define HASH64_SIZE 8                      // Widest hash_size whose bits fit a uint64_t
+#define WIDE_SCAN_CHUNK 256                // Wide distances per kernel call in a scan
+#define MAX_SAMPLES (2 * MAX_DCT_SIZE)     // Source lines one axis can touch
 #define ALIGNMENT 64
-#define AAN_SCALE_FACTOR 0.35355339059327373  // 1/sqrt(8)
 
-// SIMD optimization flags
-static bool g_avx2_enabled = 0;
-static bool g_sse4_enabled = 0;
+// Cosine basis of one DCT size. Built once for every supported size on
+// first use (see dct_tables) and read-only afterwards, so concurrent
+// computations share it without locking.
+typedef struct {
+    const double* coefficients;   // [u][x] = cos((2x + 1) u pi / 2N)
+    const double* transposed;     // [x][u], same values
+    const float* coefficients_f;  // Single-precision copies of both
+    const float* transposed_f;
+    const int32_t* coefficients_q; // [v][y] = a(v) cos in Q12 (fixed-point pipeline)
+    const int16_t* paired_q;       // Same values as [x/2][u][x%2] for project_q
+} DCTBasis;
+
+// Error messages
+static const char* ERROR_STRINGS[] = {
+    "Success",
+    "Null pointer encountered",
+    "Invalid argument value",
+    "Memory allocation failed",
+    "Unsupported operation",
+    "Domain error in mathematical function",
+    "File input/output failed",
+    "Invalid or incompatible file format"
+};
+
+// Internal functions
+static bool is_power_of_two(int value) {
+    return (value > 0) && ((value & (value - 1)) == 0);
+}
+
+// 64-bit words holding the hash_size^2 - 1 bits of a hash
+static int hash_words(int hash_size) {
+    const int bits = hash_size * hash_size - 1;
+    return (bits > 64) ? (bits + 63) / 64 : 1;
+}
+
+PhashError phash_config_validate(const PhashConfig* config) {
+    if (!config) return PHASH_ERR_NULL_POINTER;
+    
+    if (config->dct_size < MIN_DCT_SIZE || 
+        config->dct_size > MAX_DCT_SIZE ||
+        !is_power_of_two(config->dct_size)) {
+        return PHASH_ERR_INVALID_ARGUMENT;
+    }
+    
+    if (config->hash_size < 1 || 
+        config->hash_size > config->dct_size ||
+        (config->hash_size * config->hash_size) > PHASH_MAX_HASH_BITS) {
+        return PHASH_ERR_INVALID_ARGUMENT;
+    }
+
+    if (config->threshold != THRESHOLD_MEAN && config->threshold != THRESHOLD_MEDIAN) {
+        return PHASH_ERR_INVALID_ARGUMENT;
+    }
+
+     // Validate DCT method compatibility
+    if (config->dct_method == DCT_METHOD_LOEFFLER && config->dct_size != 8) {
+        return PHASH_ERR_UNSUPPORTED_OPERATION;
+    }
+    
+    if (config->dct_method == DCT_METHOD_AAN && 
+       !(config->dct_size == 8 || config->dct_size == 16 || 
+         config->dct_size == 32 || config->dct_size == 64)) {
+        return PHASH_ERR_UNSUPPORTED_OPERATION;
+    }
+    
+    return PHASH_OK;
+}
+
+// Per-channel weights of each grayscale conversion
+static void grayscale_weights(ColorSpaceConversion method, double weights[3]) {
+    switch (method) {
+        case COLORSPACE_AVERAGE:
+            weights[0] = weights[1] = weights[2] = 1.0 / 3.0;
+            break;
+        case COLORSPACE_REC709:
+            weights[0] = 0.2126; weights[1] = 0.7152; weights[2] = 0.0722;
+            break;
+        case COLORSPACE_REC2100:
+            weights[0] = 0.2627; weights[1] = 0.6780; weights[2] = 0.0593;
+            break;
+        case COLORSPACE_REC601:
+        default:
+            weights[0] = 0.299; weights[1] = 0.587; weights[2] = 0.114;
+            break;
+    }
+}
+
+static void grayscale_weights_f(ColorSpaceConversion method, float weights[3]) {
+    double w[3];
+    grayscale_weights(method, w);
+    for (int i = 0; i < 3; i++) weights[i] = (float)w[i];
+}
+
+// ---------------------------------------------------------------------------
+// Kernel dispatch
+//
+// Hot loops are reached through a table of function pointers filled by
+// phash_initialize from the CPU features detected at runtime. Only the
+// kernels in this table are compiled for instruction sets above the
+// baseline (via target attributes), so the library runs on any CPU of its
+// architecture. Every variant performs the same double (or, for the _f
+// kernels, float) operations in the same order as the scalar one (no FMA
+// contraction), so hashes do not depend on the SIMD level. The _q kernels
+// are exact integer arithmetic and agree by construction.
+// ---------------------------------------------------------------------------
+
+#define PROJECT_LANES 8   // project() output widths are multiples of this
+#define IMAGE_LANES 16    // Images per group of the cross-image kernels
+
+// Per-column bilinear taps of the resize grid, hoisted out of the row loop
+typedef struct {
+    int offset0[MAX_DCT_SIZE];   // Byte offset of the left pixel in a row
+    int offset1[MAX_DCT_SIZE];   // Byte offset of the right pixel in a row
+    double frac[MAX_DCT_SIZE];   // Horizontal interpolation weight dx
+    float frac_f[MAX_DCT_SIZE];  // Same, single precision
+    int frac_q[MAX_DCT_SIZE];    // Same in Q8 (fixed-point pipeline)
+} ResizeColumns;
+
+typedef struct {
+    PhashSimdLevel level;
+    // One output row of resize_and_grayscale: bilinear RGB interpolation
+    // between source rows row0/row1, truncation to 8 bits, then grayscale
+    void (*resize_row)(const unsigned char* row0, const unsigned char* row1,
+                       double dy, const ResizeColumns* cols, int size,
+                       ColorSpaceConversion colorspace, double* out);
+    // Grayscale of count pixels of one row, selected by pixel index
+    void (*grayscale)(const unsigned char* line, const int* index, int count,
+                      int channels, const double weights[3], double* out);
+    // DCT projection: out[u] = sum_i samples[i] * weight[i*stride + u] for
+    // u < width, each sum accumulated in increasing i
+    void (*project)(const double* samples, int count, const double* weight,
+                    int stride, int width, double* out);
+    // Rank-1 update: acc[i*PROJECT_LANES + u] += samples[i] * weight[u]
+    void (*accumulate)(const double* samples, int count, const double* weight,
+                       double* acc);
+    // Single-precision twins of the kernels above, used when
+    // use_high_precision is off; twice as many lanes per vector
+    void (*resize_row_f)(const unsigned char* row0, const unsigned char* row1,
+                         float dy, const ResizeColumns* cols, int size,
+                         ColorSpaceConversion colorspace, float* out);
+    void (*grayscale_f)(const unsigned char* line, const int* index, int count,
+                        int channels, const float weights[3], float* out);
+    void (*project_f)(const float* samples, int count, const float* weight,
+                      int stride, int width, float* out);
+    void (*accumulate_f)(const float* samples, int count, const float* weight,
+                         float* acc);
+    // Fixed-point pipeline: one resize row with Q8 taps (dy, frac_q) and
+    // Q14 grayscale weights, producing Q4 gray levels. May load 4 bytes per
+    // pixel, so row1 must not be the last row of a 3-channel image.
+    void (*resize_row_q)(const unsigned char* row0, const unsigned char* row1,
+                         int dy, const ResizeColumns* cols, int size,
+                         const int weights[3], int16_t* out);
+    // Fixed-point projection on 16-bit lanes, count even:
+    // out[u] = sum_i samples[i] * weight[(i/2)*stride + 2u + i%2]
+    // (sample pairs interleaved for multiply-add instructions), exact in
+    // 32 bits for the value ranges of the fixed-point DCT
+    void (*project_q)(const int16_t* samples, int count, const int16_t* weight,
+                      int stride, int width, int32_t* out);
+    // Fixed-point projection of PROJECT_LANES-wide rows into 64 bits:
+    // out[u] = sum_i coeff[i] * rows[i*PROJECT_LANES + u]
+    void (*project_wide_q)(const int32_t* coeff, int count, const int32_t* rows,
+                           int64_t* out);
+    // Cross-image twins of grayscale_f/accumulate_f/project_f for
+    // IMAGE_LANES images of one geometry, image l in lane l (structure of
+    // arrays). Per lane they compute exactly what the per-image kernels do.
+    //   grayscale:  out[i][l] = gray of pixel index[i] of lines[l]; may
+    //               load 4 bytes per pixel, so the lines must not be the
+    //               last row of a 3-channel image
+    //   accumulate: acc[i][v][l] += samples[r][i][l] * weight[r][v] for
+    //               r < rows in increasing r, v < PROJECT_LANES
+    //   project:    out[v][u][l] = sum_i acc[i][v][l] * weight[i][u] for
+    //               v, u < PROJECT_LANES, accumulated in increasing i
+    // Weight rows are PROJECT_LANES wide. accumulate/project are NULL at
+    // levels where a lane is no wider than the per-image kernels' vectors;
+    // plans then hash image by image. grayscale_lanes_f is always set.
+    void (*grayscale_lanes_f)(const unsigned char* const* lines, const int* index,
+                              int count, int channels, const float weights[3],
+                              float* out);
+    void (*accumulate_lanes_f)(const float* samples, int rows, int count,
+                               const float* weight, float* acc);
+    void (*project_lanes_f)(const float* acc, int count, const float* weight,
+                            float* out);
+    // Full 8x8 AAN DCT with the library normalization, row-major, in both
+    // precisions
+    void (*dct_8x8)(const double* input, double* output);
+    void (*dct_8x8_f)(const float* input, float* output);
+    // Total number of set bits in count words
+    uint64_t (*popcount)(const uint64_t* words, size_t count);
+    // One-vs-many Hamming distances: out[i] = popcount(query ^ hashes[i])
+    void (*distances)(uint64_t query, const uint64_t* hashes, size_t count,
+                      uint8_t* out);
+    // Writes the indices i, increasing, whose distance to query is at most
+    // max_distance to out and returns how many. out must have room for
+    // count indices (entries past the result may be overwritten)
+    size_t (*scan_within)(uint64_t query, const uint64_t* hashes, size_t count,
+                          int max_distance, size_t* out);
+    // distances for hashes of words (1..PHASH_MAX_HASH_WORDS) 64-bit words,
+    // stored one after another: out[i] = popcount(query ^ hashes[i])
+    void (*distances_wide)(const uint64_t* query, const uint64_t* hashes, size_t count,
+                           int words, uint16_t* out);
+    // distances over the bits set in both masks:
+    // out[i] = popcount((query ^ hashes[i]) & query_mask & masks[i])
+    void (*distances_masked)(uint64_t query, uint64_t query_mask, const uint64_t* hashes,
+                             const uint64_t* masks, size_t count, uint8_t* out);
+} PhashKernels;
+
+static inline double gray_from_rgb(double r, double g, double b,
+                                   ColorSpaceConversion colorspace,
+                                   const double weights[3]) {
+    if (colorspace == COLORSPACE_AVERAGE) return (r + g + b) / 3.0;
+    return weights[0]*r + weights[1]*g + weights[2]*b;
+}
+
+static void resize_row_scalar(const unsigned char* row0, const unsigned char* row1,
+                              double dy, const ResizeColumns* cols, int size,
+                              ColorSpaceConversion colorspace, double* out) {
+    double weights[3];
+    grayscale_weights(colorspace, weights);
+
+    for (int x = 0; x < size; x++) {
+        const double dx = cols->frac[x];
+        const double w00 = (1.0 - dx) * (1.0 - dy);
+        const double w01 = dx * (1.0 - dy);
+        const double w10 = (1.0 - dx) * dy;
+        const double w11 = dx * dy;
+        const unsigned char* p00 = row0 + cols->offset0[x];
+        const unsigned char* p01 = row0 + cols->offset1[x];
+        const unsigned char* p10 = row1 + cols->offset0[x];
+        const unsigned char* p11 = row1 + cols->offset1[x];
+
+        // Interpolate RGB channels, truncating to 8 bits
+        double rgb[3];
+        for (int ch = 0; ch < 3; ch++) {
+            rgb[ch] = (unsigned char)(w00 * p00[ch] + w01 * p01[ch] +
+                                      w10 * p10[ch] + w11 * p11[ch]);
+        }
+        out[x] = gray_from_rgb(rgb[0], rgb[1], rgb[2], colorspace, weights);
+    }
+}
+
+static void grayscale_scalar(const unsigned char* line, const int* index, int count,
+                             int channels, const double weights[3], double* out) {
+    for (int i = 0; i < count; i++) {
+        const unsigned char* p = line + index[i]*channels;
+        out[i] = weights[0]*p[0] + weights[1]*p[1] + weights[2]*p[2];
+    }
+}
+
+// GCC's outer-loop vectorization of the scalar projection kernels is slower
+// than plain scalar code, so keep it off for them.
+#if defined(__GNUC__) && !defined(__clang__)
+#define PHASH_SCALAR __attribute__((optimize("no-tree-vectorize")))
+#else
+#define PHASH_SCALAR
+#endif
+
+PHASH_SCALAR static void project_scalar(const double* samples, int count, const double* weight,
+                           int stride, int width, double* out) {
+    for (int u0 = 0; u0 < width; u0 += PROJECT_LANES) {
+        double acc[PROJECT_LANES] = {0};
+        for (int i = 0; i < count; i++) {
+            const double* w = weight + i*stride + u0;
+            for (int u = 0; u < PROJECT_LANES; u++) acc[u] += samples[i] * w[u];
+        }
+        memcpy(out + u0, acc, sizeof(acc));
+    }
+}
+
+PHASH_SCALAR static void accumulate_scalar(const double* samples, int count, const double* weight,
+                              double* acc) {
+    double w[PROJECT_LANES];
+    memcpy(w, weight, sizeof(w));
+    for (int i = 0; i < count; i++) {
+        const double s = samples[i];
+        double* a = acc + i*PROJECT_LANES;
+        a[0] += s * w[0]; a[1] += s * w[1]; a[2] += s * w[2]; a[3] += s * w[3];
+        a[4] += s * w[4]; a[5] += s * w[5]; a[6] += s * w[6]; a[7] += s * w[7];
+    }
+}
+
+static inline float gray_from_rgb_f(float r, float g, float b,
+                                    ColorSpaceConversion colorspace,
+                                    const float weights[3]) {
+    if (colorspace == COLORSPACE_AVERAGE) return (r + g + b) / 3.0f;
+    return weights[0]*r + weights[1]*g + weights[2]*b;
+}
+
+static void resize_row_scalar_f(const unsigned char* row0, const unsigned char* row1,
+                                float dy, const ResizeColumns* cols, int size,
+                                ColorSpaceConversion colorspace, float* out) {
+    float weights[3];
+    grayscale_weights_f(colorspace, weights);
+
+    for (int x = 0; x < size; x++) {
+        const float dx = cols->frac_f[x];
+        const float w00 = (1.0f - dx) * (1.0f - dy);
+        const float w01 = dx * (1.0f - dy);
+        const float w10 = (1.0f - dx) * dy;
+        const float w11 = dx * dy;
+        const unsigned char* p00 = row0 + cols->offset0[x];
+        const unsigned char* p01 = row0 + cols->offset1[x];
+        const unsigned char* p10 = row1 + cols->offset0[x];
+        const unsigned char* p11 = row1 + cols->offset1[x];
+
+        float rgb[3];
+        for (int ch = 0; ch < 3; ch++) {
+            rgb[ch] = (unsigned char)(w00 * p00[ch] + w01 * p01[ch] +
+                                      w10 * p10[ch] + w11 * p11[ch]);
+        }
+        out[x] = gray_from_rgb_f(rgb[0], rgb[1], rgb[2], colorspace, weights);
+    }
+}
+
+static void grayscale_scalar_f(const unsigned char* line, const int* index, int count,
+                               int channels, const float weights[3], float* out) {
+    for (int i = 0; i < count; i++) {
+        const unsigned char* p = line + index[i]*channels;
+        out[i] = weights[0]*p[0] + weights[1]*p[1] + weights[2]*p[2];
+    }
+}
+
+PHASH_SCALAR static void project_scalar_f(const float* samples, int count, const float* weight,
+                                          int stride, int width, float* out) {
+    for (int u0 = 0; u0 < width; u0 += PROJECT_LANES) {
+        float acc[PROJECT_LANES] = {0};
+        for (int i = 0; i < count; i++) {
+            const float* w = weight + i*stride + u0;
+            for (int u = 0; u < PROJECT_LANES; u++) acc[u] += samples[i] * w[u];
+        }
+        memcpy(out + u0, acc, sizeof(acc));
+    }
+}
+
+PHASH_SCALAR static void accumulate_scalar_f(const float* samples, int count, const float* weight,
+                                             float* acc) {
+    float w[PROJECT_LANES];
+    memcpy(w, weight, sizeof(w));
+    for (int i = 0; i < count; i++) {
+        const float s = samples[i];
+        float* a = acc + i*PROJECT_LANES;
+        a[0] += s * w[0]; a[1] += s * w[1]; a[2] += s * w[2]; a[3] += s * w[3];
+        a[4] += s * w[4]; a[5] += s * w[5]; a[6] += s * w[6]; a[7] += s * w[7];
+    }
+}
+
+static void grayscale_lanes_scalar_f(const unsigned char* const* lines, const int* index,
+                                     int count, int channels, const float weights[3],
+                                     float* out) {
+    for (int i = 0; i < count; i++) {
+        const int offset = index[i]*channels;
+        for (int l = 0; l < IMAGE_LANES; l++) {
+            const unsigned char* p = lines[l] + offset;
+            out[i*IMAGE_LANES + l] = weights[0]*p[0] + weights[1]*p[1] + weights[2]*p[2];
+        }
+    }
+}
+
+static void resize_row_scalar_q(const unsigned char* row0, const unsigned char* row1,
+                                int dy, const ResizeColumns* cols, int size,
+                                const int weights[3], int16_t* out) {
+    for (int x = 0; x < size; x++) {
+        const int dx = cols->frac_q[x];
+        const int w00 = (256 - dx) * (256 - dy);
+        const int w01 = dx * (256 - dy);
+        const int w10 = (256 - dx) * dy;
+        const int w11 = dx * dy;
+        const unsigned char* p00 = row0 + cols->offset0[x];
+        const unsigned char* p01 = row0 + cols->offset1[x];
+        const unsigned char* p10 = row1 + cols->offset0[x];
+        const unsigned char* p11 = row1 + cols->offset1[x];
+
+        // Interpolate in Q16 and truncate to 8 bits; gray rounds Q14 -> Q4
+        int rgb[3];
+        for (int ch = 0; ch < 3; ch++) {
+            rgb[ch] = (w00 * p00[ch] + w01 * p01[ch] +
+                       w10 * p10[ch] + w11 * p11[ch]) >> 16;
+        }
+        out[x] = (int16_t)((weights[0]*rgb[0] + weights[1]*rgb[1] +
+                            weights[2]*rgb[2] + 512) >> 10);
+    }
+}
+
+static void project_scalar_q(const int16_t* samples, int count, const int16_t* weight,
+                             int stride, int width, int32_t* out) {
+    for (int u0 = 0; u0 < width; u0 += PROJECT_LANES) {
+        int32_t acc[PROJECT_LANES] = {0};
+        for (int i = 0; i < count; i++) {
+            const int16_t* w = weight + (i >> 1)*stride + 2*u0 + (i & 1);
+            for (int u = 0; u < PROJECT_LANES; u++) acc[u] += samples[i] * w[2*u];
+        }
+        memcpy(out + u0, acc, sizeof(acc));
+    }
+}
+
+static void project_wide_scalar_q(const int32_t* coeff, int count, const int32_t* rows,
+                                  int64_t* out) {
+    int64_t acc[PROJECT_LANES] = {0};
+    for (int i = 0; i < count; i++) {
+        const int32_t* r = rows + i*PROJECT_LANES;
+        for (int u = 0; u < PROJECT_LANES; u++) acc[u] += (int64_t)coeff[i] * r[u];
+    }
+    memcpy(out, acc, sizeof(acc));
+}
+
+static uint64_t popcount_scalar(const uint64_t* words, size_t count) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < count; i++) total += __builtin_popcountll(words[i]);
+    return total;
+}
+
+static void distances_scalar(uint64_t query, const uint64_t* hashes, size_t count,
+                             uint8_t* out) {
+    for (size_t i = 0; i < count; i++) out[i] = (uint8_t)__builtin_popcountll(query ^ hashes[i]);
+}
+
+// Branch-free: every index is stored, and kept only if it matches
+static size_t scan_within_scalar(uint64_t query, const uint64_t* hashes, size_t count,
+                                 int max_distance, size_t* out) {
+    size_t found = 0;
+    for (size_t i = 0; i < count; i++) {
+        out[found] = i;
+        found += (__builtin_popcountll(query ^ hashes[i]) <= max_distance);
+    }
+    return found;
+}
+
+static void distances_wide_scalar(const uint64_t* query, const uint64_t* hashes, size_t count,
+                                  int words, uint16_t* out) {
+    for (size_t i = 0; i < count; i++, hashes += words) {
+        int d = 0;
+        for (int w = 0; w < words; w++) d += __builtin_popcountll(query[w] ^ hashes[w]);
+        out[i] = (uint16_t)d;
+    }
+}
+
+static void distances_masked_scalar(uint64_t query, uint64_t query_mask, const uint64_t* hashes,
+                                    const uint64_t* masks, size_t count, uint8_t* out) {
+    for (size_t i = 0; i < count; i++) {
+        out[i] = (uint8_t)__builtin_popcountll((query ^ hashes[i]) & query_mask & masks[i]);
+    }
+}
+
+// 8-point Arai-Agui-Nakajima DCT (5 multiplications), followed by removal
+// of its per-output scale factors 2*cos(k pi / 16)
+static void dct_1d_aan8(const double* in, double* out) {
+    static const double descale[8] = {
+        1.0,                 0.50979557910415918, 0.54119610014619698,
+        0.60134488693504529, 0.70710678118654752, 0.89997622313641568,
+        1.3065629648763766,  2.5629154477415064
+    };
+    double t[8];
+
+    const double s07 = in[0] + in[7], d07 = in[0] - in[7];
+    const double s16 = in[1] + in[6], d16 = in[1] - in[6];
+    const double s25 = in[2] + in[5], d25 = in[2] - in[5];
+    const double s34 = in[3] + in[4], d34 = in[3] - in[4];
+
+    // Even part
+    const double e0 = s07 + s34, e3 = s07 - s34;
+    const double e1 = s16 + s25, e2 = s16 - s25;
+    t[0] = e0 + e1;
+    t[4] = e0 - e1;
+    const double z1 = (e2 + e3) * 0.70710678118654752;
+    t[2] = e3 + z1;
+    t[6] = e3 - z1;
+
+    // Odd part
+    const double o0 = d34 + d25, o1 = d25 + d16, o2 = d16 + d07;
+    const double z5 = (o0 - o2) * 0.38268343236508977;
+    const double z2 = o0 * 0.54119610014619698 + z5;
+    const double z4 = o2 * 1.3065629648763766 + z5;
+    const double z3 = o1 * 0.70710678118654752;
+    const double z11 = d07 + z3, z13 = d07 - z3;
+    t[5] = z13 + z2;
+    t[3] = z13 - z2;
+    t[1] = z11 + z4;
+    t[7] = z11 - z4;
+
+    for (int k = 0; k < 8; k++) out[k] = t[k] * descale[k];
+}
+
+
+// Single-precision dct_1d_aan8
+static void dct_1d_aan8_f(const float* in, float* out) {
+    static const float descale[8] = {
+        1.0f,                 0.50979557910415918f, 0.54119610014619698f,
+        0.60134488693504529f, 0.70710678118654752f, 0.89997622313641568f,
+        1.3065629648763766f,  2.5629154477415064f
+    };
+    float t[8];
+
+    const float s07 = in[0] + in[7], d07 = in[0] - in[7];
+    const float s16 = in[1] + in[6], d16 = in[1] - in[6];
+    const float s25 = in[2] + in[5], d25 = in[2] - in[5];
+    const float s34 = in[3] + in[4], d34 = in[3] - in[4];
+
+    const float e0 = s07 + s34, e3 = s07 - s34;
+    const float e1 = s16 + s25, e2 = s16 - s25;
+    t[0] = e0 + e1;
+    t[4] = e0 - e1;
+    const float z1 = (e2 + e3) * 0.70710678118654752f;
+    t[2] = e3 + z1;
+    t[6] = e3 - z1;
+
+    const float o0 = d34 + d25, o1 = d25 + d16, o2 = d16 + d07;
+    const float z5 = (o0 - o2) * 0.38268343236508977f;
+    const float z2 = o0 * 0.54119610014619698f + z5;
+    const float z4 = o2 * 1.3065629648763766f + z5;
+    const float z3 = o1 * 0.70710678118654752f;
+    const float z11 = d07 + z3, z13 = d07 - z3;
+    t[5] = z13 + z2;
+    t[3] = z13 - z2;
+    t[1] = z11 + z4;
+    t[7] = z11 - z4;
+
+    for (int k = 0; k < 8; k++) out[k] = t[k] * descale[k];
+}
+
+// Full 8x8 AAN transform, row-major in and out: rows first, then columns,
+// scaled by 0.25*a(u)*a(v)
+static void dct_8x8_scalar(const double* input, double* output) {
+    double temp[64], line[8];
+
+    for (int y = 0; y < 8; y++) {
+        dct_1d_aan8(input + y*8, line);
+        for (int u = 0; u < 8; u++) temp[u*8 + y] = line[u];
+    }
+    for (int u = 0; u < 8; u++) {
+        const double au = (u == 0) ? M_SQRT1_2 : 1.0;
+        dct_1d_aan8(temp + u*8, line);
+        for (int v = 0; v < 8; v++) {
+            const double av = (v == 0) ? M_SQRT1_2 : 1.0;
+            output[v*8 + u] = 0.25 * au * av * line[v];
+        }
+    }
+}
+
+static void dct_8x8_scalar_f(const float* input, float* output) {
+    float temp[64], line[8];
+
+    for (int y = 0; y < 8; y++) {
+        dct_1d_aan8_f(input + y*8, line);
+        for (int u = 0; u < 8; u++) temp[u*8 + y] = line[u];
+    }
+    for (int u = 0; u < 8; u++) {
+        const float au = (u == 0) ? (float)M_SQRT1_2 : 1.0f;
+        dct_1d_aan8_f(temp + u*8, line);
+        for (int v = 0; v < 8; v++) {
+            const float av = (v == 0) ? (float)M_SQRT1_2 : 1.0f;
+            output[v*8 + u] = 0.25f * au * av * line[v];
+        }
+    }
+}
+
+static const PhashKernels g_kernels_scalar = {
+    .level = PHASH_SIMD_NONE,
+    .resize_row = resize_row_scalar,
+    .grayscale = grayscale_scalar,
+    .project = project_scalar,
+    .accumulate = accumulate_scalar,
+    .resize_row_f = resize_row_scalar_f,
+    .grayscale_f = grayscale_scalar_f,
+    .project_f = project_scalar_f,
+    .accumulate_f = accumulate_scalar_f,
+    .resize_row_q = resize_row_scalar_q,
+    .project_q = project_scalar_q,
+    .project_wide_q = project_wide_scalar_q,
+    .grayscale_lanes_f = grayscale_lanes_scalar_f,
+    .accumulate_lanes_f = NULL,
+    .project_lanes_f = NULL,
+    .dct_8x8 = dct_8x8_scalar,
+    .dct_8x8_f = dct_8x8_scalar_f,
+    .popcount = popcount_scalar,
+    .distances = distances_scalar,
+    .scan_within = scan_within_scalar,
+    .distances_wide = distances_wide_scalar,
+    .distances_masked = distances_masked_scalar
+};
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+#define PHASH_TARGET(isa) __attribute__((target(isa)))
+
+// SSE4.2 (2 double lanes, hardware POPCNT)
+
+PHASH_TARGET("sse4.2")
+static inline __m128d gather2_sse42(const unsigned char* base, const int* offset, int ch) {
+    return _mm_cvtepi32_pd(_mm_setr_epi32(base[offset[0] + ch], base[offset[1] + ch], 0, 0));
+}
+
+PHASH_TARGET("sse4.2")
+static void resize_row_sse42(const unsigned char* row0, const unsigned char* row1,
+                             double dy, const ResizeColumns* cols, int size,
+                             ColorSpaceConversion colorspace, double* out) {
+    double weights[3];
+    grayscale_weights(colorspace, weights);
+    const __m128d one = _mm_set1_pd(1.0);
+    const __m128d vdy = _mm_set1_pd(dy);
+    const __m128d rdy = _mm_sub_pd(one, vdy);
+
+    for (int x = 0; x < size; x += 2) {
+        const __m128d dx = _mm_loadu_pd(cols->frac + x);
+        const __m128d rdx = _mm_sub_pd(one, dx);
+        const __m128d w00 = _mm_mul_pd(rdx, rdy);
+        const __m128d w01 = _mm_mul_pd(dx, rdy);
+        const __m128d w10 = _mm_mul_pd(rdx, vdy);
+        const __m128d w11 = _mm_mul_pd(dx, vdy);
+
+        __m128d rgb[3];
+        for (int ch = 0; ch < 3; ch++) {
+            __m128d v = _mm_mul_pd(w00, gather2_sse42(row0, cols->offset0 + x, ch));
+            v = _mm_add_pd(v, _mm_mul_pd(w01, gather2_sse42(row0, cols->offset1 + x, ch)));
+            v = _mm_add_pd(v, _mm_mul_pd(w10, gather2_sse42(row1, cols->offset0 + x, ch)));
+            v = _mm_add_pd(v, _mm_mul_pd(w11, gather2_sse42(row1, cols->offset1 + x, ch)));
+            rgb[ch] = _mm_cvtepi32_pd(_mm_cvttpd_epi32(v));
+        }
+
+        __m128d gray;
+        if (colorspace == COLORSPACE_AVERAGE) {
+            gray = _mm_div_pd(_mm_add_pd(_mm_add_pd(rgb[0], rgb[1]), rgb[2]),
+                              _mm_set1_pd(3.0));
+        } else {
+            gray = _mm_mul_pd(_mm_set1_pd(weights[0]), rgb[0]);
+            gray = _mm_add_pd(gray, _mm_mul_pd(_mm_set1_pd(weights[1]), rgb[1]));
+            gray = _mm_add_pd(gray, _mm_mul_pd(_mm_set1_pd(weights[2]), rgb[2]));
+        }
+        _mm_storeu_pd(out + x, gray);
+    }
+}
+
+PHASH_TARGET("sse4.2")
+static void project_sse42(const double* samples, int count, const double* weight,
+                          int stride, int width, double* out) {
+    for (int u0 = 0; u0 < width; u0 += PROJECT_LANES) {
+        __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+        __m128d acc2 = _mm_setzero_pd(), acc3 = _mm_setzero_pd();
+        for (int i = 0; i < count; i++) {
+            const double* w = weight + i*stride + u0;
+            const __m128d s = _mm_set1_pd(samples[i]);
+            acc0 = _mm_add_pd(acc0, _mm_mul_pd(s, _mm_loadu_pd(w)));
+            acc1 = _mm_add_pd(acc1, _mm_mul_pd(s, _mm_loadu_pd(w + 2)));
+            acc2 = _mm_add_pd(acc2, _mm_mul_pd(s, _mm_loadu_pd(w + 4)));
+            acc3 = _mm_add_pd(acc3, _mm_mul_pd(s, _mm_loadu_pd(w + 6)));
+        }
+        _mm_storeu_pd(out + u0, acc0);
+        _mm_storeu_pd(out + u0 + 2, acc1);
+        _mm_storeu_pd(out + u0 + 4, acc2);
+        _mm_storeu_pd(out + u0 + 6, acc3);
+    }
+}
+
+PHASH_TARGET("sse4.2")
+static void accumulate_sse42(const double* samples, int count, const double* weight,
+                             double* acc) {
+    const __m128d w0 = _mm_loadu_pd(weight), w1 = _mm_loadu_pd(weight + 2);
+    const __m128d w2 = _mm_loadu_pd(weight + 4), w3 = _mm_loadu_pd(weight + 6);
+    for (int i = 0; i < count; i++) {
+        double* a = acc + i*PROJECT_LANES;
+        const __m128d s = _mm_set1_pd(samples[i]);
+        _mm_storeu_pd(a, _mm_add_pd(_mm_loadu_pd(a), _mm_mul_pd(s, w0)));
+        _mm_storeu_pd(a + 2, _mm_add_pd(_mm_loadu_pd(a + 2), _mm_mul_pd(s, w1)));
+        _mm_storeu_pd(a + 4, _mm_add_pd(_mm_loadu_pd(a + 4), _mm_mul_pd(s, w2)));
+        _mm_storeu_pd(a + 6, _mm_add_pd(_mm_loadu_pd(a + 6), _mm_mul_pd(s, w3)));
+    }
+}
+
+PHASH_TARGET("sse4.2")
+static inline __m128 gather4_sse42_f(const unsigned char* base, const int* offset, int ch) {
+    return _mm_cvtepi32_ps(_mm_setr_epi32(base[offset[0] + ch], base[offset[1] + ch],
+                                          base[offset[2] + ch], base[offset[3] + ch]));
+}
+
+PHASH_TARGET("sse4.2")
+static void resize_row_sse42_f(const unsigned char* row0, const unsigned char* row1,
+                               float dy, const ResizeColumns* cols, int size,
+                               ColorSpaceConversion colorspace, float* out) {
+    float weights[3];
+    grayscale_weights_f(colorspace, weights);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 vdy = _mm_set1_ps(dy);
+    const __m128 rdy = _mm_sub_ps(one, vdy);
+
+    for (int x = 0; x < size; x += 4) {
+        const __m128 dx = _mm_loadu_ps(cols->frac_f + x);
+        const __m128 rdx = _mm_sub_ps(one, dx);
+        const __m128 w00 = _mm_mul_ps(rdx, rdy);
+        const __m128 w01 = _mm_mul_ps(dx, rdy);
+        const __m128 w10 = _mm_mul_ps(rdx, vdy);
+        const __m128 w11 = _mm_mul_ps(dx, vdy);
+
+        __m128 rgb[3];
+        for (int ch = 0; ch < 3; ch++) {
+            __m128 v = _mm_mul_ps(w00, gather4_sse42_f(row0, cols->offset0 + x, ch));
+            v = _mm_add_ps(v, _mm_mul_ps(w01, gather4_sse42_f(row0, cols->offset1 + x, ch)));
+            v = _mm_add_ps(v, _mm_mul_ps(w10, gather4_sse42_f(row1, cols->offset0 + x, ch)));
+            v = _mm_add_ps(v, _mm_mul_ps(w11, gather4_sse42_f(row1, cols->offset1 + x, ch)));
+            rgb[ch] = _mm_cvtepi32_ps(_mm_cvttps_epi32(v));
+        }
+
+        __m128 gray;
+        if (colorspace == COLORSPACE_AVERAGE) {
+            gray = _mm_div_ps(_mm_add_ps(_mm_add_ps(rgb[0], rgb[1]), rgb[2]),
+                              _mm_set1_ps(3.0f));
+        } else {
+            gray = _mm_mul_ps(_mm_set1_ps(weights[0]), rgb[0]);
+            gray = _mm_add_ps(gray, _mm_mul_ps(_mm_set1_ps(weights[1]), rgb[1]));
+            gray = _mm_add_ps(gray, _mm_mul_ps(_mm_set1_ps(weights[2]), rgb[2]));
+        }
+        _mm_storeu_ps(out + x, gray);
+    }
+}
+
+PHASH_TARGET("sse4.2")
+static void project_sse42_f(const float* samples, int count, const float* weight,
+                            int stride, int width, float* out) {
+    for (int u0 = 0; u0 < width; u0 += PROJECT_LANES) {
+        __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+        for (int i = 0; i < count; i++) {
+            const float* w = weight + i*stride + u0;
+            const __m128 s = _mm_set1_ps(samples[i]);
+            acc0 = _mm_add_ps(acc0, _mm_mul_ps(s, _mm_loadu_ps(w)));
+            acc1 = _mm_add_ps(acc1, _mm_mul_ps(s, _mm_loadu_ps(w + 4)));
+        }
+        _mm_storeu_ps(out + u0, acc0);
+        _mm_storeu_ps(out + u0 + 4, acc1);
+    }
+}
+
+PHASH_TARGET("sse4.2")
+static void accumulate_sse42_f(const float* samples, int count, const float* weight,
+                               float* acc) {
+    const __m128 w0 = _mm_loadu_ps(weight), w1 = _mm_loadu_ps(weight + 4);
+    for (int i = 0; i < count; i++) {
+        float* a = acc + i*PROJECT_LANES;
+        const __m128 s = _mm_set1_ps(samples[i]);
+        _mm_storeu_ps(a, _mm_add_ps(_mm_loadu_ps(a), _mm_mul_ps(s, w0)));
+        _mm_storeu_ps(a + 4, _mm_add_ps(_mm_loadu_ps(a + 4), _mm_mul_ps(s, w1)));
+    }
+}
+
+PHASH_TARGET("sse4.2")
+static inline __m128i gather4_sse42_q(const unsigned char* base, const int* offset, int ch) {
+    return _mm_setr_epi32(base[offset[0] + ch], base[offset[1] + ch],
+                          base[offset[2] + ch], base[offset[3] + ch]);
+}
+
+PHASH_TARGET("sse4.2")
+static void resize_row_sse42_q(const unsigned char* row0, const unsigned char* row1,
+                               int dy, const ResizeColumns* cols, int size,
+                               const int weights[3], int16_t* out) {
+    const __m128i full = _mm_set1_epi32(256);
+    const __m128i vdy = _mm_set1_epi32(dy);
+    const __m128i rdy = _mm_sub_epi32(full, vdy);
+    const __m128i half = _mm_set1_epi32(512);
+
+    for (int x = 0; x < size; x += 4) {
+        const __m128i dx = _mm_loadu_si128((const __m128i*)(cols->frac_q + x));
+        const __m128i rdx = _mm_sub_epi32(full, dx);
+        const __m128i w00 = _mm_mullo_epi32(rdx, rdy);
+        const __m128i w01 = _mm_mullo_epi32(dx, rdy);
+        const __m128i w10 = _mm_mullo_epi32(rdx, vdy);
+        const __m128i w11 = _mm_mullo_epi32(dx, vdy);
+
+        __m128i gray = half;
+        for (int ch = 0; ch < 3; ch++) {
+            __m128i v = _mm_mullo_epi32(w00, gather4_sse42_q(row0, cols->offset0 + x, ch));
+            v = _mm_add_epi32(v, _mm_mullo_epi32(w01, gather4_sse42_q(row0, cols->offset1 + x, ch)));
+            v = _mm_add_epi32(v, _mm_mullo_epi32(w10, gather4_sse42_q(row1, cols->offset0 + x, ch)));
+            v = _mm_add_epi32(v, _mm_mullo_epi32(w11, gather4_sse42_q(row1, cols->offset1 + x, ch)));
+            gray = _mm_add_epi32(gray, _mm_mullo_epi32(_mm_set1_epi32(weights[ch]),
+                                                       _mm_srli_epi32(v, 16)));
+        }
+        gray = _mm_srli_epi32(gray, 10);
+        _mm_storel_epi64((__m128i*)(out + x), _mm_packs_epi32(gray, gray));
+    }
+}
+
+PHASH_TARGET("sse4.2")
+static void project_sse42_q(const int16_t* samples, int count, const int16_t* weight,
+                            int stride, int width, int32_t* out) {
+    for (int u0 = 0; u0 < width; u0 += PROJECT_LANES) {
+        __m128i acc0 = _mm_setzero_si128(), acc1 = _mm_setzero_si128();
+        for (int i = 0; i < count; i += 2) {
+            int32_t pair;
+            memcpy(&pair, samples + i, sizeof(pair));
+            const __m128i s = _mm_set1_epi32(pair);
+            const int16_t* w = weight + (i >> 1)*stride + 2*u0;
+            acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(s, _mm_loadu_si128((const __m128i*)w)));
+            acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(s, _mm_loadu_si128((const __m128i*)(w + 8))));
+        }
+        _mm_storeu_si128((__m128i*)(out + u0), acc0);
+        _mm_storeu_si128((__m128i*)(out + u0 + 4), acc1);
+    }
+}
+
+PHASH_TARGET("sse4.2")
+static void project_wide_sse42_q(const int32_t* coeff, int count, const int32_t* rows,
+                                 int64_t* out) {
+    __m128i acc0 = _mm_setzero_si128(), acc1 = _mm_setzero_si128();
+    __m128i acc2 = _mm_setzero_si128(), acc3 = _mm_setzero_si128();
+    for (int i = 0; i < count; i++) {
+        const int32_t* r = rows + i*PROJECT_LANES;
+        const __m128i c = _mm_set1_epi64x(coeff[i]);
+        acc0 = _mm_add_epi64(acc0, _mm_mul_epi32(c, _mm_cvtepi32_epi64(_mm_loadl_epi64((const __m128i*)r))));
+        acc1 = _mm_add_epi64(acc1, _mm_mul_epi32(c, _mm_cvtepi32_epi64(_mm_loadl_epi64((const __m128i*)(r + 2)))));
+        acc2 = _mm_add_epi64(acc2, _mm_mul_epi32(c, _mm_cvtepi32_epi64(_mm_loadl_epi64((const __m128i*)(r + 4)))));
+        acc3 = _mm_add_epi64(acc3, _mm_mul_epi32(c, _mm_cvtepi32_epi64(_mm_loadl_epi64((const __m128i*)(r + 6)))));
+    }
+    _mm_storeu_si128((__m128i*)out, acc0);
+    _mm_storeu_si128((__m128i*)(out + 2), acc1);
+    _mm_storeu_si128((__m128i*)(out + 4), acc2);
+    _mm_storeu_si128((__m128i*)(out + 6), acc3);
+}
+
+PHASH_TARGET("sse4.2,popcnt")
+static uint64_t popcount_sse42(const uint64_t* words, size_t count) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < count; i++) total += (uint64_t)_mm_popcnt_u64(words[i]);
+    return total;
+}
+
+PHASH_TARGET("sse4.2,popcnt")
+static void distances_sse42(uint64_t query, const uint64_t* hashes, size_t count,
+                            uint8_t* out) {
+    for (size_t i = 0; i < count; i++) out[i] = (uint8_t)_mm_popcnt_u64(query ^ hashes[i]);
+}
+
+PHASH_TARGET("sse4.2,popcnt")
+static size_t scan_within_sse42(uint64_t query, const uint64_t* hashes, size_t count,
+                                int max_distance, size_t* out) {
+    size_t found = 0;
+    for (size_t i = 0; i < count; i++) {
+        out[found] = i;
+        found += (_mm_popcnt_u64(query ^ hashes[i]) <= max_distance);
+    }
+    return found;
+}
+
+PHASH_TARGET("sse4.2,popcnt")
+static void distances_wide_sse42(const uint64_t* query, const uint64_t* hashes, size_t count,
+                                 int words, uint16_t* out) {
+    for (size_t i = 0; i < count; i++, hashes += words) {
+        uint64_t d = 0;
+        for (int w = 0; w < words; w++) d += (uint64_t)_mm_popcnt_u64(query[w] ^ hashes[w]);
+        out[i] = (uint16_t)d;
+    }
+}
+
+PHASH_TARGET("sse4.2,popcnt")
+static void distances_masked_sse42(uint64_t query, uint64_t query_mask, const uint64_t* hashes,
+                                   const uint64_t* masks, size_t count, uint8_t* out) {
+    for (size_t i = 0; i < count; i++) {
+        out[i] = (uint8_t)_mm_popcnt_u64((query ^ hashes[i]) & query_mask & masks[i]);
+    }
+}
+
+// AVX2 (4 double lanes, nibble-table popcount)
+
+PHASH_TARGET("avx2")
+static inline __m256d gather4_avx2(const unsigned char* base, const int* offset, int ch) {
+    return _mm256_cvtepi32_pd(_mm_setr_epi32(base[offset[0] + ch], base[offset[1] + ch],
+                                             base[offset[2] + ch], base[offset[3] + ch]));
+}
+
+PHASH_TARGET("avx2")
+static void resize_row_avx2(const unsigned char* row0, const unsigned char* row1,
+                            double dy, const ResizeColumns* cols, int size,
+                            ColorSpaceConversion colorspace, double* out) {
+    double weights[3];
+    grayscale_weights(colorspace, weights);
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d vdy = _mm256_set1_pd(dy);
+    const __m256d rdy = _mm256_sub_pd(one, vdy);
+
+    for (int x = 0; x < size; x += 4) {
+        const __m256d dx = _mm256_loadu_pd(cols->frac + x);
+        const __m256d rdx = _mm256_sub_pd(one, dx);
+        const __m256d w00 = _mm256_mul_pd(rdx, rdy);
+        const __m256d w01 = _mm256_mul_pd(dx, rdy);
+        const __m256d w10 = _mm256_mul_pd(rdx, vdy);
+        const __m256d w11 = _mm256_mul_pd(dx, vdy);
+
+        __m256d rgb[3];
+        for (int ch = 0; ch < 3; ch++) {
+            __m256d v = _mm256_mul_pd(w00, gather4_avx2(row0, cols->offset0 + x, ch));
+            v = _mm256_add_pd(v, _mm256_mul_pd(w01, gather4_avx2(row0, cols->offset1 + x, ch)));
+            v = _mm256_add_pd(v, _mm256_mul_pd(w10, gather4_avx2(row1, cols->offset0 + x, ch)));
+            v = _mm256_add_pd(v, _mm256_mul_pd(w11, gather4_avx2(row1, cols->offset1 + x, ch)));
+            rgb[ch] = _mm256_cvtepi32_pd(_mm256_cvttpd_epi32(v));
+        }
+
+        __m256d gray;
+        if (colorspace == COLORSPACE_AVERAGE) {
+            gray = _mm256_div_pd(_mm256_add_pd(_mm256_add_pd(rgb[0], rgb[1]), rgb[2]),
+                                 _mm256_set1_pd(3.0));
+        } else {
+            gray = _mm256_mul_pd(_mm256_set1_pd(weights[0]), rgb[0]);
+            gray = _mm256_add_pd(gray, _mm256_mul_pd(_mm256_set1_pd(weights[1]), rgb[1]));
+            gray = _mm256_add_pd(gray, _mm256_mul_pd(_mm256_set1_pd(weights[2]), rgb[2]));
+        }
+        _mm256_storeu_pd(out + x, gray);
+    }
+}
+
+PHASH_TARGET("avx2")
+static void grayscale_avx2(const unsigned char* line, const int* index, int count,
+                           int channels, const double weights[3], double* out) {
+    const __m256d w0 = _mm256_set1_pd(weights[0]);
+    const __m256d w1 = _mm256_set1_pd(weights[1]);
+    const __m256d w2 = _mm256_set1_pd(weights[2]);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const int offset[4] = {
+            index[i]*channels, index[i + 1]*channels,
+            index[i + 2]*channels, index[i + 3]*channels
+        };
+        __m256d gray = _mm256_mul_pd(w0, gather4_avx2(line, offset, 0));
+        gray = _mm256_add_pd(gray, _mm256_mul_pd(w1, gather4_avx2(line, offset, 1)));
+        gray = _mm256_add_pd(gray, _mm256_mul_pd(w2, gather4_avx2(line, offset, 2)));
+        _mm256_storeu_pd(out + i, gray);
+    }
+    grayscale_scalar(line, index + i, count - i, channels, weights, out + i);
+}
+
+PHASH_TARGET("avx2")
+static void project_avx2(const double* samples, int count, const double* weight,
+                         int stride, int width, double* out) {
+    for (int u0 = 0; u0 < width; u0 += PROJECT_LANES) {
+        __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+        for (int i = 0; i < count; i++) {
+            const double* w = weight + i*stride + u0;
+            const __m256d s = _mm256_set1_pd(samples[i]);
+            acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(s, _mm256_loadu_pd(w)));
+            acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(s, _mm256_loadu_pd(w + 4)));
+        }
+        _mm256_storeu_pd(out + u0, acc0);
+        _mm256_storeu_pd(out + u0 + 4, acc1);
+    }
+}
+
+PHASH_TARGET("avx2")
+static void accumulate_avx2(const double* samples, int count, const double* weight,
+                            double* acc) {
+    const __m256d w0 = _mm256_loadu_pd(weight), w1 = _mm256_loadu_pd(weight + 4);
+    for (int i = 0; i < count; i++) {
+        double* a = acc + i*PROJECT_LANES;
+        const __m256d s = _mm256_set1_pd(samples[i]);
+        _mm256_storeu_pd(a, _mm256_add_pd(_mm256_loadu_pd(a), _mm256_mul_pd(s, w0)));
+        _mm256_storeu_pd(a + 4, _mm256_add_pd(_mm256_loadu_pd(a + 4), _mm256_mul_pd(s, w1)));
+    }
+}
+
+PHASH_TARGET("avx2")
+static inline __m256 gather8_avx2_f(const unsigned char* base, const int* offset, int ch) {
+    return _mm256_cvtepi32_ps(_mm256_setr_epi32(
+        base[offset[0] + ch], base[offset[1] + ch], base[offset[2] + ch], base[offset[3] + ch],
+        base[offset[4] + ch], base[offset[5] + ch], base[offset[6] + ch], base[offset[7] + ch]));
+}
+
+PHASH_TARGET("avx2")
+static void resize_row_avx2_f(const unsigned char* row0, const unsigned char* row1,
+                              float dy, const ResizeColumns* cols, int size,
+                              ColorSpaceConversion colorspace, float* out) {
+    float weights[3];
+    grayscale_weights_f(colorspace, weights);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 vdy = _mm256_set1_ps(dy);
+    const __m256 rdy = _mm256_sub_ps(one, vdy);
+
+    for (int x = 0; x < size; x += 8) {
+        const __m256 dx = _mm256_loadu_ps(cols->frac_f + x);
+        const __m256 rdx = _mm256_sub_ps(one, dx);
+        const __m256 w00 = _mm256_mul_ps(rdx, rdy);
+        const __m256 w01 = _mm256_mul_ps(dx, rdy);
+        const __m256 w10 = _mm256_mul_ps(rdx, vdy);
+        const __m256 w11 = _mm256_mul_ps(dx, vdy);
+
+        __m256 rgb[3];
+        for (int ch = 0; ch < 3; ch++) {
+            __m256 v = _mm256_mul_ps(w00, gather8_avx2_f(row0, cols->offset0 + x, ch));
+            v = _mm256_add_ps(v, _mm256_mul_ps(w01, gather8_avx2_f(row0, cols->offset1 + x, ch)));
+            v = _mm256_add_ps(v, _mm256_mul_ps(w10, gather8_avx2_f(row1, cols->offset0 + x, ch)));
+            v = _mm256_add_ps(v, _mm256_mul_ps(w11, gather8_avx2_f(row1, cols->offset1 + x, ch)));
+            rgb[ch] = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(v));
+        }
+
+        __m256 gray;
+        if (colorspace == COLORSPACE_AVERAGE) {
+            gray = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(rgb[0], rgb[1]), rgb[2]),
+                                 _mm256_set1_ps(3.0f));
+        } else {
+            gray = _mm256_mul_ps(_mm256_set1_ps(weights[0]), rgb[0]);
+            gray = _mm256_add_ps(gray, _mm256_mul_ps(_mm256_set1_ps(weights[1]), rgb[1]));
+            gray = _mm256_add_ps(gray, _mm256_mul_ps(_mm256_set1_ps(weights[2]), rgb[2]));
+        }
+        _mm256_storeu_ps(out + x, gray);
+    }
+}
+
+PHASH_TARGET("avx2")
+static void grayscale_avx2_f(const unsigned char* line, const int* index, int count,
+                             int channels, const float weights[3], float* out) {
+    const __m256 w0 = _mm256_set1_ps(weights[0]);
+    const __m256 w1 = _mm256_set1_ps(weights[1]);
+    const __m256 w2 = _mm256_set1_ps(weights[2]);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        int offset[8];
+        for (int k = 0; k < 8; k++) offset[k] = index[i + k]*channels;
+        __m256 gray = _mm256_mul_ps(w0, gather8_avx2_f(line, offset, 0));
+        gray = _mm256_add_ps(gray, _mm256_mul_ps(w1, gather8_avx2_f(line, offset, 1)));
+        gray = _mm256_add_ps(gray, _mm256_mul_ps(w2, gather8_avx2_f(line, offset, 2)));
+        _mm256_storeu_ps(out + i, gray);
+    }
+    grayscale_scalar_f(line, index + i, count - i, channels, weights, out + i);
+}
+
+PHASH_TARGET("avx2")
+static void project_avx2_f(const float* samples, int count, const float* weight,
+                           int stride, int width, float* out) {
+    for (int u0 = 0; u0 < width; u0 += PROJECT_LANES) {
+        __m256 acc = _mm256_setzero_ps();
+        for (int i = 0; i < count; i++) {
+            const __m256 s = _mm256_set1_ps(samples[i]);
+            acc = _mm256_add_ps(acc, _mm256_mul_ps(s, _mm256_loadu_ps(weight + i*stride + u0)));
+        }
+        _mm256_storeu_ps(out + u0, acc);
+    }
+}
+
+PHASH_TARGET("avx2")
+static void accumulate_avx2_f(const float* samples, int count, const float* weight,
+                              float* acc) {
+    const __m256 w = _mm256_loadu_ps(weight);
+    for (int i = 0; i < count; i++) {
+        float* a = acc + i*PROJECT_LANES;
+        _mm256_storeu_ps(a, _mm256_add_ps(_mm256_loadu_ps(a),
+                                          _mm256_mul_ps(_mm256_set1_ps(samples[i]), w)));
+    }
+}
+
+// Pixel offset of 4 image lines as 32-bit lanes, one gather through the
+// line pointers
+PHASH_TARGET("avx2")
+static inline __m128i gather_lanes4_avx2(const unsigned char* const* lines, __m256i offset) {
+    const __m256i address = _mm256_add_epi64(
+        _mm256_loadu_si256((const __m256i*)lines), offset);
+    return _mm256_i64gather_epi32((const int*)0, address, 1);
+}
+
+PHASH_TARGET("avx2")
+static void grayscale_lanes_avx2_f(const unsigned char* const* lines, const int* index,
+                                   int count, int channels, const float weights[3],
+                                   float* out) {
+    const __m256 w0 = _mm256_set1_ps(weights[0]);
+    const __m256 w1 = _mm256_set1_ps(weights[1]);
+    const __m256 w2 = _mm256_set1_ps(weights[2]);
+    const __m256i byte = _mm256_set1_epi32(0xFF);
+    for (int i = 0; i < count; i++) {
+        const __m256i offset = _mm256_set1_epi64x((long long)index[i]*channels);
+        for (int h = 0; h < IMAGE_LANES; h += 8) {
+            const __m256i p = _mm256_set_m128i(gather_lanes4_avx2(lines + h + 4, offset),
+                                               gather_lanes4_avx2(lines + h, offset));
+            const __m256 r = _mm256_cvtepi32_ps(_mm256_and_si256(p, byte));
+            const __m256 g = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p, 8), byte));
+            const __m256 b = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p, 16), byte));
+            __m256 gray = _mm256_mul_ps(w0, r);
+            gray = _mm256_add_ps(gray, _mm256_mul_ps(w1, g));
+            gray = _mm256_add_ps(gray, _mm256_mul_ps(w2, b));
+            _mm256_storeu_ps(out + i*IMAGE_LANES + h, gray);
+        }
+    }
+}
+
+// Keeps the PROJECT_LANES accumulators of 8 lanes of one sample in
+// registers across the row block
+PHASH_TARGET("avx2")
+static void accumulate_lanes_avx2_f(const float* samples, int rows, int count,
+                                    const float* weight, float* acc) {
+    for (int i = 0; i < count; i++) {
+        for (int h = 0; h < IMAGE_LANES; h += 8) {
+            float* a = acc + i*PROJECT_LANES*IMAGE_LANES + h;
+            __m256 sum[PROJECT_LANES];
+            for (int v = 0; v < PROJECT_LANES; v++) sum[v] = _mm256_loadu_ps(a + v*IMAGE_LANES);
+            for (int r = 0; r < rows; r++) {
+                const __m256 s = _mm256_loadu_ps(samples + (r*count + i)*IMAGE_LANES + h);
+                const float* w = weight + r*PROJECT_LANES;
+                for (int v = 0; v < PROJECT_LANES; v++) {
+                    sum[v] = _mm256_add_ps(sum[v], _mm256_mul_ps(s, _mm256_set1_ps(w[v])));
+                }
+            }
+            for (int v = 0; v < PROJECT_LANES; v++) _mm256_storeu_ps(a + v*IMAGE_LANES, sum[v]);
+        }
+    }
+}
+
+PHASH_TARGET("avx2")
+static void project_lanes_avx2_f(const float* acc, int count, const float* weight,
+                                 float* out) {
+    for (int v = 0; v < PROJECT_LANES; v++) {
+        for (int h = 0; h < IMAGE_LANES; h += 8) {
+            __m256 sum[PROJECT_LANES];
+            for (int u = 0; u < PROJECT_LANES; u++) sum[u] = _mm256_setzero_ps();
+            for (int i = 0; i < count; i++) {
+                const __m256 a = _mm256_loadu_ps(acc + (i*PROJECT_LANES + v)*IMAGE_LANES + h);
+                const float* w = weight + i*PROJECT_LANES;
+                for (int u = 0; u < PROJECT_LANES; u++) {
+                    sum[u] = _mm256_add_ps(sum[u], _mm256_mul_ps(a, _mm256_set1_ps(w[u])));
+                }
+            }
+            for (int u = 0; u < PROJECT_LANES; u++) {
+                _mm256_storeu_ps(out + (v*PROJECT_LANES + u)*IMAGE_LANES + h, sum[u]);
+            }
+        }
+    }
+}
+
+// Loads each pixel as one 32-bit gather lane and splits the channels with
+// shifts, reading one byte past 3-channel pixels
+PHASH_TARGET("avx2")
+static void resize_row_avx2_q(const unsigned char* row0, const unsigned char* row1,
+                              int dy, const ResizeColumns* cols, int size,
+                              const int weights[3], int16_t* out) {
+    const __m256i full = _mm256_set1_epi32(256);
+    const __m256i vdy = _mm256_set1_epi32(dy);
+    const __m256i rdy = _mm256_sub_epi32(full, vdy);
+    const __m256i half = _mm256_set1_epi32(512);
+    const __m256i byte = _mm256_set1_epi32(0xFF);
+
+    for (int x = 0; x < size; x += 8) {
+        const __m256i dx = _mm256_loadu_si256((const __m256i*)(cols->frac_q + x));
+        const __m256i rdx = _mm256_sub_epi32(full, dx);
+        const __m256i w00 = _mm256_mullo_epi32(rdx, rdy);
+        const __m256i w01 = _mm256_mullo_epi32(dx, rdy);
+        const __m256i w10 = _mm256_mullo_epi32(rdx, vdy);
+        const __m256i w11 = _mm256_mullo_epi32(dx, vdy);
+        const __m256i o0 = _mm256_loadu_si256((const __m256i*)(cols->offset0 + x));
+        const __m256i o1 = _mm256_loadu_si256((const __m256i*)(cols->offset1 + x));
+        const __m256i p00 = _mm256_i32gather_epi32((const int*)row0, o0, 1);
+        const __m256i p01 = _mm256_i32gather_epi32((const int*)row0, o1, 1);
+        const __m256i p10 = _mm256_i32gather_epi32((const int*)row1, o0, 1);
+        const __m256i p11 = _mm256_i32gather_epi32((const int*)row1, o1, 1);
+
+        __m256i gray = half;
+        for (int ch = 0; ch < 3; ch++) {
+            const int shift = 8*ch;
+            __m256i v = _mm256_mullo_epi32(w00, _mm256_and_si256(_mm256_srli_epi32(p00, shift), byte));
+            v = _mm256_add_epi32(v, _mm256_mullo_epi32(w01, _mm256_and_si256(_mm256_srli_epi32(p01, shift), byte)));
+            v = _mm256_add_epi32(v, _mm256_mullo_epi32(w10, _mm256_and_si256(_mm256_srli_epi32(p10, shift), byte)));
+            v = _mm256_add_epi32(v, _mm256_mullo_epi32(w11, _mm256_and_si256(_mm256_srli_epi32(p11, shift), byte)));
+            gray = _mm256_add_epi32(gray, _mm256_mullo_epi32(_mm256_set1_epi32(weights[ch]),
+                                                             _mm256_srli_epi32(v, 16)));
+        }
+        gray = _mm256_srli_epi32(gray, 10);
+        _mm_storeu_si128((__m128i*)(out + x),
+                         _mm_packs_epi32(_mm256_castsi256_si128(gray),
+                                         _mm256_extracti128_si256(gray, 1)));
+    }
+}
+
+PHASH_TARGET("avx2")
+static void project_avx2_q(const int16_t* samples, int count, const int16_t* weight,
+                           int stride, int width, int32_t* out) {
+    for (int u0 = 0; u0 < width; u0 += PROJECT_LANES) {
+        __m256i acc = _mm256_setzero_si256();
+        for (int i = 0; i < count; i += 2) {
+            int32_t pair;
+            memcpy(&pair, samples + i, sizeof(pair));
+            const __m256i w = _mm256_loadu_si256((const __m256i*)(weight + (i >> 1)*stride + 2*u0));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_set1_epi32(pair), w));
+        }
+        _mm256_storeu_si256((__m256i*)(out + u0), acc);
+    }
+}
+
+PHASH_TARGET("avx2")
+static void project_wide_avx2_q(const int32_t* coeff, int count, const int32_t* rows,
+                                int64_t* out) {
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+    for (int i = 0; i < count; i++) {
+        const int32_t* r = rows + i*PROJECT_LANES;
+        const __m256i c = _mm256_set1_epi64x(coeff[i]);
+        acc0 = _mm256_add_epi64(acc0, _mm256_mul_epi32(c, _mm256_cvtepi32_epi64(
+            _mm_loadu_si128((const __m128i*)r))));
+        acc1 = _mm256_add_epi64(acc1, _mm256_mul_epi32(c, _mm256_cvtepi32_epi64(
+            _mm_loadu_si128((const __m128i*)(r + 4)))));
+    }
+    _mm256_storeu_si256((__m256i*)out, acc0);
+    _mm256_storeu_si256((__m256i*)(out + 4), acc1);
+}
+
+// Per-byte popcount of v via a 16-entry nibble table
+PHASH_TARGET("avx2")
+static inline __m256i popcount_bytes_avx2(__m256i v) {
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0F);
+    const __m256i lo = _mm256_and_si256(v, low_mask);
+    const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+    return _mm256_add_epi8(_mm256_shuffle_epi8(table, lo), _mm256_shuffle_epi8(table, hi));
+}
+
+PHASH_TARGET("avx2,popcnt")
+static uint64_t popcount_avx2(const uint64_t* words, size_t count) {
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m256i v = _mm256_loadu_si256((const __m256i*)(words + i));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(popcount_bytes_avx2(v),
+                                                    _mm256_setzero_si256()));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    uint64_t total = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (; i < count; i++) total += (uint64_t)_mm_popcnt_u64(words[i]);
+    return total;
+}
+
+// Hamming distances of 4 hashes to the query, one per 64-bit lane
+PHASH_TARGET("avx2")
+static inline __m256i distances4_avx2(__m256i query, const uint64_t* hashes) {
+    const __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)hashes), query);
+    return _mm256_sad_epu8(popcount_bytes_avx2(v), _mm256_setzero_si256());
+}
+
+// distances4_avx2 over the bits set in query_mask and masks
+PHASH_TARGET("avx2")
+static inline __m256i masked_distances4_avx2(__m256i query, __m256i query_mask,
+                                             const uint64_t* hashes, const uint64_t* masks) {
+    const __m256i v = _mm256_and_si256(
+        _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)hashes), query),
+        _mm256_and_si256(_mm256_loadu_si256((const __m256i*)masks), query_mask));
+    return _mm256_sad_epu8(popcount_bytes_avx2(v), _mm256_setzero_si256());
+}
+
+// 16 distances as bytes, hash 4j + k from lane k of dj. Distances fit a
+// byte: hash 4j + k lands in byte j of lane k, the low dwords of the lanes
+// are gathered and the 4x4 bytes transposed
+PHASH_TARGET("avx2")
+static inline __m128i narrow16_avx2(__m256i d0, __m256i d1, __m256i d2, __m256i d3) {
+    const __m256i low_dwords = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    const __m128i transpose = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13,
+                                            2, 6, 10, 14, 3, 7, 11, 15);
+    __m256i packed = d0;
+    packed = _mm256_or_si256(packed, _mm256_slli_epi64(d1, 8));
+    packed = _mm256_or_si256(packed, _mm256_slli_epi64(d2, 16));
+    packed = _mm256_or_si256(packed, _mm256_slli_epi64(d3, 24));
+    const __m128i bytes = _mm256_castsi256_si128(
+        _mm256_permutevar8x32_epi32(packed, low_dwords));
+    return _mm_shuffle_epi8(bytes, transpose);
+}
+
+PHASH_TARGET("avx2,popcnt")
+static void distances_avx2(uint64_t query, const uint64_t* hashes, size_t count,
+                           uint8_t* out) {
+    const __m256i q = _mm256_set1_epi64x((long long)query);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        _mm_storeu_si128((__m128i*)(out + i), narrow16_avx2(
+            distances4_avx2(q, hashes + i), distances4_avx2(q, hashes + i + 4),
+            distances4_avx2(q, hashes + i + 8), distances4_avx2(q, hashes + i + 12)));
+    }
+    for (; i < count; i++) out[i] = (uint8_t)_mm_popcnt_u64(query ^ hashes[i]);
+}
+
+PHASH_TARGET("avx2,popcnt")
+static void distances_masked_avx2(uint64_t query, uint64_t query_mask, const uint64_t* hashes,
+                                  const uint64_t* masks, size_t count, uint8_t* out) {
+    const __m256i q = _mm256_set1_epi64x((long long)query);
+    const __m256i qm = _mm256_set1_epi64x((long long)query_mask);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        _mm_storeu_si128((__m128i*)(out + i), narrow16_avx2(
+            masked_distances4_avx2(q, qm, hashes + i, masks + i),
+            masked_distances4_avx2(q, qm, hashes + i + 4, masks + i + 4),
+            masked_distances4_avx2(q, qm, hashes + i + 8, masks + i + 8),
+            masked_distances4_avx2(q, qm, hashes + i + 12, masks + i + 12)));
+    }
+    for (; i < count; i++) {
+        out[i] = (uint8_t)_mm_popcnt_u64((query ^ hashes[i]) & query_mask & masks[i]);
+    }
+}
+
+PHASH_TARGET("avx2,popcnt")
+static size_t scan_within_avx2(uint64_t query, const uint64_t* hashes, size_t count,
+                               int max_distance, size_t* out) {
+    const __m256i q = _mm256_set1_epi64x((long long)query);
+    const __m256i limit = _mm256_set1_epi64x(max_distance);
+    size_t found = 0, i = 0;
+    // Matches are rare in a dedup scan, so blocks of 8 without one are
+    // skipped with a single well-predicted branch
+    for (; i + 8 <= count; i += 8) {
+        const __m256i far0 = _mm256_cmpgt_epi64(distances4_avx2(q, hashes + i), limit);
+        const __m256i far1 = _mm256_cmpgt_epi64(distances4_avx2(q, hashes + i + 4), limit);
+        const int near = ~(_mm256_movemask_pd(_mm256_castsi256_pd(far0)) |
+                           _mm256_movemask_pd(_mm256_castsi256_pd(far1)) << 4) & 0xFF;
+        if (!near) continue;
+        for (int k = 0; k < 8; k++) {
+            out[found] = i + k;
+            found += (near >> k) & 1;
+        }
+    }
+    for (; i < count; i++) {
+        out[found] = i;
+        found += (_mm_popcnt_u64(query ^ hashes[i]) <= max_distance);
+    }
+    return found;
+}
+
+// Whole 4-word blocks of a hash through the nibble table, the rest with
+// POPCNT. Byte counts of up to 4 blocks stay below 256 and are widened
+// once per hash.
+PHASH_TARGET("avx2,popcnt")
+static void distances_wide_avx2(const uint64_t* query, const uint64_t* hashes, size_t count,
+                                int words, uint16_t* out) {
+    const int blocks = words / 4;
+    __m256i q[PHASH_MAX_HASH_WORDS / 4];
+    for (int b = 0; b < blocks; b++) q[b] = _mm256_loadu_si256((const __m256i*)(query + 4*b));
+
+    for (size_t i = 0; i < count; i++, hashes += words) {
+        __m256i bytes = _mm256_setzero_si256();
+        for (int b = 0; b < blocks; b++) {
+            const __m256i v = _mm256_xor_si256(
+                _mm256_loadu_si256((const __m256i*)(hashes + 4*b)), q[b]);
+            bytes = _mm256_add_epi8(bytes, popcount_bytes_avx2(v));
+        }
+        const __m256i sums = _mm256_sad_epu8(bytes, _mm256_setzero_si256());
+        const __m128i pair = _mm_add_epi64(_mm256_castsi256_si128(sums),
+                                           _mm256_extracti128_si256(sums, 1));
+        uint64_t d = (uint64_t)_mm_cvtsi128_si64(pair) + (uint64_t)_mm_extract_epi64(pair, 1);
+        for (int w = 4*blocks; w < words; w++) d += (uint64_t)_mm_popcnt_u64(query[w] ^ hashes[w]);
+        out[i] = (uint16_t)d;
+    }
+}
+
+// AVX-512 (8 double lanes; VPOPCNTDQ when present, else byte tables)
+
+PHASH_TARGET("avx512f,avx512bw")
+static inline __m512d gather8_avx512(const unsigned char* base, const int* offset, int ch) {
+    return _mm512_cvtepi32_pd(_mm256_setr_epi32(
+        base[offset[0] + ch], base[offset[1] + ch], base[offset[2] + ch], base[offset[3] + ch],
+        base[offset[4] + ch], base[offset[5] + ch], base[offset[6] + ch], base[offset[7] + ch]));
+}
+
+PHASH_TARGET("avx512f,avx512bw")
+static void resize_row_avx512(const unsigned char* row0, const unsigned char* row1,
+                              double dy, const ResizeColumns* cols, int size,
+                              ColorSpaceConversion colorspace, double* out) {
+    double weights[3];
+    grayscale_weights(colorspace, weights);
+    const __m512d one = _mm512_set1_pd(1.0);
+    const __m512d vdy = _mm512_set1_pd(dy);
+    const __m512d rdy = _mm512_sub_pd(one, vdy);
+
+    for (int x = 0; x < size; x += 8) {
+        const __m512d dx = _mm512_loadu_pd(cols->frac + x);
+        const __m512d rdx = _mm512_sub_pd(one, dx);
+        const __m512d w00 = _mm512_mul_pd(rdx, rdy);
+        const __m512d w01 = _mm512_mul_pd(dx, rdy);
+        const __m512d w10 = _mm512_mul_pd(rdx, vdy);
+        const __m512d w11 = _mm512_mul_pd(dx, vdy);
+
+        __m512d rgb[3];
+        for (int ch = 0; ch < 3; ch++) {
+            __m512d v = _mm512_mul_pd(w00, gather8_avx512(row0, cols->offset0 + x, ch));
+            v = _mm512_add_pd(v, _mm512_mul_pd(w01, gather8_avx512(row0, cols->offset1 + x, ch)));
+            v = _mm512_add_pd(v, _mm512_mul_pd(w10, gather8_avx512(row1, cols->offset0 + x, ch)));
+            v = _mm512_add_pd(v, _mm512_mul_pd(w11, gather8_avx512(row1, cols->offset1 + x, ch)));
+            rgb[ch] = _mm512_cvtepi32_pd(_mm512_cvttpd_epi32(v));
+        }
+
+        __m512d gray;
+        if (colorspace == COLORSPACE_AVERAGE) {
+            gray = _mm512_div_pd(_mm512_add_pd(_mm512_add_pd(rgb[0], rgb[1]), rgb[2]),
+                                 _mm512_set1_pd(3.0));
+        } else {
+            gray = _mm512_mul_pd(_mm512_set1_pd(weights[0]), rgb[0]);
+            gray = _mm512_add_pd(gray, _mm512_mul_pd(_mm512_set1_pd(weights[1]), rgb[1]));
+            gray = _mm512_add_pd(gray, _mm512_mul_pd(_mm512_set1_pd(weights[2]), rgb[2]));
+        }
+        _mm512_storeu_pd(out + x, gray);
+    }
+}
+
+PHASH_TARGET("avx512f,avx512bw")
+static void grayscale_avx512(const unsigned char* line, const int* index, int count,
+                             int channels, const double weights[3], double* out) {
+    const __m512d w0 = _mm512_set1_pd(weights[0]);
+    const __m512d w1 = _mm512_set1_pd(weights[1]);
+    const __m512d w2 = _mm512_set1_pd(weights[2]);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        int offset[8];
+        for (int k = 0; k < 8; k++) offset[k] = index[i + k]*channels;
+        __m512d gray = _mm512_mul_pd(w0, gather8_avx512(line, offset, 0));
+        gray = _mm512_add_pd(gray, _mm512_mul_pd(w1, gather8_avx512(line, offset, 1)));
+        gray = _mm512_add_pd(gray, _mm512_mul_pd(w2, gather8_avx512(line, offset, 2)));
+        _mm512_storeu_pd(out + i, gray);
+    }
+    grayscale_scalar(line, index + i, count - i, channels, weights, out + i);
+}
+
+PHASH_TARGET("avx512f,avx512bw")
+static void project_avx512(const double* samples, int count, const double* weight,
+                           int stride, int width, double* out) {
+    for (int u0 = 0; u0 < width; u0 += PROJECT_LANES) {
+        __m512d acc = _mm512_setzero_pd();
+        for (int i = 0; i < count; i++) {
+            const __m512d s = _mm512_set1_pd(samples[i]);
+            acc = _mm512_add_pd(acc, _mm512_mul_pd(s, _mm512_loadu_pd(weight + i*stride + u0)));
+        }
+        _mm512_storeu_pd(out + u0, acc);
+    }
+}
+
+PHASH_TARGET("avx512f,avx512bw")
+static void accumulate_avx512(const double* samples, int count, const double* weight,
+                              double* acc) {
+    const __m512d w = _mm512_loadu_pd(weight);
+    for (int i = 0; i < count; i++) {
+        double* a = acc + i*PROJECT_LANES;
+        _mm512_storeu_pd(a, _mm512_add_pd(_mm512_loadu_pd(a),
+                                          _mm512_mul_pd(_mm512_set1_pd(samples[i]), w)));
+    }
+}
+
+// Pixel offset of 8 image lines as 32-bit lanes, one gather through the
+// line pointers
+PHASH_TARGET("avx512f,avx512bw")
+static inline __m256i gather_lanes8_avx512(const unsigned char* const* lines, __m512i offset) {
+    const __m512i address = _mm512_add_epi64(_mm512_loadu_si512(lines), offset);
+    return _mm512_i64gather_epi32(address, (const void*)0, 1);
+}
+
+PHASH_TARGET("avx512f,avx512bw")
+static void grayscale_lanes_avx512_f(const unsigned char* const* lines, const int* index,
+                                     int count, int channels, const float weights[3],
+                                     float* out) {
+    const __m512 w0 = _mm512_set1_ps(weights[0]);
+    const __m512 w1 = _mm512_set1_ps(weights[1]);
+    const __m512 w2 = _mm512_set1_ps(weights[2]);
+    const __m512i byte = _mm512_set1_epi32(0xFF);
+    for (int i = 0; i < count; i++) {
+        const __m512i offset = _mm512_set1_epi64((long long)index[i]*channels);
+        const __m512i p = _mm512_inserti64x4(
+            _mm512_castsi256_si512(gather_lanes8_avx512(lines, offset)),
+            gather_lanes8_avx512(lines + 8, offset), 1);
+        const __m512 r = _mm512_cvtepi32_ps(_mm512_and_si512(p, byte));
+        const __m512 g = _mm512_cvtepi32_ps(_mm512_and_si512(_mm512_srli_epi32(p, 8), byte));
+        const __m512 b = _mm512_cvtepi32_ps(_mm512_and_si512(_mm512_srli_epi32(p, 16), byte));
+        __m512 gray = _mm512_mul_ps(w0, r);
+        gray = _mm512_add_ps(gray, _mm512_mul_ps(w1, g));
+        gray = _mm512_add_ps(gray, _mm512_mul_ps(w2, b));
+        _mm512_storeu_ps(out + i*IMAGE_LANES, gray);
+    }
+}
+
+PHASH_TARGET("avx512f,avx512bw")
+static void accumulate_lanes_avx512_f(const float* samples, int rows, int count,
+                                      const float* weight, float* acc) {
+    for (int i = 0; i < count; i++) {
+        float* a = acc + i*PROJECT_LANES*IMAGE_LANES;
+        __m512 sum[PROJECT_LANES];
+        for (int v = 0; v < PROJECT_LANES; v++) sum[v] = _mm512_loadu_ps(a + v*IMAGE_LANES);
+        for (int r = 0; r < rows; r++) {
+            const __m512 s = _mm512_loadu_ps(samples + (r*count + i)*IMAGE_LANES);
+            const float* w = weight + r*PROJECT_LANES;
+            for (int v = 0; v < PROJECT_LANES; v++) {
+                sum[v] = _mm512_add_ps(sum[v], _mm512_mul_ps(s, _mm512_set1_ps(w[v])));
+            }
+        }
+        for (int v = 0; v < PROJECT_LANES; v++) _mm512_storeu_ps(a + v*IMAGE_LANES, sum[v]);
+    }
+}
+
+PHASH_TARGET("avx512f,avx512bw")
+static void project_lanes_avx512_f(const float* acc, int count, const float* weight,
+                                   float* out) {
+    for (int v = 0; v < PROJECT_LANES; v++) {
+        __m512 sum[PROJECT_LANES];
+        for (int u = 0; u < PROJECT_LANES; u++) sum[u] = _mm512_setzero_ps();
+        for (int i = 0; i < count; i++) {
+            const __m512 a = _mm512_loadu_ps(acc + (i*PROJECT_LANES + v)*IMAGE_LANES);
+            const float* w = weight + i*PROJECT_LANES;
+            for (int u = 0; u < PROJECT_LANES; u++) {
+                sum[u] = _mm512_add_ps(sum[u], _mm512_mul_ps(a, _mm512_set1_ps(w[u])));
+            }
+        }
+        for (int u = 0; u < PROJECT_LANES; u++) {
+            _mm512_storeu_ps(out + (v*PROJECT_LANES + u)*IMAGE_LANES, sum[u]);
+        }
+    }
+}
+
+// Two sample pairs per iteration: the low half of each vector works on one
+// pair, the high half on the next
+PHASH_TARGET("avx512f,avx512bw")
+static void project_avx512_q(const int16_t* samples, int count, const int16_t* weight,
+                             int stride, int width, int32_t* out) {
+    for (int u0 = 0; u0 < width; u0 += PROJECT_LANES) {
+        __m512i acc = _mm512_setzero_si512();
+        int i = 0;
+        for (; i + 4 <= count; i += 4) {
+            int32_t pairs[2];
+            memcpy(pairs, samples + i, sizeof(pairs));
+            const int16_t* w = weight + (i >> 1)*stride + 2*u0;
+            const __m512i s = _mm512_inserti64x4(
+                _mm512_castsi256_si512(_mm256_set1_epi32(pairs[0])),
+                _mm256_set1_epi32(pairs[1]), 1);
+            const __m512i v = _mm512_inserti64x4(
+                _mm512_castsi256_si512(_mm256_loadu_si256((const __m256i*)w)),
+                _mm256_loadu_si256((const __m256i*)(w + stride)), 1);
+            acc = _mm512_add_epi32(acc, _mm512_madd_epi16(s, v));
+        }
+        __m256i sum = _mm256_add_epi32(_mm512_castsi512_si256(acc),
+                                       _mm512_extracti64x4_epi64(acc, 1));
+        for (; i < count; i += 2) {
+            int32_t pair;
+            memcpy(&pair, samples + i, sizeof(pair));
+            const __m256i w = _mm256_loadu_si256((const __m256i*)(weight + (i >> 1)*stride + 2*u0));
+            sum = _mm256_add_epi32(sum, _mm256_madd_epi16(_mm256_set1_epi32(pair), w));
+        }
+        _mm256_storeu_si256((__m256i*)(out + u0), sum);
+    }
+}
+
+PHASH_TARGET("avx512f,avx512bw")
+static void project_wide_avx512_q(const int32_t* coeff, int count, const int32_t* rows,
+                                  int64_t* out) {
+    __m512i acc = _mm512_setzero_si512();
+    for (int i = 0; i < count; i++) {
+        const __m512i r = _mm512_cvtepi32_epi64(
+            _mm256_loadu_si256((const __m256i*)(rows + i*PROJECT_LANES)));
+        acc = _mm512_add_epi64(acc, _mm512_mul_epi32(_mm512_set1_epi64(coeff[i]), r));
+    }
+    _mm512_storeu_si512((void*)out, acc);
+}
+
+PHASH_TARGET("avx512f,avx512bw,popcnt")
+static uint64_t popcount_avx512(const uint64_t* words, size_t count) {
+    const __m512i table = _mm512_broadcast_i32x4(
+        _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4));
+    const __m512i low_mask = _mm512_set1_epi8(0x0F);
+    __m512i acc = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m512i v = _mm512_loadu_si512((const void*)(words + i));
+        const __m512i lo = _mm512_and_si512(v, low_mask);
+        const __m512i hi = _mm512_and_si512(_mm512_srli_epi16(v, 4), low_mask);
+        const __m512i bytes = _mm512_add_epi8(_mm512_shuffle_epi8(table, lo),
+                                              _mm512_shuffle_epi8(table, hi));
+        acc = _mm512_add_epi64(acc, _mm512_sad_epu8(bytes, _mm512_setzero_si512()));
+    }
+    uint64_t total = (uint64_t)_mm512_reduce_add_epi64(acc);
+    for (; i < count; i++) total += (uint64_t)_mm_popcnt_u64(words[i]);
+    return total;
+}
+
+PHASH_TARGET("avx512f,avx512vpopcntdq,popcnt")
+static uint64_t popcount_avx512_vpopcntdq(const uint64_t* words, size_t count) {
+    __m512i acc = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(
+            _mm512_loadu_si512((const void*)(words + i))));
+    }
+    uint64_t total = (uint64_t)_mm512_reduce_add_epi64(acc);
+    for (; i < count; i++) total += (uint64_t)_mm_popcnt_u64(words[i]);
+    return total;
+}
+
+// Set bits of each 64-bit lane through the nibble table
+PHASH_TARGET("avx512f,avx512bw")
+static inline __m512i popcount8_avx512(__m512i v) {
+    const __m512i table = _mm512_broadcast_i32x4(
+        _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4));
+    const __m512i low_mask = _mm512_set1_epi8(0x0F);
+    const __m512i lo = _mm512_and_si512(v, low_mask);
+    const __m512i hi = _mm512_and_si512(_mm512_srli_epi16(v, 4), low_mask);
+    const __m512i bytes = _mm512_add_epi8(_mm512_shuffle_epi8(table, lo),
+                                          _mm512_shuffle_epi8(table, hi));
+    return _mm512_sad_epu8(bytes, _mm512_setzero_si512());
+}
+
+// Hamming distances of 8 hashes to the query, one per 64-bit lane, with
+// the nibble table or VPOPCNTDQ
+PHASH_TARGET("avx512f,avx512bw")
+static inline __m512i distances8_avx512(__m512i query, const uint64_t* hashes) {
+    return popcount8_avx512(
+        _mm512_xor_si512(_mm512_loadu_si512((const void*)hashes), query));
+}
+
+PHASH_TARGET("avx512f,avx512vpopcntdq")
+static inline __m512i distances8_avx512_vpopcntdq(__m512i query, const uint64_t* hashes) {
+    return _mm512_popcnt_epi64(
+        _mm512_xor_si512(_mm512_loadu_si512((const void*)hashes), query));
+}
+
+// (hashes ^ query) & masks & query_mask for 8 hashes
+PHASH_TARGET("avx512f")
+static inline __m512i masked_diff8_avx512(__m512i query, __m512i query_mask,
+                                          const uint64_t* hashes, const uint64_t* masks) {
+    return _mm512_and_si512(
+        _mm512_xor_si512(_mm512_loadu_si512((const void*)hashes), query),
+        _mm512_and_si512(_mm512_loadu_si512((const void*)masks), query_mask));
+}
+
+// Distances narrowed to bytes 8 at a time; matching indices are
+// compress-stored
+PHASH_TARGET("avx512f,avx512bw,popcnt")
+static void distances_avx512(uint64_t query, const uint64_t* hashes, size_t count,
+                             uint8_t* out) {
+    const __m512i q = _mm512_set1_epi64((long long)query);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm_storel_epi64((__m128i*)(out + i), _mm512_cvtepi64_epi8(distances8_avx512(q, hashes + i)));
+    }
+    for (; i < count; i++) out[i] = (uint8_t)_mm_popcnt_u64(query ^ hashes[i]);
+}
+
+PHASH_TARGET("avx512f,avx512bw,popcnt")
+static void distances_masked_avx512(uint64_t query, uint64_t query_mask, const uint64_t* hashes,
+                                    const uint64_t* masks, size_t count, uint8_t* out) {
+    const __m512i q = _mm512_set1_epi64((long long)query);
+    const __m512i qm = _mm512_set1_epi64((long long)query_mask);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm_storel_epi64((__m128i*)(out + i), _mm512_cvtepi64_epi8(
+            popcount8_avx512(masked_diff8_avx512(q, qm, hashes + i, masks + i))));
+    }
+    for (; i < count; i++) {
+        out[i] = (uint8_t)_mm_popcnt_u64((query ^ hashes[i]) & query_mask & masks[i]);
+    }
+}
+
+PHASH_TARGET("avx512f,avx512bw,popcnt")
+static size_t scan_within_avx512(uint64_t query, const uint64_t* hashes, size_t count,
+                                 int max_distance, size_t* out) {
+    const __m512i q = _mm512_set1_epi64((long long)query);
+    const __m512i limit = _mm512_set1_epi64(max_distance);
+    __m512i index = _mm512_setr_epi64(0, 1, 2, 3, 4, 5, 6, 7);
+    size_t found = 0, i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __mmask8 near = _mm512_cmple_epi64_mask(distances8_avx512(q, hashes + i), limit);
+        _mm512_mask_compressstoreu_epi64(out + found, near, index);
+        found += (size_t)_mm_popcnt_u32(near);
+        index = _mm512_add_epi64(index, _mm512_set1_epi64(8));
+    }
+    for (; i < count; i++) {
+        out[found] = i;
+        found += (_mm_popcnt_u64(query ^ hashes[i]) <= max_distance);
+    }
+    return found;
+}
+
+PHASH_TARGET("avx512f,avx512vpopcntdq,popcnt")
+static void distances_avx512_vpopcntdq(uint64_t query, const uint64_t* hashes,
+                                       size_t count, uint8_t* out) {
+    const __m512i q = _mm512_set1_epi64((long long)query);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm_storel_epi64((__m128i*)(out + i), _mm512_cvtepi64_epi8(distances8_avx512_vpopcntdq(q, hashes + i)));
+    }
+    for (; i < count; i++) out[i] = (uint8_t)_mm_popcnt_u64(query ^ hashes[i]);
+}
+
+PHASH_TARGET("avx512f,avx512vpopcntdq,popcnt")
+static void distances_masked_avx512_vpopcntdq(uint64_t query, uint64_t query_mask,
+                                              const uint64_t* hashes, const uint64_t* masks,
+                                              size_t count, uint8_t* out) {
+    const __m512i q = _mm512_set1_epi64((long long)query);
+    const __m512i qm = _mm512_set1_epi64((long long)query_mask);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm_storel_epi64((__m128i*)(out + i), _mm512_cvtepi64_epi8(
+            _mm512_popcnt_epi64(masked_diff8_avx512(q, qm, hashes + i, masks + i))));
+    }
+    for (; i < count; i++) {
+        out[i] = (uint8_t)_mm_popcnt_u64((query ^ hashes[i]) & query_mask & masks[i]);
+    }
+}
+
+PHASH_TARGET("avx512f,avx512vpopcntdq,popcnt")
+static size_t scan_within_avx512_vpopcntdq(uint64_t query, const uint64_t* hashes,
+                                           size_t count, int max_distance, size_t* out) {
+    const __m512i q = _mm512_set1_epi64((long long)query);
+    const __m512i limit = _mm512_set1_epi64(max_distance);
+    __m512i index = _mm512_setr_epi64(0, 1, 2, 3, 4, 5, 6, 7);
+    size_t found = 0, i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __mmask8 near = _mm512_cmple_epi64_mask(distances8_avx512_vpopcntdq(q, hashes + i), limit);
+        _mm512_mask_compressstoreu_epi64(out + found, near, index);
+        found += (size_t)_mm_popcnt_u32(near);
+        index = _mm512_add_epi64(index, _mm512_set1_epi64(8));
+    }
+    for (; i < count; i++) {
+        out[found] = i;
+        found += (_mm_popcnt_u64(query ^ hashes[i]) <= max_distance);
+    }
+    return found;
+}
+
+// Wide hashes go in 8-word chunks, the last one loaded under a mask:
+// masked words read as zero on both sides and add nothing. Loads the
+// query chunks and their masks and returns how many there are.
+PHASH_TARGET("avx512f")
+static inline int wide_chunks_avx512(const uint64_t* query, int words, __m512i q[2],
+                              __mmask8 mask[2]) {
+    const int chunks = (words + 7) / 8;
+    for (int c = 0; c < chunks; c++) {
+        const int left = words - 8*c;
+        mask[c] = (left >= 8) ? 0xFF : (__mmask8)((1u << left) - 1);
+        q[c] = _mm512_maskz_loadu_epi64(mask[c], query + 8*c);
+    }
+    return chunks;
+}
+
+PHASH_TARGET("avx512f,avx512bw,popcnt")
+static void distances_wide_avx512(const uint64_t* query, const uint64_t* hashes, size_t count,
+                                  int words, uint16_t* out) {
+    const __m512i table = _mm512_broadcast_i32x4(
+        _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4));
+    const __m512i low_mask = _mm512_set1_epi8(0x0F);
+    __m512i q[2];
+    __mmask8 mask[2];
+    const int chunks = wide_chunks_avx512(query, words, q, mask);
+
+    for (size_t i = 0; i < count; i++, hashes += words) {
+        __m512i bytes = _mm512_setzero_si512();
+        for (int c = 0; c < chunks; c++) {
+            const __m512i v = _mm512_xor_si512(
+                _mm512_maskz_loadu_epi64(mask[c], hashes + 8*c), q[c]);
+            const __m512i lo = _mm512_and_si512(v, low_mask);
+            const __m512i hi = _mm512_and_si512(_mm512_srli_epi16(v, 4), low_mask);
+            bytes = _mm512_add_epi8(bytes, _mm512_add_epi8(_mm512_shuffle_epi8(table, lo),
+                                                           _mm512_shuffle_epi8(table, hi)));
+        }
+        out[i] = (uint16_t)_mm512_reduce_add_epi64(
+            _mm512_sad_epu8(bytes, _mm512_setzero_si512()));
+    }
+}
+
+PHASH_TARGET("avx512f,avx512vpopcntdq")
+static void distances_wide_avx512_vpopcntdq(const uint64_t* query, const uint64_t* hashes,
+                                            size_t count, int words, uint16_t* out) {
+    __m512i q[2];
+    __mmask8 mask[2];
+    const int chunks = wide_chunks_avx512(query, words, q, mask);
+
+    for (size_t i = 0; i < count; i++, hashes += words) {
+        __m512i acc = _mm512_setzero_si512();
+        for (int c = 0; c < chunks; c++) {
+            acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_xor_si512(
+                _mm512_maskz_loadu_epi64(mask[c], hashes + 8*c), q[c])));
+        }
+        out[i] = (uint16_t)_mm512_reduce_add_epi64(acc);
+    }
+}
+
+static const PhashKernels g_kernels_sse42 = {
+    .level = PHASH_SIMD_SSE42,
+    .resize_row = resize_row_sse42,
+    .grayscale = grayscale_scalar,
+    .project = project_sse42,
+    .accumulate = accumulate_sse42,
+    .resize_row_f = resize_row_sse42_f,
+    .grayscale_f = grayscale_scalar_f,
+    .project_f = project_sse42_f,
+    .accumulate_f = accumulate_sse42_f,
+    .resize_row_q = resize_row_sse42_q,
+    .project_q = project_sse42_q,
+    .project_wide_q = project_wide_sse42_q,
+    .grayscale_lanes_f = grayscale_lanes_scalar_f,
+    .accumulate_lanes_f = NULL,
+    .project_lanes_f = NULL,
+    .dct_8x8 = dct_8x8_scalar,
+    .dct_8x8_f = dct_8x8_scalar_f,
+    .popcount = popcount_sse42,
+    .distances = distances_sse42,
+    .scan_within = scan_within_sse42,
+    .distances_wide = distances_wide_sse42,
+    .distances_masked = distances_masked_sse42
+};
+
+static const PhashKernels g_kernels_avx2 = {
+    .level = PHASH_SIMD_AVX2,
+    .resize_row = resize_row_avx2,
+    .grayscale = grayscale_avx2,
+    .project = project_avx2,
+    .accumulate = accumulate_avx2,
+    .resize_row_f = resize_row_avx2_f,
+    .grayscale_f = grayscale_avx2_f,
+    .project_f = project_avx2_f,
+    .accumulate_f = accumulate_avx2_f,
+    .resize_row_q = resize_row_avx2_q,
+    .project_q = project_avx2_q,
+    .project_wide_q = project_wide_avx2_q,
+    .grayscale_lanes_f = grayscale_lanes_avx2_f,
+    .accumulate_lanes_f = accumulate_lanes_avx2_f,
+    .project_lanes_f = project_lanes_avx2_f,
+    .dct_8x8 = dct_8x8_scalar,
+    .dct_8x8_f = dct_8x8_scalar_f,
+    .popcount = popcount_avx2,
+    .distances = distances_avx2,
+    .scan_within = scan_within_avx2,
+    .distances_wide = distances_wide_avx2,
+    .distances_masked = distances_masked_avx2
+};
+
+// Eight floats or int32 fill a 256-bit register, so the single-precision
+// kernels and the fixed-point resize of the AVX-512 tables are the AVX2 ones
+static const PhashKernels g_kernels_avx512 = {
+    .level = PHASH_SIMD_AVX512,
+    .resize_row = resize_row_avx512,
+    .grayscale = grayscale_avx512,
+    .project = project_avx512,
+    .accumulate = accumulate_avx512,
+    .resize_row_f = resize_row_avx2_f,
+    .grayscale_f = grayscale_avx2_f,
+    .project_f = project_avx2_f,
+    .accumulate_f = accumulate_avx2_f,
+    .resize_row_q = resize_row_avx2_q,
+    .project_q = project_avx512_q,
+    .project_wide_q = project_wide_avx512_q,
+    .grayscale_lanes_f = grayscale_lanes_avx512_f,
+    .accumulate_lanes_f = accumulate_lanes_avx512_f,
+    .project_lanes_f = project_lanes_avx512_f,
+    .dct_8x8 = dct_8x8_scalar,
+    .dct_8x8_f = dct_8x8_scalar_f,
+    .popcount = popcount_avx512,
+    .distances = distances_avx512,
+    .scan_within = scan_within_avx512,
+    .distances_wide = distances_wide_avx512,
+    .distances_masked = distances_masked_avx512
+};
+
+static const PhashKernels g_kernels_avx512_vpopcntdq = {
+    .level = PHASH_SIMD_AVX512,
+    .resize_row = resize_row_avx512,
+    .grayscale = grayscale_avx512,
+    .project = project_avx512,
+    .accumulate = accumulate_avx512,
+    .resize_row_f = resize_row_avx2_f,
+    .grayscale_f = grayscale_avx2_f,
+    .project_f = project_avx2_f,
+    .accumulate_f = accumulate_avx2_f,
+    .resize_row_q = resize_row_avx2_q,
+    .project_q = project_avx512_q,
+    .project_wide_q = project_wide_avx512_q,
+    .grayscale_lanes_f = grayscale_lanes_avx512_f,
+    .accumulate_lanes_f = accumulate_lanes_avx512_f,
+    .project_lanes_f = project_lanes_avx512_f,
+    .dct_8x8 = dct_8x8_scalar,
+    .dct_8x8_f = dct_8x8_scalar_f,
+    .popcount = popcount_avx512_vpopcntdq,
+    .distances = distances_avx512_vpopcntdq,
+    .scan_within = scan_within_avx512_vpopcntdq,
+    .distances_wide = distances_wide_avx512_vpopcntdq,
+    .distances_masked = distances_masked_avx512_vpopcntdq
+};
+
+// CPU feature detection: cpuid for the instruction sets, xgetbv for the
+// register state the OS saves on context switches
+typedef struct {
+    bool sse42, popcnt, avx2, avx512, avx512_vpopcntdq;
+} CpuFeatures;
+
+static CpuFeatures detect_cpu_features(void) {
+    CpuFeatures f = {0};
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return f;
+    f.sse42 = (ecx >> 20) & 1;
+    f.popcnt = (ecx >> 23) & 1;
+    const bool osxsave = (ecx >> 27) & 1;
+    const bool avx = (ecx >> 28) & 1;
+    if (!osxsave || !avx) return f;
+
+    unsigned int xcr0_lo, xcr0_hi;
+    __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    const bool ymm_state = (xcr0_lo & 0x06) == 0x06;
+    const bool zmm_state = (xcr0_lo & 0xE6) == 0xE6;
+    if (!ymm_state || __get_cpuid_max(0, NULL) < 7) return f;
+
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    f.avx2 = (ebx >> 5) & 1;
+    f.avx512 = zmm_state && ((ebx >> 16) & 1) && ((ebx >> 30) & 1);  // F + BW
+    f.avx512_vpopcntdq = f.avx512 && ((ecx >> 14) & 1);
+    return f;
+}
+
+#endif // __x86_64__ || _M_X64
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+
+// NEON (2 double / 4 float lanes; Advanced SIMD is mandatory on AArch64)
+
+static void project_neon(const double* samples, int count, const double* weight,
+                         int stride, int width, double* out) {
+    for (int u0 = 0; u0 < width; u0 += PROJECT_LANES) {
+        float64x2_t acc0 = vdupq_n_f64(0.0), acc1 = vdupq_n_f64(0.0);
+        float64x2_t acc2 = vdupq_n_f64(0.0), acc3 = vdupq_n_f64(0.0);
+        for (int i = 0; i < count; i++) {
+            const double* w = weight + i*stride + u0;
+            const float64x2_t s = vdupq_n_f64(samples[i]);
+            acc0 = vaddq_f64(acc0, vmulq_f64(s, vld1q_f64(w)));
+            acc1 = vaddq_f64(acc1, vmulq_f64(s, vld1q_f64(w + 2)));
+            acc2 = vaddq_f64(acc2, vmulq_f64(s, vld1q_f64(w + 4)));
+            acc3 = vaddq_f64(acc3, vmulq_f64(s, vld1q_f64(w + 6)));
+        }
+        vst1q_f64(out + u0, acc0);
+        vst1q_f64(out + u0 + 2, acc1);
+        vst1q_f64(out + u0 + 4, acc2);
+        vst1q_f64(out + u0 + 6, acc3);
+    }
+}
+
+static void accumulate_neon(const double* samples, int count, const double* weight,
+                            double* acc) {
+    const float64x2_t w0 = vld1q_f64(weight), w1 = vld1q_f64(weight + 2);
+    const float64x2_t w2 = vld1q_f64(weight + 4), w3 = vld1q_f64(weight + 6);
+    for (int i = 0; i < count; i++) {
+        double* a = acc + i*PROJECT_LANES;
+        const float64x2_t s = vdupq_n_f64(samples[i]);
+        vst1q_f64(a, vaddq_f64(vld1q_f64(a), vmulq_f64(s, w0)));
+        vst1q_f64(a + 2, vaddq_f64(vld1q_f64(a + 2), vmulq_f64(s, w1)));
+        vst1q_f64(a + 4, vaddq_f64(vld1q_f64(a + 4), vmulq_f64(s, w2)));
+        vst1q_f64(a + 6, vaddq_f64(vld1q_f64(a + 6), vmulq_f64(s, w3)));
+    }
+}
+
+static void project_neon_f(const float* samples, int count, const float* weight,
+                           int stride, int width, float* out) {
+    for (int u0 = 0; u0 < width; u0 += PROJECT_LANES) {
+        float32x4_t acc0 = vdupq_n_f32(0.0f), acc1 = vdupq_n_f32(0.0f);
+        for (int i = 0; i < count; i++) {
+            const float* w = weight + i*stride + u0;
+            const float32x4_t s = vdupq_n_f32(samples[i]);
+            acc0 = vaddq_f32(acc0, vmulq_f32(s, vld1q_f32(w)));
+            acc1 = vaddq_f32(acc1, vmulq_f32(s, vld1q_f32(w + 4)));
+        }
+        vst1q_f32(out + u0, acc0);
+        vst1q_f32(out + u0 + 4, acc1);
+    }
+}
+
+static void accumulate_neon_f(const float* samples, int count, const float* weight,
+                              float* acc) {
+    const float32x4_t w0 = vld1q_f32(weight), w1 = vld1q_f32(weight + 4);
+    for (int i = 0; i < count; i++) {
+        float* a = acc + i*PROJECT_LANES;
+        const float32x4_t s = vdupq_n_f32(samples[i]);
+        vst1q_f32(a, vaddq_f32(vld1q_f32(a), vmulq_f32(s, w0)));
+        vst1q_f32(a + 4, vaddq_f32(vld1q_f32(a + 4), vmulq_f32(s, w1)));
+    }
+}
+
+// dct_1d_aan8 applied lane-wise to eight vectors, with the same operations
+// in the same order, so each lane matches the scalar kernel bit for bit
+static inline void aan8_neon(float64x2_t v[8]) {
+    static const double descale[8] = {
+        1.0,                 0.50979557910415918, 0.54119610014619698,
+        0.60134488693504529, 0.70710678118654752, 0.89997622313641568,
+        1.3065629648763766,  2.5629154477415064
+    };
+    const float64x2_t s07 = vaddq_f64(v[0], v[7]), d07 = vsubq_f64(v[0], v[7]);
+    const float64x2_t s16 = vaddq_f64(v[1], v[6]), d16 = vsubq_f64(v[1], v[6]);
+    const float64x2_t s25 = vaddq_f64(v[2], v[5]), d25 = vsubq_f64(v[2], v[5]);
+    const float64x2_t s34 = vaddq_f64(v[3], v[4]), d34 = vsubq_f64(v[3], v[4]);
+
+    const float64x2_t e0 = vaddq_f64(s07, s34), e3 = vsubq_f64(s07, s34);
+    const float64x2_t e1 = vaddq_f64(s16, s25), e2 = vsubq_f64(s16, s25);
+    v[0] = vaddq_f64(e0, e1);
+    v[4] = vsubq_f64(e0, e1);
+    const float64x2_t z1 = vmulq_n_f64(vaddq_f64(e2, e3), 0.70710678118654752);
+    v[2] = vaddq_f64(e3, z1);
+    v[6] = vsubq_f64(e3, z1);
+
+    const float64x2_t o0 = vaddq_f64(d34, d25), o1 = vaddq_f64(d25, d16);
+    const float64x2_t o2 = vaddq_f64(d16, d07);
+    const float64x2_t z5 = vmulq_n_f64(vsubq_f64(o0, o2), 0.38268343236508977);
+    const float64x2_t z2 = vaddq_f64(vmulq_n_f64(o0, 0.54119610014619698), z5);
+    const float64x2_t z4 = vaddq_f64(vmulq_n_f64(o2, 1.3065629648763766), z5);
+    const float64x2_t z3 = vmulq_n_f64(o1, 0.70710678118654752);
+    const float64x2_t z11 = vaddq_f64(d07, z3), z13 = vsubq_f64(d07, z3);
+    v[5] = vaddq_f64(z13, z2);
+    v[3] = vsubq_f64(z13, z2);
+    v[1] = vaddq_f64(z11, z4);
+    v[7] = vsubq_f64(z11, z4);
+
+    for (int k = 0; k < 8; k++) v[k] = vmulq_n_f64(v[k], descale[k]);
+}
+
+// In-register transpose of an 8x8 double matrix held as m[row][pair]
+// (columns 2*pair and 2*pair + 1), one 2x2 block at a time
+static inline void transpose_8x8_neon(const float64x2_t m[8][4], float64x2_t t[8][4]) {
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            t[2*j][i] = vtrn1q_f64(m[2*i][j], m[2*i + 1][j]);
+            t[2*j + 1][i] = vtrn2q_f64(m[2*i][j], m[2*i + 1][j]);
+        }
+    }
+}
+
+// Same order of operations as dct_8x8_scalar: a transpose turns the row
+// pass into lane-wise butterflies across registers, and a second transpose
+// does the same for the column pass, leaving the result row-major
+static void dct_8x8_neon(const double* input, double* output) {
+    float64x2_t m[8][4], t[8][4], v[8];
+
+    for (int y = 0; y < 8; y++) {
+        for (int j = 0; j < 4; j++) m[y][j] = vld1q_f64(input + y*8 + 2*j);
+    }
+
+    // Row pass: t[x][pair of rows y] -> m[u][pair of rows y]
+    transpose_8x8_neon(m, t);
+    for (int j = 0; j < 4; j++) {
+        for (int k = 0; k < 8; k++) v[k] = t[k][j];
+        aan8_neon(v);
+        for (int k = 0; k < 8; k++) m[k][j] = v[k];
+    }
+
+    // Column pass: t[y][pair of columns u] -> t[v][pair of columns u]
+    transpose_8x8_neon(m, t);
+    for (int j = 0; j < 4; j++) {
+        for (int k = 0; k < 8; k++) v[k] = t[k][j];
+        aan8_neon(v);
+        for (int k = 0; k < 8; k++) t[k][j] = v[k];
+    }
+
+    for (int y = 0; y < 8; y++) {
+        const double av = (y == 0) ? M_SQRT1_2 : 1.0;
+        for (int j = 0; j < 4; j++) {
+            double scale[2];
+            for (int k = 0; k < 2; k++) {
+                const double au = (j == 0 && k == 0) ? M_SQRT1_2 : 1.0;
+                scale[k] = 0.25 * au * av;
+            }
+            vst1q_f64(output + y*8 + 2*j, vmulq_f64(vld1q_f64(scale), t[y][j]));
+        }
+    }
+}
+
+// Single-precision twin of aan8_neon on four lanes
+static inline void aan8_neon_f(float32x4_t v[8]) {
+    static const float descale[8] = {
+        1.0f,                 0.50979557910415918f, 0.54119610014619698f,
+        0.60134488693504529f, 0.70710678118654752f, 0.89997622313641568f,
+        1.3065629648763766f,  2.5629154477415064f
+    };
+    const float32x4_t s07 = vaddq_f32(v[0], v[7]), d07 = vsubq_f32(v[0], v[7]);
+    const float32x4_t s16 = vaddq_f32(v[1], v[6]), d16 = vsubq_f32(v[1], v[6]);
+    const float32x4_t s25 = vaddq_f32(v[2], v[5]), d25 = vsubq_f32(v[2], v[5]);
+    const float32x4_t s34 = vaddq_f32(v[3], v[4]), d34 = vsubq_f32(v[3], v[4]);
+
+    const float32x4_t e0 = vaddq_f32(s07, s34), e3 = vsubq_f32(s07, s34);
+    const float32x4_t e1 = vaddq_f32(s16, s25), e2 = vsubq_f32(s16, s25);
+    v[0] = vaddq_f32(e0, e1);
+    v[4] = vsubq_f32(e0, e1);
+    const float32x4_t z1 = vmulq_n_f32(vaddq_f32(e2, e3), 0.70710678118654752f);
+    v[2] = vaddq_f32(e3, z1);
+    v[6] = vsubq_f32(e3, z1);
+
+    const float32x4_t o0 = vaddq_f32(d34, d25), o1 = vaddq_f32(d25, d16);
+    const float32x4_t o2 = vaddq_f32(d16, d07);
+    const float32x4_t z5 = vmulq_n_f32(vsubq_f32(o0, o2), 0.38268343236508977f);
+    const float32x4_t z2 = vaddq_f32(vmulq_n_f32(o0, 0.54119610014619698f), z5);
+    const float32x4_t z4 = vaddq_f32(vmulq_n_f32(o2, 1.3065629648763766f), z5);
+    const float32x4_t z3 = vmulq_n_f32(o1, 0.70710678118654752f);
+    const float32x4_t z11 = vaddq_f32(d07, z3), z13 = vsubq_f32(d07, z3);
+    v[5] = vaddq_f32(z13, z2);
+    v[3] = vsubq_f32(z13, z2);
+    v[1] = vaddq_f32(z11, z4);
+    v[7] = vsubq_f32(z11, z4);
+
+    for (int k = 0; k < 8; k++) v[k] = vmulq_n_f32(v[k], descale[k]);
+}
+
+// 4x4 float transpose: trn1/trn2 on 32-bit lanes, then on 64-bit pairs
+static inline void transpose_4x4_neon_f(float32x4_t a0, float32x4_t a1,
+                                        float32x4_t a2, float32x4_t a3,
+                                        float32x4_t out[4]) {
+    const float32x4_t t0 = vtrn1q_f32(a0, a1), t1 = vtrn2q_f32(a0, a1);
+    const float32x4_t t2 = vtrn1q_f32(a2, a3), t3 = vtrn2q_f32(a2, a3);
+    out[0] = vreinterpretq_f32_f64(vtrn1q_f64(vreinterpretq_f64_f32(t0),
+                                              vreinterpretq_f64_f32(t2)));
+    out[1] = vreinterpretq_f32_f64(vtrn1q_f64(vreinterpretq_f64_f32(t1),
+                                              vreinterpretq_f64_f32(t3)));
+    out[2] = vreinterpretq_f32_f64(vtrn2q_f64(vreinterpretq_f64_f32(t0),
+                                              vreinterpretq_f64_f32(t2)));
+    out[3] = vreinterpretq_f32_f64(vtrn2q_f64(vreinterpretq_f64_f32(t1),
+                                              vreinterpretq_f64_f32(t3)));
+}
+
+// 8x8 float transpose of m[row][half] (columns 4*half..4*half + 3) as four
+// 4x4 blocks
+static inline void transpose_8x8_neon_f(const float32x4_t m[8][2], float32x4_t t[8][2]) {
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            float32x4_t block[4];
+            transpose_4x4_neon_f(m[4*i][j], m[4*i + 1][j], m[4*i + 2][j],
+                                 m[4*i + 3][j], block);
+            for (int k = 0; k < 4; k++) t[4*j + k][i] = block[k];
+        }
+    }
+}
+
+static void dct_8x8_neon_f(const float* input, float* output) {
+    float32x4_t m[8][2], t[8][2], v[8];
+
+    for (int y = 0; y < 8; y++) {
+        m[y][0] = vld1q_f32(input + y*8);
+        m[y][1] = vld1q_f32(input + y*8 + 4);
+    }
+
+    transpose_8x8_neon_f(m, t);
+    for (int j = 0; j < 2; j++) {
+        for (int k = 0; k < 8; k++) v[k] = t[k][j];
+        aan8_neon_f(v);
+        for (int k = 0; k < 8; k++) m[k][j] = v[k];
+    }
+
+    transpose_8x8_neon_f(m, t);
+    for (int j = 0; j < 2; j++) {
+        for (int k = 0; k < 8; k++) v[k] = t[k][j];
+        aan8_neon_f(v);
+        for (int k = 0; k < 8; k++) t[k][j] = v[k];
+    }
+
+    for (int y = 0; y < 8; y++) {
+        const float av = (y == 0) ? (float)M_SQRT1_2 : 1.0f;
+        for (int j = 0; j < 2; j++) {
+            float scale[4];
+            for (int k = 0; k < 4; k++) {
+                const float au = (j == 0 && k == 0) ? (float)M_SQRT1_2 : 1.0f;
+                scale[k] = 0.25f * au * av;
+            }
+            vst1q_f32(output + y*8 + 4*j, vmulq_f32(vld1q_f32(scale), t[y][j]));
+        }
+    }
+}
+
+static uint64_t popcount_neon(const uint64_t* words, size_t count) {
+    uint64_t total = 0;
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        total += vaddvq_u8(vcntq_u8(vreinterpretq_u8_u64(vld1q_u64(words + i))));
+    }
+    for (; i < count; i++) total += __builtin_popcountll(words[i]);
+    return total;
+}
+
+static void distances_neon(uint64_t query, const uint64_t* hashes, size_t count,
+                           uint8_t* out) {
+    const uint64x2_t q = vdupq_n_u64(query);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        const uint8x16_t bits = vcntq_u8(vreinterpretq_u8_u64(
+            veorq_u64(vld1q_u64(hashes + i), q)));
+        out[i] = vaddv_u8(vget_low_u8(bits));
+        out[i + 1] = vaddv_u8(vget_high_u8(bits));
+    }
+    for (; i < count; i++) out[i] = (uint8_t)__builtin_popcountll(query ^ hashes[i]);
+}
+
+static void distances_masked_neon(uint64_t query, uint64_t query_mask, const uint64_t* hashes,
+                                  const uint64_t* masks, size_t count, uint8_t* out) {
+    const uint64x2_t q = vdupq_n_u64(query);
+    const uint64x2_t qm = vdupq_n_u64(query_mask);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        const uint64x2_t diff = vandq_u64(veorq_u64(vld1q_u64(hashes + i), q),
+                                          vandq_u64(vld1q_u64(masks + i), qm));
+        const uint8x16_t bits = vcntq_u8(vreinterpretq_u8_u64(diff));
+        out[i] = vaddv_u8(vget_low_u8(bits));
+        out[i + 1] = vaddv_u8(vget_high_u8(bits));
+    }
+    for (; i < count; i++) {
+        out[i] = (uint8_t)__builtin_popcountll((query ^ hashes[i]) & query_mask & masks[i]);
+    }
+}
+
+// Byte counts of up to 8 word pairs stay below 256
+static void distances_wide_neon(const uint64_t* query, const uint64_t* hashes, size_t count,
+                                int words, uint16_t* out) {
+    for (size_t i = 0; i < count; i++, hashes += words) {
+        uint8x16_t bytes = vdupq_n_u8(0);
+        int w = 0;
+        for (; w + 2 <= words; w += 2) {
+            bytes = vaddq_u8(bytes, vcntq_u8(vreinterpretq_u8_u64(
+                veorq_u64(vld1q_u64(hashes + w), vld1q_u64(query + w)))));
+        }
+        uint32_t d = vaddlvq_u8(bytes);
+        for (; w < words; w++) d += (uint32_t)__builtin_popcountll(query[w] ^ hashes[w]);
+        out[i] = (uint16_t)d;
+    }
+}
+
+static const PhashKernels g_kernels_neon = {
+    .level = PHASH_SIMD_NEON,
+    .resize_row = resize_row_scalar,
+    .grayscale = grayscale_scalar,
+    .project = project_neon,
+    .accumulate = accumulate_neon,
+    .resize_row_f = resize_row_scalar_f,
+    .grayscale_f = grayscale_scalar_f,
+    .project_f = project_neon_f,
+    .accumulate_f = accumulate_neon_f,
+    .resize_row_q = resize_row_scalar_q,
+    .project_q = project_scalar_q,
+    .project_wide_q = project_wide_scalar_q,
+    .grayscale_lanes_f = grayscale_lanes_scalar_f,
+    .accumulate_lanes_f = NULL,
+    .project_lanes_f = NULL,
+    .dct_8x8 = dct_8x8_neon,
+    .dct_8x8_f = dct_8x8_neon_f,
+    .popcount = popcount_neon,
+    .distances = distances_neon,
+    .scan_within = scan_within_scalar,
+    .distances_wide = distances_wide_neon,
+    .distances_masked = distances_masked_neon
+};
+
+#endif // __aarch64__ || _M_ARM64
+
+// Best kernels for this CPU and the ones currently in use. g_kernels is
+// atomic so that phash_set_simd_level may run alongside computations.
+static const PhashKernels* g_kernels_detected = &g_kernels_scalar;
+static _Atomic(const PhashKernels*) g_kernels = &g_kernels_scalar;
+
+static const PhashKernels* active_kernels(void) {
+    return atomic_load_explicit(&g_kernels, memory_order_relaxed);
+}
+
+static void detect_kernels(void) {
+#if defined(__x86_64__) || defined(_M_X64)
+    const CpuFeatures f = detect_cpu_features();
+    if (f.avx512 && f.popcnt) {
+        g_kernels_detected = f.avx512_vpopcntdq ? &g_kernels_avx512_vpopcntdq
+                                                : &g_kernels_avx512;
+    } else if (f.avx2 && f.popcnt) {
+        g_kernels_detected = &g_kernels_avx2;
+    } else if (f.sse42 && f.popcnt) {
+        g_kernels_detected = &g_kernels_sse42;
+    } else {
+        g_kernels_detected = &g_kernels_scalar;
+    }
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    g_kernels_detected = &g_kernels_neon;
+#else
+    g_kernels_detected = &g_kernels_scalar;
+#endif
+    atomic_store_explicit(&g_kernels, g_kernels_detected, memory_order_relaxed);
+}
+
+// Kernel table for a SIMD level, or NULL if this CPU cannot run it
+static const PhashKernels* kernels_for_level(PhashSimdLevel level) {
+    if (level == PHASH_SIMD_NONE) return &g_kernels_scalar;
+#if defined(__x86_64__) || defined(_M_X64)
+    if (level > g_kernels_detected->level) return NULL;
+    switch (level) {
+        case PHASH_SIMD_SSE42: return &g_kernels_sse42;
+        case PHASH_SIMD_AVX2: return &g_kernels_avx2;
+        case PHASH_SIMD_AVX512: return g_kernels_detected;
+        default: return NULL;
+    }
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    return (level == PHASH_SIMD_NEON) ? &g_kernels_neon : NULL;
+#else
+    return NULL;
+#endif
+}
+
+// Kernels a computation with this config should use
+static const PhashKernels* kernels_for(const PhashConfig* cfg) {
+    return cfg->enable_simd ? active_kernels() : &g_kernels_scalar;
+}
+
+// Bilinear sampling grid of a dst_size x dst_size resize: the column taps
+// and, per output row, the two source rows and the vertical weight dy
+typedef struct {
+    ResizeColumns cols;
+    int row0[MAX_DCT_SIZE];      // Upper source row
+    int row1[MAX_DCT_SIZE];      // Lower source row
+    double frac[MAX_DCT_SIZE];   // Vertical interpolation weight dy
+    float frac_f[MAX_DCT_SIZE];  // Same, single precision
+    int frac_q[MAX_DCT_SIZE];    // Same in Q8 (fixed-point pipeline)
+} ResizeGrid;
+
+static void resize_grid_build(int width, int height, int channels, int dst_size,
+                              ResizeGrid* grid) {
+    const double x_ratio = (width > 1) ? (double)(width - 1) / (dst_size - 1) : 0.0;
+    const double y_ratio = (height > 1) ? (double)(height - 1) / (dst_size - 1) : 0.0;
+
+    for (int x = 0; x < dst_size; x++) {
+        const double src_x = x * x_ratio;
+        const int x0 = (int)src_x;
+        const int x1 = (x0 < width - 1) ? x0 + 1 : x0;
+        grid->cols.offset0[x] = x0 * channels;
+        grid->cols.offset1[x] = x1 * channels;
+        grid->cols.frac[x] = src_x - x0;
+        grid->cols.frac_f[x] = (float)grid->cols.frac[x];
+    }
+
+    for (int y = 0; y < dst_size; y++) {
+        const double src_y = y * y_ratio;
+        const int y0 = (int)src_y;
+        grid->row0[y] = y0;
+        grid->row1[y] = (y0 < height - 1) ? y0 + 1 : y0;
+        grid->frac[y] = src_y - y0;
+        grid->frac_f[y] = (float)grid->frac[y];
+    }
+}
+
+// SIMD-optimized bilinear interpolation of the grid into matrix
+static void resize_and_grayscale(const ResizeGrid* grid, const unsigned char* pixels,
+                                 size_t stride, int dst_size,
+                                 ColorSpaceConversion colorspace,
+                                 const PhashKernels* kernels, double* matrix) {
+    for (int y = 0; y < dst_size; y++) {
+        kernels->resize_row(pixels + grid->row0[y]*stride, pixels + grid->row1[y]*stride,
+                            grid->frac[y], &grid->cols, dst_size, colorspace,
+                            matrix + y*dst_size);
+    }
+}
+
+// Single-precision resize_and_grayscale. The sampling grid is computed in
+// double, as above, so both precisions read the same source pixels.
+static void resize_and_grayscale_f(const ResizeGrid* grid, const unsigned char* pixels,
+                                   size_t stride, int dst_size,
+                                   ColorSpaceConversion colorspace,
+                                   const PhashKernels* kernels, float* matrix) {
+    for (int y = 0; y < dst_size; y++) {
+        kernels->resize_row_f(pixels + grid->row0[y]*stride, pixels + grid->row1[y]*stride,
+                              grid->frac_f[y], &grid->cols, dst_size, colorspace,
+                              matrix + y*dst_size);
+    }
+}
+
+// The 1D kernels below compute the unnormalized DCT-II
+//   out[k] = sum_n in[n] * cos((2n + 1) k pi / 2N)
+// and leave the 0.5*a(k) normalization to the 2D driver. The 8-point AAN
+// kernel lives with the dispatch kernels.
+
+// 8-point Loeffler-Ligtenberg-Moschytz DCT (11 multiplications). Its odd
+// and non-DC even outputs carry a factor sqrt(2), removed at the end.
+static void dct_1d_loeffler8(const double* in, double* out) {
+    double d07 = in[0] - in[7], d16 = in[1] - in[6];
+    double d25 = in[2] - in[5], d34 = in[3] - in[4];
+    const double s07 = in[0] + in[7], s16 = in[1] + in[6];
+    const double s25 = in[2] + in[5], s34 = in[3] + in[4];
+
+    // Even part: butterflies and one rotation by sqrt(2)*c6
+    const double e0 = s07 + s34, e3 = s07 - s34;
+    const double e1 = s16 + s25, e2 = s16 - s25;
+    out[0] = e0 + e1;
+    out[4] = (e0 - e1) * M_SQRT1_2;
+    const double r = (e2 + e3) * 0.54119610014619712;
+    out[2] = (r + e3 * 0.76536686473017945) * M_SQRT1_2;
+    out[6] = (r - e2 * 1.8477590650225737) * M_SQRT1_2;
+
+    // Odd part: rotations by sqrt(2)*c3 and sqrt(2)*c1 sharing products
+    const double z1 = d34 + d07, z2 = d25 + d16;
+    double z3 = d34 + d16, z4 = d25 + d07;
+    const double z5 = (z3 + z4) * 1.1758756024193588;
+    d34 *= 0.29863133620137045;
+    d25 *= 2.0531198686373475;
+    d16 *= 3.0727110268456652;
+    d07 *= 1.5013211100714612;
+    const double m1 = z1 * -0.89997622313641568;
+    const double m2 = z2 * -2.5629154477415064;
+    z3 = z3 * -1.9615705608064611 + z5;
+    z4 = z4 * -0.39018064403225650 + z5;
+    out[7] = (d34 + m1 + z3) * M_SQRT1_2;
+    out[5] = (d25 + m2 + z4) * M_SQRT1_2;
+    out[3] = (d16 + m2 + z3) * M_SQRT1_2;
+    out[1] = (d07 + m1 + z4) * M_SQRT1_2;
+}
+
+// Single-precision dct_1d_loeffler8
+static void dct_1d_loeffler8_f(const float* in, float* out) {
+    const float sqrt1_2 = (float)M_SQRT1_2;
+    float d07 = in[0] - in[7], d16 = in[1] - in[6];
+    float d25 = in[2] - in[5], d34 = in[3] - in[4];
+    const float s07 = in[0] + in[7], s16 = in[1] + in[6];
+    const float s25 = in[2] + in[5], s34 = in[3] + in[4];
+
+    const float e0 = s07 + s34, e3 = s07 - s34;
+    const float e1 = s16 + s25, e2 = s16 - s25;
+    out[0] = e0 + e1;
+    out[4] = (e0 - e1) * sqrt1_2;
+    const float r = (e2 + e3) * 0.54119610014619712f;
+    out[2] = (r + e3 * 0.76536686473017945f) * sqrt1_2;
+    out[6] = (r - e2 * 1.8477590650225737f) * sqrt1_2;
+
+    const float z1 = d34 + d07, z2 = d25 + d16;
+    float z3 = d34 + d16, z4 = d25 + d07;
+    const float z5 = (z3 + z4) * 1.1758756024193588f;
+    d34 *= 0.29863133620137045f;
+    d25 *= 2.0531198686373475f;
+    d16 *= 3.0727110268456652f;
+    d07 *= 1.5013211100714612f;
+    const float m1 = z1 * -0.89997622313641568f;
+    const float m2 = z2 * -2.5629154477415064f;
+    z3 = z3 * -1.9615705608064611f + z5;
+    z4 = z4 * -0.39018064403225650f + z5;
+    out[7] = (d34 + m1 + z3) * sqrt1_2;
+    out[5] = (d25 + m2 + z4) * sqrt1_2;
+    out[3] = (d16 + m2 + z3) * sqrt1_2;
+    out[1] = (d07 + m1 + z4) * sqrt1_2;
+}
+
+// Fills the size x size cosine basis and its transpose
+static void dct_basis_fill(int size, double* basis, double* transposed) {
+    for (int u = 0; u < size; u++) {
+        for (int x = 0; x < size; x++) {
+            basis[u*size + x] = cos((2*x + 1)*u*M_PI/(2*size));
+            transposed[x*size + u] = basis[u*size + x];
+        }
+    }
+}
+
+// Single-precision basis: the double values rounded to float
+static void dct_basis_fill_f(int size, float* basis, float* transposed) {
+    for (int u = 0; u < size; u++) {
+        for (int x = 0; x < size; x++) {
+            basis[u*size + x] = (float)cos((2*x + 1)*u*M_PI/(2*size));
+            transposed[x*size + u] = basis[u*size + x];
+        }
+    }
+}
+
+// round(4096 * cos(j pi / 128)) for j = 0..64. The fixed-point basis is
+// built from this table rather than from cos() so that it is identical on
+// every platform.
+static const int16_t COS_Q12[65] = {
+    4096, 4095, 4091, 4085, 4076, 4065, 4052, 4036, 4017, 3996, 3973, 3948, 3920,
+    3889, 3857, 3822, 3784, 3745, 3703, 3659, 3612, 3564, 3513, 3461, 3406, 3349,
+    3290, 3229, 3166, 3102, 3035, 2967, 2896, 2824, 2751, 2675, 2598, 2520, 2440,
+    2359, 2276, 2191, 2106, 2019, 1931, 1842, 1751, 1660, 1567, 1474, 1380, 1285,
+    1189, 1092, 995, 897, 799, 700, 601, 501, 401, 301, 201, 101, 0
+};
+
+// a(u) cos((2x + 1) u pi / 2N) in Q12, a(0) = 1/sqrt(2) and a(u) = 1 else.
+// The angle is j pi / 128 with j = (2x + 1) u (64 / N), folded into the
+// first quadrant of the table.
+static int dct_basis_q12(int size, int u, int x) {
+    if (u == 0) return COS_Q12[32];
+    int j = ((2*x + 1)*u*(MAX_DCT_SIZE / size)) % 256;
+    if (j > 128) j = 256 - j;
+    return (j > 64) ? -COS_Q12[128 - j] : COS_Q12[j];
+}
+
+static void dct_basis_fill_q(int size, int32_t* basis, int16_t* paired) {
+    for (int u = 0; u < size; u++) {
+        for (int x = 0; x < size; x++) {
+            basis[u*size + x] = dct_basis_q12(size, u, x);
+            paired[(x/2)*2*size + 2*u + (x & 1)] = (int16_t)basis[u*size + x];
+        }
+    }
+}
+
+// Basis tables of all four sizes (8 + 16 + 32 + 64 squared entries per
+// array) and the Lee factors, filled once under g_tables_once
+#define BASIS_ENTRIES (8*8 + 16*16 + 32*32 + 64*64)
+static _Alignas(ALIGNMENT) double g_basis_storage[2 * BASIS_ENTRIES];
+static _Alignas(ALIGNMENT) float g_basis_storage_f[2 * BASIS_ENTRIES];
+static _Alignas(ALIGNMENT) int32_t g_basis_storage_q[BASIS_ENTRIES];
+static _Alignas(ALIGNMENT) int16_t g_basis_storage_paired[BASIS_ENTRIES];
+static DCTBasis g_dct_basis[4];            // Indexed by log2(size) - 3
+static double g_lee_factors[8 + 16 + 32];
+static float g_lee_factors_f[8 + 16 + 32];
+static pthread_once_t g_tables_once = PTHREAD_ONCE_INIT;
+
+static int basis_index(int size) {
+    return (size == 8) ? 0 : (size == 16) ? 1 : (size == 32) ? 2 : 3;
+}
+
+// 0.5 / cos((2n + 1) pi / 4 half) for half = 8, 16, 32, used by dct_1d_lee,
+// and rounded to float for dct_1d_lee_f
+static void lee_factors_fill(void) {
+    for (int half = 8; half <= MAX_DCT_SIZE / 2; half *= 2) {
+        double* f = g_lee_factors + (half - 8);
+        for (int n = 0; n < half; n++) {
+            f[n] = 0.5 / cos((2*n + 1)*M_PI/(4*half));
+            g_lee_factors_f[half - 8 + n] = (float)f[n];
+        }
+    }
+}
+
+static void tables_build(void) {
+    size_t offset = 0;
+    for (int size = MIN_DCT_SIZE; size <= MAX_DCT_SIZE; size *= 2) {
+        const size_t n = (size_t)size*size;
+        double* basis = g_basis_storage + 2*offset;
+        float* basis_f = g_basis_storage_f + 2*offset;
+        int32_t* basis_q = g_basis_storage_q + offset;
+        int16_t* paired_q = g_basis_storage_paired + offset;
+
+        dct_basis_fill(size, basis, basis + n);
+        dct_basis_fill_f(size, basis_f, basis_f + n);
+        dct_basis_fill_q(size, basis_q, paired_q);
+        g_dct_basis[basis_index(size)] = (DCTBasis){
+            .coefficients = basis,
+            .transposed = basis + n,
+            .coefficients_f = basis_f,
+            .transposed_f = basis_f + n,
+            .coefficients_q = basis_q,
+            .paired_q = paired_q
+        };
+        offset += n;
+    }
+    lee_factors_fill();
+}
+
+// Shared cosine basis of a valid dct_size, in every precision
+static const DCTBasis* dct_tables(int size) {
+    pthread_once(&g_tables_once, tables_build);
+    return &g_dct_basis[basis_index(size)];
+}
+
+// Separable DCT over an explicit cosine basis: a row pass and a column
+// pass, O(n^3) multiply-adds instead of O(n^4). Only the top-left
+// keep x keep coefficients are produced (keep == size for the full
+// transform), written with a row stride of keep. Each coefficient is
+// accumulated in the same order whatever keep is, so a truncated transform
+// is bit-identical to the matching block of the full one. Both passes run
+// on the project kernel, padded to PROJECT_LANES columns.
+static void dct_separable(const double* input, double* output, int size, int keep,
+                          const double* basis, const double* transposed,
+                          const PhashKernels* kernels) {
+    double temp[MAX_DCT_SIZE * MAX_DCT_SIZE];
+    double line[MAX_DCT_SIZE];
+    const int width = (keep + PROJECT_LANES - 1) / PROJECT_LANES * PROJECT_LANES;
+
+    // Row pass: temp[y][u] = sum_x input[y][x] * cos_u(x)
+    for (int y = 0; y < size; y++) {
+        kernels->project(input + y*size, size, transposed, size, width,
+                         temp + y*width);
+    }
+
+    // Column pass: output[v][u] = sum_y cos_v(y) * temp[y][u]
+    for (int v = 0; v < keep; v++) {
+        const double av = (v == 0) ? M_SQRT1_2 : 1.0;
+        kernels->project(basis + v*size, size, temp, width, width, line);
+        for (int u = 0; u < keep; u++) {
+            const double au = (u == 0) ? M_SQRT1_2 : 1.0;
+            output[v*keep + u] = 0.25 * au * av * line[u];
+        }
+    }
+}
+
+// Generic DCT using the cached lookup table
+static PhashError dct_generic(const double* input, double* output,
+                              int size, int keep, const PhashKernels* kernels) {
+    const DCTBasis* tables = dct_tables(size);
+    dct_separable(input, output, size, keep, tables->coefficients,
+                  tables->transposed, kernels);
+    return PHASH_OK;
+}
+
+// Single-precision dct_separable
+static void dct_separable_f(const float* input, float* output, int size, int keep,
+                            const float* basis, const float* transposed,
+                            const PhashKernels* kernels) {
+    float temp[MAX_DCT_SIZE * MAX_DCT_SIZE];
+    float line[MAX_DCT_SIZE];
+    const int width = (keep + PROJECT_LANES - 1) / PROJECT_LANES * PROJECT_LANES;
+
+    for (int y = 0; y < size; y++) {
+        kernels->project_f(input + y*size, size, transposed, size, width,
+                           temp + y*width);
+    }
+
+    for (int v = 0; v < keep; v++) {
+        const float av = (v == 0) ? (float)M_SQRT1_2 : 1.0f;
+        kernels->project_f(basis + v*size, size, temp, width, width, line);
+        for (int u = 0; u < keep; u++) {
+            const float au = (u == 0) ? (float)M_SQRT1_2 : 1.0f;
+            output[v*keep + u] = 0.25f * au * av * line[u];
+        }
+    }
+}
+
+static PhashError dct_generic_f(const float* input, float* output,
+                                int size, int keep, const PhashKernels* kernels) {
+    const DCTBasis* tables = dct_tables(size);
+    dct_separable_f(input, output, size, keep, tables->coefficients_f,
+                    tables->transposed_f, kernels);
+    return PHASH_OK;
+}
+
+// Basic full transform: evaluates its cosine basis into the caller's
+// 2*size*size scratch on every call instead of using the shared tables.
+// Produces the same values as dct_generic.
+static void dct_naive(const double* input, double* output, int size,
+                      const PhashKernels* kernels, double* basis) {
+    dct_basis_fill(size, basis, basis + size*size);
+    dct_separable(input, output, size, size, basis, basis + size*size, kernels);
+}
+
+static void dct_naive_f(const float* input, float* output, int size,
+                        const PhashKernels* kernels, float* basis) {
+    dct_basis_fill_f(size, basis, basis + size*size);
+    dct_separable_f(input, output, size, size, basis, basis + size*size, kernels);
+}
+
+// Lee's recursive factorization for the 16/32/64-point transforms: the
+// even outputs are the half-size DCT of x[n] + x[N-1-n], the odd outputs
+// are pairwise sums of the half-size DCT of
+// (x[n] - x[N-1-n]) / (2 cos((2n + 1) pi / 2N)). Recursion bottoms out in
+// the 8-point AAN kernel. The factors are filled by tables_build.
+
+static void dct_1d_lee(const double* in, double* out, int size) {
+    double even[MAX_DCT_SIZE / 2], odd[MAX_DCT_SIZE / 2];
+    double even_out[MAX_DCT_SIZE / 2], odd_out[MAX_DCT_SIZE / 2];
+
+    if (size == 8) {
+        dct_1d_aan8(in, out);
+        return;
+    }
+
+    const int half = size / 2;
+    const double* f = g_lee_factors + (half - 8);
+    for (int n = 0; n < half; n++) {
+        even[n] = in[n] + in[size - 1 - n];
+        odd[n] = (in[n] - in[size - 1 - n]) * f[n];
+    }
+    dct_1d_lee(even, even_out, half);
+    dct_1d_lee(odd, odd_out, half);
+
+    for (int k = 0; k < half - 1; k++) {
+        out[2*k] = even_out[k];
+        out[2*k + 1] = odd_out[k] + odd_out[k + 1];
+    }
+    out[size - 2] = even_out[half - 1];
+    out[size - 1] = odd_out[half - 1];
+}
+
+// Single-precision dct_1d_lee, bottoming out in dct_1d_aan8_f
+static void dct_1d_lee_f(const float* in, float* out, int size) {
+    float even[MAX_DCT_SIZE / 2], odd[MAX_DCT_SIZE / 2];
+    float even_out[MAX_DCT_SIZE / 2], odd_out[MAX_DCT_SIZE / 2];
+
+    if (size == 8) {
+        dct_1d_aan8_f(in, out);
+        return;
+    }
+
+    const int half = size / 2;
+    const float* f = g_lee_factors_f + (half - 8);
+    for (int n = 0; n < half; n++) {
+        even[n] = in[n] + in[size - 1 - n];
+        odd[n] = (in[n] - in[size - 1 - n]) * f[n];
+    }
+    dct_1d_lee_f(even, even_out, half);
+    dct_1d_lee_f(odd, odd_out, half);
+
+    for (int k = 0; k < half - 1; k++) {
+        out[2*k] = even_out[k];
+        out[2*k + 1] = odd_out[k] + odd_out[k + 1];
+    }
+    out[size - 2] = even_out[half - 1];
+    out[size - 1] = odd_out[half - 1];
+}
+
+// 2D transform from a fast 1D kernel: every row is transformed, then only
+// the first keep columns. Writes keep x keep coefficients with the same
+// normalization as dct_separable.
+static void dct_factorized(const double* input, double* output, int size, int keep,
+                           void (*kernel)(const double*, double*, int)) {
+    double temp[MAX_DCT_SIZE * MAX_DCT_SIZE];
+    double line[MAX_DCT_SIZE];
+
+    // Row pass, stored transposed: temp[u][y]
+    for (int y = 0; y < size; y++) {
+        kernel(input + y*size, line, size);
+        for (int u = 0; u < keep; u++) temp[u*size + y] = line[u];
+    }
+
+    // Column pass over the kept columns
+    for (int u = 0; u < keep; u++) {
+        const double au = (u == 0) ? M_SQRT1_2 : 1.0;
+        kernel(temp + u*size, line, size);
+        for (int v = 0; v < keep; v++) {
+            const double av = (v == 0) ? M_SQRT1_2 : 1.0;
+            output[v*keep + u] = 0.25 * au * av * line[v];
+        }
+    }
+}
+
+static void dct_factorized_f(const float* input, float* output, int size, int keep,
+                             void (*kernel)(const float*, float*, int)) {
+    float temp[MAX_DCT_SIZE * MAX_DCT_SIZE];
+    float line[MAX_DCT_SIZE];
+
+    for (int y = 0; y < size; y++) {
+        kernel(input + y*size, line, size);
+        for (int u = 0; u < keep; u++) temp[u*size + y] = line[u];
+    }
+
+    for (int u = 0; u < keep; u++) {
+        const float au = (u == 0) ? (float)M_SQRT1_2 : 1.0f;
+        kernel(temp + u*size, line, size);
+        for (int v = 0; v < keep; v++) {
+            const float av = (v == 0) ? (float)M_SQRT1_2 : 1.0f;
+            output[v*keep + u] = 0.25f * au * av * line[v];
+        }
+    }
+}
+
+static void loeffler_kernel(const double* in, double* out, int size) {
+    (void)size;
+    dct_1d_loeffler8(in, out);
+}
+
+static void loeffler_kernel_f(const float* in, float* out, int size) {
+    (void)size;
+    dct_1d_loeffler8_f(in, out);
+}
+
+
+// Side length of the coefficient block compute_dct produces. Only the
+// naive method computes the full matrix; every other method stops at the
+// low-frequency block the hash reads.
+static int dct_output_size(const PhashConfig* cfg) {
+    return (cfg->dct_method == DCT_METHOD_NAIVE) ? cfg->dct_size : cfg->hash_size;
+}
+
+// naive_basis: 2*dct_size^2 scratch values, used by the naive method only
+static PhashError compute_dct(const double* input, double* output,
+                             const PhashConfig* cfg, const PhashKernels* kernels,
+                             double* naive_basis) {
+    switch (cfg->dct_method) {
+        case DCT_METHOD_NAIVE:
+            dct_naive(input, output, cfg->dct_size, kernels, naive_basis);
+            return PHASH_OK;
+        case DCT_METHOD_LOEFFLER:
+            if (cfg->dct_size != 8) return PHASH_ERR_UNSUPPORTED_OPERATION;
+            dct_factorized(input, output, 8, cfg->hash_size, loeffler_kernel);
+            return PHASH_OK;
+        case DCT_METHOD_AAN:
+            if (cfg->dct_size == 8) {
+                double full[64];
+                kernels->dct_8x8(input, full);
+                for (int v = 0; v < cfg->hash_size; v++) {
+                    memcpy(output + v*cfg->hash_size, full + v*8,
+                           cfg->hash_size*sizeof(double));
+                }
+                return PHASH_OK;
+            }
+            dct_tables(cfg->dct_size);
+            dct_factorized(input, output, cfg->dct_size, cfg->hash_size, dct_1d_lee);
+            return PHASH_OK;
+        case DCT_METHOD_LOOKUP:
+        case DCT_METHOD_AUTO:
+        default:
+            return dct_generic(input, output, cfg->dct_size, cfg->hash_size, kernels);
+    }
+}
+
+// Single-precision compute_dct
+static PhashError compute_dct_f(const float* input, float* output,
+                               const PhashConfig* cfg, const PhashKernels* kernels,
+                               float* naive_basis) {
+    switch (cfg->dct_method) {
+        case DCT_METHOD_NAIVE:
+            dct_naive_f(input, output, cfg->dct_size, kernels, naive_basis);
+            return PHASH_OK;
+        case DCT_METHOD_LOEFFLER:
+            if (cfg->dct_size != 8) return PHASH_ERR_UNSUPPORTED_OPERATION;
+            dct_factorized_f(input, output, 8, cfg->hash_size, loeffler_kernel_f);
+            return PHASH_OK;
+        case DCT_METHOD_AAN:
+            if (cfg->dct_size == 8) {
+                float full[64];
+                kernels->dct_8x8_f(input, full);
+                for (int v = 0; v < cfg->hash_size; v++) {
+                    memcpy(output + v*cfg->hash_size, full + v*8,
+                           cfg->hash_size*sizeof(float));
+                }
+                return PHASH_OK;
+            }
+            dct_tables(cfg->dct_size);
+            dct_factorized_f(input, output, cfg->dct_size, cfg->hash_size, dct_1d_lee_f);
+            return PHASH_OK;
+        case DCT_METHOD_LOOKUP:
+        case DCT_METHOD_AUTO:
+        default:
+            return dct_generic_f(input, output, cfg->dct_size, cfg->hash_size, kernels);
+    }
+}
+
+// Whether a config runs the single-precision pipeline
+static bool use_single_precision(const PhashConfig* cfg) {
+    return !cfg->use_high_precision;
+}
+
+// Resize + DCT projection along one image axis. Bilinear sampling of the
+// dct_size grid and the first keep DCT basis functions (including their
+// 0.5*a(u) normalization) are folded into one weight per referenced source
+// line: coefficient u of a line is sum_i weight[i][u] * line[index[i]].
+// Rows of weight are padded to FUSED_KEEP (a multiple of PROJECT_LANES)
+// with zeros to suit the project kernel.
+#define FUSED_KEEP PROJECT_LANES   // Widest block of the fused pipelines
+
+typedef struct {
+    int count;                               // Referenced source lines
+    int index[MAX_SAMPLES];                  // Source coordinate per sample
+    double weight[MAX_SAMPLES * FUSED_KEEP]; // [sample][u]
+} AxisProjection;
+
+static void axis_projection_build(int src_len, int size, int keep,
+                                  AxisProjection* proj) {
+    const double* basis = dct_tables(size)->coefficients;
+
+    // Same sampling grid as resize_and_grayscale
+    const double ratio = (src_len > 1) ? (double)(src_len - 1) / (size - 1) : 0.0;
+
+    proj->count = 0;
+    for (int x = 0; x < size; x++) {
+        const double src = x * ratio;
+        const int i0 = (int)src;
+        const int i1 = (i0 < src_len - 1) ? i0 + 1 : i0;
+        const double d = src - i0;
+
+        // Sample positions are non-decreasing in x, so each source line only
+        // needs to be compared against the most recently added one
+        int s0, s1;
+        if (proj->count == 0 || proj->index[proj->count - 1] != i0) {
+            memset(proj->weight + proj->count*FUSED_KEEP, 0,
+                   FUSED_KEEP*sizeof(double));
+            proj->index[proj->count++] = i0;
+        }
+        s0 = proj->count - 1;
+        if (proj->index[proj->count - 1] != i1) {
+            memset(proj->weight + proj->count*FUSED_KEEP, 0,
+                   FUSED_KEEP*sizeof(double));
+            proj->index[proj->count++] = i1;
+        }
+        s1 = proj->count - 1;
+
+        for (int u = 0; u < keep; u++) {
+            const double b = ((u == 0) ? 0.5 * M_SQRT1_2 : 0.5) * basis[u*size + x];
+            proj->weight[s0*FUSED_KEEP + u] += b * (1.0 - d);
+            proj->weight[s1*FUSED_KEEP + u] += b * d;
+        }
+    }
+}
+
+// Single-precision AxisProjection; weights are built in double and rounded
+typedef struct {
+    int count;
+    int index[MAX_SAMPLES];
+    float weight[MAX_SAMPLES * FUSED_KEEP];
+} AxisProjectionF;
+
+static void axis_projection_build_f(int src_len, int size, int keep,
+                                    AxisProjectionF* proj) {
+    AxisProjection wide;
+    axis_projection_build(src_len, size, keep, &wide);
+
+    proj->count = wide.count;
+    memcpy(proj->index, wide.index, wide.count*sizeof(int));
+    for (int i = 0; i < wide.count*FUSED_KEEP; i++) {
+        proj->weight[i] = (float)wide.weight[i];
+    }
+}
+
+// Hashing pipelines a plan can run
+typedef enum {
+    PIPELINE_FUSED,     // fused_dct
+    PIPELINE_FUSED_F,   // fused_dct_f
+    PIPELINE_RESIZE,    // resize_and_grayscale + compute_dct
+    PIPELINE_RESIZE_F,  // Single-precision twins of the above
+    PIPELINE_FIXED      // Fixed-point pipeline
+} PlanPipeline;
+
+// Everything a hash computation derives from the config and the input
+// geometry: pipeline, kernels, sampling grid or axis projections and
+// grayscale weights. Immutable once built; the DCT bases it uses are the
+// shared dct_tables.
+struct PhashPlan {
+    PhashConfig config;
+    int width, height, channels;
+    size_t stride;                 // Bytes per source row
+    const PhashKernels* kernels;   // Resolved when the plan is built
+    PlanPipeline pipeline;
+    union {
+        struct { AxisProjection x, y; double gray[3]; } fused;
+        struct { AxisProjectionF x, y; float gray[3]; } fused_f;
+        struct { ResizeGrid grid; int gray_q[3]; } resize; // gray_q: fixed only
+    } u;
+};
+
+// Fused resize, grayscale and low-frequency DCT. Projects the referenced
+// source pixels straight onto the keep x keep coefficients (row stride
+// keep) without materializing the resized image. gray, if not NULL,
+// receives the converted referenced pixels: py->count rows of px->count.
+static void fused_dct(const PhashPlan* plan, const unsigned char* pixels,
+                      double* output, double* gray) {
+    const AxisProjection* px = &plan->u.fused.x;
+    const AxisProjection* py = &plan->u.fused.y;
+    double samples[MAX_SAMPLES];
+    double columns[MAX_SAMPLES * FUSED_KEEP] = {0};
+    double coeffs[FUSED_KEEP * FUSED_KEEP];
+    const PhashKernels* kernels = plan->kernels;
+    const int keep = plan->config.hash_size;
+
+    // Vertical pass: convert each referenced row and accumulate its
+    // contribution to the vertical coefficients of every referenced column,
+    // columns[c][v]. Each column has its own accumulators, so there is no
+    // loop-carried dependency between pixels.
+    for (int r = 0; r < py->count; r++) {
+        const unsigned char* line = pixels + py->index[r]*plan->stride;
+        kernels->grayscale(line, px->index, px->count, plan->channels,
+                           plan->u.fused.gray, samples);
+        if (gray) memcpy(gray + r*px->count, samples, px->count*sizeof(double));
+        kernels->accumulate(samples, px->count, py->weight + r*FUSED_KEEP, columns);
+    }
+
+    // Horizontal pass: project each vertical coefficient across the columns
+    for (int v = 0; v < keep; v++) {
+        for (int c = 0; c < px->count; c++) samples[c] = columns[c*FUSED_KEEP + v];
+        kernels->project(samples, px->count, px->weight, FUSED_KEEP,
+                         FUSED_KEEP, coeffs + v*FUSED_KEEP);
+    }
+
+    for (int v = 0; v < keep; v++) {
+        memcpy(output + v*keep, coeffs + v*FUSED_KEEP, keep*sizeof(double));
+    }
+}
+
+// Single-precision fused_dct
+static void fused_dct_f(const PhashPlan* plan, const unsigned char* pixels,
+                        float* output, float* gray) {
+    const AxisProjectionF* px = &plan->u.fused_f.x;
+    const AxisProjectionF* py = &plan->u.fused_f.y;
+    float samples[MAX_SAMPLES];
+    float columns[MAX_SAMPLES * FUSED_KEEP] = {0};
+    float coeffs[FUSED_KEEP * FUSED_KEEP];
+    const PhashKernels* kernels = plan->kernels;
+    const int keep = plan->config.hash_size;
+
+    for (int r = 0; r < py->count; r++) {
+        const unsigned char* line = pixels + py->index[r]*plan->stride;
+        kernels->grayscale_f(line, px->index, px->count, plan->channels,
+                             plan->u.fused_f.gray, samples);
+        if (gray) memcpy(gray + r*px->count, samples, px->count*sizeof(float));
+        kernels->accumulate_f(samples, px->count, py->weight + r*FUSED_KEEP, columns);
+    }
+
+    for (int v = 0; v < keep; v++) {
+        for (int c = 0; c < px->count; c++) samples[c] = columns[c*FUSED_KEEP + v];
+        kernels->project_f(samples, px->count, px->weight, FUSED_KEEP,
+                           FUSED_KEEP, coeffs + v*FUSED_KEEP);
+    }
+
+    for (int v = 0; v < keep; v++) {
+        memcpy(output + v*keep, coeffs + v*FUSED_KEEP, keep*sizeof(float));
+    }
+}
+
+// Element of rank k (0-based) of values[0..count), by quickselect with
+// Hoare partitioning around the middle element: expected O(count), and
+// values is reordered
+static double select_rank(double* values, int count, int k) {
+    int lo = 0, hi = count - 1;
+    while (lo < hi) {
+        const double pivot = values[lo + (hi - lo) / 2];
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (values[i] < pivot) i++;
+            while (values[j] > pivot) j--;
+            if (i <= j) {
+                const double t = values[i];
+                values[i++] = values[j];
+                values[j--] = t;
+            }
+        }
+        if (k <= j) hi = j;
+        else if (k >= i) lo = i;
+        else break;   // values[j + 1 .. i - 1] all equal the pivot
+    }
+    return values[k];
+}
+
+static float select_rank_f(float* values, int count, int k) {
+    int lo = 0, hi = count - 1;
+    while (lo < hi) {
+        const float pivot = values[lo + (hi - lo) / 2];
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (values[i] < pivot) i++;
+            while (values[j] > pivot) j--;
+            if (i <= j) {
+                const float t = values[i];
+                values[i++] = values[j];
+                values[j--] = t;
+            }
+        }
+        if (k <= j) hi = j;
+        else if (k >= i) lo = i;
+        else break;   // values[j + 1 .. i - 1] all equal the pivot
+    }
+    return values[k];
+}
+
+// Threshold the AC coefficients of the top-left hash_size block into
+// hash_words(hash_size) words, bit i in word i / 64. A coefficient sets
+// its bit if it is above the mean of the AC coefficients, or above their
+// lower median (rank (count - 1) / 2), which sets exactly count / 2 bits
+// when the coefficients are distinct.
+static PhashError hash_from_coefficients(const double* coeffs, int stride,
+                                         int hash_size, ThresholdMode mode,
+                                         uint64_t* out_words) {
+    double ac[MAX_HASH_SIZE * MAX_HASH_SIZE];
+    double avg = 0.0;
+    int count = 0;
+    
+    for (int y = 0; y < hash_size; y++) {
+        for (int x = 0; x < hash_size; x++) {
+            if (x == 0 && y == 0) continue;
+            ac[count] = coeffs[y*stride + x];
+            avg += ac[count++];
+        }
+    }
+    
+    if (count == 0) return PHASH_ERR_DOMAIN;
+    
+    avg = (mode == THRESHOLD_MEDIAN) ? select_rank(ac, count, (count - 1) / 2)
+                                     : avg / count;
+    memset(out_words, 0, hash_words(hash_size)*sizeof(uint64_t));
+    int bit_pos = 0;
+    
+    for (int y = 0; y < hash_size; y++) {
+        for (int x = 0; x < hash_size; x++) {
+            if (x == 0 && y == 0) continue;
+            if (coeffs[y*stride + x] > avg)
+                out_words[bit_pos / 64] |= 1ULL << (bit_pos % 64);
+            bit_pos++;
+        }
+    }
+    
+    return PHASH_OK;
+}
+
+static PhashError hash_from_coefficients_f(const float* coeffs, int stride,
+                                           int hash_size, ThresholdMode mode,
+                                           uint64_t* out_words) {
+    float ac[MAX_HASH_SIZE * MAX_HASH_SIZE];
+    float avg = 0.0f;
+    int count = 0;
+    
+    for (int y = 0; y < hash_size; y++) {
+        for (int x = 0; x < hash_size; x++) {
+            if (x == 0 && y == 0) continue;
+            ac[count] = coeffs[y*stride + x];
+            avg += ac[count++];
+        }
+    }
+    
+    if (count == 0) return PHASH_ERR_DOMAIN;
+    
+    avg = (mode == THRESHOLD_MEDIAN) ? select_rank_f(ac, count, (count - 1) / 2)
+                                     : avg / count;
+    memset(out_words, 0, hash_words(hash_size)*sizeof(uint64_t));
+    int bit_pos = 0;
+    
+    for (int y = 0; y < hash_size; y++) {
+        for (int x = 0; x < hash_size; x++) {
+            if (x == 0 && y == 0) continue;
+            if (coeffs[y*stride + x] > avg)
+                out_words[bit_pos / 64] |= 1ULL << (bit_pos % 64);
+            bit_pos++;
+        }
+    }
+    
+    return PHASH_OK;
+}
+
+// ---------------------------------------------------------------------------
+// Fixed-point pipeline
+//
+// Integer-only resize, grayscale, DCT and threshold. Every stage has an
+// exact rounding rule, so hashes are bit-identical on every architecture,
+// compiler and SIMD level:
+//   - sampling grid: source position x (len - 1) / (N - 1), integer part by
+//     integer division, fraction rounded half up to Q8
+//   - bilinear: Q16 weights (products of the Q8 taps), truncated to 8 bits
+//     like the floating-point paths
+//   - grayscale: Q14 channel weights summing to 16384, rounded half up to
+//     Q4 gray levels (0..4080)
+//   - DCT: Q12 basis from COS_Q12; the row pass is exact in 32 bits
+//     (64 * 4080 * 4096 < 2^31), the column pass exact in 64 bits, and the
+//     common 0.25 scale is dropped
+//   - threshold: a coefficient c sets its bit iff c * count > sum, i.e.
+//     exactly c > mean, or c > the lower median selected among the
+//     integer coefficients
+// ---------------------------------------------------------------------------
+
+static void grayscale_weights_q(ColorSpaceConversion method, int weights[3]) {
+    switch (method) {
+        case COLORSPACE_AVERAGE:
+            weights[0] = 5461; weights[1] = 5462; weights[2] = 5461;
+            break;
+        case COLORSPACE_REC709:
+            weights[0] = 3483; weights[1] = 11718; weights[2] = 1183;
+            break;
+        case COLORSPACE_REC2100:
+            weights[0] = 4304; weights[1] = 11108; weights[2] = 972;
+            break;
+        case COLORSPACE_REC601:
+        default:
+            weights[0] = 4899; weights[1] = 9617; weights[2] = 1868;
+            break;
+    }
+}
+
+// Integer part and Q8 fraction of sample i of a len -> size grid
+static void grid_position_q(int i, int len, int size, int* index, int* frac) {
+    const int num = i * (len - 1);
+    const int den = size - 1;
+    *index = num / den;
+    *frac = ((num % den) * 512 + den) / (2 * den);
+}
+
+// Fixed-point resize grid; only the Q8 fractions are filled
+static void resize_grid_build_q(int width, int height, int channels, int dst_size,
+                                ResizeGrid* grid) {
+    for (int x = 0; x < dst_size; x++) {
+        int x0;
+        grid_position_q(x, width, dst_size, &x0, &grid->cols.frac_q[x]);
+        const int x1 = (x0 < width - 1) ? x0 + 1 : x0;
+        grid->cols.offset0[x] = x0 * channels;
+        grid->cols.offset1[x] = x1 * channels;
+    }
+
+    for (int y = 0; y < dst_size; y++) {
+        int y0;
+        grid_position_q(y, height, dst_size, &y0, &grid->frac_q[y]);
+        grid->row0[y] = y0;
+        grid->row1[y] = (y0 < height - 1) ? y0 + 1 : y0;
+    }
+}
+
+static void resize_and_grayscale_q(const PhashPlan* plan, const unsigned char* pixels,
+                                   int16_t* matrix) {
+    const ResizeGrid* grid = &plan->u.resize.grid;
+    const int dst_size = plan->config.dct_size;
+    const int last_row = plan->height - 1;
+
+    for (int y = 0; y < dst_size; y++) {
+        // Rows ending a 3-channel buffer go through the byte-wise scalar
+        // kernel, which computes the same values
+        const PhashKernels* row_kernels =
+            (plan->channels < 4 && grid->row1[y] == last_row) ? &g_kernels_scalar
+                                                              : plan->kernels;
+        row_kernels->resize_row_q(pixels + grid->row0[y]*plan->stride,
+                                  pixels + grid->row1[y]*plan->stride,
+                                  grid->frac_q[y], &grid->cols, dst_size,
+                                  plan->u.resize.gray_q, matrix + y*dst_size);
+    }
+}
+
+// Top-left keep x keep block of the fixed-point DCT, row stride keep.
+// Columns are transformed in groups of PROJECT_LANES, the width of the
+// 64-bit column kernel; keep <= dct_size, so the last group never reads
+// past the basis.
+static void dct_fixed(const int16_t* input, int64_t* output, int size, int keep,
+                      const PhashKernels* kernels) {
+    const DCTBasis* tables = dct_tables(size);
+    int32_t temp[MAX_DCT_SIZE * PROJECT_LANES];
+
+    for (int u0 = 0; u0 < keep; u0 += PROJECT_LANES) {
+        const int width = (keep - u0 < PROJECT_LANES) ? keep - u0 : PROJECT_LANES;
+
+        // Row pass on 16-bit lanes: temp[y][u] = sum_x input[y][x] * C[u0 + u][x]
+        for (int y = 0; y < size; y++) {
+            kernels->project_q(input + y*size, size, tables->paired_q + 2*u0, 2*size,
+                               PROJECT_LANES, temp + y*PROJECT_LANES);
+        }
+
+        // Column pass in 64 bits: output[v][u0 + u] = sum_y C[v][y] * temp[y][u]
+        for (int v = 0; v < keep; v++) {
+            int64_t line[PROJECT_LANES];
+            kernels->project_wide_q(tables->coefficients_q + v*size, size, temp, line);
+            memcpy(output + v*keep + u0, line, width*sizeof(int64_t));
+        }
+    }
+}
+
+static int64_t select_rank_q(int64_t* values, int count, int k) {
+    int lo = 0, hi = count - 1;
+    while (lo < hi) {
+        const int64_t pivot = values[lo + (hi - lo) / 2];
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (values[i] < pivot) i++;
+            while (values[j] > pivot) j--;
+            if (i <= j) {
+                const int64_t t = values[i];
+                values[i++] = values[j];
+                values[j--] = t;
+            }
+        }
+        if (k <= j) hi = j;
+        else if (k >= i) lo = i;
+        else break;   // values[j + 1 .. i - 1] all equal the pivot
+    }
+    return values[k];
+}
+
+static PhashError hash_from_coefficients_q(const int64_t* coeffs, int stride,
+                                           int hash_size, ThresholdMode mode,
+                                           uint64_t* out_words) {
+    int64_t ac[MAX_HASH_SIZE * MAX_HASH_SIZE];
+    int64_t sum = 0;
+    int count = 0;
+    
+    for (int y = 0; y < hash_size; y++) {
+        for (int x = 0; x < hash_size; x++) {
+            if (x == 0 && y == 0) continue;
+            ac[count] = coeffs[y*stride + x];
+            sum += ac[count++];
+        }
+    }
+    
+    if (count == 0) return PHASH_ERR_DOMAIN;
+    
+    // c sets its bit iff c * scale > bound
+    int64_t scale = count, bound = sum;
+    if (mode == THRESHOLD_MEDIAN) {
+        scale = 1;
+        bound = select_rank_q(ac, count, (count - 1) / 2);
+    }
+    memset(out_words, 0, hash_words(hash_size)*sizeof(uint64_t));
+    int bit_pos = 0;
+    
+    for (int y = 0; y < hash_size; y++) {
+        for (int x = 0; x < hash_size; x++) {
+            if (x == 0 && y == 0) continue;
+            if (coeffs[y*stride + x] * scale > bound)
+                out_words[bit_pos / 64] |= 1ULL << (bit_pos % 64);
+            bit_pos++;
+        }
+    }
+    
+    return PHASH_OK;
+}
+
+// ---------------------------------------------------------------------------
+// Hashing plans
+//
+// plan_init derives everything that depends only on the config and the
+// image geometry; plan_run then touches nothing but the pixels.
+// phash_compute builds a plan on the stack for every call, phash_plan_*
+// keep one around for any number of same-sized images.
+// ---------------------------------------------------------------------------
+
+// Blocks wider than FUSED_KEEP go through the resize pipelines
+static PlanPipeline plan_pipeline(const PhashConfig* config) {
+    const bool fused = config->dct_method == DCT_METHOD_AUTO &&
+                       config->hash_size <= FUSED_KEEP;
+    if (config->use_fixed_point) return PIPELINE_FIXED;
+    if (use_single_precision(config)) return fused ? PIPELINE_FUSED_F : PIPELINE_RESIZE_F;
+    return fused ? PIPELINE_FUSED : PIPELINE_RESIZE;
+}
+
+static PhashError plan_init(PhashPlan* plan, const PhashConfig* config,
+                            int width, int height, int channels) {
+    PhashError err;
+    if ((err = phash_config_validate(config)) != PHASH_OK)
+        return err;
+    if (width < 1 || height < 1 || channels < 3)
+        return PHASH_ERR_INVALID_ARGUMENT;
+
+    plan->config = *config;
+    plan->width = width;
+    plan->height = height;
+    plan->channels = channels;
+    plan->stride = (size_t)width * channels;
+    plan->kernels = kernels_for(config);
+    plan->pipeline = plan_pipeline(config);
+
+    const int size = config->dct_size, keep = config->hash_size;
+    switch (plan->pipeline) {
+        case PIPELINE_FIXED:
+            resize_grid_build_q(width, height, channels, size, &plan->u.resize.grid);
+            grayscale_weights_q(config->colorspace, plan->u.resize.gray_q);
+            break;
+        case PIPELINE_FUSED:
+            axis_projection_build(width, size, keep, &plan->u.fused.x);
+            axis_projection_build(height, size, keep, &plan->u.fused.y);
+            grayscale_weights(config->colorspace, plan->u.fused.gray);
+            break;
+        case PIPELINE_FUSED_F:
+            axis_projection_build_f(width, size, keep, &plan->u.fused_f.x);
+            axis_projection_build_f(height, size, keep, &plan->u.fused_f.y);
+            grayscale_weights_f(config->colorspace, plan->u.fused_f.gray);
+            break;
+        case PIPELINE_RESIZE:
+        case PIPELINE_RESIZE_F:
+            resize_grid_build(width, height, channels, size, &plan->u.resize.grid);
+            break;
+    }
+
+    // Build the shared DCT bases now rather than on the first image
+    dct_tables(size);
+    return PHASH_OK;
+}
+
+// Scratch of the resize pipelines, carved from one workspace: the resized
+// image, the DCT output block and, for the naive method, its cosine basis.
+// Offsets are in bytes from the ALIGNMENT-aligned workspace start, each
+// region starting on an ALIGNMENT boundary. The fused and fixed-point
+// pipelines work in fixed-size stack buffers and need no workspace.
+typedef struct {
+    size_t coeffs;
+    size_t basis;
+    size_t total;   // 0 if no workspace is needed
+} WorkspaceLayout;
+
+static size_t align_up(size_t bytes) {
+    return (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+static WorkspaceLayout workspace_layout(const PhashConfig* config) {
+    WorkspaceLayout layout = {0, 0, 0};
+    const PlanPipeline pipeline = plan_pipeline(config);
+    if (pipeline != PIPELINE_RESIZE && pipeline != PIPELINE_RESIZE_F)
+        return layout;
+
+    const size_t element = (pipeline == PIPELINE_RESIZE) ? sizeof(double) : sizeof(float);
+    const size_t size = config->dct_size;
+    const size_t coeff_size = dct_output_size(config);
+    layout.coeffs = align_up(size*size*element);
+    layout.basis = layout.coeffs + align_up(coeff_size*coeff_size*element);
+    layout.total = layout.basis;
+    if (config->dct_method == DCT_METHOD_NAIVE)
+        layout.total += align_up(2*size*size*element);
+    return layout;
+}
+
+// Low-frequency coefficients of one image in the precision of its
+// pipeline: the top-left hash_size block, row stride `stride`, either in
+// the block's own storage or in the workspace
+typedef enum { BLOCK_DOUBLE, BLOCK_FLOAT, BLOCK_FIXED } BlockType;
+
+typedef struct {
+    BlockType type;
+    int stride;
+    const void* values;
+    union {
+        double d[MAX_HASH_SIZE * MAX_HASH_SIZE];
+        float f[MAX_HASH_SIZE * MAX_HASH_SIZE];
+        int64_t q[MAX_HASH_SIZE * MAX_HASH_SIZE];
+    } storage;
+} CoeffBlock;
+
+static PhashError block_threshold(const CoeffBlock* block, const PhashConfig* config,
+                                  uint64_t* out_words) {
+    switch (block->type) {
+        case BLOCK_FIXED:
+            return hash_from_coefficients_q(block->values, block->stride, config->hash_size,
+                                            config->threshold, out_words);
+        case BLOCK_FLOAT:
+            return hash_from_coefficients_f(block->values, block->stride, config->hash_size,
+                                            config->threshold, out_words);
+        case BLOCK_DOUBLE:
+        default:
+            return hash_from_coefficients(block->values, block->stride, config->hash_size,
+                                          config->threshold, out_words);
+    }
+}
+
+// Resize into a dct_size matrix, then DCT
+static PhashError plan_transform_resize(const PhashPlan* plan, const unsigned char* pixels,
+                                        unsigned char* workspace, CoeffBlock* block) {
+    const PhashConfig* config = &plan->config;
+    const WorkspaceLayout layout = workspace_layout(config);
+    double* grayscale = (double*)workspace;
+    double* dct_matrix = (double*)(workspace + layout.coeffs);
+    double* naive_basis = (double*)(workspace + layout.basis);
+    
+    resize_and_grayscale(&plan->u.resize.grid, pixels, plan->stride, config->dct_size,
+                         config->colorspace, plan->kernels, grayscale);
+    block->type = BLOCK_DOUBLE;
+    block->stride = dct_output_size(config);
+    block->values = dct_matrix;
+    return compute_dct(grayscale, dct_matrix, config, plan->kernels, naive_basis);
+}
+
+// Single-precision plan_transform_resize
+static PhashError plan_transform_resize_f(const PhashPlan* plan, const unsigned char* pixels,
+                                          unsigned char* workspace, CoeffBlock* block) {
+    const PhashConfig* config = &plan->config;
+    const WorkspaceLayout layout = workspace_layout(config);
+    float* grayscale = (float*)workspace;
+    float* dct_matrix = (float*)(workspace + layout.coeffs);
+    float* naive_basis = (float*)(workspace + layout.basis);
+    
+    resize_and_grayscale_f(&plan->u.resize.grid, pixels, plan->stride, config->dct_size,
+                           config->colorspace, plan->kernels, grayscale);
+    block->type = BLOCK_FLOAT;
+    block->stride = dct_output_size(config);
+    block->values = dct_matrix;
+    return compute_dct_f(grayscale, dct_matrix, config, plan->kernels, naive_basis);
+}
+
+// Everything up to the threshold. workspace: ALIGNMENT-aligned,
+// workspace_layout(&plan->config).total bytes
+static PhashError plan_transform(const PhashPlan* plan, const unsigned char* pixels,
+                                 unsigned char* workspace, CoeffBlock* block) {
+    const int keep = plan->config.hash_size;
+    
+    switch (plan->pipeline) {
+        case PIPELINE_FIXED: {
+            int16_t grayscale[MAX_DCT_SIZE * MAX_DCT_SIZE];
+            resize_and_grayscale_q(plan, pixels, grayscale);
+            dct_fixed(grayscale, block->storage.q, plan->config.dct_size, keep, plan->kernels);
+            block->type = BLOCK_FIXED;
+            break;
+        }
+        case PIPELINE_FUSED:
+            fused_dct(plan, pixels, block->storage.d, NULL);
+            block->type = BLOCK_DOUBLE;
+            break;
+        case PIPELINE_FUSED_F:
+            fused_dct_f(plan, pixels, block->storage.f, NULL);
+            block->type = BLOCK_FLOAT;
+            break;
+        case PIPELINE_RESIZE_F:
+            return plan_transform_resize_f(plan, pixels, workspace, block);
+        case PIPELINE_RESIZE:
+        default:
+            return plan_transform_resize(plan, pixels, workspace, block);
+    }
+    block->stride = keep;
+    block->values = &block->storage;
+    return PHASH_OK;
+}
+
+static PhashError plan_run(const PhashPlan* plan, const unsigned char* pixels,
+                           unsigned char* workspace, uint64_t* out_words) {
+    CoeffBlock block;
+    PhashError err = plan_transform(plan, pixels, workspace, &block);
+    if (err != PHASH_OK) return err;
+    return block_threshold(&block, &plan->config, out_words);
+}
+
+// plan_run with a caller workspace of phash_workspace_size bytes, or with
+// a temporary one if workspace is NULL
+static PhashError plan_run_ws(const PhashPlan* plan, const unsigned char* pixels,
+                              void* workspace, uint64_t* out_words) {
+    const size_t total = workspace_layout(&plan->config).total;
+    if (total == 0)
+        return plan_run(plan, pixels, NULL, out_words);
+    
+    if (workspace) {
+        // phash_workspace_size leaves room to align the start
+        const uintptr_t start = ((uintptr_t)workspace + ALIGNMENT - 1)
+                                / ALIGNMENT * ALIGNMENT;
+        return plan_run(plan, pixels, (unsigned char*)start, out_words);
+    }
+    
+    unsigned char* temporary = aligned_alloc(ALIGNMENT, total);
+    if (!temporary) return PHASH_ERR_MEMORY_ALLOCATION;
+    PhashError err = plan_run(plan, pixels, temporary, out_words);
+    free(temporary);
+    return err;
+}
+
+// Rows the cross-image pipeline converts before accumulating them together
+#define LANE_ROW_BLOCK 4
+
+// Cross-image fused_dct_f over IMAGE_LANES images of the plan's geometry
+// (lines of unused lanes repeat a valid image). scratch holds
+// LANE_SCRATCH_FLOATS floats; output receives coefficient [v][u] of image
+// l at ((v*PROJECT_LANES + u)*IMAGE_LANES + l).
+#define LANE_SCRATCH_FLOATS (MAX_SAMPLES * (LANE_ROW_BLOCK + PROJECT_LANES) * IMAGE_LANES)
+
+static void fused_dct_lanes_f(const PhashPlan* plan, const unsigned char* const* pixels,
+                              float* scratch, float* output) {
+    const AxisProjectionF* px = &plan->u.fused_f.x;
+    const AxisProjectionF* py = &plan->u.fused_f.y;
+    const int count = px->count;
+    float* samples = scratch;
+    float* columns = scratch + LANE_ROW_BLOCK*MAX_SAMPLES*IMAGE_LANES;
+    const unsigned char* lines[IMAGE_LANES];
+
+    memset(columns, 0, count*PROJECT_LANES*IMAGE_LANES*sizeof(float));
+    for (int r0 = 0; r0 < py->count; r0 += LANE_ROW_BLOCK) {
+        const int rows = (py->count - r0 < LANE_ROW_BLOCK) ? py->count - r0 : LANE_ROW_BLOCK;
+        for (int r = 0; r < rows; r++) {
+            const int y = py->index[r0 + r];
+            for (int l = 0; l < IMAGE_LANES; l++) lines[l] = pixels[l] + y*plan->stride;
+            // The last row of a 3-channel image goes through the byte-wise
+            // scalar kernel, which computes the same values
+            const PhashKernels* row_kernels =
+                (plan->channels < 4 && y == plan->height - 1) ? &g_kernels_scalar
+                                                              : plan->kernels;
+            row_kernels->grayscale_lanes_f(lines, px->index, count, plan->channels,
+                                           plan->u.fused_f.gray,
+                                           samples + r*count*IMAGE_LANES);
+        }
+        plan->kernels->accumulate_lanes_f(samples, rows, count,
+                                          py->weight + r0*FUSED_KEEP, columns);
+    }
+    plan->kernels->project_lanes_f(columns, count, px->weight, output);
+}
+
+// count images through plan: IMAGE_LANES at a time on the cross-image
+// kernels for the single-precision fused pipeline, one at a time otherwise.
+// Either way the scratch is allocated once and shared by all images.
+static PhashError plan_run_many(const PhashPlan* plan, const unsigned char* const* pixels,
+                                size_t count, uint64_t* out_hashes) {
+    PhashError err;
+    
+    if (plan->pipeline != PIPELINE_FUSED_F || !plan->kernels->accumulate_lanes_f ||
+        count < 2) {
+        const size_t total = workspace_layout(&plan->config).total;
+        unsigned char* workspace = NULL;
+        if (total && count) {
+            workspace = aligned_alloc(ALIGNMENT, total);
+            if (!workspace) return PHASH_ERR_MEMORY_ALLOCATION;
+        }
+        err = PHASH_OK;
+        for (size_t i = 0; i < count && err == PHASH_OK; i++) {
+            err = plan_run(plan, pixels[i], workspace, &out_hashes[i]);
+        }
+        free(workspace);
+        return err;
+    }
+    
+    const int keep = plan->config.hash_size;
+    const size_t scratch_bytes = align_up(LANE_SCRATCH_FLOATS*sizeof(float));
+    float* scratch = aligned_alloc(ALIGNMENT, scratch_bytes);
+    if (!scratch) return PHASH_ERR_MEMORY_ALLOCATION;
+    
+    err = PHASH_OK;
+    for (size_t base = 0; base < count && err == PHASH_OK; base += IMAGE_LANES) {
+        const int group = (count - base < IMAGE_LANES) ? (int)(count - base) : IMAGE_LANES;
+        const unsigned char* group_pixels[IMAGE_LANES];
+        float coeffs[PROJECT_LANES * PROJECT_LANES * IMAGE_LANES];
+        for (int l = 0; l < IMAGE_LANES; l++) {
+            group_pixels[l] = pixels[base + (l < group ? l : group - 1)];
+        }
+        
+        fused_dct_lanes_f(plan, group_pixels, scratch, coeffs);
+        for (int l = 0; l < group && err == PHASH_OK; l++) {
+            float lane[FUSED_KEEP * FUSED_KEEP];
+            for (int v = 0; v < keep; v++) {
+                for (int u = 0; u < keep; u++) {
+                    lane[v*keep + u] = coeffs[(v*PROJECT_LANES + u)*IMAGE_LANES + l];
+                }
+            }
+            err = hash_from_coefficients_f(lane, keep, keep, plan->config.threshold,
+                                           &out_hashes[base + l]);
+        }
+    }
+    
+    free(scratch);
+    return err;
+}
+
+// Public API implementation
+PhashError phash_compute(const PhashImage* image,
+                        const PhashConfig* config,
+                        uint64_t* out_hash) {
+    return phash_compute_ws(image, config, NULL, out_hash);
+}
+
+PhashError phash_compute_ws(const PhashImage* image,
+                           const PhashConfig* config,
+                           void* workspace,
+                           uint64_t* out_hash) {
+    PhashPlan plan;
+    PhashError err;
+    
+    if (!image || !image->data || !config || !out_hash) 
+        return PHASH_ERR_NULL_POINTER;
+    
+    if ((err = plan_init(&plan, config, image->width, image->height,
+                         image->channels)) != PHASH_OK)
+        return err;
+    if (config->hash_size > HASH64_SIZE)
+        return PHASH_ERR_INVALID_ARGUMENT;
+    
+    return plan_run_ws(&plan, image->data, workspace, out_hash);
+}
+
+size_t phash_workspace_size(const PhashConfig* config) {
+    if (phash_config_validate(config) != PHASH_OK) return 0;
+    const size_t total = workspace_layout(config).total;
+    return total ? total + ALIGNMENT - 1 : 0;
+}
+
+PhashError phash_plan_create(const PhashConfig* config,
+                            int width, int height, int channels,
+                            PhashPlan** out_plan) {
+    if (!config || !out_plan) return PHASH_ERR_NULL_POINTER;
+    
+    PhashPlan* plan = malloc(sizeof(PhashPlan));
+    if (!plan) return PHASH_ERR_MEMORY_ALLOCATION;
+    
+    PhashError err = plan_init(plan, config, width, height, channels);
+    if (err != PHASH_OK) {
+        free(plan);
+        return err;
+    }
+    
+    *out_plan = plan;
+    return PHASH_OK;
+}
+
+PhashError phash_plan_execute(const PhashPlan* plan,
+                             const unsigned char* pixels,
+                             uint64_t* out_hash) {
+    return phash_plan_execute_ws(plan, pixels, NULL, out_hash);
+}
+
+PhashError phash_plan_execute_ws(const PhashPlan* plan,
+                                const unsigned char* pixels,
+                                void* workspace,
+                                uint64_t* out_hash) {
+    if (!plan || !pixels || !out_hash) return PHASH_ERR_NULL_POINTER;
+    if (plan->config.hash_size > HASH64_SIZE) return PHASH_ERR_INVALID_ARGUMENT;
+    return plan_run_ws(plan, pixels, workspace, out_hash);
+}
+
+PhashError phash_plan_execute_many(const PhashPlan* plan,
+                                  const unsigned char* const* pixels,
+                                  size_t count,
+                                  uint64_t* out_hashes) {
+    if (!plan || (count && (!pixels || !out_hashes))) return PHASH_ERR_NULL_POINTER;
+    for (size_t i = 0; i < count; i++) {
+        if (!pixels[i]) return PHASH_ERR_NULL_POINTER;
+    }
+    if (plan->config.hash_size > HASH64_SIZE) return PHASH_ERR_INVALID_ARGUMENT;
+    return plan_run_many(plan, pixels, count, out_hashes);
+}
+
+void phash_plan_destroy(PhashPlan* plan) {
+    free(plan);
+}
+
+int phash_hash_words(const PhashConfig* config) {
+    if (phash_config_validate(config) != PHASH_OK) return 0;
+    return hash_words(config->hash_size);
+}
+
+PhashError phash_compute_wide(const PhashImage* image,
+                             const PhashConfig* config,
+                             PhashHash* out_hash) {
+    return phash_compute_wide_ws(image, config, NULL, out_hash);
+}
+
+PhashError phash_compute_wide_ws(const PhashImage* image,
+                                const PhashConfig* config,
+                                void* workspace,
+                                PhashHash* out_hash) {
+    PhashPlan plan;
+    PhashError err;
+    
+    if (!image || !image->data || !config || !out_hash)
+        return PHASH_ERR_NULL_POINTER;
+    
+    if ((err = plan_init(&plan, config, image->width, image->height,
+                         image->channels)) != PHASH_OK)
+        return err;
+    
+    return phash_plan_execute_wide_ws(&plan, image->data, workspace, out_hash);
+}
+
+PhashError phash_plan_execute_wide(const PhashPlan* plan,
+                                  const unsigned char* pixels,
+                                  PhashHash* out_hash) {
+    return phash_plan_execute_wide_ws(plan, pixels, NULL, out_hash);
+}
+
+PhashError phash_plan_execute_wide_ws(const PhashPlan* plan,
+                                     const unsigned char* pixels,
+                                     void* workspace,
+                                     PhashHash* out_hash) {
+    if (!plan || !pixels || !out_hash) return PHASH_ERR_NULL_POINTER;
+    
+    PhashHash hash = { .word_count = hash_words(plan->config.hash_size) };
+    PhashError err = plan_run_ws(plan, pixels, workspace, hash.words);
+    if (err == PHASH_OK) *out_hash = hash;
+    return err;
+}
+
+// ---------------------------------------------------------------------------
+// Multi-algorithm hashing
+//
+// phash_compute_multi resizes and converts the image once, into the
+// dct_size x dct_size grayscale grid of the resize pipelines. The DCT hash
+// is taken from the grid as plan_transform_resize does, or, for the fused
+// pipelines, from the same pass that converts the pixels the grid is
+// interpolated from. The other families work on area averages of the grid:
+//   - aHash: 8x8 block means above their mean
+//   - dHash: 9x8 block means, bit set where a block is brighter than the
+//     one to its left
+//   - wHash: full three-level 2D Haar transform of the 8x8 block means
+//     (the Haar LL band of the grid), AC coefficients above their lower
+//     median
+// Bits are numbered row-major, bit y*8 + x for block (x, y).
+// ---------------------------------------------------------------------------
+
+#define MULTI_BLOCKS 8
+
+// Area-average footprint of cell c of count cells over size grid lines:
+// lines first..last, weighted by weight[i - first] so that the weights sum
+// to 1
+typedef struct {
+    int first, last;
+    double weight[MAX_DCT_SIZE / MULTI_BLOCKS + 2];
+} BoxCell;
+
+static void box_cells(int size, int count, BoxCell* cells) {
+    const double span = (double)size / count;
+    for (int c = 0; c < count; c++) {
+        const double lo = c * span, hi = (c + 1) * span;
+        BoxCell* cell = &cells[c];
+        cell->first = (int)lo;
+        cell->last = (int)ceil(hi) - 1;
+        if (cell->last > size - 1) cell->last = size - 1;   // hi rounded up
+        for (int i = cell->first; i <= cell->last; i++) {
+            cell->weight[i - cell->first] = (fmin(hi, i + 1.0) - fmax(lo, (double)i)) / span;
+        }
+    }
+}
+
+// out[y][x] (row stride width) = mean of the grid over cell (x, y) of a
+// width x height partition
+static void box_resample(const double* grid, int size, int width, int height,
+                         double* out) {
+    BoxCell cx[MULTI_BLOCKS + 1], cy[MULTI_BLOCKS];
+    double row[MAX_DCT_SIZE];
+    box_cells(size, width, cx);
+    box_cells(size, height, cy);
+
+    for (int y = 0; y < height; y++) {
+        memset(row, 0, size*sizeof(double));
+        for (int i = cy[y].first; i <= cy[y].last; i++) {
+            const double w = cy[y].weight[i - cy[y].first];
+            for (int x = 0; x < size; x++) row[x] += w * grid[i*size + x];
+        }
+        for (int x = 0; x < width; x++) {
+            double sum = 0.0;
+            for (int i = cx[x].first; i <= cx[x].last; i++) {
+                sum += cx[x].weight[i - cx[x].first] * row[i];
+            }
+            out[y*width + x] = sum;
+        }
+    }
+}
+
+// In-place 2D Haar analysis of an n x n block (row stride n), all levels:
+// averages to the top-left, halved differences to the right and below
+static void haar_2d(double* block, int n) {
+    double line[MULTI_BLOCKS];
+    for (int len = n; len > 1; len /= 2) {
+        const int half = len / 2;
+        for (int y = 0; y < len; y++) {
+            double* row = block + y*n;
+            for (int k = 0; k < half; k++) {
+                line[k] = 0.5 * (row[2*k] + row[2*k + 1]);
+                line[half + k] = 0.5 * (row[2*k] - row[2*k + 1]);
+            }
+            memcpy(row, line, len*sizeof(double));
+        }
+        for (int x = 0; x < len; x++) {
+            for (int k = 0; k < half; k++) {
+                line[k] = 0.5 * (block[2*k*n + x] + block[(2*k + 1)*n + x]);
+                line[half + k] = 0.5 * (block[2*k*n + x] - block[(2*k + 1)*n + x]);
+            }
+            for (int k = 0; k < len; k++) block[k*n + x] = line[k];
+        }
+    }
+}
+
+// aHash, dHash and wHash of a size x size grayscale grid
+static void grid_hashes(const double* grid, int size, PhashMultiHash* out) {
+    double blocks[MULTI_BLOCKS * MULTI_BLOCKS];
+    double wide[MULTI_BLOCKS * (MULTI_BLOCKS + 1)];
+    const int n = MULTI_BLOCKS;
+
+    box_resample(grid, size, n, n, blocks);
+    double mean = 0.0;
+    for (int i = 0; i < n*n; i++) mean += blocks[i];
+    mean /= n*n;
+    out->ahash = 0;
+    for (int i = 0; i < n*n; i++) {
+        if (blocks[i] > mean) out->ahash |= 1ULL << i;
+    }
+
+    box_resample(grid, size, n + 1, n, wide);
+    out->dhash = 0;
+    for (int y = 0; y < n; y++) {
+        for (int x = 0; x < n; x++) {
+            if (wide[y*(n + 1) + x + 1] > wide[y*(n + 1) + x])
+                out->dhash |= 1ULL << (y*n + x);
+        }
+    }
+
+    haar_2d(blocks, n);
+    hash_from_coefficients(blocks, n, n, THRESHOLD_MEDIAN, &out->whash);
+}
+
+// Sample indices (into the ascending, distinct source lines index[]) and
+// fraction of the two source lines grid line x of size interpolates
+// between, on the sampling grid of resize_and_grayscale
+typedef struct {
+    int s0[MAX_DCT_SIZE], s1[MAX_DCT_SIZE];
+    double frac[MAX_DCT_SIZE];
+} SampleTaps;
+
+static void sample_taps(const int* index, int src_len, int size, SampleTaps* taps) {
+    const double ratio = (src_len > 1) ? (double)(src_len - 1) / (size - 1) : 0.0;
+    int s = 0;
+    for (int x = 0; x < size; x++) {
+        const double src = x * ratio;
+        const int i0 = (int)src;
+        const int i1 = (i0 < src_len - 1) ? i0 + 1 : i0;
+        while (index[s] != i0) s++;
+        taps->s0[x] = s;
+        taps->s1[x] = (i1 == i0) ? s : s + 1;
+        taps->frac[x] = src - i0;
+    }
+}
+
+// size x size grid of a fused plan from its converted source pixels gray
+// (rows of count_x samples of the referenced lines index_x, index_y)
+static void grid_from_samples(const double* gray, int count_x, const int* index_x,
+                              const int* index_y, int width, int height, int size,
+                              double* grid) {
+    SampleTaps tx, ty;
+    sample_taps(index_x, width, size, &tx);
+    sample_taps(index_y, height, size, &ty);
+    for (int y = 0; y < size; y++) {
+        const double* row0 = gray + ty.s0[y]*count_x;
+        const double* row1 = gray + ty.s1[y]*count_x;
+        const double dy = ty.frac[y];
+        for (int x = 0; x < size; x++) {
+            const double dx = tx.frac[x];
+            const double top = row0[tx.s0[x]]*(1.0 - dx) + row0[tx.s1[x]]*dx;
+            const double bottom = row1[tx.s0[x]]*(1.0 - dx) + row1[tx.s1[x]]*dx;
+            grid[y*size + x] = top*(1.0 - dy) + bottom*dy;
+        }
+    }
+}
+
+// Workspace of phash_compute_multi: the pipeline's own scratch, the grid,
+// then (fused pipelines) the converted source pixels. Offsets as in
+// WorkspaceLayout.
+typedef struct {
+    size_t grid;
+    size_t gray;
+    size_t total;
+} MultiLayout;
+
+static MultiLayout multi_layout(const PhashConfig* config) {
+    MultiLayout layout;
+    const PlanPipeline pipeline = plan_pipeline(config);
+    const size_t size = config->dct_size;
+    const bool fused = (pipeline == PIPELINE_FUSED || pipeline == PIPELINE_FUSED_F);
+    layout.grid = align_up(workspace_layout(config).total);
+    layout.gray = layout.grid + align_up(size*size*sizeof(double));
+    layout.total = layout.gray + (fused ? MAX_SAMPLES*MAX_SAMPLES*sizeof(double) : 0);
+    return layout;
+}
+
+size_t phash_multi_workspace_size(const PhashConfig* config) {
+    if (phash_config_validate(config) != PHASH_OK) return 0;
+    return multi_layout(config).total + ALIGNMENT - 1;
+}
+
+PhashError phash_compute_multi(const PhashImage* image, const PhashConfig* config,
+                               PhashMultiHash* out_hashes) {
+    return phash_compute_multi_ws(image, config, NULL, out_hashes);
+}
+
+PhashError phash_compute_multi_ws(const PhashImage* image, const PhashConfig* config,
+                                  void* workspace, PhashMultiHash* out_hashes) {
+    PhashPlan plan;
+    PhashError err;
+    
+    if (!image || !image->data || !config || !out_hashes)
+        return PHASH_ERR_NULL_POINTER;
+    
+    if ((err = plan_init(&plan, config, image->width, image->height,
+                         image->channels)) != PHASH_OK)
+        return err;
+    if (config->hash_size > HASH64_SIZE)
+        return PHASH_ERR_INVALID_ARGUMENT;
+    
+    const int size = config->dct_size;
+    const MultiLayout layout = multi_layout(config);
+    unsigned char* temporary = NULL;
+    unsigned char* scratch;
+    if (workspace) {
+        // phash_multi_workspace_size leaves room to align the start
+        scratch = (unsigned char*)(((uintptr_t)workspace + ALIGNMENT - 1)
+                                   / ALIGNMENT * ALIGNMENT);
+    } else {
+        if (!(temporary = aligned_alloc(ALIGNMENT, align_up(layout.total))))
+            return PHASH_ERR_MEMORY_ALLOCATION;
+        scratch = temporary;
+    }
+    double* grid = (double*)(scratch + layout.grid);
+    double* gray = (double*)(scratch + layout.gray);
+    PhashMultiHash hashes;
+    CoeffBlock block;
+    
+    switch (plan.pipeline) {
+        case PIPELINE_FIXED: {
+            int16_t grayscale[MAX_DCT_SIZE * MAX_DCT_SIZE];
+            int64_t coeffs[HASH64_SIZE * HASH64_SIZE];
+            const int keep = config->hash_size;
+            resize_and_grayscale_q(&plan, image->data, grayscale);
+            dct_fixed(grayscale, coeffs, size, keep, plan.kernels);
+            err = hash_from_coefficients_q(coeffs, keep, keep, config->threshold,
+                                           &hashes.phash);
+            for (int i = 0; i < size*size; i++) grid[i] = grayscale[i];
+            break;
+        }
+        case PIPELINE_FUSED: {
+            const AxisProjection* px = &plan.u.fused.x;
+            const AxisProjection* py = &plan.u.fused.y;
+            fused_dct(&plan, image->data, block.storage.d, gray);
+            block.type = BLOCK_DOUBLE;
+            block.stride = config->hash_size;
+            block.values = &block.storage;
+            err = block_threshold(&block, config, &hashes.phash);
+            grid_from_samples(gray, px->count, px->index, py->index, image->width,
+                              image->height, size, grid);
+            break;
+        }
+        case PIPELINE_FUSED_F: {
+            const AxisProjectionF* px = &plan.u.fused_f.x;
+            const AxisProjectionF* py = &plan.u.fused_f.y;
+            float* gray_f = (float*)gray;
+            fused_dct_f(&plan, image->data, block.storage.f, gray_f);
+            block.type = BLOCK_FLOAT;
+            block.stride = config->hash_size;
+            block.values = &block.storage;
+            err = block_threshold(&block, config, &hashes.phash);
+            // Widened in place from the back
+            for (int i = px->count*py->count - 1; i >= 0; i--) gray[i] = gray_f[i];
+            grid_from_samples(gray, px->count, px->index, py->index, image->width,
+                              image->height, size, grid);
+            break;
+        }
+        case PIPELINE_RESIZE_F: {
+            err = plan_run(&plan, image->data, scratch, &hashes.phash);
+            const float* grayscale = (const float*)scratch;
+            for (int i = 0; i < size*size; i++) grid[i] = grayscale[i];
+            break;
+        }
+        default:
+            err = plan_run(&plan, image->data, scratch, &hashes.phash);
+            memcpy(grid, scratch, size*size*sizeof(double));
+            break;
+    }
+    
+    if (err == PHASH_OK) {
+        grid_hashes(grid, size, &hashes);
+        *out_hashes = hashes;
+    }
+    free(temporary);
+    return err;
+}
+
+// ---------------------------------------------------------------------------
+// Dihedral hashing
+//
+// The DCT basis is symmetric about the centre of the grid:
+// cos((2(N-1-x) + 1) u pi / 2N) = (-1)^u cos((2x + 1) u pi / 2N). Flipping
+// the image left to right therefore negates the odd columns u of the
+// coefficient block, flipping it top to bottom negates the odd rows v, and
+// transposing it transposes the block. The eight transforms of the
+// dihedral group are built from one block by reindexing and sign changes,
+// then thresholded again (their mean or median differs).
+// ---------------------------------------------------------------------------
+
+// plan_transform of a whole image into a block that owns its coefficients,
+// with a caller workspace of phash_workspace_size bytes, or a temporary
+// one if workspace is NULL. Needs hash_size <= 8.
+static PhashError image_block(const PhashImage* image, const PhashConfig* config,
+                              void* workspace, CoeffBlock* block) {
+    PhashPlan plan;
+    PhashError err;
+    
+    if ((err = plan_init(&plan, config, image->width, image->height,
+                         image->channels)) != PHASH_OK)
+        return err;
+    if (config->hash_size > HASH64_SIZE)
+        return PHASH_ERR_INVALID_ARGUMENT;
+    
+    const size_t total = workspace_layout(config).total;
+    unsigned char* scratch = NULL;
+    unsigned char* temporary = NULL;
+    if (total && workspace) {
+        scratch = (unsigned char*)(((uintptr_t)workspace + ALIGNMENT - 1)
+                                   / ALIGNMENT * ALIGNMENT);
+    } else if (total) {
+        if (!(temporary = aligned_alloc(ALIGNMENT, total)))
+            return PHASH_ERR_MEMORY_ALLOCATION;
+        scratch = temporary;
+    }
+    
+    err = plan_transform(&plan, image->data, scratch, block);
+    if (err == PHASH_OK && block->values != &block->storage) {
+        // Resize pipelines leave the coefficients in the workspace
+        const int keep = config->hash_size;
+        const size_t size = (block->type == BLOCK_FLOAT) ? sizeof(float) : sizeof(double);
+        for (int v = 0; v < keep; v++) {
+            memcpy((unsigned char*)&block->storage + v*keep*size,
+                   (const unsigned char*)block->values + v*block->stride*size, keep*size);
+        }
+        block->stride = keep;
+        block->values = &block->storage;
+    }
+    free(temporary);
+    return err;
+}
+
+// out = the block of image transform t of the block's image: transposed if
+// t & 4, then flipped left to right if t & 1 and top to bottom if t & 2
+static void block_dihedral(const CoeffBlock* block, int keep, int t, CoeffBlock* out) {
+    const int stride = block->stride;
+    out->type = block->type;
+    out->stride = keep;
+    out->values = &out->storage;
+    
+    for (int v = 0; v < keep; v++) {
+        for (int u = 0; u < keep; u++) {
+            const int src = (t & 4) ? u*stride + v : v*stride + u;
+            const int negate = ((t & 1) && (u & 1)) != ((t & 2) && (v & 1));
+            const int dst = v*keep + u;
+            switch (block->type) {
+                case BLOCK_FIXED: {
+                    const int64_t c = ((const int64_t*)block->values)[src];
+                    out->storage.q[dst] = negate ? -c : c;
+                    break;
+                }
+                case BLOCK_FLOAT: {
+                    const float c = ((const float*)block->values)[src];
+                    out->storage.f[dst] = negate ? -c : c;
+                    break;
+                }
+                case BLOCK_DOUBLE:
+                default: {
+                    const double c = ((const double*)block->values)[src];
+                    out->storage.d[dst] = negate ? -c : c;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+PhashError phash_compute_dihedral(const PhashImage* image, const PhashConfig* config,
+                                  uint64_t out_hashes[8]) {
+    return phash_compute_dihedral_ws(image, config, NULL, out_hashes);
+}
+
+PhashError phash_compute_dihedral_ws(const PhashImage* image, const PhashConfig* config,
+                                     void* workspace, uint64_t out_hashes[8]) {
+    CoeffBlock block, transformed;
+    uint64_t hashes[8];
+    
+    if (!image || !image->data || !config || !out_hashes)
+        return PHASH_ERR_NULL_POINTER;
+    
+    PhashError err = image_block(image, config, workspace, &block);
+    for (int t = 0; t < 8 && err == PHASH_OK; t++) {
+        block_dihedral(&block, config->hash_size, t, &transformed);
+        err = block_threshold(&transformed, config, &hashes[t]);
+    }
+    
+    if (err == PHASH_OK) memcpy(out_hashes, hashes, sizeof(hashes));
+    return err;
+}
+
+PhashError phash_compute_canonical(const PhashImage* image, const PhashConfig* config,
+                                   uint64_t* out_hash) {
+    uint64_t hashes[8];
+    
+    if (!out_hash) return PHASH_ERR_NULL_POINTER;
+    PhashError err = phash_compute_dihedral(image, config, hashes);
+    if (err != PHASH_OK) return err;
+    
+    uint64_t least = hashes[0];
+    for (int t = 1; t < 8; t++) {
+        if (hashes[t] < least) least = hashes[t];
+    }
+    *out_hash = least;
+    return PHASH_OK;
+}
+
+// ---------------------------------------------------------------------------
+// Confidence margins
+//
+// A bit whose coefficient lies close to the threshold flips under small
+// changes to the image. Its margin |c - t| is measured in units of the
+// mean margin of all AC coefficients, which makes it independent of
+// contrast, and quantized to 2^bits levels of 2^-(bits - 1) units each:
+// level 0 is a margin under half a unit for 2 bits, an eighth for 4. The
+// levels are stored as bit planes, so the bits at or above a level form a
+// mask with a few logic operations per plane.
+// ---------------------------------------------------------------------------
+
+// Margin levels of the bits of block (hash_size <= 8), in hash bit order.
+// Computed in double from the coefficients; for the fixed-point pipeline
+// these are exact, so its margins are platform independent too.
+static PhashError block_margins(const CoeffBlock* block, const PhashConfig* config,
+                                int bits, PhashMargins* out) {
+    double ac[HASH64_SIZE * HASH64_SIZE];
+    const int hash_size = config->hash_size;
+    double threshold = 0.0;
+    int count = 0;
+    
+    for (int y = 0; y < hash_size; y++) {
+        for (int x = 0; x < hash_size; x++) {
+            if (x == 0 && y == 0) continue;
+            const int index = y*block->stride + x;
+            switch (block->type) {
+                case BLOCK_FIXED: ac[count] = (double)((const int64_t*)block->values)[index]; break;
+                case BLOCK_FLOAT: ac[count] = ((const float*)block->values)[index]; break;
+                case BLOCK_DOUBLE:
+                default: ac[count] = ((const double*)block->values)[index]; break;
+            }
+            threshold += ac[count++];
+        }
+    }
+    
+    if (count == 0) return PHASH_ERR_DOMAIN;
+    
+    if (config->threshold == THRESHOLD_MEDIAN) {
+        double sorted[HASH64_SIZE * HASH64_SIZE];
+        memcpy(sorted, ac, count*sizeof(double));
+        threshold = select_rank(sorted, count, (count - 1) / 2);
+    } else {
+        threshold /= count;
+    }
+    
+    double unit = 0.0;
+    for (int i = 0; i < count; i++) unit += fabs(ac[i] - threshold);
+    unit /= count;
+    
+    const int top = (1 << bits) - 1;
+    memset(out, 0, sizeof(*out));
+    out->bits = bits;
+    for (int i = 0; i < count && unit > 0.0; i++) {
+        const double steps = fabs(ac[i] - threshold) / unit * (1 << (bits - 1));
+        const int level = (steps >= top) ? top : (int)steps;
+        for (int k = 0; k < bits; k++) {
+            out->planes[k] |= (uint64_t)((level >> k) & 1) << i;
+        }
+    }
+    return PHASH_OK;
+}
+
+PhashError phash_compute_margins(const PhashImage* image, const PhashConfig* config,
+                                 int margin_bits, uint64_t* out_hash,
+                                 PhashMargins* out_margins) {
+    return phash_compute_margins_ws(image, config, margin_bits, NULL, out_hash,
+                                    out_margins);
+}
+
+PhashError phash_compute_margins_ws(const PhashImage* image, const PhashConfig* config,
+                                    int margin_bits, void* workspace, uint64_t* out_hash,
+                                    PhashMargins* out_margins) {
+    CoeffBlock block;
+    uint64_t hash;
+    PhashMargins margins;
+    
+    if (!image || !image->data || !config || !out_hash || !out_margins)
+        return PHASH_ERR_NULL_POINTER;
+    if (margin_bits < PHASH_MARGIN_MIN_BITS || margin_bits > PHASH_MARGIN_MAX_BITS)
+        return PHASH_ERR_INVALID_ARGUMENT;
+    
+    PhashError err = image_block(image, config, workspace, &block);
+    if (err == PHASH_OK) err = block_threshold(&block, config, &hash);
+    if (err == PHASH_OK) err = block_margins(&block, config, margin_bits, &margins);
+    if (err != PHASH_OK) return err;
+    
+    *out_hash = hash;
+    *out_margins = margins;
+    return PHASH_OK;
+}
+
+// Bits whose level is at least min_level, from the most significant plane
+// down: above where a higher plane exceeds min_level's bit while all
+// higher planes were equal
+static uint64_t margin_mask(const PhashMargins* margins, int min_level) {
+    uint64_t above = 0, equal = ~0ULL;
+    for (int k = margins->bits - 1; k >= 0; k--) {
+        if ((min_level >> k) & 1) {
+            equal &= margins->planes[k];
+        } else {
+            above |= equal & margins->planes[k];
+            equal &= ~margins->planes[k];
+        }
+    }
+    return above | equal;
+}
+
+uint64_t phash_margin_mask(const PhashMargins* margins, int min_level) {
+    if (!margins || margins->bits < PHASH_MARGIN_MIN_BITS ||
+        margins->bits > PHASH_MARGIN_MAX_BITS || min_level >= (1 << margins->bits))
+        return 0;
+    if (min_level <= 0) return ~0ULL;
+    return margin_mask(margins, min_level);
+}
+
+// ---------------------------------------------------------------------------
+// Batch hashing
+//
+// phash_compute_batch (and the other multi-threaded entry points) run on a
+// library-owned pool of worker threads that is started on first use, grown
+// on demand and stopped by phash_terminate. A job is a count of items and
+// a participate function that claims and processes them.
+// The calling thread takes part as participant 0. Each participant starts
+// with an equal contiguous share of the batch and takes items from its
+// front; once empty it steals the back half of another participant's
+// remaining range. A range is a packed (next, end) pair in one atomic word,
+// so the owner and the thieves claim items with a single CAS each. Results
+// are written by item index, so the output does not depend on scheduling.
+// ---------------------------------------------------------------------------
+
+#define MAX_BATCH_THREADS 256
+#define BATCH_PASS_ITEMS ((size_t)1 << 31)   // Items per pass, fit 32-bit ranges
+
+typedef struct {
+    _Alignas(ALIGNMENT) _Atomic uint64_t range;   // next | end << 32
+} WorkRange;
+
+static uint64_t range_pack(uint32_t next, uint32_t end) {
+    return (uint64_t)next | (uint64_t)end << 32;
+}
+
+typedef struct BatchJob BatchJob;
+struct BatchJob {
+    void (*participate)(BatchJob* job, int self); // Claims and runs items
+    void* task;                     // State of the kind of work
+    size_t base;                    // First item of the current pass
+    int participants;
+    WorkRange* ranges;
+    _Atomic uint64_t first_error;   // Lowest failing index << 8 | error code
+};
+
+// Claims the next item of participant self, stealing when its range is
+// empty; false when no work is left anywhere
+static bool batch_claim(BatchJob* job, int self, uint32_t* item) {
+    _Atomic uint64_t* own = &job->ranges[self].range;
+    for (;;) {
+        uint64_t r = atomic_load(own);
+        const uint32_t next = (uint32_t)r, end = (uint32_t)(r >> 32);
+        if (next >= end) break;
+        if (atomic_compare_exchange_weak(own, &r, range_pack(next + 1, end))) {
+            *item = next;
+            return true;
+        }
+    }
+
+    for (int k = 1; k < job->participants; k++) {
+        _Atomic uint64_t* victim = &job->ranges[(self + k) % job->participants].range;
+        uint64_t r = atomic_load(victim);
+        for (;;) {
+            const uint32_t next = (uint32_t)r, end = (uint32_t)(r >> 32);
+            if (next >= end) break;
+            const uint32_t split = end - (end - next + 1) / 2;
+            if (atomic_compare_exchange_weak(victim, &r, range_pack(next, split))) {
+                // Keep the first stolen item, publish the rest as our range
+                atomic_store(own, range_pack(split + 1, end));
+                *item = split;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void batch_record_error(BatchJob* job, uint32_t item, PhashError err) {
+    const uint64_t packed = (uint64_t)item << 8 | (uint64_t)err;
+    uint64_t current = atomic_load(&job->first_error);
+    while (packed < current &&
+           !atomic_compare_exchange_weak(&job->first_error, &current, packed)) {
+    }
+}
+
+typedef struct {
+    const PhashImage* const* images;
+    const PhashConfig* config;
+    uint64_t* hashes;             // words per image
+    int words;
+    PhashError* errors;
+    size_t workspace_size;
+} HashTask;
+
+static void hash_participate(BatchJob* job, int self) {
+    const HashTask* task = job->task;
+    // Consecutive images of one geometry share a plan
+    PhashPlan plan;
+    bool have_plan = false;
+    void* workspace = task->workspace_size ? malloc(task->workspace_size) : NULL;
+    uint32_t item;
+
+    while (batch_claim(job, self, &item)) {
+        const size_t index = job->base + item;
+        const PhashImage* image = task->images[index];
+        uint64_t* hash = task->hashes + index*task->words;
+        PhashError err = PHASH_OK;
+
+        if (!image || !image->data) {
+            err = PHASH_ERR_NULL_POINTER;
+        } else if (!have_plan || image->width != plan.width ||
+                   image->height != plan.height || image->channels != plan.channels) {
+            err = plan_init(&plan, task->config, image->width, image->height,
+                            image->channels);
+            have_plan = (err == PHASH_OK);
+        }
+        if (err == PHASH_OK)
+            err = plan_run_ws(&plan, image->data, workspace, hash);
+
+        if (err != PHASH_OK) memset(hash, 0, task->words*sizeof(uint64_t));
+        if (task->errors) task->errors[index] = err;
+        if (err != PHASH_OK) batch_record_error(job, item, err);
+    }
+    free(workspace);
+}
+
+static struct {
+    pthread_mutex_t batch_lock;   // One batch on the pool at a time
+    pthread_mutex_t lock;         // Guards the fields below
+    pthread_cond_t wake;          // New batch or shutdown
+    pthread_cond_t done;          // A worker finished its share
+    pthread_t threads[MAX_BATCH_THREADS];
+    unsigned born[MAX_BATCH_THREADS]; // Generation current at each worker's start
+    int count;                    // Running workers
+    BatchJob* job;
+    unsigned generation;          // Incremented per batch
+    int active;                   // Workers still on the current batch
+    bool shutdown;
+} g_pool = {
+    .batch_lock = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER
+};
+
+// Worker i is participant i + 1 of every batch that has that many
+static void* pool_worker(void* arg) {
+    const int index = (int)(intptr_t)arg;
+    const int participant = index + 1;
+    pthread_mutex_lock(&g_pool.lock);
+    unsigned seen = g_pool.born[index];
+    for (;;) {
+        while (!g_pool.shutdown && g_pool.generation == seen)
+            pthread_cond_wait(&g_pool.wake, &g_pool.lock);
+        if (g_pool.shutdown) break;
+        seen = g_pool.generation;
+        // The batch may already be over if this worker was not needed
+        BatchJob* job = g_pool.job;
+        if (!job || participant >= job->participants) continue;
+
+        pthread_mutex_unlock(&g_pool.lock);
+        job->participate(job, participant);
+        pthread_mutex_lock(&g_pool.lock);
+        if (--g_pool.active == 0) pthread_cond_signal(&g_pool.done);
+    }
+    pthread_mutex_unlock(&g_pool.lock);
+    return NULL;
+}
+
+// Starts workers until there are wanted (or as many as the system allows);
+// called with batch_lock held
+static int pool_grow(int wanted) {
+    pthread_mutex_lock(&g_pool.lock);
+    while (g_pool.count < wanted) {
+        g_pool.born[g_pool.count] = g_pool.generation;
+        if (pthread_create(&g_pool.threads[g_pool.count], NULL, pool_worker,
+                           (void*)(intptr_t)g_pool.count) != 0)
+            break;
+        g_pool.count++;
+    }
+    const int count = g_pool.count;
+    pthread_mutex_unlock(&g_pool.lock);
+    return count;
+}
+
+static void pool_shutdown(void) {
+    pthread_mutex_lock(&g_pool.batch_lock);
+    pthread_mutex_lock(&g_pool.lock);
+    g_pool.shutdown = true;
+    pthread_cond_broadcast(&g_pool.wake);
+    pthread_mutex_unlock(&g_pool.lock);
+    for (int i = 0; i < g_pool.count; i++) pthread_join(g_pool.threads[i], NULL);
+    g_pool.count = 0;
+    g_pool.shutdown = false;
+    pthread_mutex_unlock(&g_pool.batch_lock);
+}
+
+static int batch_default_threads(void) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return (cpus > 0) ? (int)cpus : 1;
+}
+
+// One pass of at most BATCH_PASS_ITEMS items
+static void batch_run(BatchJob* job, size_t count, int threads) {
+    WorkRange ranges[MAX_BATCH_THREADS];
+    if ((size_t)threads > count) threads = (int)count;
+    if (threads > 1) threads = pool_grow(threads - 1) + 1;
+
+    job->participants = threads;
+    job->ranges = ranges;
+    atomic_init(&job->first_error, UINT64_MAX);
+    for (int t = 0; t < threads; t++) {
+        const uint32_t begin = (uint32_t)(count * t / threads);
+        const uint32_t end = (uint32_t)(count * (t + 1) / threads);
+        atomic_init(&ranges[t].range, range_pack(begin, end));
+    }
+
+    if (threads > 1) {
+        pthread_mutex_lock(&g_pool.lock);
+        g_pool.job = job;
+        g_pool.active = threads - 1;
+        g_pool.generation++;
+        pthread_cond_broadcast(&g_pool.wake);
+        pthread_mutex_unlock(&g_pool.lock);
+    }
+
+    job->participate(job, 0);
+
+    if (threads > 1) {
+        pthread_mutex_lock(&g_pool.lock);
+        while (g_pool.active > 0) pthread_cond_wait(&g_pool.done, &g_pool.lock);
+        g_pool.job = NULL;
+        pthread_mutex_unlock(&g_pool.lock);
+    }
+}
+
+// Participants (including the caller) options ask for, capped
+static PhashError batch_threads(const PhashBatchOptions* options, int* out_threads) {
+    const int requested = options ? options->num_threads : 0;
+    if (requested < 0) return PHASH_ERR_INVALID_ARGUMENT;
+    const int threads = requested ? requested : batch_default_threads();
+    *out_threads = (threads > MAX_BATCH_THREADS) ? MAX_BATCH_THREADS : threads;
+    return PHASH_OK;
+}
+
+// Runs items [0, count) of job in passes of at most BATCH_PASS_ITEMS, one
+// job on the pool at a time. Returns PHASH_OK or the error recorded for
+// the lowest failing item.
+static PhashError batch_execute(BatchJob* job, size_t count, int threads) {
+    PhashError result = PHASH_OK;
+    pthread_mutex_lock(&g_pool.batch_lock);
+    for (size_t base = 0; base < count; base += BATCH_PASS_ITEMS) {
+        const size_t pass = (count - base < BATCH_PASS_ITEMS) ? count - base
+                                                               : BATCH_PASS_ITEMS;
+        job->base = base;
+        batch_run(job, pass, threads);
+        
+        const uint64_t first = atomic_load(&job->first_error);
+        if (first != UINT64_MAX && result == PHASH_OK)
+            result = (PhashError)(first & 0xFF);
+    }
+    pthread_mutex_unlock(&g_pool.batch_lock);
+    return result;
+}
+
+// Batch of hashes of any width, words per image
+static PhashError compute_batch(const PhashImage* const* images, size_t count,
+                                const PhashConfig* config, uint64_t* out_hashes,
+                                const PhashBatchOptions* options) {
+    PhashError err;
+    int threads;
+    
+    if ((err = batch_threads(options, &threads)) != PHASH_OK)
+        return err;
+    
+    HashTask task = {
+        .images = images,
+        .config = config,
+        .hashes = out_hashes,
+        .words = hash_words(config->hash_size),
+        .errors = options ? options->errors : NULL,
+        .workspace_size = phash_workspace_size(config)
+    };
+    BatchJob job = { .participate = hash_participate, .task = &task };
+    return batch_execute(&job, count, threads);
+}
+
+PhashError phash_compute_batch(const PhashImage* const* images, size_t count,
+                              const PhashConfig* config, uint64_t* out_hashes,
+                              const PhashBatchOptions* options) {
+    PhashError err;
+    
+    if (!images || !config || !out_hashes)
+        return PHASH_ERR_NULL_POINTER;
+    
+    if ((err = phash_config_validate(config)) != PHASH_OK)
+        return err;
+    if (config->hash_size > HASH64_SIZE)
+        return PHASH_ERR_INVALID_ARGUMENT;
+    
+    return compute_batch(images, count, config, out_hashes, options);
+}
+
+PhashError phash_compute_batch_wide(const PhashImage* const* images, size_t count,
+                                   const PhashConfig* config, uint64_t* out_hashes,
+                                   const PhashBatchOptions* options) {
+    PhashError err;
+    
+    if (!images || !config || !out_hashes)
+        return PHASH_ERR_NULL_POINTER;
+    
+    if ((err = phash_config_validate(config)) != PHASH_OK)
+        return err;
+    
+    return compute_batch(images, count, config, out_hashes, options);
+}
+
+// ---------------------------------------------------------------------------
+// All-pairs Hamming distances
+//
+// Distance matrices and threshold joins of a set A against a set B (or
+// against itself) are split into blocks of JOIN_ROWS hashes of A, the work
+// items of a pool job. A block walks B in tiles of JOIN_COLUMNS hashes and
+// runs the one-vs-many kernels over each tile once per row, so a tile is
+// loaded from memory once and then read JOIN_ROWS times from L1.
+// ---------------------------------------------------------------------------
+
+#define JOIN_ROWS 64
+#define JOIN_COLUMNS 4096   // 32 KiB of hashes
+
+// Pairs found in one row block, sorted
+typedef struct {
+    PhashPair* pairs;
+    size_t count;
+} JoinBlock;
+
+typedef struct {
+    const uint64_t* a;
+    size_t count_a;
+    const uint64_t* b;
+    size_t count_b;
+    bool self;                // b is a; only pairs i < j
+    int max_distance;
+    uint8_t* matrix;          // Dense output, or NULL for pairs
+    JoinBlock* blocks;        // Sparse output, one entry per row block
+    const PhashKernels* kernels;
+} JoinTask;
+
+// Pairs come out tile by tile, each row's in increasing j; a stable
+// counting sort on the row restores (a, b) order. Returns the sorted copy
+// (NULL if empty or out of memory).
+static PhashPair* join_sort_block(const PhashPair* pairs, size_t count, size_t row0) {
+    size_t start[JOIN_ROWS + 1] = { 0 };
+    if (!count) return NULL;
+    PhashPair* sorted = malloc(count * sizeof(PhashPair));
+    if (!sorted) return NULL;
+    for (size_t k = 0; k < count; k++) start[pairs[k].a - row0 + 1]++;
+    for (int r = 0; r < JOIN_ROWS; r++) start[r + 1] += start[r];
+    for (size_t k = 0; k < count; k++) sorted[start[pairs[k].a - row0]++] = pairs[k];
+    return sorted;
+}
+
+static void join_participate(BatchJob* job, int self) {
+    const JoinTask* task = job->task;
+    const PhashKernels* kernels = task->kernels;
+    size_t* hits = task->matrix ? NULL : malloc(JOIN_COLUMNS * sizeof(size_t));
+    PhashPair* found = NULL;
+    size_t capacity = 0;
+    uint32_t item;
+
+    while (batch_claim(job, self, &item)) {
+        const size_t block = job->base + item;
+        const size_t row0 = block * JOIN_ROWS;
+        const size_t row1 = (task->count_a - row0 < JOIN_ROWS) ? task->count_a
+                                                               : row0 + JOIN_ROWS;
+        const size_t first_column = task->self ? row0 + 1 : 0;
+        size_t used = 0;
+        bool failed = !task->matrix && !hits;
+
+        for (size_t c0 = first_column; !failed && c0 < task->count_b; c0 += JOIN_COLUMNS) {
+            const size_t c1 = (task->count_b - c0 < JOIN_COLUMNS) ? task->count_b
+                                                                  : c0 + JOIN_COLUMNS;
+            for (size_t i = row0; i < row1; i++) {
+                const size_t start = (task->self && i + 1 > c0) ? i + 1 : c0;
+                if (start >= c1) continue;
+                if (task->matrix) {
+                    kernels->distances(task->a[i], task->b + start, c1 - start,
+                                       task->matrix + i*task->count_b + start);
+                    continue;
+                }
+
+                const size_t n = kernels->scan_within(task->a[i], task->b + start, c1 - start,
+                                                      task->max_distance, hits);
+                if (used + n > capacity) {
+                    const size_t grown = (used + n > 2*capacity) ? used + n : 2*capacity;
+                    PhashPair* larger = realloc(found, grown * sizeof(PhashPair));
+                    if (!larger) {
+                        failed = true;
+                        break;
+                    }
+                    found = larger;
+                    capacity = grown;
+                }
+                for (size_t k = 0; k < n; k++) {
+                    const size_t j = start + hits[k];
+                    found[used++] = (PhashPair){
+                        .a = i, .b = j,
+                        .distance = __builtin_popcountll(task->a[i] ^ task->b[j])
+                    };
+                }
+            }
+        }
+
+        if (task->matrix) continue;
+        JoinBlock* out = &task->blocks[block];
+        out->pairs = failed ? NULL : join_sort_block(found, used, row0);
+        out->count = out->pairs ? used : 0;
+        if (failed || (used && !out->pairs))
+            batch_record_error(job, item, PHASH_ERR_MEMORY_ALLOCATION);
+    }
+    free(found);
+    free(hits);
+}
+
+// Concatenates the pairs of count blocks in order into one allocation and
+// frees the blocks. err is the result of the job that filled them; on
+// failure nothing is returned.
+static PhashError blocks_concat(JoinBlock* blocks, size_t count, PhashError err,
+                                PhashPair** out_pairs, size_t* out_count) {
+    size_t total = 0;
+    for (size_t k = 0; k < count; k++) total += blocks[k].count;
+    PhashPair* pairs = NULL;
+    if (err == PHASH_OK && total) {
+        pairs = malloc(total * sizeof(PhashPair));
+        if (!pairs) err = PHASH_ERR_MEMORY_ALLOCATION;
+    }
+    size_t used = 0;
+    for (size_t k = 0; k < count; k++) {
+        if (pairs && blocks[k].count) {
+            memcpy(pairs + used, blocks[k].pairs, blocks[k].count * sizeof(PhashPair));
+            used += blocks[k].count;
+        }
+        free(blocks[k].pairs);
+    }
+    free(blocks);
+    
+    if (err != PHASH_OK) return err;
+    *out_pairs = pairs;
+    *out_count = total;
+    return PHASH_OK;
+}
+
+static PhashError join_run(JoinTask* task, PhashPair** out_pairs, size_t* out_count,
+                           const PhashBatchOptions* options) {
+    PhashError err;
+    int threads;
+    
+    if ((err = batch_threads(options, &threads)) != PHASH_OK)
+        return err;
+    
+    const size_t blocks = (task->count_a + JOIN_ROWS - 1) / JOIN_ROWS;
+    task->kernels = active_kernels();
+    if (!task->matrix) {
+        *out_pairs = NULL;
+        *out_count = 0;
+        if (!blocks) return PHASH_OK;
+        task->blocks = calloc(blocks, sizeof(JoinBlock));
+        if (!task->blocks) return PHASH_ERR_MEMORY_ALLOCATION;
+    }
+    
+    BatchJob job = { .participate = join_participate, .task = task };
+    err = batch_execute(&job, blocks, threads);
+    if (task->matrix) return err;
+    return blocks_concat(task->blocks, blocks, err, out_pairs, out_count);
+}
+
+PhashError phash_distance_matrix(const uint64_t* a, size_t count_a,
+                                 const uint64_t* b, size_t count_b,
+                                 uint8_t* out_matrix,
+                                 const PhashBatchOptions* options) {
+    if ((count_a && !a) || (count_b && !b) || (count_a && count_b && !out_matrix))
+        return PHASH_ERR_NULL_POINTER;
+    if (!count_a || !count_b) return PHASH_OK;
+    
+    JoinTask task = {
+        .a = a, .count_a = count_a,
+        .b = b, .count_b = count_b,
+        .matrix = out_matrix
+    };
+    return join_run(&task, NULL, NULL, options);
+}
+
+PhashError phash_pairs_within(const uint64_t* hashes, size_t count, int max_distance,
+                              PhashPair** out_pairs, size_t* out_count,
+                              const PhashBatchOptions* options) {
+    if (!out_pairs || !out_count || (count && !hashes)) return PHASH_ERR_NULL_POINTER;
+    if (max_distance < 0) return PHASH_ERR_INVALID_ARGUMENT;
+    
+    JoinTask task = {
+        .a = hashes, .count_a = count,
+        .b = hashes, .count_b = count,
+        .self = true,
+        .max_distance = max_distance
+    };
+    return join_run(&task, out_pairs, out_count, options);
+}
+
+PhashError phash_join_within(const uint64_t* a, size_t count_a,
+                             const uint64_t* b, size_t count_b,
+                             int max_distance,
+                             PhashPair** out_pairs, size_t* out_count,
+                             const PhashBatchOptions* options) {
+    if (!out_pairs || !out_count || (count_a && !a) || (count_b && !b))
+        return PHASH_ERR_NULL_POINTER;
+    if (max_distance < 0) return PHASH_ERR_INVALID_ARGUMENT;
+    
+    JoinTask task = {
+        .a = a, .count_a = count_a,
+        .b = b, .count_b = count_b,
+        .max_distance = max_distance
+    };
+    return join_run(&task, out_pairs, out_count, options);
+}
+
+void phash_pairs_free(PhashPair* pairs) {
+    free(pairs);
+}
+
+// ---------------------------------------------------------------------------
+// BK-tree
+//
+// Nodes live in one arena array and refer to each other by index: a node
+// keeps its first child and next sibling, and siblings are ordered by the
+// distance to their parent (the edge). A query at distance d from a node
+// only descends into children with edge in [d - r, d + r], so the sorted
+// sibling list is cut at d + r. Node 0 is the root.
+// ---------------------------------------------------------------------------
+
+#define BK_NONE 0                    // No child / sibling (the root is no one's)
+#define BK_MAX_NODES UINT32_MAX
+#define BK_STACK 256                 // Query stack entries kept on the C stack
+
+typedef struct {
+    uint64_t hash;
+    size_t id;
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint32_t edge;                   // Distance to the parent
+} BkNode;
+
+struct PhashBkTree {
+    BkNode* nodes;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+PhashError phash_bktree_create(PhashBkTree** out_tree) {
+    if (!out_tree) return PHASH_ERR_NULL_POINTER;
+    PhashBkTree* tree = calloc(1, sizeof(PhashBkTree));
+    if (!tree) return PHASH_ERR_MEMORY_ALLOCATION;
+    *out_tree = tree;
+    return PHASH_OK;
+}
+
+void phash_bktree_destroy(PhashBkTree* tree) {
+    if (tree) {
+        free(tree->nodes);
+        free(tree);
+    }
+}
+
+size_t phash_bktree_size(const PhashBkTree* tree) {
+    return tree ? tree->count : 0;
+}
+
+PhashError phash_bktree_insert(PhashBkTree* tree, uint64_t hash, size_t id) {
+    if (!tree) return PHASH_ERR_NULL_POINTER;
+    
+    if (tree->count == tree->capacity) {
+        if (tree->capacity == BK_MAX_NODES) return PHASH_ERR_MEMORY_ALLOCATION;
+        const uint32_t grown = (tree->capacity > BK_MAX_NODES / 2) ? BK_MAX_NODES
+                             : tree->capacity ? 2 * tree->capacity : 64;
+        BkNode* nodes = realloc(tree->nodes, (size_t)grown * sizeof(BkNode));
+        if (!nodes) return PHASH_ERR_MEMORY_ALLOCATION;
+        tree->nodes = nodes;
+        tree->capacity = grown;
+    }
+    
+    const uint32_t index = tree->count++;
+    tree->nodes[index] = (BkNode){ .hash = hash, .id = id };
+    if (index == 0) return PHASH_OK;
+    
+    const PhashKernels* kernels = active_kernels();
+    uint32_t node = 0;
+    for (;;) {
+        const uint64_t diff = tree->nodes[node].hash ^ hash;
+        const uint32_t edge = (uint32_t)kernels->popcount(&diff, 1);
+        // Find the child on this edge, or the link to insert the new one at
+        uint32_t* link = &tree->nodes[node].first_child;
+        while (*link != BK_NONE && tree->nodes[*link].edge < edge)
+            link = &tree->nodes[*link].next_sibling;
+        if (*link != BK_NONE && tree->nodes[*link].edge == edge) {
+            node = *link;
+            continue;
+        }
+        tree->nodes[index].edge = edge;
+        tree->nodes[index].next_sibling = *link;
+        *link = index;
+        return PHASH_OK;
+    }
+}
+
+PhashError phash_bktree_optimize(PhashBkTree* tree) {
+    if (!tree) return PHASH_ERR_NULL_POINTER;
+    if (tree->count < 2) return PHASH_OK;
+    
+    // Breadth-first order places the children of each node side by side, so
+    // a query walks every sibling list sequentially
+    BkNode* nodes = malloc((size_t)tree->count * sizeof(BkNode));
+    if (!nodes) return PHASH_ERR_MEMORY_ALLOCATION;
+    nodes[0] = tree->nodes[0];
+    uint32_t placed = 1;
+    for (uint32_t n = 0; n < placed; n++) {
+        uint32_t c = nodes[n].first_child;
+        if (c == BK_NONE) continue;
+        nodes[n].first_child = placed;
+        for (; c != BK_NONE; c = tree->nodes[c].next_sibling) {
+            nodes[placed] = tree->nodes[c];
+            nodes[placed].next_sibling = (tree->nodes[c].next_sibling != BK_NONE) ? placed + 1
+                                                                                   : BK_NONE;
+            placed++;
+        }
+    }
+    
+    free(tree->nodes);
+    tree->nodes = nodes;
+    tree->capacity = tree->count;
+    return PHASH_OK;
+}
+
+// Depth-first traversal stack, on the C stack until it outgrows BK_STACK
+typedef struct {
+    uint32_t* items;
+    size_t count;
+    size_t capacity;
+    uint32_t local[BK_STACK];
+} BkStack;
+
+static bool bk_push(BkStack* stack, uint32_t node) {
+    if (stack->count == stack->capacity) {
+        const size_t grown = 2 * stack->capacity;
+        uint32_t* items = (stack->items == stack->local) ? malloc(grown * sizeof(uint32_t))
+                        : realloc(stack->items, grown * sizeof(uint32_t));
+        if (!items) return false;
+        if (stack->items == stack->local) memcpy(items, stack->local, sizeof(stack->local));
+        stack->items = items;
+        stack->capacity = grown;
+    }
+    stack->items[stack->count++] = node;
+    return true;
+}
+
+static void bk_stack_init(BkStack* stack) {
+    stack->items = stack->local;
+    stack->count = 0;
+    stack->capacity = BK_STACK;
+}
+
+static void bk_stack_free(BkStack* stack) {
+    if (stack->items != stack->local) free(stack->items);
+}
+
+PhashError phash_bktree_query(const PhashBkTree* tree, uint64_t query, int radius,
+                              PhashMatch* out_matches, size_t capacity,
+                              size_t* out_count) {
+    if (!tree || !out_count || (capacity && !out_matches)) return PHASH_ERR_NULL_POINTER;
+    if (radius < 0) return PHASH_ERR_INVALID_ARGUMENT;
+    
+    *out_count = 0;
+    if (!tree->count) return PHASH_OK;
+    
+    const PhashKernels* kernels = active_kernels();
+    const BkNode* nodes = tree->nodes;
+    const uint32_t r = (uint32_t)radius;
+    size_t found = 0;
+    BkStack stack;
+    bk_stack_init(&stack);
+    bk_push(&stack, 0);
+    
+    while (stack.count) {
+        const BkNode* node = &nodes[stack.items[--stack.count]];
+        const uint64_t diff = node->hash ^ query;
+        const uint32_t d = (uint32_t)kernels->popcount(&diff, 1);
+        if (d <= r) {
+            if (found < capacity) out_matches[found] = (PhashMatch){ node->id, (int)d };
+            found++;
+        }
+        const uint32_t low = (d > r) ? d - r : 0;
+        for (uint32_t c = node->first_child; c != BK_NONE && nodes[c].edge <= d + r;
+             c = nodes[c].next_sibling) {
+            if (nodes[c].edge >= low && !bk_push(&stack, c)) {
+                bk_stack_free(&stack);
+                return PHASH_ERR_MEMORY_ALLOCATION;
+            }
+        }
+    }
+    
+    bk_stack_free(&stack);
+    *out_count = found;
+    return PHASH_OK;
+}
+
+PhashError phash_bktree_nearest(const PhashBkTree* tree, uint64_t query,
+                                PhashMatch* out_match) {
+    if (!tree || !out_match) return PHASH_ERR_NULL_POINTER;
+    if (!tree->count) return PHASH_ERR_INVALID_ARGUMENT;
+    
+    const PhashKernels* kernels = active_kernels();
+    const BkNode* nodes = tree->nodes;
+    PhashMatch best = { SIZE_MAX, 65 };
+    BkStack stack;
+    bk_stack_init(&stack);
+    bk_push(&stack, 0);
+    
+    // The search radius shrinks to the best distance found so far
+    while (stack.count) {
+        const BkNode* node = &nodes[stack.items[--stack.count]];
+        const uint64_t diff = node->hash ^ query;
+        const uint32_t d = (uint32_t)kernels->popcount(&diff, 1);
+        if ((int)d < best.distance || ((int)d == best.distance && node->id < best.id))
+            best = (PhashMatch){ node->id, (int)d };
+        const uint32_t r = (uint32_t)best.distance;
+        const uint32_t low = (d > r) ? d - r : 0;
+        for (uint32_t c = node->first_child; c != BK_NONE && nodes[c].edge <= d + r;
+             c = nodes[c].next_sibling) {
+            if (nodes[c].edge >= low && !bk_push(&stack, c)) {
+                bk_stack_free(&stack);
+                return PHASH_ERR_MEMORY_ALLOCATION;
+            }
+        }
+    }
+    
+    bk_stack_free(&stack);
+    *out_match = best;
+    return PHASH_OK;
+}
+
+// ---------------------------------------------------------------------------
+// Multi-index hashing
+//
+// The 64 hash bits are cut into m substrings, each indexing its own hash
+// table of buckets. If a stored hash is within r = s*m + a (a < m) of the
+// query then, by the pigeonhole principle, one of its first a + 1
+// substrings is within s of the query's, or one of the others within
+// s - 1. A query therefore probes every key at those distances in each
+// table and verifies the candidates. Buckets keep the full hashes next to
+// the ids, so verification is a sequential scan_within over the bucket.
+// A candidate found in several tables is reported only from the first
+// table whose probe radius covers it. The keys to probe grow as
+// C(width, radius), so when they would outnumber the stored entries the
+// query verifies every entry instead.
+// ---------------------------------------------------------------------------
+
+#define MIH_MAX_SUBSTRINGS 16
+#define MIH_DEFAULT_SUBSTRINGS 4
+#define MIH_SCAN_CHUNK 256            // Bucket entries verified per kernel call
+#define MIH_QUERY_BLOCK 64            // Queries per work item of a batch
+#define MIH_BITMAP_BITS 24            // Widest substring with a presence bitmap
+
+typedef struct {
+    uint64_t* hashes;
+    uint64_t* ids;
+    size_t count;
+    size_t capacity;
+} MihBucket;
+
+// Open addressing on the substring value; buckets are never removed, an
+// emptied one stays for reuse. capacity is a power of two (or 0). Most
+// probed keys have no bucket, so substrings of up to MIH_BITMAP_BITS bits
+// also get a bitmap of the keys that have one, which answers those probes
+// from cache instead of from the table.
+typedef struct {
+    uint64_t* keys;
+    MihBucket* buckets;              // hashes == NULL marks a free slot
+    size_t capacity;
+    size_t used;
+    uint64_t* present;               // Bit per key with a bucket, or NULL
+} MihTable;
+
+// Where the substrings lie; the first 64 % m are one bit wider
+typedef struct {
+    int substrings;
+    int offset[MIH_MAX_SUBSTRINGS];  // First bit of each substring
+    int width[MIH_MAX_SUBSTRINGS];
+} MihLayout;
+
+struct PhashMihIndex {
+    MihLayout layout;
+    MihTable tables[MIH_MAX_SUBSTRINGS];
+    size_t count;
+};
+
+static void mih_layout_init(MihLayout* layout, int substrings) {
+    layout->substrings = substrings;
+    for (int t = 0, offset = 0; t < substrings; t++) {
+        layout->offset[t] = offset;
+        layout->width[t] = 64 / substrings + (t < 64 % substrings);
+        offset += layout->width[t];
+    }
+}
+
+static uint64_t mih_key(const MihLayout* layout, int t, uint64_t hash) {
+    const uint64_t mask = (layout->width[t] == 64) ? UINT64_MAX
+                                                   : ((1ULL << layout->width[t]) - 1);
+    return (hash >> layout->offset[t]) & mask;
+}
+
+static size_t mih_slot(const MihTable* table, uint64_t key) {
+    return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 17) & (table->capacity - 1);
+}
+
+static MihBucket* mih_find(const MihTable* table, uint64_t key) {
+    if (!table->capacity) return NULL;
+    if (table->present && !(table->present[key / 64] >> (key % 64) & 1)) return NULL;
+    for (size_t i = mih_slot(table, key);; i = (i + 1) & (table->capacity - 1)) {
+        if (!table->buckets[i].hashes) return NULL;
+        if (table->keys[i] == key) return &table->buckets[i];
+    }
+}
+
+// Bucket of key, created if missing; NULL when out of memory
+static MihBucket* mih_bucket(MihTable* table, uint64_t key) {
+    MihBucket* found = mih_find(table, key);
+    if (found) return found;
+    
+    if (2 * (table->used + 1) > table->capacity) {
+        MihTable grown = { .capacity = table->capacity ? 2 * table->capacity : 64 };
+        grown.keys = malloc(grown.capacity * sizeof(uint64_t));
+        grown.buckets = calloc(grown.capacity, sizeof(MihBucket));
+        if (!grown.keys || !grown.buckets) {
+            free(grown.keys);
+            free(grown.buckets);
+            return NULL;
+        }
+        for (size_t i = 0; i < table->capacity; i++) {
+            if (!table->buckets[i].hashes) continue;
+            size_t j = mih_slot(&grown, table->keys[i]);
+            while (grown.buckets[j].hashes) j = (j + 1) & (grown.capacity - 1);
+            grown.keys[j] = table->keys[i];
+            grown.buckets[j] = table->buckets[i];
+        }
+        grown.used = table->used;
+        grown.present = table->present;
+        free(table->keys);
+        free(table->buckets);
+        *table = grown;
+    }
+    
+    size_t i = mih_slot(table, key);
+    while (table->buckets[i].hashes) i = (i + 1) & (table->capacity - 1);
+    MihBucket* bucket = &table->buckets[i];
+    bucket->hashes = malloc(4 * sizeof(uint64_t));
+    bucket->ids = malloc(4 * sizeof(uint64_t));
+    if (!bucket->hashes || !bucket->ids) {
+        free(bucket->hashes);
+        free(bucket->ids);
+        *bucket = (MihBucket){ 0 };
+        return NULL;
+    }
+    bucket->capacity = 4;
+    table->keys[i] = key;
+    table->used++;
+    if (table->present) table->present[key / 64] |= 1ULL << (key % 64);
+    return bucket;
+}
+
+static bool mih_bucket_append(MihBucket* bucket, uint64_t hash, size_t id) {
+    if (bucket->count == bucket->capacity) {
+        const size_t grown = 2 * bucket->capacity;
+        uint64_t* hashes = realloc(bucket->hashes, grown * sizeof(uint64_t));
+        if (!hashes) return false;
+        bucket->hashes = hashes;
+        uint64_t* ids = realloc(bucket->ids, grown * sizeof(uint64_t));
+        if (!ids) return false;
+        bucket->ids = ids;
+        bucket->capacity = grown;
+    }
+    bucket->hashes[bucket->count] = hash;
+    bucket->ids[bucket->count] = id;
+    bucket->count++;
+    return true;
+}
+
+// Swap-removes the entry (hash, id) of bucket; false if absent
+static bool mih_bucket_remove(MihBucket* bucket, uint64_t hash, size_t id) {
+    for (size_t k = 0; bucket && k < bucket->count; k++) {
+        if (bucket->hashes[k] != hash || bucket->ids[k] != id) continue;
+        bucket->count--;
+        bucket->hashes[k] = bucket->hashes[bucket->count];
+        bucket->ids[k] = bucket->ids[bucket->count];
+        return true;
+    }
+    return false;
+}
+
+PhashError phash_mih_create(int substrings, PhashMihIndex** out_index) {
+    if (!out_index) return PHASH_ERR_NULL_POINTER;
+    if (!substrings) substrings = MIH_DEFAULT_SUBSTRINGS;
+    if (substrings < 1 || substrings > MIH_MAX_SUBSTRINGS) return PHASH_ERR_INVALID_ARGUMENT;
+    
+    PhashMihIndex* index = calloc(1, sizeof(PhashMihIndex));
+    if (!index) return PHASH_ERR_MEMORY_ALLOCATION;
+    
+    mih_layout_init(&index->layout, substrings);
+    for (int t = 0; t < substrings; t++) {
+        const int width = index->layout.width[t];
+        if (width > MIH_BITMAP_BITS) continue;
+        index->tables[t].present = calloc(((size_t)1 << width) / 64 + 1, sizeof(uint64_t));
+        if (!index->tables[t].present) {
+            phash_mih_destroy(index);
+            return PHASH_ERR_MEMORY_ALLOCATION;
+        }
+    }
+    *out_index = index;
+    return PHASH_OK;
+}
+
+void phash_mih_destroy(PhashMihIndex* index) {
+    if (!index) return;
+    for (int t = 0; t < index->layout.substrings; t++) {
+        MihTable* table = &index->tables[t];
+        for (size_t i = 0; i < table->capacity; i++) {
+            free(table->buckets[i].hashes);
+            free(table->buckets[i].ids);
+        }
+        free(table->keys);
+        free(table->buckets);
+        free(table->present);
+    }
+    free(index);
+}
+
+size_t phash_mih_size(const PhashMihIndex* index) {
+    return index ? index->count : 0;
+}
+
+PhashError phash_mih_insert(PhashMihIndex* index, uint64_t hash, size_t id) {
+    if (!index) return PHASH_ERR_NULL_POINTER;
+    
+    for (int t = 0; t < index->layout.substrings; t++) {
+        MihBucket* bucket = mih_bucket(&index->tables[t], mih_key(&index->layout, t, hash));
+        if (!bucket || !mih_bucket_append(bucket, hash, id)) {
+            // Undo the tables already updated
+            for (int u = 0; u < t; u++) {
+                mih_bucket_remove(mih_find(&index->tables[u], mih_key(&index->layout, u, hash)),
+                                  hash, id);
+            }
+            return PHASH_ERR_MEMORY_ALLOCATION;
+        }
+    }
+    index->count++;
+    return PHASH_OK;
+}
+
+PhashError phash_mih_remove(PhashMihIndex* index, uint64_t hash, size_t id) {
+    if (!index) return PHASH_ERR_NULL_POINTER;
+    
+    for (int t = 0; t < index->layout.substrings; t++) {
+        const uint64_t key = mih_key(&index->layout, t, hash);
+        if (!mih_bucket_remove(mih_find(&index->tables[t], key), hash, id))
+            return PHASH_ERR_INVALID_ARGUMENT;   // Not stored (checked in table 0)
+    }
+    index->count--;
+    return PHASH_OK;
+}
+
+// Entries of one bucket, in memory or in an index file
+typedef struct {
+    const uint64_t* hashes;
+    const uint64_t* ids;
+    size_t count;
+} MihView;
+
+// Bucket of key in table t of source; false if there is none
+typedef bool (*MihLookup)(const void* source, int t, uint64_t key, MihView* view);
+
+// Next run of stored entries from *cursor (0 to start), together covering
+// every entry once; false after the last
+typedef bool (*MihEntries)(const void* source, size_t* cursor, MihView* view);
+
+static bool mih_lookup_memory(const void* source, int t, uint64_t key, MihView* view) {
+    const MihBucket* bucket = mih_find(&((const PhashMihIndex*)source)->tables[t], key);
+    if (!bucket) return false;
+    *view = (MihView){ bucket->hashes, bucket->ids, bucket->count };
+    return true;
+}
+
+// The buckets of table 0, which holds every entry once
+static bool mih_entries_memory(const void* source, size_t* cursor, MihView* view) {
+    const MihTable* table = &((const PhashMihIndex*)source)->tables[0];
+    while (*cursor < table->capacity) {
+        const MihBucket* bucket = &table->buckets[(*cursor)++];
+        if (!bucket->hashes || !bucket->count) continue;
+        *view = (MihView){ bucket->hashes, bucket->ids, bucket->count };
+        return true;
+    }
+    return false;
+}
+
+typedef struct {
+    const MihLayout* layout;
+    MihLookup lookup;
+    const void* source;
+    const PhashKernels* kernels;
+    uint64_t query;
+    int radius;
+    int probe_radius[MIH_MAX_SUBSTRINGS];  // Per table; -1 = not probed
+    int table;                             // Table being probed
+    PhashMatch* out;
+    size_t capacity;
+    size_t found;
+} MihSearch;
+
+// Reports the matches of one bucket the earlier tables did not cover
+static void mih_verify(MihSearch* search, const MihView* bucket) {
+    size_t hits[MIH_SCAN_CHUNK];
+    for (size_t base = 0; base < bucket->count; base += MIH_SCAN_CHUNK) {
+        const size_t chunk = (bucket->count - base < MIH_SCAN_CHUNK) ? bucket->count - base
+                                                                     : MIH_SCAN_CHUNK;
+        const size_t n = search->kernels->scan_within(search->query, bucket->hashes + base,
+                                                      chunk, search->radius, hits);
+        for (size_t k = 0; k < n; k++) {
+            const uint64_t hash = bucket->hashes[base + hits[k]];
+            bool seen = false;
+            for (int t = 0; t < search->table && !seen; t++) {
+                const uint64_t diff = mih_key(search->layout, t, hash) ^
+                                      mih_key(search->layout, t, search->query);
+                seen = (int)search->kernels->popcount(&diff, 1) <= search->probe_radius[t];
+            }
+            if (seen) continue;
+            if (search->found < search->capacity) {
+                const uint64_t diff = hash ^ search->query;
+                search->out[search->found] = (PhashMatch){
+                    (size_t)bucket->ids[base + hits[k]], (int)search->kernels->popcount(&diff, 1)
+                };
+            }
+            search->found++;
+        }
+    }
+}
+
+// Probes every key obtained by flipping up to flips more bits of key at
+// positions >= bit
+static void mih_probe(MihSearch* search, uint64_t key, int bit, int flips) {
+    MihView bucket;
+    if (search->lookup(search->source, search->table, key, &bucket))
+        mih_verify(search, &bucket);
+    if (!flips) return;
+    for (int b = bit; b < search->layout->width[search->table]; b++)
+        mih_probe(search, key ^ (1ULL << b), b + 1, flips - 1);
+}
+
+// Keys the probe radii enumerate over all tables: sum_k C(width, k) for
+// k up to each table's radius (in double, as it can pass 2^64)
+static double mih_probe_count(const MihSearch* search) {
+    double total = 0.0;
+    for (int t = 0; t < search->layout->substrings; t++) {
+        const int width = search->layout->width[t];
+        double keys = 1.0;
+        for (int k = 0; k <= search->probe_radius[t]; k++) {
+            total += keys;
+            keys = keys * (width - k) / (k + 1);
+        }
+    }
+    return total;
+}
+
+// Matches of query within radius into out (up to capacity); returns the
+// total number. When the probes would outnumber the stored entries,
+// verifies every entry instead: a scan bounds the cost of any radius and
+// layout, which the probes alone do not (C(64, 10) keys for one table at
+// radius 10).
+static size_t mih_search(const MihLayout* layout, MihLookup lookup, MihEntries entries,
+                         const void* source, size_t stored, const PhashKernels* kernels,
+                         uint64_t query, int radius, PhashMatch* out, size_t capacity) {
+    MihSearch search = {
+        .layout = layout, .lookup = lookup, .source = source, .kernels = kernels,
+        .query = query, .radius = radius, .out = out, .capacity = capacity
+    };
+    const int m = layout->substrings;
+    const int s = radius / m, a = radius % m;
+    for (int t = 0; t < m; t++) {
+        search.probe_radius[t] = (t <= a) ? s : s - 1;
+        if (search.probe_radius[t] > layout->width[t]) search.probe_radius[t] = layout->width[t];
+    }
+    
+    if (mih_probe_count(&search) > (double)stored) {
+        // search.table stays 0, so no entry counts as seen
+        MihView run;
+        size_t cursor = 0;
+        while (entries(source, &cursor, &run)) mih_verify(&search, &run);
+        return search.found;
+    }
+    for (int t = 0; t < m; t++) {
+        if (search.probe_radius[t] < 0) continue;
+        search.table = t;
+        // Flipping bits of one substring enumerates each key once
+        mih_probe(&search, mih_key(layout, t, query), 0, search.probe_radius[t]);
+    }
+    return search.found;
+}
+
+PhashError phash_mih_query(const PhashMihIndex* index, uint64_t query, int radius,
+                           PhashMatch* out_matches, size_t capacity, size_t* out_count) {
+    if (!index || !out_count || (capacity && !out_matches)) return PHASH_ERR_NULL_POINTER;
+    if (radius < 0) return PHASH_ERR_INVALID_ARGUMENT;
+    *out_count = mih_search(&index->layout, mih_lookup_memory, mih_entries_memory, index,
+                            index->count, active_kernels(), query, radius,
+                            out_matches, capacity);
+    return PHASH_OK;
+}
+
+typedef struct {
+    const PhashMihIndex* index;
+    const PhashKernels* kernels;
+    const uint64_t* queries;
+    size_t count;
+    int radius;
+    JoinBlock* blocks;               // One per MIH_QUERY_BLOCK queries
+} MihBatchTask;
+
+static int compare_pairs(const void* x, const void* y) {
+    const PhashPair* p = x;
+    const PhashPair* q = y;
+    return (p->b > q->b) - (p->b < q->b);
+}
+
+static void mih_participate(BatchJob* job, int self) {
+    const MihBatchTask* task = job->task;
+    PhashMatch* matches = NULL;
+    size_t capacity = 0;
+    PhashPair* found = NULL;
+    size_t found_capacity = 0;
+    uint32_t item;
+
+    while (batch_claim(job, self, &item)) {
+        const size_t block = job->base + item;
+        const size_t first = block * MIH_QUERY_BLOCK;
+        const size_t last = (task->count - first < MIH_QUERY_BLOCK) ? task->count
+                                                                     : first + MIH_QUERY_BLOCK;
+        size_t used = 0;
+        bool failed = false;
+
+        for (size_t q = first; q < last && !failed; q++) {
+            size_t n = mih_search(&task->index->layout, mih_lookup_memory, mih_entries_memory,
+                                  task->index, task->index->count, task->kernels,
+                                  task->queries[q], task->radius, matches, capacity);
+            if (n > capacity) {
+                // Rare: rerun with a buffer large enough for every match
+                PhashMatch* larger = realloc(matches, n * sizeof(PhashMatch));
+                if (!larger) {
+                    failed = true;
+                    break;
+                }
+                matches = larger;
+                capacity = n;
+                n = mih_search(&task->index->layout, mih_lookup_memory, mih_entries_memory,
+                               task->index, task->index->count, task->kernels,
+                               task->queries[q], task->radius, matches, capacity);
+            }
+            if (n == 0) continue;   // found may still be NULL
+            if (used + n > found_capacity) {
+                const size_t grown = (used + n > 2*found_capacity) ? used + n : 2*found_capacity;
+                PhashPair* larger = realloc(found, grown * sizeof(PhashPair));
+                if (!larger) {
+                    failed = true;
+                    break;
+                }
+                found = larger;
+                found_capacity = grown;
+            }
+            for (size_t k = 0; k < n; k++) {
+                found[used + k] = (PhashPair){ q, matches[k].id, matches[k].distance };
+            }
+            qsort(found + used, n, sizeof(PhashPair), compare_pairs);
+            used += n;
+        }
+
+        JoinBlock* out = &task->blocks[block];
+        out->pairs = (failed || !used) ? NULL : malloc(used * sizeof(PhashPair));
+        out->count = out->pairs ? used : 0;
+        if (out->pairs) memcpy(out->pairs, found, used * sizeof(PhashPair));
+        if (failed || (used && !out->pairs))
+            batch_record_error(job, item, PHASH_ERR_MEMORY_ALLOCATION);
+    }
+    free(found);
+    free(matches);
+}
+
+PhashError phash_mih_query_many(const PhashMihIndex* index, const uint64_t* queries,
+                                size_t count, int radius,
+                                PhashPair** out_pairs, size_t* out_count,
+                                const PhashBatchOptions* options) {
+    PhashError err;
+    int threads;
+    
+    if (!index || !out_pairs || !out_count || (count && !queries))
+        return PHASH_ERR_NULL_POINTER;
+    if (radius < 0) return PHASH_ERR_INVALID_ARGUMENT;
+    if ((err = batch_threads(options, &threads)) != PHASH_OK)
+        return err;
+    
+    *out_pairs = NULL;
+    *out_count = 0;
+    const size_t blocks = (count + MIH_QUERY_BLOCK - 1) / MIH_QUERY_BLOCK;
+    if (!blocks) return PHASH_OK;
+    
+    MihBatchTask task = {
+        .index = index, .kernels = active_kernels(), .queries = queries,
+        .count = count, .radius = radius,
+        .blocks = calloc(blocks, sizeof(JoinBlock))
+    };
+    if (!task.blocks) return PHASH_ERR_MEMORY_ALLOCATION;
+    
+    BatchJob job = { .participate = mih_participate, .task = &task };
+    err = batch_execute(&job, blocks, threads);
+    return blocks_concat(task.blocks, blocks, err, out_pairs, out_count);
+}
+
+// ---------------------------------------------------------------------------
+// Near-duplicate clustering
+//
+// Clusters are the connected components of the graph linking every pair
+// within the threshold. The hashes are put in a multi-index hashing index,
+// and each hash's neighbors are found with an MIH range query on the pool,
+// blocks of MIH_QUERY_BLOCK hashes per work item. Edges go straight into
+// a concurrent union-find: parent links always point to a lower index, a
+// union links the higher root under the lower with a CAS, and finds halve
+// paths with CAS as well. Every root is therefore the lowest index of its
+// component, whatever the order of the unions.
+// ---------------------------------------------------------------------------
+
+static size_t uf_find(_Atomic size_t* parent, size_t x) {
+    for (;;) {
+        size_t p = atomic_load_explicit(&parent[x], memory_order_relaxed);
+        if (p == x) return x;
+        const size_t grandparent = atomic_load_explicit(&parent[p], memory_order_relaxed);
+        if (grandparent != p) {
+            atomic_compare_exchange_weak_explicit(&parent[x], &p, grandparent,
+                                                  memory_order_relaxed, memory_order_relaxed);
+        }
+        x = grandparent;
+    }
+}
+
+static void uf_union(_Atomic size_t* parent, size_t a, size_t b) {
+    for (;;) {
+        a = uf_find(parent, a);
+        b = uf_find(parent, b);
+        if (a == b) return;
+        const size_t low = (a < b) ? a : b, high = (a < b) ? b : a;
+        size_t expected = high;
+        if (atomic_compare_exchange_weak_explicit(&parent[high], &expected, low,
+                                                  memory_order_relaxed, memory_order_relaxed))
+            return;
+    }
+}
 
-// DCT lookup table
 typedef struct {
-    double* coefficients;
-    size_t size;
-    bool initialized;
-} DCTLookup;
-static DCTLookup g_dct_lookup = {0};
+    const PhashMihIndex* index;
+    const PhashKernels* kernels;
+    const uint64_t* hashes;
+    size_t count;
+    int radius;
+    _Atomic size_t* parent;
+} ClusterTask;
 
-// Error messages
-static const char* ERROR_STRINGS[] = {
-    "Success",
-    "Null pointer encountered",
-    "Invalid argument value",
-    "Memory allocation failed",
-    "Unsupported operation",
-    "Domain error in mathematical function"
-};
+static void cluster_participate(BatchJob* job, int self) {
+    const ClusterTask* task = job->task;
+    PhashMatch* matches = NULL;
+    size_t capacity = 0;
+    uint32_t item;
 
-// Internal functions
-static bool is_power_of_two(int value) {
-    return (value > 0) && ((value & (value - 1)) == 0);
+    while (batch_claim(job, self, &item)) {
+        const size_t first = (job->base + item) * MIH_QUERY_BLOCK;
+        const size_t last = (task->count - first < MIH_QUERY_BLOCK) ? task->count
+                                                                     : first + MIH_QUERY_BLOCK;
+        for (size_t i = first; i < last; i++) {
+            size_t n = mih_search(&task->index->layout, mih_lookup_memory, mih_entries_memory,
+                                  task->index, task->index->count, task->kernels,
+                                  task->hashes[i], task->radius, matches, capacity);
+            if (n > capacity) {
+                PhashMatch* larger = realloc(matches, n * sizeof(PhashMatch));
+                if (!larger) {
+                    batch_record_error(job, item, PHASH_ERR_MEMORY_ALLOCATION);
+                    break;
+                }
+                matches = larger;
+                capacity = n;
+                n = mih_search(&task->index->layout, mih_lookup_memory, mih_entries_memory,
+                               task->index, task->index->count, task->kernels,
+                               task->hashes[i], task->radius, matches, capacity);
+            }
+            // Each edge is seen from both ends; the lower one links it
+            for (size_t k = 0; k < n; k++) {
+                if (matches[k].id > i) uf_union(task->parent, i, matches[k].id);
+            }
+        }
+    }
+    free(matches);
 }
 
-PhashError phash_config_validate(const PhashConfig* config) {
-    if (!config) return PHASH_ERR_NULL_POINTER;
+// Substrings of the clustering index: about 64 / log2(count), as MIH
+// prescribes, but enough that each table is probed at radius <= 1. Near
+// duplicates share substrings, so clustered data fills buckets unevenly
+// and the extra probes of radius 2 cost more than the narrower keys.
+static int cluster_substrings(size_t count, int radius) {
+    int bits = 1;
+    while (bits < 63 && ((size_t)1 << bits) < count) bits++;
+    int m = 64 / bits;
+    if (m < (radius + 2) / 2) m = (radius + 2) / 2;
+    return (m > MIH_MAX_SUBSTRINGS) ? MIH_MAX_SUBSTRINGS : m;
+}
+
+PhashError phash_cluster(const uint64_t* hashes, size_t count, int max_distance,
+                         size_t* out_labels, size_t* out_clusters,
+                         const PhashBatchOptions* options) {
+    PhashError err;
+    int threads;
     
-    if (config->dct_size < MIN_DCT_SIZE || 
-        config->dct_size > MAX_DCT_SIZE ||
-        !is_power_of_two(config->dct_size)) {
-        return PHASH_ERR_INVALID_ARGUMENT;
+    if (!out_clusters || (count && (!hashes || !out_labels))) return PHASH_ERR_NULL_POINTER;
+    if (max_distance < 0) return PHASH_ERR_INVALID_ARGUMENT;
+    if ((err = batch_threads(options, &threads)) != PHASH_OK) return err;
+    
+    PhashMihIndex* index = NULL;
+    _Atomic size_t* parent = malloc((count ? count : 1) * sizeof(*parent));
+    err = parent ? phash_mih_create(cluster_substrings(count, max_distance), &index)
+                 : PHASH_ERR_MEMORY_ALLOCATION;
+    for (size_t i = 0; err == PHASH_OK && i < count; i++) {
+        atomic_init(&parent[i], i);
+        err = phash_mih_insert(index, hashes[i], i);
     }
     
-    if (config->hash_size < 1 || 
-        config->hash_size > config->dct_size ||
-        (config->hash_size * config->hash_size) > 64) {
-        return PHASH_ERR_INVALID_ARGUMENT;
+    if (err == PHASH_OK) {
+        ClusterTask task = {
+            .index = index, .kernels = active_kernels(), .hashes = hashes,
+            .count = count, .radius = max_distance, .parent = parent
+        };
+        BatchJob job = { .participate = cluster_participate, .task = &task };
+        err = batch_execute(&job, (count + MIH_QUERY_BLOCK - 1) / MIH_QUERY_BLOCK, threads);
     }
-
-     // Validate DCT method compatibility
-    if (config->dct_method == DCT_METHOD_LOEFFLER && config->dct_size != 8) {
-        return PHASH_ERR_UNSUPPORTED_OPERATION;
+    
+    // Roots are the lowest members, so they are labeled before the rest
+    if (err == PHASH_OK) {
+        size_t clusters = 0;
+        for (size_t i = 0; i < count; i++) {
+            const size_t root = uf_find(parent, i);
+            out_labels[i] = (root == i) ? clusters++ : out_labels[root];
+        }
+        *out_clusters = clusters;
     }
     
-    if (config->dct_method == DCT_METHOD_AAN && 
-       !(config->dct_size == 8 || config->dct_size == 16 || 
-         config->dct_size == 32 || config->dct_size == 64)) {
-        return PHASH_ERR_UNSUPPORTED_OPERATION;
+    phash_mih_destroy(index);
+    free(parent);
+    return err;
+}
+
+// ---------------------------------------------------------------------------
+// k nearest neighbors
+//
+// A scan keeps a candidate set filtered by scan_within at a running
+// distance limit. Once k candidates are held, a histogram of their
+// distances (only 65 values are possible) gives the k-th distance D, and
+// the set is cut back to the k best. When hashes are visited in index
+// order, a later hash at distance D loses the tie to the held ones, so
+// the limit drops to D - 1, and the scan stops once it would be negative.
+// Multi-threaded scans visit blocks out of order and keep the limit at D.
+// ---------------------------------------------------------------------------
+
+#define KNN_CHUNK 1024                // Hashes per scan_within call
+#define KNN_BLOCK ((size_t)1 << 16)   // Hashes per work item of a threaded scan
+
+typedef struct {
+    size_t k;
+    bool in_order;                    // Hashes arrive in increasing index
+    int limit;                        // Distances above are not candidates
+    PhashMatch* held;
+    size_t count;
+    size_t capacity;
+    bool failed;                      // Out of memory
+} KnnSet;
+
+static int compare_matches(const void* x, const void* y) {
+    const PhashMatch* a = x;
+    const PhashMatch* b = y;
+    if (a->distance != b->distance) return a->distance - b->distance;
+    return (a->id > b->id) - (a->id < b->id);
+}
+
+// Cuts the set to its k best and tightens the limit
+static void knn_compact(KnnSet* set) {
+    size_t histogram[65] = { 0 };
+    for (size_t i = 0; i < set->count; i++) histogram[set->held[i].distance]++;
+    int cut = 0;
+    size_t below = 0;                 // Candidates closer than cut
+    while (below + histogram[cut] < set->k) below += histogram[cut++];
+    
+    // Keep everything closer than the k-th distance and the ties at it with
+    // the lowest ids: the first ones when in order, else found by sorting
+    size_t kept = 0, ties = 0;
+    for (size_t i = 0; i < set->count; i++) {
+        const PhashMatch m = set->held[i];
+        if (m.distance < cut || (m.distance == cut && (!set->in_order || ties++ < set->k - below)))
+            set->held[kept++] = m;
+    }
+    if (!set->in_order) qsort(set->held, kept, sizeof(PhashMatch), compare_matches);
+    set->count = set->k;
+    set->limit = set->in_order ? cut - 1 : cut;
+}
+
+// Adds hashes[0 .. count) numbered from base
+static void knn_add(KnnSet* set, const PhashKernels* kernels, uint64_t query,
+                    const uint64_t* hashes, size_t base, size_t count) {
+    size_t hits[KNN_CHUNK];
+    for (size_t offset = 0; offset < count && set->limit >= 0 && !set->failed;
+         offset += KNN_CHUNK) {
+        const size_t chunk = (count - offset < KNN_CHUNK) ? count - offset : KNN_CHUNK;
+        const size_t n = kernels->scan_within(query, hashes + offset, chunk, set->limit, hits);
+        if (set->count + n > set->capacity) {
+            const size_t grown = set->count + n + set->k + KNN_CHUNK;
+            PhashMatch* held = realloc(set->held, grown * sizeof(PhashMatch));
+            if (!held) {
+                set->failed = true;
+                return;
+            }
+            set->held = held;
+            set->capacity = grown;
+        }
+        for (size_t i = 0; i < n; i++) {
+            const uint64_t diff = query ^ hashes[offset + hits[i]];
+            set->held[set->count++] = (PhashMatch){
+                base + offset + hits[i], (int)kernels->popcount(&diff, 1)
+            };
+        }
+        if (set->count >= set->k + (set->in_order ? 0 : KNN_CHUNK)) knn_compact(set);
+    }
+}
+
+// Writes the best min(k, held) candidates of set, by distance then id
+static size_t knn_output(KnnSet* set, size_t* out_ids, uint8_t* out_distances) {
+    if (set->count == 0) return 0;   // held may be NULL
+    qsort(set->held, set->count, sizeof(PhashMatch), compare_matches);
+    const size_t n = (set->count < set->k) ? set->count : set->k;
+    for (size_t i = 0; i < n; i++) {
+        out_ids[i] = set->held[i].id;
+        if (out_distances) out_distances[i] = (uint8_t)set->held[i].distance;
     }
+    return n;
+}
+
+static PhashError knn_check(const uint64_t* hashes, size_t count, size_t k,
+                            const size_t* out_ids, const size_t* out_count) {
+    if (!out_count || (count && !hashes) || (k && !out_ids)) return PHASH_ERR_NULL_POINTER;
+    return PHASH_OK;
+}
+
+PhashError phash_knn(uint64_t query, const uint64_t* hashes, size_t count, size_t k,
+                     size_t* out_ids, uint8_t* out_distances, size_t* out_count) {
+    PhashError err;
+    if ((err = knn_check(hashes, count, k, out_ids, out_count)) != PHASH_OK) return err;
     
+    KnnSet set = { .k = k, .in_order = true, .limit = k ? 64 : -1 };
+    knn_add(&set, active_kernels(), query, hashes, 0, count);
+    if (set.failed) {
+        free(set.held);
+        return PHASH_ERR_MEMORY_ALLOCATION;
+    }
+    *out_count = knn_output(&set, out_ids, out_distances);
+    free(set.held);
     return PHASH_OK;
 }
 
-static inline double rgb_to_grayscale(unsigned char r, unsigned char g, unsigned char b,
-                                     ColorSpaceConversion method) {
-    switch (method) {
-        case COLORSPACE_AVERAGE: return (r + g + b) / 3.0;
-        case COLORSPACE_REC601: return 0.299*r + 0.587*g + 0.114*b;
-        case COLORSPACE_REC709: return 0.2126*r + 0.7152*g + 0.0722*b;
-        case COLORSPACE_REC2100: return 0.2627*r + 0.6780*g + 0.0593*b;
-        default: return 0.299*r + 0.587*g + 0.114*b;
+typedef struct {
+    uint64_t query;
+    const uint64_t* hashes;
+    size_t count;
+    const PhashKernels* kernels;
+    KnnSet sets[MAX_BATCH_THREADS];   // One per participant
+} KnnTask;
+
+static void knn_participate(BatchJob* job, int self) {
+    KnnTask* task = job->task;
+    KnnSet* set = &task->sets[self];
+    uint32_t item;
+
+    while (batch_claim(job, self, &item)) {
+        const size_t first = (job->base + item) * KNN_BLOCK;
+        const size_t n = (task->count - first < KNN_BLOCK) ? task->count - first : KNN_BLOCK;
+        knn_add(set, task->kernels, task->query, task->hashes + first, first, n);
+        if (set->failed) batch_record_error(job, item, PHASH_ERR_MEMORY_ALLOCATION);
     }
 }
 
-// SIMD-optimized bilinear interpolation
-static PhashError resize_and_grayscale(const PhashImage* img,
-                                      const PhashConfig* cfg,
-                                      double** out_matrix) {
-    const int dst_size = cfg->dct_size;
-    double* matrix = aligned_alloc(ALIGNMENT, dst_size*dst_size*sizeof(double));
-    if (!matrix) return PHASH_ERR_MEMORY_ALLOCATION;
+PhashError phash_knn_threaded(uint64_t query, const uint64_t* hashes, size_t count, size_t k,
+                              size_t* out_ids, uint8_t* out_distances, size_t* out_count,
+                              const PhashBatchOptions* options) {
+    PhashError err;
+    int threads;
+    
+    if ((err = knn_check(hashes, count, k, out_ids, out_count)) != PHASH_OK) return err;
+    if ((err = batch_threads(options, &threads)) != PHASH_OK) return err;
+    
+    KnnTask* task = calloc(1, sizeof(KnnTask));
+    if (!task) return PHASH_ERR_MEMORY_ALLOCATION;
+    *task = (KnnTask){ .query = query, .hashes = hashes, .count = count,
+                       .kernels = active_kernels() };
+    for (int t = 0; t < MAX_BATCH_THREADS; t++)
+        task->sets[t] = (KnnSet){ .k = k, .limit = k ? 64 : -1 };
+    
+    BatchJob job = { .participate = knn_participate, .task = task };
+    err = batch_execute(&job, (count + KNN_BLOCK - 1) / KNN_BLOCK, threads);
+    
+    // Merge the participants' candidates into the first set
+    KnnSet* merged = &task->sets[0];
+    for (int t = 1; err == PHASH_OK && t < MAX_BATCH_THREADS; t++) {
+        const KnnSet* set = &task->sets[t];
+        if (!set->count) continue;
+        if (merged->count + set->count > merged->capacity) {
+            PhashMatch* held = realloc(merged->held,
+                                       (merged->count + set->count) * sizeof(PhashMatch));
+            if (!held) {
+                err = PHASH_ERR_MEMORY_ALLOCATION;
+                break;
+            }
+            merged->held = held;
+            merged->capacity = merged->count + set->count;
+        }
+        memcpy(merged->held + merged->count, set->held, set->count * sizeof(PhashMatch));
+        merged->count += set->count;
+    }
+    if (err == PHASH_OK) *out_count = knn_output(merged, out_ids, out_distances);
+    
+    for (int t = 0; t < MAX_BATCH_THREADS; t++) free(task->sets[t].held);
+    free(task);
+    return err;
+}
 
-    const double x_ratio = (img->width > 1) ? 
-        (double)(img->width - 1) / (dst_size - 1) : 0.0;
-    const double y_ratio = (img->height > 1) ? 
-        (double)(img->height - 1) / (dst_size - 1) : 0.0;
+// ---------------------------------------------------------------------------
+// Index files
+//
+// Layout, every section starting at a multiple of ALIGNMENT bytes:
+//   IndexHeader
+//   hashes[count], ids[count]                      uint64
+//   MIH section (optional):
+//     IndexTable[substrings]
+//     per table: keys[key_count] (increasing), starts[key_count + 1],
+//                hashes[count], ids[count] grouped by key, in row order
+// The header records every offset, so opening checks bounds and then
+// uses the mapping in place. Bucket k of a table holds entries
+// starts[k] .. starts[k+1] - 1 and is found by binary search on keys.
+// ---------------------------------------------------------------------------
 
-    for (int y = 0; y < dst_size; y++) {
-        for (int x = 0; x < dst_size; x++) {
-            const double src_x = x * x_ratio;
-            const double src_y = y * y_ratio;
-            const int x0 = (int)src_x;
-            const int y0 = (int)src_y;
-            const int x1 = (x0 < img->width - 1) ? x0 + 1 : x0;
-            const int y1 = (y0 < img->height - 1) ? y0 + 1 : y0;
-            
-            const double dx = src_x - x0;
-            const double dy = src_y - y0;
-            const double w00 = (1.0 - dx) * (1.0 - dy);
-            const double w01 = dx * (1.0 - dy);
-            const double w10 = (1.0 - dx) * dy;
-            const double w11 = dx * dy;
-
-            const unsigned char* p = img->data;
-            const int stride = img->width * img->channels;
-            
-            // Interpolate RGB channels
-            double r = w00 * p[y0*stride + x0*img->channels] +
-                      w01 * p[y0*stride + x1*img->channels] +
-                      w10 * p[y1*stride + x0*img->channels] +
-                      w11 * p[y1*stride + x1*img->channels];
-            
-            double g = w00 * p[y0*stride + x0*img->channels + 1] +
-                      w01 * p[y0*stride + x1*img->channels + 1] +
-                      w10 * p[y1*stride + x0*img->channels + 1] +
-                      w11 * p[y1*stride + x1*img->channels + 1];
-            
-            double b = w00 * p[y0*stride + x0*img->channels + 2] +
-                      w01 * p[y0*stride + x1*img->channels + 2] +
-                      w10 * p[y1*stride + x0*img->channels + 2] +
-                      w11 * p[y1*stride + x1*img->channels + 2];
-
-            matrix[y*dst_size + x] = rgb_to_grayscale(r, g, b, cfg->colorspace);
-        }
-    }
-    
-    *out_matrix = matrix;
-    return PHASH_OK;
-}
-
-// Fast 8x8 DCT using AAN algorithm
-static void dct_8x8_aan(const double* input, double* output) {
-    double temp[64];
-    
-    // Process rows
-    for (int i = 0; i < 8; i++) {
-        const double* in = input + i*8;
-        double* t = temp + i*8;
-        
-        const double s0 = in[0] + in[7];
-        const double s1 = in[1] + in[6];
-        const double s2 = in[2] + in[5];
-        const double s3 = in[3] + in[4];
-        const double s4 = in[3] - in[4];
-        const double s5 = in[2] - in[5];
-        const double s6 = in[1] - in[6];
-        const double s7 = in[0] - in[7];
-        
-        const double t0 = s0 + s3;
-        const double t1 = s1 + s2;
-        const double t2 = s0 - s3;
-        const double t3 = s1 - s2;
-        
-        t[0] = t0 + t1;
-        t[4] = t0 - t1;
-        t[2] = t2 * 1.387039845 + t3 * 0.275899379;
-        t[6] = t3 * 1.387039845 - t2 * 0.275899379;
-        
-        const double u0 = s4 * 0.707106781;
-        const double u1 = s5 * 0.541196100;
-        const double u2 = s6 * 1.306562965;
-        const double u3 = s7 * 0.382683433;
-        
-        t[5] = u0 + u1;
-        t[3] = u2 + u3;
-        t[1] = u2 - u3;
-        t[7] = u0 - u1;
-    }
-    
-    // Process columns
-    for (int i = 0; i < 8; i++) {
-        double* col = temp + i;
-        const double s0 = col[0] + col[56];
-        const double s1 = col[8] + col[48];
-        const double s2 = col[16] + col[40];
-        const double s3 = col[24] + col[32];
-        const double s4 = col[24] - col[32];
-        const double s5 = col[16] - col[40];
-        const double s6 = col[8] - col[48];
-        const double s7 = col[0] - col[56];
-        
-        const double t0 = s0 + s3;
-        const double t1 = s1 + s2;
-        const double t2 = s0 - s3;
-        const double t3 = s1 - s2;
-        
-        col[0] = (t0 + t1) * AAN_SCALE_FACTOR;
-        col[32] = (t0 - t1) * AAN_SCALE_FACTOR;
-        col[16] = (t2 * 1.387039845 + t3 * 0.275899379) * AAN_SCALE_FACTOR;
-        col[48] = (t3 * 1.387039845 - t2 * 0.275899379) * AAN_SCALE_FACTOR;
+#define INDEX_MAGIC "PHASHIDX"
+#define INDEX_BYTE_ORDER 0x01020304u
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;             // INDEX_BYTE_ORDER as the writer stored it
+    uint64_t fingerprint;
+    uint64_t count;
+    uint64_t file_size;
+    uint64_t hashes_offset;
+    uint64_t ids_offset;
+    uint64_t mih_offset;             // 0 without MIH tables
+    uint32_t mih_substrings;
+    uint32_t reserved[5];
+} IndexHeader;                       // 88 bytes
+
+typedef struct {
+    uint64_t key_count;
+    uint64_t keys_offset;
+    uint64_t starts_offset;
+    uint64_t hashes_offset;
+    uint64_t ids_offset;
+    uint64_t reserved[3];
+} IndexTable;                        // 64 bytes
+
+// Both are the on-disk format
+_Static_assert(sizeof(IndexHeader) == 88, "IndexHeader layout changed");
+_Static_assert(sizeof(IndexTable) == 64, "IndexTable layout changed");
+
+struct PhashIndexFile {
+    const unsigned char* map;
+    size_t size;
+    const IndexHeader* header;
+    const uint64_t* hashes;
+    const uint64_t* ids;
+    MihLayout layout;                // substrings 0 without MIH tables
+    struct {
+        const uint64_t* keys;
+        const uint64_t* starts;
+        const uint64_t* hashes;
+        const uint64_t* ids;
+        size_t key_count;
+    } tables[MIH_MAX_SUBSTRINGS];
+};
+
+uint64_t phash_config_fingerprint(const PhashConfig* config) {
+    if (phash_config_validate(config) != PHASH_OK) return 0;
+    // The fixed-point pipeline ignores precision and method
+    const bool fixed = config->use_fixed_point;
+    return (uint64_t)PHASH_INDEX_VERSION << 56 |
+           (uint64_t)config->dct_size << 40 |
+           (uint64_t)config->hash_size << 32 |
+           (uint64_t)config->colorspace << 24 |
+           (uint64_t)(fixed ? 0 : config->dct_method + 1) << 16 |
+           (uint64_t)config->threshold << 8 |
+           (uint64_t)fixed << 1 |
+           (uint64_t)(!fixed && config->use_high_precision);
+}
+
+static bool index_put(FILE* f, const void* data, size_t bytes, uint64_t* offset) {
+    static const unsigned char zeros[ALIGNMENT];
+    const size_t pad = (size_t)(align_up(*offset) - *offset);
+    if (pad && fwrite(zeros, 1, pad, f) != pad) return false;
+    *offset += pad;
+    if (bytes && fwrite(data, 1, bytes, f) != bytes) return false;
+    *offset += bytes;
+    return true;
+}
+
+typedef struct {
+    uint64_t key;
+    uint64_t row;
+} IndexEntry;
+
+static int compare_index_entries(const void* x, const void* y) {
+    const IndexEntry* a = x;
+    const IndexEntry* b = y;
+    if (a->key != b->key) return (a->key > b->key) - (a->key < b->key);
+    return (a->row > b->row) - (a->row < b->row);
+}
+
+// Writes the MIH tables of hashes after *offset and fills table[]
+static PhashError index_put_mih(FILE* f, const MihLayout* layout, const uint64_t* hashes,
+                                const uint64_t* ids, size_t count, IndexTable* table,
+                                uint64_t* offset) {
+    IndexEntry* entries = malloc((count ? count : 1) * sizeof(IndexEntry));
+    uint64_t* column = malloc((count + 1) * sizeof(uint64_t));
+    PhashError err = (entries && column) ? PHASH_OK : PHASH_ERR_MEMORY_ALLOCATION;
+    
+    for (int t = 0; err == PHASH_OK && t < layout->substrings; t++) {
+        for (size_t i = 0; i < count; i++)
+            entries[i] = (IndexEntry){ mih_key(layout, t, hashes[i]), i };
+        qsort(entries, count, sizeof(IndexEntry), compare_index_entries);
         
-        const double u0 = s4 * 0.707106781;
-        const double u1 = s5 * 0.541196100;
-        const double u2 = s6 * 1.306562965;
-        const double u3 = s7 * 0.382683433;
+        // Distinct keys, then bucket starts, in place in column
+        size_t keys = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (!keys || entries[i].key != column[keys - 1]) column[keys++] = entries[i].key;
+        }
+        table[t].key_count = keys;
+        table[t].keys_offset = align_up(*offset);
+        bool ok = index_put(f, column, keys * sizeof(uint64_t), offset);
+        keys = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (!i || entries[i].key != entries[i - 1].key) column[keys++] = i;
+        }
+        column[keys] = count;
+        table[t].starts_offset = align_up(*offset);
+        ok = ok && index_put(f, column, (keys + 1) * sizeof(uint64_t), offset);
         
-        col[24] = (u0 + u1) * AAN_SCALE_FACTOR;
-        col[40] = (u2 + u3) * AAN_SCALE_FACTOR;
-        col[8] = (u2 - u3) * AAN_SCALE_FACTOR;
-        col[56] = (u0 - u1) * AAN_SCALE_FACTOR;
+        for (size_t i = 0; i < count; i++) column[i] = hashes[entries[i].row];
+        table[t].hashes_offset = align_up(*offset);
+        ok = ok && index_put(f, column, count * sizeof(uint64_t), offset);
+        for (size_t i = 0; i < count; i++)
+            column[i] = ids ? ids[entries[i].row] : entries[i].row;
+        table[t].ids_offset = align_up(*offset);
+        ok = ok && index_put(f, column, count * sizeof(uint64_t), offset);
+        if (!ok) err = PHASH_ERR_IO;
     }
     
-    // Transpose and store
-    for (int i = 0; i < 64; i++) {
-        output[i] = temp[(i%8)*8 + (i/8)];
-    }
+    free(entries);
+    free(column);
+    return err;
 }
 
-// Generic DCT using lookup table
-static void dct_generic(const double* input, double* output, int size) {
-    if (!g_dct_lookup.initialized || g_dct_lookup.size != size) {
-        free(g_dct_lookup.coefficients);
-        g_dct_lookup.coefficients = malloc(size*size*sizeof(double));
-        for (int u = 0; u < size; u++) {
-            for (int x = 0; x < size; x++) {
-                g_dct_lookup.coefficients[u*size + x] = 
-                    cos((2*x + 1)*u*M_PI/(2*size));
-            }
+PhashError phash_index_write(const char* path, const PhashConfig* config,
+                             const uint64_t* hashes, const uint64_t* ids,
+                             size_t count, int mih_substrings) {
+    PhashError err;
+    
+    if (!path || !config || (count && !hashes)) return PHASH_ERR_NULL_POINTER;
+    if ((err = phash_config_validate(config)) != PHASH_OK) return err;
+    if (config->hash_size > HASH64_SIZE ||
+        mih_substrings < 0 || mih_substrings > MIH_MAX_SUBSTRINGS)
+        return PHASH_ERR_INVALID_ARGUMENT;
+    
+    const size_t path_length = strlen(path);
+    char* temp = malloc(path_length + 5);
+    if (!temp) return PHASH_ERR_MEMORY_ALLOCATION;
+    memcpy(temp, path, path_length);
+    memcpy(temp + path_length, ".tmp", 5);
+    FILE* f = fopen(temp, "wb");
+    if (!f) {
+        free(temp);
+        return PHASH_ERR_IO;
+    }
+    
+    IndexHeader header = {
+        .version = PHASH_INDEX_VERSION,
+        .byte_order = INDEX_BYTE_ORDER,
+        .fingerprint = phash_config_fingerprint(config),
+        .count = count,
+        .mih_substrings = (uint32_t)mih_substrings
+    };
+    IndexTable tables[MIH_MAX_SUBSTRINGS] = { { 0 } };
+    uint64_t offset = 0;
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    
+    // The header and table list are rewritten once the offsets are known
+    bool ok = index_put(f, &header, sizeof(header), &offset);
+    header.hashes_offset = align_up(offset);
+    ok = ok && index_put(f, hashes, count * sizeof(uint64_t), &offset);
+    header.ids_offset = align_up(offset);
+    if (ids) {
+        ok = ok && index_put(f, ids, count * sizeof(uint64_t), &offset);
+    } else {
+        // Row numbers, generated a chunk at a time after the padding
+        uint64_t rows[MIH_SCAN_CHUNK];
+        ok = ok && index_put(f, NULL, 0, &offset);
+        for (size_t base = 0; ok && base < count; base += MIH_SCAN_CHUNK) {
+            const size_t chunk = (count - base < MIH_SCAN_CHUNK) ? count - base : MIH_SCAN_CHUNK;
+            for (size_t i = 0; i < chunk; i++) rows[i] = base + i;
+            ok = fwrite(rows, sizeof(uint64_t), chunk, f) == chunk;
+            offset += chunk * sizeof(uint64_t);
         }
-        g_dct_lookup.size = size;
-        g_dct_lookup.initialized = 1;
     }
+    err = ok ? PHASH_OK : PHASH_ERR_IO;
     
-    for (int v = 0; v < size; v++) {
-        for (int u = 0; u < size; u++) {
-            double sum = 0.0;
-            const double au = (u == 0) ? M_SQRT1_2 : 1.0;
-            const double av = (v == 0) ? M_SQRT1_2 : 1.0;
-            
-            for (int y = 0; y < size; y++) {
-                for (int x = 0; x < size; x++) {
-                    sum += input[y*size + x] * 
-                          g_dct_lookup.coefficients[u*size + x] *
-                          g_dct_lookup.coefficients[v*size + y];
-                }
-            }
-            output[v*size + u] = 0.25 * au * av * sum;
+    if (err == PHASH_OK && mih_substrings) {
+        MihLayout layout;
+        mih_layout_init(&layout, mih_substrings);
+        header.mih_offset = align_up(offset);
+        if (!index_put(f, tables, mih_substrings * sizeof(IndexTable), &offset)) {
+            err = PHASH_ERR_IO;
+        } else {
+            err = index_put_mih(f, &layout, hashes, ids, count, tables, &offset);
+        }
+    }
+    
+    if (err == PHASH_OK) {
+        header.file_size = offset;
+        ok = fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1;
+        if (ok && mih_substrings) {
+            ok = fseek(f, (long)header.mih_offset, SEEK_SET) == 0 &&
+                 fwrite(tables, sizeof(IndexTable), mih_substrings, f) == (size_t)mih_substrings;
         }
+        if (!ok) err = PHASH_ERR_IO;
     }
+    if (fclose(f) != 0 && err == PHASH_OK) err = PHASH_ERR_IO;
+    if (err == PHASH_OK && rename(temp, path) != 0) err = PHASH_ERR_IO;
+    if (err != PHASH_OK) remove(temp);
+    free(temp);
+    return err;
 }
 
+// Section of entries uint64 values at offset, if it lies in the file
+static const uint64_t* index_section(const PhashIndexFile* file, uint64_t offset,
+                                     uint64_t entries) {
+    if (offset % ALIGNMENT || offset > file->size ||
+        entries > (file->size - offset) / sizeof(uint64_t))
+        return NULL;
+    return (const uint64_t*)(file->map + offset);
+}
 
-#if defined(__aarch64__) || defined(_M_ARM64)
-
-// DCT coefficient constants
-static const double C1 = 0.98078528040323043;  // cos(1*pi/16)
-static const double C2 = 0.92387953251128674;  // cos(2*pi/16)
-static const double C3 = 0.83146961230254524;  // cos(3*pi/16)
-static const double C4 = 0.70710678118654752;  // cos(4*pi/16)
-static const double C5 = 0.55557023301960222;  // cos(5*pi/16)
-static const double C6 = 0.38268343236508977;  // cos(6*pi/16)
-static const double C7 = 0.19509032201612825;  // cos(7*pi/16)
-
-static void dct_8x8_neon(const double* input, double* output) {
-    float64x2_t rows[8], cols[8];
-    float64x2_t temp[8];
+static PhashError index_map(PhashIndexFile* file, const PhashConfig* config) {
+    const IndexHeader* h = (const IndexHeader*)file->map;
+    if (file->size < sizeof(IndexHeader) || memcmp(h->magic, INDEX_MAGIC, 8) != 0 ||
+        h->version != PHASH_INDEX_VERSION || h->byte_order != INDEX_BYTE_ORDER ||
+        h->file_size != file->size || h->mih_substrings > MIH_MAX_SUBSTRINGS)
+        return PHASH_ERR_FORMAT;
+    if (config && h->fingerprint != phash_config_fingerprint(config))
+        return PHASH_ERR_FORMAT;
+    
+    file->header = h;
+    file->hashes = index_section(file, h->hashes_offset, h->count);
+    file->ids = index_section(file, h->ids_offset, h->count);
+    if (!file->hashes || !file->ids) return PHASH_ERR_FORMAT;
     
-    // Load input rows
-    for (int i = 0; i < 8; i++) {
-        rows[i] = vld1q_f64(&input[i * 8]);
+    if (!h->mih_substrings) return PHASH_OK;
+    const uint64_t* list = index_section(file, h->mih_offset,
+                                         h->mih_substrings * sizeof(IndexTable) / sizeof(uint64_t));
+    if (!list) return PHASH_ERR_FORMAT;
+    const IndexTable* tables = (const IndexTable*)list;
+    mih_layout_init(&file->layout, (int)h->mih_substrings);
+    for (int t = 0; t < file->layout.substrings; t++) {
+        const IndexTable* table = &tables[t];
+        if (table->key_count > h->count) return PHASH_ERR_FORMAT;
+        file->tables[t].key_count = (size_t)table->key_count;
+        file->tables[t].keys = index_section(file, table->keys_offset, table->key_count);
+        file->tables[t].starts = index_section(file, table->starts_offset, table->key_count + 1);
+        file->tables[t].hashes = index_section(file, table->hashes_offset, h->count);
+        file->tables[t].ids = index_section(file, table->ids_offset, h->count);
+        if (!file->tables[t].keys || !file->tables[t].starts ||
+            !file->tables[t].hashes || !file->tables[t].ids)
+            return PHASH_ERR_FORMAT;
     }
+    return PHASH_OK;
+}
+
+PhashError phash_index_open(const char* path, const PhashConfig* config,
+                            PhashIndexFile** out_file) {
+    if (!path || !out_file) return PHASH_ERR_NULL_POINTER;
     
-    // 1D DCT on rows
-    for (int i = 0; i < 8; i++) {
-        // Stage 1: Initial butterfly
-        float64x2_t sum = vaddq_f64(rows[i], rows[7-i]);
-        float64x2_t diff = vsubq_f64(rows[i], rows[7-i]);
-        
-        // Stage 2: Apply DCT coefficients
-        float64x2_t term1 = vmulq_n_f64(sum, C4);
-        float64x2_t term2 = vmulq_n_f64(diff, C4);
-        
-        // Additional terms for different frequencies
-        float64x2_t term3 = vmulq_n_f64(vaddq_f64(
-            vmulq_n_f64(rows[i], C1),
-            vmulq_n_f64(rows[7-i], C7)
-        ), 0.5);
-        
-        float64x2_t term4 = vmulq_n_f64(vaddq_f64(
-            vmulq_n_f64(rows[i], C3),
-            vmulq_n_f64(rows[7-i], C5)
-        ), 0.5);
-        
-        float64x2_t term5 = vmulq_n_f64(vaddq_f64(
-            vmulq_n_f64(rows[i], C5),
-            vmulq_n_f64(rows[7-i], C3)
-        ), 0.5);
-        
-        float64x2_t term6 = vmulq_n_f64(vaddq_f64(
-            vmulq_n_f64(rows[i], C7),
-            vmulq_n_f64(rows[7-i], C1)
-        ), 0.5);
-        
-        // Combine terms
-        temp[i] = vaddq_f64(term1, term3);
-        temp[7-i] = vaddq_f64(term2, term4);
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) return PHASH_ERR_IO;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return PHASH_ERR_IO;
+    }
+    if ((uint64_t)st.st_size < sizeof(IndexHeader)) {
+        close(fd);
+        return PHASH_ERR_FORMAT;
     }
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);   // The mapping keeps the file open
+    if (map == MAP_FAILED) return PHASH_ERR_IO;
     
-    // Transpose the matrix
-    for (int i = 0; i < 8; i++) {
-        cols[i] = temp[i];
+    PhashIndexFile* file = calloc(1, sizeof(PhashIndexFile));
+    if (!file) {
+        munmap(map, (size_t)st.st_size);
+        return PHASH_ERR_MEMORY_ALLOCATION;
     }
+    file->map = map;
+    file->size = (size_t)st.st_size;
     
-    // 1D DCT on columns
-    for (int i = 0; i < 8; i++) {
-        // Similar process as rows
-        float64x2_t sum = vaddq_f64(cols[i], cols[7-i]);
-        float64x2_t diff = vsubq_f64(cols[i], cols[7-i]);
-        
-        float64x2_t term1 = vmulq_n_f64(sum, C4);
-        float64x2_t term2 = vmulq_n_f64(diff, C4);
-        
-        float64x2_t term3 = vmulq_n_f64(vaddq_f64(
-            vmulq_n_f64(cols[i], C1),
-            vmulq_n_f64(cols[7-i], C7)
-        ), 0.5);
-        
-        float64x2_t term4 = vmulq_n_f64(vaddq_f64(
-            vmulq_n_f64(cols[i], C3),
-            vmulq_n_f64(cols[7-i], C5)
-        ), 0.5);
-        
-        float64x2_t term5 = vmulq_n_f64(vaddq_f64(
-            vmulq_n_f64(cols[i], C5),
-            vmulq_n_f64(cols[7-i], C3)
-        ), 0.5);
-        
-        float64x2_t term6 = vmulq_n_f64(vaddq_f64(
-            vmulq_n_f64(cols[i], C7),
-            vmulq_n_f64(cols[7-i], C1)
-        ), 0.5);
-        
-        // Scale and store final results
-        float64x2_t result = vmulq_n_f64(
-            vaddq_f64(vaddq_f64(term1, term3), vaddq_f64(term4, term6)),
-            1.0 / 8.0
-        );
-        vst1q_f64(&output[i * 8], result);
+    PhashError err = index_map(file, config);
+    if (err != PHASH_OK) {
+        phash_index_close(file);
+        return err;
     }
+    *out_file = file;
+    return PHASH_OK;
 }
 
-// Helper function to perform full 8x8 DCT
-void dct_transform_8x8(const double input[64], double output[64]) {
-    dct_8x8_neon(input, output);
-    
-    // Apply normalization factors
-    const double norm_factor = sqrt(1.0 / 8.0);
-    for (int i = 0; i < 64; i++) {
-        output[i] *= norm_factor;
+void phash_index_close(PhashIndexFile* file) {
+    if (file) {
+        munmap((void*)file->map, file->size);
+        free(file);
     }
 }
 
-#endif // __aarch64__ || _M_ARM64
+size_t phash_index_count(const PhashIndexFile* file) {
+    return file ? (size_t)file->header->count : 0;
+}
 
-static PhashError compute_dct(const double* input, double* output,
-                             const PhashConfig* cfg) {
-#if defined(__x86_64__) || defined(_M_X64)
-    if (cfg->dct_size == 8 && cfg->dct_method == DCT_METHOD_AAN) {
-        dct_8x8_aan(input, output);
-    } else {
-        dct_generic(input, output, cfg->dct_size);
+uint64_t phash_index_fingerprint(const PhashIndexFile* file) {
+    return file ? file->header->fingerprint : 0;
+}
+
+const uint64_t* phash_index_hashes(const PhashIndexFile* file) {
+    return file ? file->hashes : NULL;
+}
+
+const uint64_t* phash_index_ids(const PhashIndexFile* file) {
+    return file ? file->ids : NULL;
+}
+
+static bool mih_lookup_file(const void* source, int t, uint64_t key, MihView* view) {
+    const PhashIndexFile* file = source;
+    const uint64_t* keys = file->tables[t].keys;
+    size_t low = 0, high = file->tables[t].key_count;
+    while (low < high) {
+        const size_t mid = low + (high - low) / 2;
+        if (keys[mid] < key) low = mid + 1;
+        else high = mid;
     }
-#elif defined(__aarch64__) || defined(_M_ARM64)
-    if (cfg->dct_size == 8) {
-        dct_8x8_neon(input, output);
-    } else {
-        dct_generic(input, output, cfg->dct_size);
+    if (low == file->tables[t].key_count || keys[low] != key) return false;
+    
+    // Bounds are checked here rather than at open, which reads no tables
+    const uint64_t begin = file->tables[t].starts[low], end = file->tables[t].starts[low + 1];
+    if (begin > end || end > file->header->count) return false;
+    *view = (MihView){ file->tables[t].hashes + begin, file->tables[t].ids + begin,
+                       (size_t)(end - begin) };
+    return true;
+}
+
+// The whole hash column as one run, for the scan fallback of mih_search
+static bool mih_entries_file(const void* source, size_t* cursor, MihView* view) {
+    const PhashIndexFile* file = source;
+    if (*cursor) return false;
+    *cursor = 1;
+    *view = (MihView){ file->hashes, file->ids, (size_t)file->header->count };
+    return true;
+}
+
+PhashError phash_index_query(const PhashIndexFile* file, uint64_t query, int radius,
+                             PhashMatch* out_matches, size_t capacity, size_t* out_count) {
+    if (!file || !out_count || (capacity && !out_matches)) return PHASH_ERR_NULL_POINTER;
+    if (radius < 0) return PHASH_ERR_INVALID_ARGUMENT;
+    
+    const PhashKernels* kernels = active_kernels();
+    if (file->layout.substrings) {
+        // mih_substrings comes from the file: the fallback bounds any value
+        *out_count = mih_search(&file->layout, mih_lookup_file, mih_entries_file, file,
+                                (size_t)file->header->count, kernels, query, radius,
+                                out_matches, capacity);
+        return PHASH_OK;
     }
-#endif
+    
+    // No tables: scan the hash column in chunks
+    const size_t count = (size_t)file->header->count;
+    size_t hits[MIH_SCAN_CHUNK], found = 0;
+    for (size_t base = 0; base < count; base += MIH_SCAN_CHUNK) {
+        const size_t chunk = (count - base < MIH_SCAN_CHUNK) ? count - base : MIH_SCAN_CHUNK;
+        const size_t n = kernels->scan_within(query, file->hashes + base, chunk, radius, hits);
+        for (size_t k = 0; k < n; k++, found++) {
+            if (found >= capacity) continue;
+            const uint64_t diff = query ^ file->hashes[base + hits[k]];
+            out_matches[found] = (PhashMatch){
+                (size_t)file->ids[base + hits[k]], (int)kernels->popcount(&diff, 1)
+            };
+        }
+    }
+    *out_count = found;
     return PHASH_OK;
 }
 
-// Public API implementation
-PhashError phash_compute(const PhashImage* image,
-                        const PhashConfig* config,
-                        uint64_t* out_hash) {
+PhashError phash_dct(const PhashConfig* config,
+                    const double* input,
+                    double* output) {
     PhashError err;
-    double *grayscale = NULL, *dct_matrix = NULL;
     
-    if (!image || !config || !out_hash) 
+    if (!config || !input || !output)
         return PHASH_ERR_NULL_POINTER;
     
     if ((err = phash_config_validate(config)) != PHASH_OK)
         return err;
     
-    if ((err = resize_and_grayscale(image, config, &grayscale)) != PHASH_OK)
-        return err;
+    if (config->use_fixed_point)
+        return PHASH_ERR_UNSUPPORTED_OPERATION;
     
-    dct_matrix = aligned_alloc(ALIGNMENT, config->dct_size*config->dct_size*sizeof(double));
-    if (!dct_matrix) {
-        free(grayscale);
-        return PHASH_ERR_MEMORY_ALLOCATION;
-    }
+    const int size = config->dct_size, keep = config->hash_size;
+    const int stride = dct_output_size(config);
+    const PhashKernels* kernels = kernels_for(config);
     
-    if ((err = compute_dct(grayscale, dct_matrix, config)) != PHASH_OK) {
-        free(grayscale);
-        free(dct_matrix);
-        return err;
+    // Scratch basis of the naive method, large enough for either precision
+    double* naive_basis = NULL;
+    if (config->dct_method == DCT_METHOD_NAIVE) {
+        naive_basis = malloc(2*size*size*sizeof(double));
+        if (!naive_basis) return PHASH_ERR_MEMORY_ALLOCATION;
     }
     
-    // Compute hash
-    const int hash_size = config->hash_size;
-    const int dct_size = config->dct_size;
-    double avg = 0.0;
-    int count = 0;
-    
-    for (int y = 0; y < hash_size; y++) {
-        for (int x = 0; x < hash_size; x++) {
-            if (x == 0 && y == 0) continue;
-            avg += dct_matrix[y*dct_size + x];
-            count++;
+    if (use_single_precision(config)) {
+        float input_f[MAX_DCT_SIZE * MAX_DCT_SIZE];
+        float coeffs[MAX_DCT_SIZE * MAX_DCT_SIZE];
+        for (int i = 0; i < size*size; i++) input_f[i] = (float)input[i];
+        err = compute_dct_f(input_f, coeffs, config, kernels, (float*)naive_basis);
+        for (int v = 0; err == PHASH_OK && v < keep; v++) {
+            for (int u = 0; u < keep; u++) output[v*keep + u] = coeffs[v*stride + u];
         }
-    }
-    
-    if (count == 0) {
-        free(grayscale);
-        free(dct_matrix);
-        return PHASH_ERR_DOMAIN;
-    }
-    
-    avg /= count;
-    uint64_t hash = 0;
-    int bit_pos = 0;
-    
-    for (int y = 0; y < hash_size; y++) {
-        for (int x = 0; x < hash_size; x++) {
-            if (x == 0 && y == 0) continue;
-            if (dct_matrix[y*dct_size + x] > avg)
-                hash |= 1ULL << bit_pos;
-            bit_pos++;
+    } else {
+        double coeffs[MAX_DCT_SIZE * MAX_DCT_SIZE];
+        err = compute_dct(input, coeffs, config, kernels, naive_basis);
+        for (int v = 0; err == PHASH_OK && v < keep; v++) {
+            memcpy(output + v*keep, coeffs + v*stride, keep*sizeof(double));
         }
     }
     
-    free(grayscale);
-    free(dct_matrix);
-    *out_hash = hash;
-    return PHASH_OK;
+    free(naive_basis);
+    return err;
 }
 
 // Remaining API functions
 PhashError phash_compare(uint64_t hash_a, uint64_t hash_b, int* out_distance) {
     if (!out_distance) return PHASH_ERR_NULL_POINTER;
-    *out_distance = __builtin_popcountll(hash_a ^ hash_b);
+    const uint64_t diff = hash_a ^ hash_b;
+    *out_distance = (int)active_kernels()->popcount(&diff, 1);
+    return PHASH_OK;
+}
+
+PhashError phash_compare_many(uint64_t query, const uint64_t* hashes, size_t count,
+                              uint8_t* out_distances) {
+    if (count && (!hashes || !out_distances)) return PHASH_ERR_NULL_POINTER;
+    active_kernels()->distances(query, hashes, count, out_distances);
+    return PHASH_OK;
+}
+
+PhashError phash_compare_many_masked(uint64_t query, uint64_t query_mask,
+                                     const uint64_t* hashes, const uint64_t* masks,
+                                     size_t count, uint8_t* out_distances) {
+    if (count && (!hashes || !masks || !out_distances)) return PHASH_ERR_NULL_POINTER;
+    active_kernels()->distances_masked(query, query_mask, hashes, masks, count, out_distances);
+    return PHASH_OK;
+}
+
+// Sum over the differing bits of the lower of their two levels: the bits
+// at or above level L in both hashes are counted once for each L
+PhashError phash_compare_weighted(uint64_t hash_a, const PhashMargins* margins_a,
+                                  uint64_t hash_b, const PhashMargins* margins_b,
+                                  int* out_distance) {
+    if (!margins_a || !margins_b || !out_distance) return PHASH_ERR_NULL_POINTER;
+    if (margins_a->bits != margins_b->bits || margins_a->bits < PHASH_MARGIN_MIN_BITS ||
+        margins_a->bits > PHASH_MARGIN_MAX_BITS)
+        return PHASH_ERR_INVALID_ARGUMENT;
+    
+    const uint64_t diff = hash_a ^ hash_b;
+    int distance = 0;
+    for (int level = 1; level < (1 << margins_a->bits); level++) {
+        const uint64_t both = diff & margin_mask(margins_a, level) & margin_mask(margins_b, level);
+        if (!both) break;   // Masks only shrink as the level rises
+        distance += __builtin_popcountll(both);
+    }
+    *out_distance = distance;
+    return PHASH_OK;
+}
+
+PhashError phash_scan_within(uint64_t query, const uint64_t* hashes, size_t count,
+                             int max_distance, size_t* out_indices, size_t* out_count) {
+    if (!out_count || (count && (!hashes || !out_indices))) return PHASH_ERR_NULL_POINTER;
+    if (max_distance < 0) return PHASH_ERR_INVALID_ARGUMENT;
+    *out_count = active_kernels()->scan_within(query, hashes, count, max_distance,
+                                               out_indices);
+    return PHASH_OK;
+}
+
+static bool wide_words_valid(int words) {
+    return words >= 1 && words <= PHASH_MAX_HASH_WORDS;
+}
+
+PhashError phash_compare_wide(const PhashHash* hash_a, const PhashHash* hash_b,
+                              int* out_distance) {
+    if (!hash_a || !hash_b || !out_distance) return PHASH_ERR_NULL_POINTER;
+    if (!wide_words_valid(hash_a->word_count) || hash_a->word_count != hash_b->word_count)
+        return PHASH_ERR_INVALID_ARGUMENT;
+    uint16_t distance;
+    active_kernels()->distances_wide(hash_a->words, hash_b->words, 1, hash_a->word_count,
+                                     &distance);
+    *out_distance = distance;
+    return PHASH_OK;
+}
+
+PhashError phash_compare_many_wide(const PhashHash* query, const uint64_t* hashes,
+                                   size_t count, uint16_t* out_distances) {
+    if (!query || (count && (!hashes || !out_distances))) return PHASH_ERR_NULL_POINTER;
+    if (!wide_words_valid(query->word_count)) return PHASH_ERR_INVALID_ARGUMENT;
+    active_kernels()->distances_wide(query->words, hashes, count, query->word_count,
+                                     out_distances);
+    return PHASH_OK;
+}
+
+// Distances of a chunk at a time, filtered branch-free as in
+// scan_within_scalar
+PhashError phash_scan_within_wide(const PhashHash* query, const uint64_t* hashes,
+                                  size_t count, int max_distance,
+                                  size_t* out_indices, size_t* out_count) {
+    if (!query || !out_count || (count && (!hashes || !out_indices)))
+        return PHASH_ERR_NULL_POINTER;
+    if (max_distance < 0 || !wide_words_valid(query->word_count))
+        return PHASH_ERR_INVALID_ARGUMENT;
+    
+    const PhashKernels* kernels = active_kernels();
+    const int words = query->word_count;
+    uint16_t distances[WIDE_SCAN_CHUNK];
+    size_t found = 0;
+    for (size_t base = 0; base < count; base += WIDE_SCAN_CHUNK) {
+        const size_t n = (count - base < WIDE_SCAN_CHUNK) ? count - base : WIDE_SCAN_CHUNK;
+        kernels->distances_wide(query->words, hashes + base*words, n, words, distances);
+        for (size_t i = 0; i < n; i++) {
+            out_indices[found] = base + i;
+            found += (distances[i] <= max_distance);
+        }
+    }
+    *out_count = found;
     return PHASH_OK;
 }
 
@@ -490,7 +6352,7 @@ void phash_image_destroy(PhashImage* image) {
 }
 
 const char* phash_error_string(PhashError error) {
-    if (error < 0 || error > PHASH_ERR_DOMAIN) return "Unknown error";
+    if (error < 0 || error > PHASH_ERR_FORMAT) return "Unknown error";
     return ERROR_STRINGS[error];
 }
 
@@ -499,26 +6361,33 @@ PhashConfig phash_config_default(void) {
         .dct_size = 32,
         .hash_size = 8,
         .use_high_precision = 0,
+        .use_fixed_point = 0,
         .enable_simd = 1,
         .colorspace = COLORSPACE_REC709,
-        .dct_method = DCT_METHOD_AUTO
+        .dct_method = DCT_METHOD_AUTO,
+        .threshold = THRESHOLD_MEAN
     };
 }
 
 PhashError phash_initialize(void) {
-#if defined(__x86_64__) || defined(_M_X64)
-    g_avx2_enabled = 1;
-    g_sse4_enabled = 1;
-#elif defined(__aarch64__) || defined(_M_ARM64)
-    // ARM NEON is always available on Apple M1
-    g_avx2_enabled = 0;
-    g_sse4_enabled = 0;
-#endif
+    detect_kernels();
+    return PHASH_OK;
+}
+
+PhashSimdLevel phash_simd_level(void) {
+    return active_kernels()->level;
+}
+
+PhashError phash_set_simd_level(PhashSimdLevel level) {
+    const PhashKernels* kernels = kernels_for_level(level);
+    if (!kernels) return PHASH_ERR_UNSUPPORTED_OPERATION;
+    atomic_store_explicit(&g_kernels, kernels, memory_order_relaxed);
     return PHASH_OK;
 }
 
 void phash_terminate(void) {
-    free(g_dct_lookup.coefficients);
-    g_dct_lookup = (DCTLookup){0};
+    // Basis tables are static and stay valid for later calls; the batch
+    // pool restarts on the next phash_compute_batch
+    pool_shutdown();
 }
 
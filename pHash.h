@@ -24,7 +24,9 @@ typedef enum {
     PHASH_ERR_INVALID_ARGUMENT,
     PHASH_ERR_MEMORY_ALLOCATION,
     PHASH_ERR_UNSUPPORTED_OPERATION,
-    PHASH_ERR_DOMAIN
+    PHASH_ERR_DOMAIN,
+    PHASH_ERR_IO,                 // A file could not be opened, read or written
+    PHASH_ERR_FORMAT              // A file is not a valid or compatible index
 } PhashError;
 
 typedef enum {
@@ -43,14 +45,41 @@ typedef enum {
     DCT_METHOD_AAN        // Arai-Agui-Nakajima (8/16/32/64 sizes)
 } DCTMethod;
 
+// What each AC coefficient is compared against. The median sets half of
+// the bits (exactly count / 2 of count distinct coefficients), which keeps
+// the substrings of multi-index hashing evenly filled.
+typedef enum {
+    THRESHOLD_MEAN,       // Mean of the AC coefficients (classic pHash)
+    THRESHOLD_MEDIAN      // Lower median, by linear-time selection
+} ThresholdMode;
+
+typedef enum {
+    PHASH_SIMD_NONE,      // Portable scalar kernels
+    PHASH_SIMD_SSE42,     // x86-64 SSE4.2 + POPCNT
+    PHASH_SIMD_AVX2,      // x86-64 AVX2
+    PHASH_SIMD_AVX512,    // x86-64 AVX-512 F/BW (+ VPOPCNTDQ when present)
+    PHASH_SIMD_NEON       // AArch64 Advanced SIMD
+} PhashSimdLevel;
+
 // Configuration parameters
 typedef struct {
     int dct_size;          // Must be power of 2 between 8 and 64
-    int hash_size;         // Must be <= dct_size (typical 8-32)
-    bool use_high_precision; // Use double precision for calculations
+    int hash_size;         // Must be <= dct_size and <= 32 (typical 8-32);
+                           // above 8 only the _wide functions apply
+    bool use_high_precision; // Use double precision for calculations. When
+                             // false, resize, DCT and threshold run in float
+                             // for every method; hashes then differ from
+                             // double by at most 2 bits on the test corpus,
+                             // under 1 bit per 16 hashes on average
+    bool use_fixed_point;  // Integer pipeline with specified rounding: hashes
+                           // are bit-identical on every architecture and
+                           // SIMD level. Overrides use_high_precision and
+                           // dct_method
     bool enable_simd;      // Allow SIMD optimizations when available
     ColorSpaceConversion colorspace;
     DCTMethod dct_method;
+    ThresholdMode threshold; // Hashes differ between modes, and so do
+                             // config fingerprints
 } PhashConfig;
 
 // Image representation
@@ -62,15 +91,460 @@ typedef struct {
     bool owns_memory;     // If true, data will be freed on destruction
 } PhashImage;
 
-// Core functions
+// Core functions. These and the utility and configuration functions are
+// reentrant: any number of threads may call them at once. Functions
+// returning uint64_t hashes need hash_size <= 8 and return
+// PHASH_ERR_INVALID_ARGUMENT for wider configs.
 PhashError phash_compute(const PhashImage* image, 
                         const PhashConfig* config,
                         uint64_t* out_hash);
 
+// phash_compute with caller-provided scratch memory: workspace must hold
+// phash_workspace_size(config) bytes (any alignment) and may be reused
+// across calls, but not by two calls at once. With a workspace the call
+// performs no heap allocation. workspace may be NULL, in which case
+// scratch is allocated per call as in phash_compute.
+PhashError phash_compute_ws(const PhashImage* image,
+                           const PhashConfig* config,
+                           void* workspace,
+                           uint64_t* out_hash);
+
+// Workspace bytes phash_compute_ws needs for config; 0 if it needs none
+// (the default AUTO method and the fixed-point pipeline) or config is
+// invalid
+size_t phash_workspace_size(const PhashConfig* config);
+
 PhashError phash_compare(uint64_t hash_a, 
                         uint64_t hash_b,
                         int* out_distance);
 
+// Hamming distances from query to each of count hashes, as phash_compare
+// gives them (0..64), into out_distances[count]
+PhashError phash_compare_many(uint64_t query,
+                             const uint64_t* hashes,
+                             size_t count,
+                             uint8_t* out_distances);
+
+// Indices of the hashes within max_distance (>= 0) of query, in increasing
+// order. out_indices must have room for count entries; *out_count receives
+// the number of matches
+PhashError phash_scan_within(uint64_t query,
+                            const uint64_t* hashes,
+                            size_t count,
+                            int max_distance,
+                            size_t* out_indices,
+                            size_t* out_count);
+
+// Hamming distances over the bits set in both query_mask and masks[i]:
+// out_distances[i] = popcount((query ^ hashes[i]) & query_mask & masks[i]).
+// With masks from phash_margin_mask this ignores the unstable bits of
+// either side.
+PhashError phash_compare_many_masked(uint64_t query,
+                                    uint64_t query_mask,
+                                    const uint64_t* hashes,
+                                    const uint64_t* masks,
+                                    size_t count,
+                                    uint8_t* out_distances);
+
+// Several hash families from one resize and grayscale pass, for cascades
+// of filters. The image is resized once to the dct_size x dct_size grid of
+// config; bits are numbered row-major over 8x8 blocks of that grid.
+typedef struct {
+    uint64_t phash;   // DCT hash, as phash_compute with config
+    uint64_t ahash;   // Average hash: 8x8 block means above their mean
+    uint64_t dhash;   // Difference hash: over 9x8 block means, set where a
+                      // block is brighter than the one to its left
+    uint64_t whash;   // Wavelet hash: 63 AC coefficients of the 2D Haar
+                      // transform of the 8x8 block means, above their median
+} PhashMultiHash;
+
+// phash is that of phash_compute for every config. The fused AUTO pipeline
+// never forms the grid; it is interpolated from the pixels that pipeline
+// converts, as the resize pipelines would. Needs hash_size <= 8.
+PhashError phash_compute_multi(const PhashImage* image,
+                              const PhashConfig* config,
+                              PhashMultiHash* out_hashes);
+
+// phash_compute_multi with caller-provided scratch memory of
+// phash_multi_workspace_size(config) bytes, as in phash_compute_ws. The
+// multi-hash also keeps the grid, so this is more than
+// phash_workspace_size and is never 0 for a valid config.
+PhashError phash_compute_multi_ws(const PhashImage* image,
+                                 const PhashConfig* config,
+                                 void* workspace,
+                                 PhashMultiHash* out_hashes);
+
+size_t phash_multi_workspace_size(const PhashConfig* config);
+
+// Hashes of the eight flips and rotations of the image from one resize and
+// DCT pass. out_hashes[t] is the hash of the image transposed if t & 4,
+// then flipped left to right if t & 1 and top to bottom if t & 2, so 0 is
+// the image itself (as phash_compute), 3 is its 180 degree rotation and 5
+// and 6 its 90 degree clockwise and counterclockwise rotations. The hashes
+// match those of the transformed images up to near-threshold bits where
+// resampling is not exactly symmetric. Needs hash_size <= 8.
+PhashError phash_compute_dihedral(const PhashImage* image,
+                                 const PhashConfig* config,
+                                 uint64_t out_hashes[8]);
+
+// phash_compute_dihedral with a workspace of phash_workspace_size(config)
+// bytes, as in phash_compute_ws
+PhashError phash_compute_dihedral_ws(const PhashImage* image,
+                                    const PhashConfig* config,
+                                    void* workspace,
+                                    uint64_t out_hashes[8]);
+
+// Smallest of the eight phash_compute_dihedral hashes: one hash for an
+// image and all of its flips and rotations
+PhashError phash_compute_canonical(const PhashImage* image,
+                                  const PhashConfig* config,
+                                  uint64_t* out_hash);
+
+// Per-bit confidence of a hash: the margin |c - t| of each bit's
+// coefficient from the threshold, in units of the mean margin over the
+// hash, quantized to levels 0..2^bits - 1 of 2^-(bits - 1) units each.
+// Level 0 bits are the ones likely to flip under re-encoding or resizing.
+// The level of hash bit i is bit i of planes[0] (least significant) ..
+// planes[bits - 1].
+#define PHASH_MARGIN_MIN_BITS 2
+#define PHASH_MARGIN_MAX_BITS 4
+
+typedef struct {
+    uint64_t planes[PHASH_MARGIN_MAX_BITS];   // Unused planes are 0
+    int bits;                                 // PHASH_MARGIN_MIN_BITS..MAX_BITS
+} PhashMargins;
+
+// phash_compute plus the margins of its bits, quantized to margin_bits
+// bits. Needs hash_size <= 8.
+PhashError phash_compute_margins(const PhashImage* image,
+                                const PhashConfig* config,
+                                int margin_bits,
+                                uint64_t* out_hash,
+                                PhashMargins* out_margins);
+
+// phash_compute_margins with a workspace of phash_workspace_size(config)
+// bytes, as in phash_compute_ws
+PhashError phash_compute_margins_ws(const PhashImage* image,
+                                   const PhashConfig* config,
+                                   int margin_bits,
+                                   void* workspace,
+                                   uint64_t* out_hash,
+                                   PhashMargins* out_margins);
+
+// Hash bits whose level is at least min_level (all bits for min_level <= 0,
+// none for an invalid margins or a level above the highest)
+uint64_t phash_margin_mask(const PhashMargins* margins, int min_level);
+
+// Confidence-weighted distance: each differing bit counts the lower of its
+// levels in the two hashes, so bits that are unstable on either side count
+// nothing. The margins must have the same bits.
+PhashError phash_compare_weighted(uint64_t hash_a,
+                                 const PhashMargins* margins_a,
+                                 uint64_t hash_b,
+                                 const PhashMargins* margins_b,
+                                 int* out_distance);
+
+// DCT stage of phash_compute on a dct_size x dct_size grayscale matrix
+// (row-major), with the method, precision and SIMD setting of config.
+// Writes the hash_size x hash_size low-frequency block the hash is taken
+// from, row-major. Not available for the fixed-point pipeline.
+PhashError phash_dct(const PhashConfig* config,
+                    const double* input,
+                    double* output);
+
+// Hashing plans: the config, image geometry, sampling grid, DCT bases and
+// kernels resolved once (using the SIMD level active at creation) and
+// reused for every image of that size. Executing a plan gives the same
+// hash as phash_compute; a plan is read-only and may be executed from
+// several threads at once.
+typedef struct PhashPlan PhashPlan;
+
+PhashError phash_plan_create(const PhashConfig* config,
+                            int width, int height, int channels,
+                            PhashPlan** out_plan);
+
+// pixels: width x height pixels of channels bytes, rows packed as in
+// PhashImage
+PhashError phash_plan_execute(const PhashPlan* plan,
+                             const unsigned char* pixels,
+                             uint64_t* out_hash);
+
+// Hashes count images of the plan's geometry into out_hashes, with the
+// same results as phash_plan_execute on each. For the single-precision
+// AUTO pipeline (the default config) at the AVX2 and AVX-512 levels, 16
+// images at a time are gathered into structure-of-arrays form and resized
+// and transformed together, one image per SIMD lane; other pipelines and
+// levels hash the images one by one.
+PhashError phash_plan_execute_many(const PhashPlan* plan,
+                                  const unsigned char* const* pixels,
+                                  size_t count,
+                                  uint64_t* out_hashes);
+
+// phash_plan_execute with a workspace, as in phash_compute_ws, of
+// phash_workspace_size(config) bytes for the config the plan was made with
+PhashError phash_plan_execute_ws(const PhashPlan* plan,
+                                const unsigned char* pixels,
+                                void* workspace,
+                                uint64_t* out_hash);
+
+void phash_plan_destroy(PhashPlan* plan);
+
+// Batch hashing on a library-owned work-stealing thread pool, started on
+// first use and stopped by phash_terminate. out_hashes[i] is the hash of
+// images[i] (0 if it failed) whatever the scheduling. Returns PHASH_OK if
+// every image hashed, otherwise the error of the lowest failing index.
+typedef struct {
+    int num_threads;      // Threads including the caller; 0 = one per online CPU
+    PhashError* errors;   // Optional: per-image result, count entries
+} PhashBatchOptions;
+
+// options may be NULL for the defaults. Concurrent batches from several
+// threads are run one after another.
+PhashError phash_compute_batch(const PhashImage* const* images, size_t count,
+                              const PhashConfig* config, uint64_t* out_hashes,
+                              const PhashBatchOptions* options);
+
+// Hashes wider than 64 bits: a hash_size x hash_size block has
+// hash_size^2 - 1 AC coefficients, one bit each, so hash_size 16 gives 255
+// bits and 32 gives 1023. Wide configs hash through the resize (or
+// fixed-point) pipeline rather than the fused one.
+#define PHASH_MAX_HASH_BITS 1024
+#define PHASH_MAX_HASH_WORDS (PHASH_MAX_HASH_BITS / 64)
+
+typedef struct {
+    uint64_t words[PHASH_MAX_HASH_WORDS]; // Bit i in words[i / 64]
+    int word_count;                       // Words in use; the rest are 0
+} PhashHash;
+
+// 64-bit words per hash of config: 1 for hash_size <= 8, then
+// (hash_size^2 - 1 + 63) / 64; 0 if config is invalid
+int phash_hash_words(const PhashConfig* config);
+
+// Hash of any width allowed by config. For hash_size <= 8, words[0] is
+// the hash phash_compute gives.
+PhashError phash_compute_wide(const PhashImage* image,
+                             const PhashConfig* config,
+                             PhashHash* out_hash);
+
+PhashError phash_plan_execute_wide(const PhashPlan* plan,
+                                  const unsigned char* pixels,
+                                  PhashHash* out_hash);
+
+// The _wide functions with a workspace of phash_workspace_size(config)
+// bytes, as in phash_compute_ws
+PhashError phash_compute_wide_ws(const PhashImage* image,
+                                const PhashConfig* config,
+                                void* workspace,
+                                PhashHash* out_hash);
+
+PhashError phash_plan_execute_wide_ws(const PhashPlan* plan,
+                                     const unsigned char* pixels,
+                                     void* workspace,
+                                     PhashHash* out_hash);
+
+// phash_compute_batch for hashes of any width: out_hashes holds count rows
+// of phash_hash_words(config) words, row i being words of image i (all
+// zero if it failed)
+PhashError phash_compute_batch_wide(const PhashImage* const* images, size_t count,
+                                   const PhashConfig* config, uint64_t* out_hashes,
+                                   const PhashBatchOptions* options);
+
+// Hamming distance of two hashes of the same word_count;
+// PHASH_ERR_INVALID_ARGUMENT if they differ
+PhashError phash_compare_wide(const PhashHash* hash_a,
+                             const PhashHash* hash_b,
+                             int* out_distance);
+
+// phash_compare_many and phash_scan_within for wide hashes: hashes holds
+// count rows of query->word_count words, as phash_compute_batch_wide
+// writes them
+PhashError phash_compare_many_wide(const PhashHash* query,
+                                  const uint64_t* hashes,
+                                  size_t count,
+                                  uint16_t* out_distances);
+
+PhashError phash_scan_within_wide(const PhashHash* query,
+                                 const uint64_t* hashes,
+                                 size_t count,
+                                 int max_distance,
+                                 size_t* out_indices,
+                                 size_t* out_count);
+
+// All-pairs distances and threshold joins. Both run blocked for cache
+// reuse on the batch thread pool; options are those of
+// phash_compute_batch (errors is not used).
+//
+// A pair of hashes found within a distance threshold
+typedef struct {
+    size_t a;             // Index in the first (or only) set
+    size_t b;             // Index in the second set; > a in a self-join
+    int distance;
+} PhashPair;
+
+// Dense count_a x count_b distance matrix, row-major:
+// out_matrix[i*count_b + j] is the distance of a[i] and b[j]. Pass the
+// same array twice for all pairs of one set.
+PhashError phash_distance_matrix(const uint64_t* a, size_t count_a,
+                                 const uint64_t* b, size_t count_b,
+                                 uint8_t* out_matrix,
+                                 const PhashBatchOptions* options);
+
+// Every pair i < j of hashes within max_distance (>= 0), sorted by (a, b).
+// *out_pairs is allocated by the library (NULL when there are none) and
+// released with phash_pairs_free.
+PhashError phash_pairs_within(const uint64_t* hashes, size_t count, int max_distance,
+                              PhashPair** out_pairs, size_t* out_count,
+                              const PhashBatchOptions* options);
+
+// Threshold join of two sets: every (i, j) with a[i] and b[j] within
+// max_distance, sorted by (a, b), returned as in phash_pairs_within
+PhashError phash_join_within(const uint64_t* a, size_t count_a,
+                             const uint64_t* b, size_t count_b,
+                             int max_distance,
+                             PhashPair** out_pairs, size_t* out_count,
+                             const PhashBatchOptions* options);
+
+void phash_pairs_free(PhashPair* pairs);
+
+// The k hashes closest to query: their indices and distances, by
+// increasing distance and then index, into out_ids[k] and
+// out_distances[k] (which may be NULL). *out_count receives min(k, count).
+// Scans with a distance limit that tightens as neighbors are found.
+PhashError phash_knn(uint64_t query, const uint64_t* hashes, size_t count, size_t k,
+                     size_t* out_ids, uint8_t* out_distances, size_t* out_count);
+
+// phash_knn on the batch thread pool, for large counts; same results
+PhashError phash_knn_threaded(uint64_t query, const uint64_t* hashes, size_t count, size_t k,
+                              size_t* out_ids, uint8_t* out_distances, size_t* out_count,
+                              const PhashBatchOptions* options);
+
+// BK-tree over 64-bit hashes for Hamming range and nearest-neighbor
+// queries. Nodes are allocated from one growing arena. Queries may run
+// concurrently with each other, but not with insert.
+typedef struct PhashBkTree PhashBkTree;
+
+// A stored hash found by a query: its id and distance to the query
+typedef struct {
+    size_t id;
+    int distance;
+} PhashMatch;
+
+PhashError phash_bktree_create(PhashBkTree** out_tree);
+
+// Adds hash under a caller-chosen id; duplicates of hash or id are kept
+PhashError phash_bktree_insert(PhashBkTree* tree, uint64_t hash, size_t id);
+
+size_t phash_bktree_size(const PhashBkTree* tree);
+
+// Rewrites the arena in breadth-first order so that the children of every
+// node are adjacent, which speeds up queries several times on large trees.
+// Worth calling after bulk inserts; later inserts keep working.
+PhashError phash_bktree_optimize(PhashBkTree* tree);
+
+// Every stored hash within radius (>= 0) of query, in no particular order.
+// *out_count receives the number of matches; the first capacity of them
+// are written to out_matches.
+PhashError phash_bktree_query(const PhashBkTree* tree, uint64_t query, int radius,
+                              PhashMatch* out_matches, size_t capacity,
+                              size_t* out_count);
+
+// The stored hash closest to query, the lowest id among ties;
+// PHASH_ERR_INVALID_ARGUMENT if the tree is empty
+PhashError phash_bktree_nearest(const PhashBkTree* tree, uint64_t query,
+                                PhashMatch* out_match);
+
+void phash_bktree_destroy(PhashBkTree* tree);
+
+// Multi-index hashing (MIH) for range queries on large hash sets: each
+// hash is split into substrings, each indexing its own table, and a query
+// probes only the keys near its own substrings. Queries take time
+// sub-linear in the number of stored hashes for small radii. Queries may
+// run concurrently with each other, but not with insert or remove.
+typedef struct PhashMihIndex PhashMihIndex;
+
+// substrings: number of tables, 1..16; 0 picks 4 (16-bit substrings).
+// Around 64 / log2(stored hashes) is best. Fewer substrings mean wider
+// keys: emptier buckets, but many more keys to probe per table as the
+// radius grows. More substrings mean fuller buckets and fewer probes. A
+// query whose probes would outnumber the stored hashes verifies every
+// stored hash instead, so no query costs more than a linear scan.
+PhashError phash_mih_create(int substrings, PhashMihIndex** out_index);
+
+// Adds hash under a caller-chosen id; duplicates are kept
+PhashError phash_mih_insert(PhashMihIndex* index, uint64_t hash, size_t id);
+
+// Removes one entry inserted as (hash, id); PHASH_ERR_INVALID_ARGUMENT if
+// there is none
+PhashError phash_mih_remove(PhashMihIndex* index, uint64_t hash, size_t id);
+
+size_t phash_mih_size(const PhashMihIndex* index);
+
+// Every stored hash within radius (>= 0) of query, as in
+// phash_bktree_query
+PhashError phash_mih_query(const PhashMihIndex* index, uint64_t query, int radius,
+                           PhashMatch* out_matches, size_t capacity, size_t* out_count);
+
+// Range queries for count queries on the batch thread pool. Pairs hold
+// the query index in a and the stored id in b, sorted by (a, b), and are
+// returned as in phash_pairs_within.
+PhashError phash_mih_query_many(const PhashMihIndex* index, const uint64_t* queries,
+                                size_t count, int radius,
+                                PhashPair** out_pairs, size_t* out_count,
+                                const PhashBatchOptions* options);
+
+void phash_mih_destroy(PhashMihIndex* index);
+
+// Groups hashes into near-duplicate clusters: the connected components of
+// the graph linking every pair within max_distance (>= 0). out_labels[i]
+// is the cluster of hashes[i]; clusters are numbered 0, 1, ... in order of
+// their first member and *out_clusters receives how many there are.
+// Neighbors are found through a multi-index hashing index and merged with
+// a concurrent union-find on the batch thread pool.
+PhashError phash_cluster(const uint64_t* hashes, size_t count, int max_distance,
+                         size_t* out_labels, size_t* out_clusters,
+                         const PhashBatchOptions* options);
+
+// On-disk hash index: a header (format version, config fingerprint,
+// count) followed by 64-byte-aligned columns of hashes and ids and,
+// optionally, prebuilt multi-index hashing tables. Files are in the
+// byte order of the machine that wrote them. Opening maps the file
+// read-only without parsing it, so several processes share one copy in
+// the page cache.
+#define PHASH_INDEX_VERSION 1
+
+typedef struct PhashIndexFile PhashIndexFile;
+
+// Identifies the hashes a config produces: configs with equal
+// fingerprints hash identically. 0 for an invalid config.
+uint64_t phash_config_fingerprint(const PhashConfig* config);
+
+// Writes count hashes with their ids (NULL: ids are 0..count-1) computed
+// with config. mih_substrings > 0 also stores MIH tables for that many
+// substrings (as in phash_mih_create). The file is written next to path
+// and renamed over it, so readers never see a partial index.
+PhashError phash_index_write(const char* path, const PhashConfig* config,
+                             const uint64_t* hashes, const uint64_t* ids,
+                             size_t count, int mih_substrings);
+
+// Maps an index file. With config non-NULL, a file written for another
+// fingerprint is rejected with PHASH_ERR_FORMAT.
+PhashError phash_index_open(const char* path, const PhashConfig* config,
+                            PhashIndexFile** out_file);
+
+size_t phash_index_count(const PhashIndexFile* file);
+uint64_t phash_index_fingerprint(const PhashIndexFile* file);
+// Columns of the mapped file, count entries each, 64-byte aligned
+const uint64_t* phash_index_hashes(const PhashIndexFile* file);
+const uint64_t* phash_index_ids(const PhashIndexFile* file);
+
+// Stored hashes within radius (>= 0) of query, as in phash_bktree_query
+// with the stored ids; uses the MIH tables when the file has them and a
+// SIMD scan otherwise. May run from several threads at once.
+PhashError phash_index_query(const PhashIndexFile* file, uint64_t query, int radius,
+                             PhashMatch* out_matches, size_t capacity, size_t* out_count);
+
+void phash_index_close(PhashIndexFile* file);
+
 // Utility functions
 PhashError phash_image_create(const unsigned char* data,
                              int width, int height, int channels,
@@ -85,9 +559,20 @@ PhashError phash_config_validate(const PhashConfig* config);
 PhashConfig phash_config_default(void);
 
 // Library initialization/cleanup
+// phash_initialize detects the CPU features and selects the best kernels;
+// until it is called only the scalar kernels are used. Call it once before
+// starting threads that compute hashes. phash_terminate stops the batch
+// thread pool and must not run concurrently with other calls.
 PhashError phash_initialize(void);
 void phash_terminate(void);
 
+// Runtime kernel dispatch. Kernels of every level produce identical hashes;
+// PhashConfig.enable_simd = false forces the scalar kernels per call.
+PhashSimdLevel phash_simd_level(void);
+// Restricts dispatch to a level this CPU supports (e.g. for testing or
+// benchmarking); PHASH_ERR_UNSUPPORTED_OPERATION otherwise
+PhashError phash_set_simd_level(PhashSimdLevel level);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <stdio.h>
+#include <pthread.h>
 #define STB_IMAGE_IMPLEMENTATION
 #include "pHash.h"
 
@@ -9,6 +10,26 @@ static unsigned char test_image_data[] = {
     0, 0, 0,      255, 255, 255, 128, 128, 128 // More pixels
 };
 
+// Deterministic synthetic RGB pattern used by the regression tests
+static void fill_pattern(unsigned char* data, int width, int height, int seed) {
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            unsigned char* p = data + (y*width + x)*3;
+            p[0] = (unsigned char)((x*seed + y*3) & 0xFF);
+            p[1] = (unsigned char)(((x ^ y)*(seed + 1)) & 0xFF);
+            p[2] = (unsigned char)((x*y + seed*17) & 0xFF);
+        }
+    }
+}
+
+// xorshift64 step of the randomized tests
+static uint64_t next_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
 void test_initialization() {
     PhashError err = phash_initialize();
     assert(err == PHASH_OK);
@@ -66,6 +87,1234 @@ void test_hash_computation() {
     printf("✓ Hash computation test passed\n");
 }
 
+void test_dct_sizes() {
+    // Reference hashes produced by the original O(n^4) lookup-table DCT
+    static const uint64_t expected[] = {
+        0x7DC692FB18B19836ULL, 0x4FEFB2F743B1F836ULL,
+        0x3DFF86F7C6B17836ULL, 0x3FFF87F7C7B1F836ULL
+    };
+    static unsigned char pattern[97 * 61 * 3];
+    PhashImage* img = NULL;
+    
+    fill_pattern(pattern, 97, 61, 5);
+    PhashError err = phash_image_create(pattern, 97, 61, 3, 0, &img);
+    assert(err == PHASH_OK);
+    
+    for (int i = 0; i < 4; i++) {
+        PhashConfig config = phash_config_default();
+        config.dct_size = 8 << i;
+        config.dct_method = DCT_METHOD_LOOKUP;
+        config.use_high_precision = 1;
+        
+        uint64_t hash;
+        err = phash_compute(img, &config, &hash);
+        assert(err == PHASH_OK);
+        assert(hash == expected[i]);
+    }
+    
+    phash_image_destroy(img);
+    printf("✓ DCT size test passed\n");
+}
+
+void test_truncated_dct() {
+    static unsigned char pattern[97 * 61 * 3];
+    PhashImage* img = NULL;
+    
+    fill_pattern(pattern, 97, 61, 11);
+    PhashError err = phash_image_create(pattern, 97, 61, 3, 0, &img);
+    assert(err == PHASH_OK);
+    
+    // The lookup method only computes the hash_size x hash_size block but
+    // must agree bit for bit with the full generic transform
+    for (int size = 8; size <= 64; size *= 2) {
+        for (int hash_size = 2; hash_size <= 8; hash_size++) {
+            PhashConfig config = phash_config_default();
+            config.dct_size = size;
+            config.hash_size = hash_size;
+            config.use_high_precision = 1;
+            
+            uint64_t full, truncated;
+            config.dct_method = DCT_METHOD_NAIVE;
+            err = phash_compute(img, &config, &full);
+            assert(err == PHASH_OK);
+            config.dct_method = DCT_METHOD_LOOKUP;
+            err = phash_compute(img, &config, &truncated);
+            assert(err == PHASH_OK);
+            assert(full == truncated);
+        }
+    }
+    
+    phash_image_destroy(img);
+    printf("✓ Truncated DCT test passed\n");
+}
+
+void test_dct_methods() {
+    static unsigned char pattern[97 * 61 * 3];
+    PhashImage* img = NULL;
+    
+    fill_pattern(pattern, 97, 61, 7);
+    PhashError err = phash_image_create(pattern, 97, 61, 3, 0, &img);
+    assert(err == PHASH_OK);
+    
+    // Every fast factorization must reproduce the lookup-table hash
+    for (int size = 8; size <= 64; size *= 2) {
+        PhashConfig config = phash_config_default();
+        config.dct_size = size;
+        config.use_high_precision = 1;
+        
+        uint64_t reference, hash;
+        config.dct_method = DCT_METHOD_LOOKUP;
+        err = phash_compute(img, &config, &reference);
+        assert(err == PHASH_OK);
+        
+        config.dct_method = DCT_METHOD_AAN;
+        err = phash_compute(img, &config, &hash);
+        assert(err == PHASH_OK);
+        assert(hash == reference);
+        
+        config.dct_method = DCT_METHOD_LOEFFLER;
+        err = phash_compute(img, &config, &hash);
+        if (size == 8) {
+            assert(err == PHASH_OK);
+            assert(hash == reference);
+        } else {
+            assert(err == PHASH_ERR_UNSUPPORTED_OPERATION);
+        }
+    }
+    
+    phash_image_destroy(img);
+    printf("✓ DCT method test passed\n");
+}
+
+void test_dct_reference() {
+    static double input[64 * 64], output[64 * 64], reference[64 * 64];
+    static const DCTMethod methods[] = {
+        DCT_METHOD_AUTO, DCT_METHOD_NAIVE, DCT_METHOD_LOOKUP,
+        DCT_METHOD_AAN, DCT_METHOD_LOEFFLER
+    };
+    const PhashSimdLevel detected = phash_simd_level();
+    PhashError err;
+    
+    for (int size = 8; size <= 64; size *= 2) {
+        for (int i = 0; i < size * size; i++) {
+            input[i] = (double)((i * 7919 + size * 31) % 256);
+        }
+        
+        // Direct O(n^4) transform with the library's 0.25 * a(u) * a(v) scaling
+        double peak = 0.0;
+        for (int v = 0; v < size; v++) {
+            for (int u = 0; u < size; u++) {
+                double sum = 0.0;
+                for (int y = 0; y < size; y++) {
+                    for (int x = 0; x < size; x++) {
+                        sum += input[y * size + x] *
+                               cos((2 * x + 1) * u * M_PI / (2.0 * size)) *
+                               cos((2 * y + 1) * v * M_PI / (2.0 * size));
+                    }
+                }
+                double au = u ? 1.0 : M_SQRT1_2;
+                double av = v ? 1.0 : M_SQRT1_2;
+                reference[v * size + u] = 0.25 * au * av * sum;
+                if (fabs(reference[v * size + u]) > peak) {
+                    peak = fabs(reference[v * size + u]);
+                }
+            }
+        }
+        
+        // Every level, method and precision must match within rounding
+        for (int level = PHASH_SIMD_NONE; level <= PHASH_SIMD_NEON; level++) {
+            if (phash_set_simd_level((PhashSimdLevel)level) != PHASH_OK) continue;
+            
+            for (int m = 0; m < 5; m++) {
+                for (int high = 0; high <= 1; high++) {
+                    PhashConfig config = phash_config_default();
+                    config.dct_size = size;
+                    config.hash_size = 8;
+                    config.dct_method = methods[m];
+                    config.use_high_precision = high;
+                    
+                    err = phash_dct(&config, input, output);
+                    if (methods[m] == DCT_METHOD_LOEFFLER && size != 8) {
+                        assert(err == PHASH_ERR_UNSUPPORTED_OPERATION);
+                        continue;
+                    }
+                    assert(err == PHASH_OK);
+                    
+                    const double tolerance = peak * (high ? 1e-12 : 1e-5);
+                    for (int v = 0; v < 8; v++) {
+                        for (int u = 0; u < 8; u++) {
+                            double diff = output[v * 8 + u] - reference[v * size + u];
+                            assert(fabs(diff) <= tolerance);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    
+    PhashConfig config = phash_config_default();
+    config.use_fixed_point = 1;
+    err = phash_dct(&config, input, output);
+    assert(err == PHASH_ERR_UNSUPPORTED_OPERATION);
+    err = phash_dct(NULL, input, output);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    
+    err = phash_set_simd_level(detected);
+    assert(err == PHASH_OK);
+    printf("✓ DCT reference test passed\n");
+}
+
+void test_fused_projection() {
+    static unsigned char pattern[160 * 120 * 3];
+    static const int dims[][2] = { {160, 120}, {97, 61}, {33, 47}, {5, 3} };
+    
+    // The fused projection interpolates exactly, while the resize path
+    // truncates interpolated channels to integers, so hashes may differ in
+    // a couple of near-threshold bits
+    for (int i = 0; i < 4; i++) {
+        PhashImage* img = NULL;
+        fill_pattern(pattern, dims[i][0], dims[i][1], 3 + i);
+        PhashError err = phash_image_create(pattern, dims[i][0], dims[i][1], 3, 0, &img);
+        assert(err == PHASH_OK);
+        
+        for (int size = 8; size <= 64; size *= 2) {
+            PhashConfig config = phash_config_default();
+            config.dct_size = size;
+            config.use_high_precision = 1;
+            
+            uint64_t fused, reference;
+            int distance;
+            config.dct_method = DCT_METHOD_LOOKUP;
+            err = phash_compute(img, &config, &reference);
+            assert(err == PHASH_OK);
+            config.dct_method = DCT_METHOD_AUTO;
+            err = phash_compute(img, &config, &fused);
+            assert(err == PHASH_OK);
+            phash_compare(fused, reference, &distance);
+            assert(distance <= 2);
+        }
+        phash_image_destroy(img);
+    }
+    
+    printf("✓ Fused projection test passed\n");
+}
+
+void test_simd_dispatch() {
+    static unsigned char pattern[131 * 77 * 3];
+    static const DCTMethod methods[] = {
+        DCT_METHOD_AUTO, DCT_METHOD_NAIVE, DCT_METHOD_LOOKUP, DCT_METHOD_AAN
+    };
+    const PhashSimdLevel detected = phash_simd_level();
+    PhashImage* img = NULL;
+    
+    fill_pattern(pattern, 131, 77, 9);
+    PhashError err = phash_image_create(pattern, 131, 77, 3, 0, &img);
+    assert(err == PHASH_OK);
+    
+    // Every level this CPU supports must reproduce the scalar hashes
+    for (int level = PHASH_SIMD_NONE; level <= PHASH_SIMD_NEON; level++) {
+        if (phash_set_simd_level((PhashSimdLevel)level) != PHASH_OK) continue;
+        
+        for (int m = 0; m < 4; m++) {
+            for (int cs = COLORSPACE_LUMINOSITY; cs <= COLORSPACE_REC2100; cs++) {
+                PhashConfig config = phash_config_default();
+                config.dct_method = methods[m];
+                config.colorspace = (ColorSpaceConversion)cs;
+                
+                // Single, double and fixed-point pipelines
+                for (int mode = 0; mode < 3; mode++) {
+                    uint64_t scalar, simd;
+                    config.use_high_precision = (mode == 1);
+                    config.use_fixed_point = (mode == 2);
+                    config.enable_simd = 0;
+                    err = phash_compute(img, &config, &scalar);
+                    assert(err == PHASH_OK);
+                    config.enable_simd = 1;
+                    err = phash_compute(img, &config, &simd);
+                    assert(err == PHASH_OK);
+                    assert(scalar == simd);
+                }
+            }
+        }
+        
+        int distance;
+        err = phash_compare(0x0123456789ABCDEFULL, 0xFEDCBA9876543210ULL, &distance);
+        assert(err == PHASH_OK);
+        assert(distance == 64);
+    }
+    
+    err = phash_set_simd_level(detected);
+    assert(err == PHASH_OK);
+    phash_image_destroy(img);
+    printf("✓ SIMD dispatch test passed\n");
+}
+
+void test_single_precision() {
+    static unsigned char pattern[320 * 200 * 3];
+    static const int dims[][2] = { {320, 200}, {160, 120}, {97, 61}, {64, 64}, {33, 47}, {5, 3} };
+    static const DCTMethod methods[] = {
+        DCT_METHOD_AUTO, DCT_METHOD_LOOKUP, DCT_METHOD_NAIVE, DCT_METHOD_AAN,
+        DCT_METHOD_LOEFFLER
+    };
+    int hashes = 0, differing_bits = 0;
+    
+    // The float pipeline may flip coefficients that sit within rounding
+    // error of the mean. Over this corpus at most 2 bits of a hash differ
+    // from the double pipeline, and fewer than 1 bit per 16 hashes on
+    // average (the bound documented in pHash.h).
+    for (int i = 0; i < 6; i++) {
+        for (int seed = 1; seed <= 4; seed++) {
+            PhashImage* img = NULL;
+            fill_pattern(pattern, dims[i][0], dims[i][1], seed);
+            PhashError err = phash_image_create(pattern, dims[i][0], dims[i][1], 3, 0, &img);
+            assert(err == PHASH_OK);
+            
+            for (int m = 0; m < 5; m++) {
+                for (int size = 8; size <= 64; size *= 2) {
+                    PhashConfig config = phash_config_default();
+                    config.dct_method = methods[m];
+                    config.dct_size = size;
+                    if (methods[m] == DCT_METHOD_LOEFFLER && size != 8) continue;
+                    
+                    uint64_t single, wide;
+                    int distance;
+                    config.use_high_precision = 0;
+                    err = phash_compute(img, &config, &single);
+                    assert(err == PHASH_OK);
+                    config.use_high_precision = 1;
+                    err = phash_compute(img, &config, &wide);
+                    assert(err == PHASH_OK);
+                    phash_compare(single, wide, &distance);
+                    assert(distance <= 2);
+                    differing_bits += distance;
+                    hashes++;
+                }
+            }
+            phash_image_destroy(img);
+        }
+    }
+    assert(differing_bits * 16 < hashes);
+    
+    printf("✓ Single precision test passed\n");
+}
+
+void test_fixed_point() {
+    static unsigned char pattern[320 * 200 * 4];
+    static const uint64_t expected[] = {
+        0x7DC692FB18B19836ULL, 0x4FEFB2F743B1F836ULL,
+        0x3DFF86F7C6B17836ULL, 0x3FFF87F7C7B1F836ULL
+    };
+    static const int dims[][2] = { {320, 200}, {97, 61}, {64, 64}, {33, 47}, {5, 3}, {1, 1} };
+    PhashImage* img = NULL;
+    PhashError err;
+    
+    // Pinned hashes: the integer pipeline must reproduce them on every
+    // architecture and SIMD level
+    fill_pattern(pattern, 97, 61, 5);
+    err = phash_image_create(pattern, 97, 61, 3, 0, &img);
+    assert(err == PHASH_OK);
+    for (int i = 0, size = 8; size <= 64; i++, size *= 2) {
+        PhashConfig config = phash_config_default();
+        config.dct_size = size;
+        config.use_fixed_point = 1;
+        
+        uint64_t hash;
+        err = phash_compute(img, &config, &hash);
+        assert(err == PHASH_OK);
+        assert(hash == expected[i]);
+    }
+    phash_image_destroy(img);
+    
+    // Close to the double pipeline, with or without an alpha channel (the
+    // 3-channel buffers end exactly at the last pixel)
+    for (int i = 0; i < 6; i++) {
+        for (int channels = 3; channels <= 4; channels++) {
+            const int w = dims[i][0], h = dims[i][1];
+            fill_pattern(pattern, w, h, 7 + i);
+            if (channels == 4) {
+                for (int p = w*h - 1; p >= 0; p--) {
+                    memmove(pattern + p*4, pattern + p*3, 3);
+                    pattern[p*4 + 3] = 255;
+                }
+            }
+            unsigned char* data = malloc((size_t)w*h*channels);
+            assert(data != NULL);
+            memcpy(data, pattern, (size_t)w*h*channels);
+            err = phash_image_create(data, w, h, channels, 0, &img);
+            assert(err == PHASH_OK);
+            
+            for (int size = 8; size <= 64; size *= 2) {
+                PhashConfig config = phash_config_default();
+                config.dct_size = size;
+                config.dct_method = DCT_METHOD_LOOKUP;
+                
+                uint64_t fixed, wide;
+                int distance;
+                config.use_fixed_point = 1;
+                err = phash_compute(img, &config, &fixed);
+                assert(err == PHASH_OK);
+                config.use_fixed_point = 0;
+                config.use_high_precision = 1;
+                err = phash_compute(img, &config, &wide);
+                assert(err == PHASH_OK);
+                phash_compare(fixed, wide, &distance);
+                // A flat image has exactly zero AC coefficients in integer
+                // arithmetic, while the double ones are rounding noise
+                if (w*h == 1) assert(fixed == 0);
+                else assert(distance <= 3);
+            }
+            phash_image_destroy(img);
+            free(data);
+        }
+    }
+    
+    printf("✓ Fixed-point test passed\n");
+}
+
+// Worker for test_concurrent_compute: hashes every config in turn, so
+// consecutive calls alternate between DCT sizes, and records the results
+typedef struct {
+    const PhashImage* image;
+    const PhashConfig* configs;
+    int count;
+    uint64_t hashes[64];
+} ConcurrentJob;
+
+static void* concurrent_worker(void* arg) {
+    ConcurrentJob* job = arg;
+    for (int round = 0; round < 20; round++) {
+        for (int i = 0; i < job->count; i++) {
+            uint64_t hash;
+            if (phash_compute(job->image, &job->configs[i], &hash) != PHASH_OK) {
+                hash = 0;
+            }
+            if (round == 0) job->hashes[i] = hash;
+            else if (job->hashes[i] != hash) job->hashes[i] = ~0ULL;
+        }
+    }
+    return NULL;
+}
+
+void test_concurrent_compute() {
+    static unsigned char pattern[113 * 71 * 3];
+    static const DCTMethod methods[] = {
+        DCT_METHOD_AUTO, DCT_METHOD_LOOKUP, DCT_METHOD_AAN
+    };
+    PhashConfig configs[64];
+    uint64_t expected[64];
+    PhashImage* img = NULL;
+    int count = 0;
+    
+    fill_pattern(pattern, 113, 71, 11);
+    PhashError err = phash_image_create(pattern, 113, 71, 3, 0, &img);
+    assert(err == PHASH_OK);
+    
+    for (int mode = 0; mode < 3; mode++) {
+        for (int m = 0; m < 3; m++) {
+            for (int size = 8; size <= 64; size *= 2) {
+                PhashConfig config = phash_config_default();
+                config.dct_size = size;
+                config.dct_method = methods[m];
+                config.use_high_precision = (mode == 1);
+                config.use_fixed_point = (mode == 2);
+                err = phash_compute(img, &config, &expected[count]);
+                assert(err == PHASH_OK);
+                configs[count++] = config;
+            }
+        }
+    }
+    
+    // Threads sharing the basis tables must reproduce the serial hashes
+    pthread_t threads[4];
+    ConcurrentJob jobs[4];
+    for (int t = 0; t < 4; t++) {
+        jobs[t].image = img;
+        jobs[t].configs = configs;
+        jobs[t].count = count;
+        const int created = pthread_create(&threads[t], NULL, concurrent_worker, &jobs[t]);
+        assert(created == 0);
+    }
+    for (int t = 0; t < 4; t++) {
+        const int joined = pthread_join(threads[t], NULL);
+        assert(joined == 0);
+        for (int i = 0; i < count; i++) {
+            assert(jobs[t].hashes[i] == expected[i]);
+        }
+    }
+    
+    phash_image_destroy(img);
+    printf("✓ Concurrent compute test passed\n");
+}
+
+void test_plan() {
+    static unsigned char frames[3][160 * 90 * 4];
+    static const DCTMethod methods[] = {
+        DCT_METHOD_AUTO, DCT_METHOD_NAIVE, DCT_METHOD_LOOKUP, DCT_METHOD_AAN
+    };
+    static const int dims[][3] = { {160, 90, 3}, {160, 90, 4}, {7, 130, 3}, {1, 1, 4} };
+    PhashError err;
+    
+    // Pattern bytes for 160 x 90 pixels of up to 4 channels
+    for (int f = 0; f < 3; f++) fill_pattern(frames[f], 160, 120, 20 + f);
+    
+    // A plan reused across frames must reproduce phash_compute on each
+    for (int d = 0; d < 4; d++) {
+        const int width = dims[d][0], height = dims[d][1], channels = dims[d][2];
+        for (int m = 0; m < 4; m++) {
+            for (int mode = 0; mode < 3; mode++) {
+                PhashConfig config = phash_config_default();
+                config.dct_method = methods[m];
+                config.dct_size = (m == 3) ? 16 : 32;
+                config.use_high_precision = (mode == 1);
+                config.use_fixed_point = (mode == 2);
+                
+                PhashPlan* plan = NULL;
+                err = phash_plan_create(&config, width, height, channels, &plan);
+                assert(err == PHASH_OK);
+                
+                for (int f = 0; f < 3; f++) {
+                    PhashImage* img = NULL;
+                    uint64_t expected, hash;
+                    err = phash_image_create(frames[f], width, height, channels, 0, &img);
+                    assert(err == PHASH_OK);
+                    err = phash_compute(img, &config, &expected);
+                    assert(err == PHASH_OK);
+                    err = phash_plan_execute(plan, frames[f], &hash);
+                    assert(err == PHASH_OK);
+                    assert(hash == expected);
+                    phash_image_destroy(img);
+                }
+                phash_plan_destroy(plan);
+            }
+        }
+    }
+    
+    // Invalid configs and geometries are rejected at creation
+    PhashConfig config = phash_config_default();
+    PhashPlan* plan = NULL;
+    uint64_t hash;
+    err = phash_plan_create(NULL, 16, 16, 3, &plan);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_plan_create(&config, 16, 16, 3, NULL);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_plan_create(&config, 0, 16, 3, &plan);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    err = phash_plan_create(&config, 16, 16, 1, &plan);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    config.dct_size = 12;
+    err = phash_plan_create(&config, 16, 16, 3, &plan);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    
+    config = phash_config_default();
+    err = phash_plan_create(&config, 16, 16, 3, &plan);
+    assert(err == PHASH_OK);
+    err = phash_plan_execute(plan, NULL, &hash);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_plan_execute(NULL, frames[0], &hash);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    phash_plan_destroy(plan);
+    phash_plan_destroy(NULL);
+    
+    printf("✓ Plan test passed\n");
+}
+
+void test_workspace() {
+    static unsigned char pattern[120 * 80 * 3];
+    static unsigned char workspace[1 << 18];
+    static const DCTMethod methods[] = {
+        DCT_METHOD_AUTO, DCT_METHOD_NAIVE, DCT_METHOD_LOOKUP, DCT_METHOD_AAN
+    };
+    PhashImage* img = NULL;
+    PhashError err;
+    
+    fill_pattern(pattern, 120, 80, 13);
+    err = phash_image_create(pattern, 120, 80, 3, 0, &img);
+    assert(err == PHASH_OK);
+    
+    for (int size = 8; size <= 64; size *= 2) {
+        for (int m = 0; m < 4; m++) {
+            for (int mode = 0; mode < 3; mode++) {
+                PhashConfig config = phash_config_default();
+                config.dct_size = size;
+                config.dct_method = methods[m];
+                config.use_high_precision = (mode == 1);
+                config.use_fixed_point = (mode == 2);
+                
+                const size_t bytes = phash_workspace_size(&config);
+                if (methods[m] == DCT_METHOD_AUTO || mode == 2) assert(bytes == 0);
+                else assert(bytes > 0 && bytes + 64 < sizeof(workspace));
+                
+                // Misaligned, dirty workspace with a guard band behind it
+                unsigned char* ws = workspace + 3;
+                memset(workspace, 0xCD, sizeof(workspace));
+                
+                uint64_t expected, hash;
+                err = phash_compute(img, &config, &expected);
+                assert(err == PHASH_OK);
+                err = phash_compute_ws(img, &config, ws, &hash);
+                assert(err == PHASH_OK);
+                assert(hash == expected);
+                
+                PhashPlan* plan = NULL;
+                err = phash_plan_create(&config, 120, 80, 3, &plan);
+                assert(err == PHASH_OK);
+                err = phash_plan_execute_ws(plan, pattern, ws, &hash);
+                assert(err == PHASH_OK);
+                assert(hash == expected);
+                phash_plan_destroy(plan);
+                
+                for (size_t i = 3 + bytes; i < 3 + bytes + 64; i++) {
+                    assert(workspace[i] == 0xCD);
+                }
+            }
+        }
+    }
+    
+    PhashConfig config = phash_config_default();
+    config.dct_size = 12;
+    const size_t invalid_size = phash_workspace_size(&config);
+    const size_t null_size = phash_workspace_size(NULL);
+    assert(invalid_size == 0 && null_size == 0);
+    
+    phash_image_destroy(img);
+    printf("✓ Workspace test passed\n");
+}
+
+void test_batch() {
+    static unsigned char pattern[200 * 150 * 3];
+    static PhashImage images[300];
+    static const PhashImage* items[300];
+    static uint64_t expected[300], hashes[300];
+    static PhashError errors[300];
+    static const int thread_counts[] = { 1, 2, 3, 8, 0 };
+    PhashConfig config = phash_config_default();
+    PhashError err;
+    
+    fill_pattern(pattern, 200, 150, 17);
+    
+    // Mixed geometries, runs of equal ones, one missing and one invalid image
+    for (int i = 0; i < 300; i++) {
+        images[i] = (PhashImage){ pattern + (i % 7) * 3, 20 + (i / 3) % 170,
+                                  10 + (i / 5) % 130, 3, 0 };
+        items[i] = &images[i];
+    }
+    items[17] = NULL;
+    images[40].channels = 1;
+    
+    for (int i = 0; i < 300; i++) {
+        expected[i] = 0;
+        if (items[i] && images[i].channels == 3) {
+            err = phash_compute(items[i], &config, &expected[i]);
+            assert(err == PHASH_OK);
+        }
+    }
+    
+    // Same hashes, errors and overall result for any thread count
+    for (int t = 0; t < 5; t++) {
+        PhashBatchOptions options = { thread_counts[t], errors };
+        memset(hashes, 0xFF, sizeof(hashes));
+        err = phash_compute_batch(items, 300, &config, hashes, &options);
+        assert(err == PHASH_ERR_NULL_POINTER);
+        for (int i = 0; i < 300; i++) {
+            assert(hashes[i] == expected[i]);
+            if (i == 17) assert(errors[i] == PHASH_ERR_NULL_POINTER);
+            else if (i == 40) assert(errors[i] == PHASH_ERR_INVALID_ARGUMENT);
+            else assert(errors[i] == PHASH_OK);
+        }
+    }
+    
+    items[17] = &images[17];
+    err = phash_compute_batch(items + 41, 259, &config, hashes, NULL);
+    assert(err == PHASH_OK);
+    for (int i = 41; i < 300; i++) assert(hashes[i - 41] == expected[i]);
+    
+    // The pool restarts after phash_terminate
+    phash_terminate();
+    PhashBatchOptions options = { 4, NULL };
+    err = phash_compute_batch(items + 41, 259, &config, hashes, &options);
+    assert(err == PHASH_OK);
+    for (int i = 41; i < 300; i++) assert(hashes[i - 41] == expected[i]);
+    
+    err = phash_compute_batch(items, 0, &config, hashes, NULL);
+    assert(err == PHASH_OK);
+    err = phash_compute_batch(NULL, 1, &config, hashes, NULL);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    options.num_threads = -1;
+    err = phash_compute_batch(items, 1, &config, hashes, &options);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    
+    printf("✓ Batch test passed\n");
+}
+
+void test_plan_many() {
+    static const int dims[][3] = { {61, 45, 3}, {61, 45, 4}, {40, 2, 3}, {300, 17, 3} };
+    static const size_t counts[] = { 1, 5, 16, 37 };
+    const PhashSimdLevel detected = phash_simd_level();
+    const unsigned char* pixels[37];
+    uint64_t hashes[37];
+    PhashError err;
+    
+    // Each frame gets its own exactly sized allocation so that reads past
+    // the last pixel would show under a memory checker
+    for (int d = 0; d < 4; d++) {
+        const int width = dims[d][0], height = dims[d][1], channels = dims[d][2];
+        const size_t bytes = (size_t)width*height*channels;
+        for (int i = 0; i < 37; i++) {
+            unsigned char* frame = malloc(bytes);
+            assert(frame != NULL);
+            uint32_t state = 2654435761u*(uint32_t)(i + 1) + (uint32_t)d;
+            for (size_t b = 0; b < bytes; b++) {
+                state = state*1664525u + 1013904223u;
+                frame[b] = (unsigned char)(state >> 24);
+            }
+            pixels[i] = frame;
+        }
+        
+        // Every level, for the cross-image float pipeline and a pipeline
+        // that hashes image by image, must match phash_plan_execute
+        for (int level = PHASH_SIMD_NONE; level <= PHASH_SIMD_NEON; level++) {
+            if (phash_set_simd_level((PhashSimdLevel)level) != PHASH_OK) continue;
+            for (int mode = 0; mode < 2; mode++) {
+                PhashConfig config = phash_config_default();
+                config.use_high_precision = (mode == 1);
+                PhashPlan* plan = NULL;
+                err = phash_plan_create(&config, width, height, channels, &plan);
+                assert(err == PHASH_OK);
+                
+                for (int c = 0; c < 4; c++) {
+                    memset(hashes, 0, sizeof(hashes));
+                    err = phash_plan_execute_many(plan, pixels, counts[c], hashes);
+                    assert(err == PHASH_OK);
+                    for (size_t i = 0; i < counts[c]; i++) {
+                        uint64_t expected;
+                        err = phash_plan_execute(plan, pixels[i], &expected);
+                        assert(err == PHASH_OK);
+                        assert(hashes[i] == expected);
+                    }
+                }
+                phash_plan_destroy(plan);
+            }
+        }
+        err = phash_set_simd_level(detected);
+        assert(err == PHASH_OK);
+        
+        for (int i = 0; i < 37; i++) free((void*)pixels[i]);
+    }
+    
+    // NULL plan, array or image pointer
+    PhashConfig config = phash_config_default();
+    PhashPlan* plan = NULL;
+    unsigned char frame[16 * 16 * 3] = {0};
+    const unsigned char* list[2] = { frame, NULL };
+    err = phash_plan_create(&config, 16, 16, 3, &plan);
+    assert(err == PHASH_OK);
+    err = phash_plan_execute_many(NULL, list, 1, hashes);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_plan_execute_many(plan, NULL, 1, hashes);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_plan_execute_many(plan, list, 1, NULL);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_plan_execute_many(plan, list, 2, hashes);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_plan_execute_many(plan, list, 0, hashes);
+    assert(err == PHASH_OK);
+    phash_plan_destroy(plan);
+    
+    printf("✓ Plan execute-many test passed\n");
+}
+
+void test_median_threshold() {
+    enum { WIDTH = 83, HEIGHT = 67, FRAMES = 20 };
+    static unsigned char frames[FRAMES][WIDTH * HEIGHT * 3];
+    const unsigned char* pixels[FRAMES];
+    uint64_t hashes[FRAMES];
+    PhashConfig config = phash_config_default();
+    PhashError err;
+    
+    assert(config.threshold == THRESHOLD_MEAN);
+    config.threshold = (ThresholdMode)2;
+    err = phash_config_validate(&config);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    
+    // Fingerprints tell the modes apart
+    config = phash_config_default();
+    const uint64_t mean_print = phash_config_fingerprint(&config);
+    config.threshold = THRESHOLD_MEDIAN;
+    const uint64_t median_print = phash_config_fingerprint(&config);
+    assert(median_print != mean_print);
+    
+    for (int f = 0; f < FRAMES; f++) {
+        fill_pattern(frames[f], WIDTH, HEIGHT, 3 + 7*f);
+        pixels[f] = frames[f];
+    }
+    
+    // Every pipeline and width sets exactly half of the bits (rounded
+    // down), where the mean usually does not
+    int unbalanced = 0;
+    for (int p = 0; p < 5; p++) {
+        for (int size = 5; size <= 16; size += 11) {
+            config = phash_config_default();
+            config.hash_size = size;
+            config.use_high_precision = (p == 1);
+            config.use_fixed_point = (p == 2);
+            if (p == 3) config.dct_method = DCT_METHOD_LOOKUP;
+            if (p == 4) config.dct_method = DCT_METHOD_AAN;
+            const int bits = size*size - 1;
+            
+            for (int f = 0; f < FRAMES; f++) {
+                PhashImage image = { frames[f], WIDTH, HEIGHT, 3, 0 };
+                PhashHash mean, median;
+                int set = 0;
+                config.threshold = THRESHOLD_MEAN;
+                err = phash_compute_wide(&image, &config, &mean);
+                assert(err == PHASH_OK);
+                config.threshold = THRESHOLD_MEDIAN;
+                err = phash_compute_wide(&image, &config, &median);
+                assert(err == PHASH_OK);
+                for (int w = 0; w < median.word_count; w++) {
+                    set += __builtin_popcountll(median.words[w]);
+                }
+                assert(set == bits / 2);
+                
+                set = 0;
+                for (int w = 0; w < mean.word_count; w++) {
+                    set += __builtin_popcountll(mean.words[w]);
+                }
+                unbalanced += (set != bits / 2);
+            }
+        }
+    }
+    assert(unbalanced > 0);
+    
+    // The cross-image pipeline thresholds the same way
+    config = phash_config_default();
+    config.threshold = THRESHOLD_MEDIAN;
+    PhashPlan* plan = NULL;
+    err = phash_plan_create(&config, WIDTH, HEIGHT, 3, &plan);
+    assert(err == PHASH_OK);
+    err = phash_plan_execute_many(plan, pixels, FRAMES, hashes);
+    assert(err == PHASH_OK);
+    for (int f = 0; f < FRAMES; f++) {
+        uint64_t expected;
+        err = phash_plan_execute(plan, pixels[f], &expected);
+        assert(err == PHASH_OK);
+        assert(hashes[f] == expected);
+        assert(__builtin_popcountll(expected) == 31);
+    }
+    phash_plan_destroy(plan);
+    
+    printf("✓ Median threshold test passed\n");
+}
+
+void test_multi_hash() {
+    enum { WIDTH = 120, HEIGHT = 90 };
+    static unsigned char pixels[WIDTH * HEIGHT * 3], brighter[WIDTH * HEIGHT * 3];
+    static const DCTMethod methods[] = {
+        DCT_METHOD_AUTO, DCT_METHOD_NAIVE, DCT_METHOD_LOOKUP, DCT_METHOD_AAN
+    };
+    const PhashSimdLevel detected = phash_simd_level();
+    PhashImage image = { pixels, WIDTH, HEIGHT, 3, 0 };
+    PhashConfig config = phash_config_default();
+    PhashMultiHash multi, again;
+    uint64_t expected;
+    PhashError err;
+    
+    // Natural-ish content: smooth shapes, dark enough to brighten unclipped
+    for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            unsigned char* p = pixels + (y*WIDTH + x)*3;
+            const int v = (int)(80 + 60*sin(x*0.07) * cos(y*0.05) + (x*y % 17));
+            p[0] = (unsigned char)v;
+            p[1] = (unsigned char)(v/2 + x/3);
+            p[2] = (unsigned char)(200 - v/2);
+            for (int c = 0; c < 3; c++) brighter[(y*WIDTH + x)*3 + c] = p[c] + 20;
+        }
+    }
+    
+    // The DCT hash is phash_compute's, for both precisions, every method
+    // (AUTO runs the fused pipelines) and the fixed-point pipeline
+    for (int p = 0; p < 3; p++) {
+        for (int m = 0; m < 4; m++) {
+            config = phash_config_default();
+            config.use_high_precision = (p == 1);
+            config.use_fixed_point = (p == 2);
+            config.dct_method = methods[m];
+            err = phash_compute_multi(&image, &config, &multi);
+            assert(err == PHASH_OK);
+            err = phash_compute(&image, &config, &expected);
+            assert(err == PHASH_OK);
+            assert(multi.phash == expected);
+            
+            // Same hashes with a caller workspace
+            const size_t bytes = phash_multi_workspace_size(&config);
+            assert(bytes > phash_workspace_size(&config));
+            void* workspace = malloc(bytes);
+            assert(workspace);
+            err = phash_compute_multi_ws(&image, &config, workspace, &again);
+            free(workspace);
+            assert(err == PHASH_OK);
+            assert(memcmp(&multi, &again, sizeof(multi)) == 0);
+        }
+    }
+    
+    // The fused pipelines interpolate the grid from the pixels they
+    // convert: the spatial hashes are those of the resize pipelines
+    for (int p = 0; p < 2; p++) {
+        config = phash_config_default();
+        config.use_high_precision = p;
+        err = phash_compute_multi(&image, &config, &multi);
+        assert(err == PHASH_OK);
+        config.dct_method = DCT_METHOD_LOOKUP;
+        err = phash_compute_multi(&image, &config, &again);
+        assert(err == PHASH_OK);
+        assert(multi.ahash == again.ahash);
+        assert(multi.dhash == again.dhash);
+        assert(multi.whash == again.whash);
+    }
+    
+    // Same hashes on every SIMD level; the wavelet hash is balanced
+    config = phash_config_default();
+    err = phash_compute_multi(&image, &config, &multi);
+    assert(err == PHASH_OK);
+    assert(__builtin_popcountll(multi.whash) == 31);
+    for (int level = PHASH_SIMD_NONE; level <= PHASH_SIMD_NEON; level++) {
+        if (phash_set_simd_level((PhashSimdLevel)level) != PHASH_OK) continue;
+        err = phash_compute_multi(&image, &config, &again);
+        assert(err == PHASH_OK);
+        assert(memcmp(&multi, &again, sizeof(multi)) == 0);
+    }
+    err = phash_set_simd_level(detected);
+    assert(err == PHASH_OK);
+    
+    // A uniform brightness change moves none of the three spatial hashes
+    PhashImage shifted = { brighter, WIDTH, HEIGHT, 3, 0 };
+    config.colorspace = COLORSPACE_AVERAGE;
+    err = phash_compute_multi(&image, &config, &multi);
+    assert(err == PHASH_OK);
+    err = phash_compute_multi(&shifted, &config, &again);
+    assert(err == PHASH_OK);
+    assert(multi.ahash == again.ahash);
+    assert(multi.dhash == again.dhash);
+    assert(multi.whash == again.whash);
+    
+    // Known patterns: a left-to-right ramp and a dark left half
+    for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            memset(pixels + (y*WIDTH + x)*3, 2*x, 3);
+        }
+    }
+    err = phash_compute_multi(&image, &config, &multi);
+    assert(err == PHASH_OK);
+    assert(multi.dhash == UINT64_MAX);
+    assert(multi.ahash == 0xF0F0F0F0F0F0F0F0ULL);
+    for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            memset(pixels + (y*WIDTH + x)*3, (x < WIDTH/2) ? 10 : 200, 3);
+        }
+    }
+    err = phash_compute_multi(&image, &config, &multi);
+    assert(err == PHASH_OK);
+    assert(multi.ahash == 0xF0F0F0F0F0F0F0F0ULL);
+    
+    // Invalid arguments
+    config.hash_size = 16;
+    err = phash_compute_multi(&image, &config, &multi);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    err = phash_compute_multi(NULL, &config, &multi);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    
+    printf("✓ Multi-hash test passed\n");
+}
+
+// Transform t of an RGB image as phash_compute_dihedral numbers them
+static void dihedral_image(const unsigned char* src, int width, int height, int t,
+                           unsigned char* dst, int* out_width, int* out_height) {
+    const int w = (t & 4) ? height : width, h = (t & 4) ? width : height;
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            const int tx = (t & 1) ? w - 1 - x : x, ty = (t & 2) ? h - 1 - y : y;
+            const int sx = (t & 4) ? ty : tx, sy = (t & 4) ? tx : ty;
+            memcpy(dst + (y*w + x)*3, src + (sy*width + sx)*3, 3);
+        }
+    }
+    *out_width = w;
+    *out_height = h;
+}
+
+void test_dihedral() {
+    enum { WIDTH = 96, HEIGHT = 72 };
+    static unsigned char pixels[WIDTH * HEIGHT * 3], moved[WIDTH * HEIGHT * 3];
+    PhashImage image = { pixels, WIDTH, HEIGHT, 3, 0 };
+    PhashConfig config;
+    uint64_t hashes[8], expected, canonical, other;
+    PhashError err;
+    
+    for (int y = 0; y < HEIGHT; y++) {
+        for (int x = 0; x < WIDTH; x++) {
+            unsigned char* p = pixels + (y*WIDTH + x)*3;
+            const int v = (int)(120 + 70*sin(x*0.09 + 0.4) * cos(y*0.06) + 30*(x > y));
+            p[0] = (unsigned char)v;
+            p[1] = (unsigned char)(v/2 + x);
+            p[2] = (unsigned char)(220 - v/2 - y/2);
+        }
+    }
+    
+    // Every pipeline and threshold: hash 0 is phash_compute's, and hash t
+    // is that of the transformed image: exactly for the fixed-point
+    // pipeline, within a near-threshold bit or two for floating point
+    for (int p = 0; p < 5; p++) {
+        for (int mode = THRESHOLD_MEAN; mode <= THRESHOLD_MEDIAN; mode++) {
+            config = phash_config_default();
+            config.threshold = (ThresholdMode)mode;
+            config.use_high_precision = (p == 1);
+            config.use_fixed_point = (p == 2);
+            if (p == 3) config.dct_method = DCT_METHOD_LOOKUP;
+            if (p == 4) config.hash_size = 6;
+            err = phash_compute_dihedral(&image, &config, hashes);
+            assert(err == PHASH_OK);
+            err = phash_compute(&image, &config, &expected);
+            assert(err == PHASH_OK);
+            assert(hashes[0] == expected);
+            
+            // Same hashes with a caller workspace
+            uint64_t ws_hashes[8];
+            void* workspace = malloc(phash_workspace_size(&config) + 1);
+            assert(workspace);
+            err = phash_compute_dihedral_ws(&image, &config, workspace, ws_hashes);
+            free(workspace);
+            assert(err == PHASH_OK);
+            assert(memcmp(hashes, ws_hashes, sizeof(hashes)) == 0);
+            
+            for (int t = 1; t < 8; t++) {
+                PhashImage transformed = { moved, 0, 0, 3, 0 };
+                int distance;
+                dihedral_image(pixels, WIDTH, HEIGHT, t, moved,
+                               &transformed.width, &transformed.height);
+                err = phash_compute(&transformed, &config, &expected);
+                assert(err == PHASH_OK);
+                err = phash_compare(hashes[t], expected, &distance);
+                assert(err == PHASH_OK);
+                assert(distance <= (config.use_fixed_point ? 0 : 2));
+            }
+        }
+    }
+    
+    // The canonical hash is the same for every transform of the image
+    config = phash_config_default();
+    config.use_fixed_point = 1;
+    err = phash_compute_canonical(&image, &config, &canonical);
+    assert(err == PHASH_OK);
+    err = phash_compute_dihedral(&image, &config, hashes);
+    assert(err == PHASH_OK);
+    for (int t = 0; t < 8; t++) assert(canonical <= hashes[t]);
+    for (int t = 1; t < 8; t++) {
+        PhashImage transformed = { moved, 0, 0, 3, 0 };
+        dihedral_image(pixels, WIDTH, HEIGHT, t, moved, &transformed.width, &transformed.height);
+        err = phash_compute_canonical(&transformed, &config, &other);
+        assert(err == PHASH_OK);
+        assert(other == canonical);
+    }
+    
+    // Errors
+    config = phash_config_default();
+    err = phash_compute_dihedral(NULL, &config, hashes);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_compute_dihedral(&image, &config, NULL);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_compute_canonical(&image, &config, NULL);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    config.hash_size = 12;
+    err = phash_compute_dihedral(&image, &config, hashes);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    
+    printf("✓ Dihedral hash test passed\n");
+}
+
+// Level of hash bit i in margins, from its bit planes
+static int margin_level(const PhashMargins* margins, int i) {
+    int level = 0;
+    for (int k = 0; k < margins->bits; k++) level |= (int)((margins->planes[k] >> i) & 1) << k;
+    return level;
+}
+
+void test_margins() {
+    enum { WIDTH = 160, HEIGHT = 120, IMAGES = 20, COUNT = 1003 };
+    static unsigned char pixels[WIDTH * HEIGHT * 3], noisy[WIDTH * HEIGHT * 3];
+    static uint64_t hashes[COUNT], masks[COUNT];
+    static uint8_t distances[COUNT];
+    const PhashSimdLevel detected = phash_simd_level();
+    PhashImage image = { pixels, WIDTH, HEIGHT, 3, 0 };
+    PhashImage other = { noisy, WIDTH, HEIGHT, 3, 0 };
+    PhashConfig config;
+    PhashMargins margins, noisy_margins;
+    uint64_t hash, noisy_hash, expected;
+    uint64_t state = 88172645463325252ULL;
+    int distance;
+    PhashError err;
+    
+    fill_pattern(pixels, WIDTH, HEIGHT, 11);
+    
+    // Every pipeline, threshold and width: the hash is phash_compute's and
+    // the masks follow the levels
+    for (int p = 0; p < 4; p++) {
+        for (int mode = THRESHOLD_MEAN; mode <= THRESHOLD_MEDIAN; mode++) {
+            for (int bits = PHASH_MARGIN_MIN_BITS; bits <= PHASH_MARGIN_MAX_BITS; bits++) {
+                config = phash_config_default();
+                config.threshold = (ThresholdMode)mode;
+                config.use_high_precision = (p == 1);
+                config.use_fixed_point = (p == 2);
+                if (p == 3) config.dct_method = DCT_METHOD_LOOKUP;
+                err = phash_compute_margins(&image, &config, bits, &hash, &margins);
+                assert(err == PHASH_OK);
+                err = phash_compute(&image, &config, &expected);
+                assert(err == PHASH_OK);
+                assert(hash == expected);
+                assert(margins.bits == bits);
+                
+                // Same result with a caller workspace
+                PhashMargins ws_margins;
+                uint64_t ws_hash;
+                void* workspace = malloc(phash_workspace_size(&config) + 1);
+                assert(workspace);
+                err = phash_compute_margins_ws(&image, &config, bits, workspace,
+                                               &ws_hash, &ws_margins);
+                free(workspace);
+                assert(err == PHASH_OK);
+                assert(ws_hash == hash);
+                assert(ws_margins.bits == margins.bits);
+                assert(memcmp(ws_margins.planes, margins.planes, sizeof(margins.planes)) == 0);
+                
+                int top = 0;
+                for (int i = 0; i < 63; i++) {
+                    if (margin_level(&margins, i) > top) top = margin_level(&margins, i);
+                }
+                assert(top > 0);
+                assert(margins.planes[0] >> 63 == 0);
+                const uint64_t all = phash_margin_mask(&margins, 0);
+                const uint64_t none = phash_margin_mask(&margins, 1 << bits);
+                assert(all == UINT64_MAX && none == 0);
+                for (int level = 1; level < (1 << bits); level++) {
+                    const uint64_t mask = phash_margin_mask(&margins, level);
+                    for (int i = 0; i < 64; i++) {
+                        assert(((mask >> i) & 1) == (margin_level(&margins, i) >= level));
+                    }
+                }
+            }
+        }
+    }
+    
+    // Sensor-like noise flips only level 0 bits: the distance over the
+    // bits stable in both hashes stays 0 while the plain one does not
+    config = phash_config_default();
+    int flipped = 0;
+    for (int n = 0; n < IMAGES; n++) {
+        for (int y = 0; y < HEIGHT; y++) {
+            for (int x = 0; x < WIDTH; x++) {
+                unsigned char* p = pixels + (y*WIDTH + x)*3;
+                const int v = (int)(120 + 60*sin(x*(0.03 + 0.002*n) + n) * cos(y*0.05 + n*0.3)
+                                    + 20*sin((x + y)*0.11*(1 + n % 5)));
+                p[0] = (unsigned char)v;
+                p[1] = (unsigned char)(v/2 + x/3);
+                p[2] = (unsigned char)(200 - v/2);
+            }
+        }
+        for (int i = 0; i < WIDTH * HEIGHT * 3; i++) {
+            const uint64_t r = next_random(&state);
+            const int v = pixels[i] + (int)(r % 9) - 4;
+            noisy[i] = (unsigned char)(v < 0 ? 0 : v > 255 ? 255 : v);
+        }
+        err = phash_compute_margins(&image, &config, 2, &hash, &margins);
+        assert(err == PHASH_OK);
+        err = phash_compute_margins(&other, &config, 2, &noisy_hash, &noisy_margins);
+        assert(err == PHASH_OK);
+        err = phash_compare(hash, noisy_hash, &distance);
+        assert(err == PHASH_OK);
+        flipped += distance;
+        
+        const uint64_t stable = phash_margin_mask(&noisy_margins, 1);
+        err = phash_compare_many_masked(hash, phash_margin_mask(&margins, 1), &noisy_hash,
+                                        &stable, 1, distances);
+        assert(err == PHASH_OK);
+        assert(distances[0] == 0);
+        err = phash_compare_weighted(hash, &margins, noisy_hash, &noisy_margins,
+                                     &distance);
+        assert(err == PHASH_OK);
+        assert(distance == 0);
+    }
+    assert(flipped > 0);
+    
+    // Weighted distance: the lower level of each differing bit
+    for (int n = 0; n < 200; n++) {
+        PhashMargins a = { { 0 }, 3 }, b = { { 0 }, 3 };
+        for (int k = 0; k < 3; k++) {
+            a.planes[k] = next_random(&state);
+            b.planes[k] = next_random(&state);
+        }
+        const uint64_t r = next_random(&state);
+        const uint64_t x = r, y = r * 0x9E3779B97F4A7C15ULL;
+        int reference = 0;
+        for (int i = 0; i < 64; i++) {
+            if (((x ^ y) >> i) & 1) {
+                const int la = margin_level(&a, i), lb = margin_level(&b, i);
+                reference += (la < lb) ? la : lb;
+            }
+        }
+        err = phash_compare_weighted(x, &a, y, &b, &distance);
+        assert(err == PHASH_OK);
+        assert(distance == reference);
+    }
+    
+    // Masked distances on every SIMD level, with unaligned starts and tails
+    for (int i = 0; i < COUNT; i++) {
+        hashes[i] = next_random(&state);
+        const uint64_t r = next_random(&state);
+        masks[i] = r | r >> 3;
+    }
+    const uint64_t query = 0x0F1E2D3C4B5A6978ULL, query_mask = 0xFFFF0FFFFFF0FFFFULL;
+    for (int level = PHASH_SIMD_NONE; level <= PHASH_SIMD_NEON; level++) {
+        if (phash_set_simd_level((PhashSimdLevel)level) != PHASH_OK) continue;
+        for (int offset = 0; offset < 3; offset++) {
+            const size_t count = COUNT - offset*7;
+            err = phash_compare_many_masked(query, query_mask, hashes + offset, masks + offset,
+                                            count, distances);
+            assert(err == PHASH_OK);
+            for (size_t i = 0; i < count; i++) {
+                const uint64_t diff = (query ^ hashes[offset + i]) & query_mask & masks[offset + i];
+                assert(distances[i] == __builtin_popcountll(diff));
+            }
+        }
+    }
+    err = phash_set_simd_level(detected);
+    assert(err == PHASH_OK);
+    
+    // Errors
+    config = phash_config_default();
+    err = phash_compute_margins(&image, &config, 1, &hash, &margins);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    err = phash_compute_margins(&image, &config, 5, &hash, &margins);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    err = phash_compute_margins(&image, &config, 2, NULL, &margins);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_compute_margins(&image, &config, 2, &hash, NULL);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    config.hash_size = 12;
+    err = phash_compute_margins(&image, &config, 2, &hash, &margins);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    const uint64_t null_mask = phash_margin_mask(NULL, 1);
+    assert(null_mask == 0);
+    noisy_margins.bits = 3;
+    err = phash_compare_weighted(hash, &margins, hash, &noisy_margins, &distance);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    err = phash_compare_weighted(hash, NULL, hash, &margins, &distance);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_compare_many_masked(query, query_mask, NULL, masks, 1, distances);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_compare_many_masked(query, query_mask, NULL, NULL, 0, NULL);
+    assert(err == PHASH_OK);
+    
+    printf("✓ Confidence margin test passed\n");
+}
+
 void test_hash_comparison() {
     uint64_t hash1 = 0x1234567890ABCDEF;
     uint64_t hash2 = 0x1234567890ABCDEF;
@@ -83,9 +1332,869 @@ void test_hash_comparison() {
     printf("✓ Hash comparison test passed\n");
 }
 
+void test_compare_many() {
+    enum { COUNT = 1003 };   // Not a multiple of any vector width
+    static uint64_t hashes[COUNT];
+    static uint8_t distances[COUNT];
+    static size_t indices[COUNT];
+    static const int limits[] = { 0, 5, 20, 32, 64 };
+    const PhashSimdLevel detected = phash_simd_level();
+    const uint64_t query = 0x0F1E2D3C4B5A6978ULL;
+    uint64_t state = 88172645463325252ULL;
+    PhashError err;
+    
+    // Random hashes, some exact or near copies of the query
+    for (int i = 0; i < COUNT; i++) {
+        const uint64_t r = next_random(&state);
+        hashes[i] = (i % 7 == 0) ? query ^ (r & r >> 9 & r >> 23) : r;
+    }
+    hashes[COUNT - 1] = ~query;
+    
+    // Every level must agree with phash_compare, offsets cover unaligned
+    // starts and short tails
+    for (int level = PHASH_SIMD_NONE; level <= PHASH_SIMD_NEON; level++) {
+        if (phash_set_simd_level((PhashSimdLevel)level) != PHASH_OK) continue;
+        for (int offset = 0; offset < 3; offset++) {
+            const size_t count = COUNT - offset*7;
+            const uint64_t* base = hashes + offset;
+            err = phash_compare_many(query, base, count, distances);
+            assert(err == PHASH_OK);
+            for (size_t i = 0; i < count; i++) {
+                int expected;
+                err = phash_compare(query, base[i], &expected);
+                assert(err == PHASH_OK);
+                assert(distances[i] == expected);
+            }
+            
+            for (int l = 0; l < 5; l++) {
+                size_t found = 0, next = 0;
+                err = phash_scan_within(query, base, count, limits[l], indices, &found);
+                assert(err == PHASH_OK);
+                for (size_t i = 0; i < count; i++) {
+                    if (distances[i] <= limits[l]) {
+                        assert(next < found && indices[next] == i);
+                        next++;
+                    }
+                }
+                assert(next == found);
+                if (limits[l] == 64) assert(found == count);
+            }
+        }
+    }
+    err = phash_set_simd_level(detected);
+    assert(err == PHASH_OK);
+    
+    // Empty input and invalid arguments
+    size_t found = 1;
+    err = phash_compare_many(query, NULL, 0, NULL);
+    assert(err == PHASH_OK);
+    err = phash_scan_within(query, NULL, 0, 3, NULL, &found);
+    assert(err == PHASH_OK);
+    assert(found == 0);
+    err = phash_compare_many(query, NULL, 1, distances);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_compare_many(query, hashes, 1, NULL);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_scan_within(query, hashes, 1, 3, indices, NULL);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_scan_within(query, hashes, 1, 3, NULL, &found);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_scan_within(query, hashes, 1, -1, indices, &found);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    
+    printf("✓ Compare-many test passed\n");
+}
+
+void test_wide_hash() {
+    enum { WIDTH = 90, HEIGHT = 70, COUNT = 301, IMAGES = 12 };
+    static unsigned char pixels[WIDTH * HEIGHT * 3], edited[WIDTH * HEIGHT * 3];
+    static uint64_t rows[(COUNT + 1) * PHASH_MAX_HASH_WORDS];
+    static uint16_t distances[COUNT];
+    static size_t indices[COUNT];
+    static const int sizes[] = { 9, 12, 16, 31, 32 };
+    static const int word_counts[] = { 1, 2, 3, 4, 5, 8, 13, 16 };
+    static const int limits[] = { 0, 20, 200, 1024 };
+    const PhashSimdLevel detected = phash_simd_level();
+    PhashImage image = { pixels, WIDTH, HEIGHT, 3, 0 };
+    PhashImage other = { edited, WIDTH, HEIGHT, 3, 0 };
+    PhashConfig config = phash_config_default();
+    PhashHash hash, again, moved;
+    uint64_t narrow;
+    int distance;
+    PhashError err;
+    
+    fill_pattern(pixels, WIDTH, HEIGHT, 5);
+    memcpy(edited, pixels, sizeof(pixels));
+    for (int y = 10; y < 40; y++) memset(edited + (y*WIDTH + 20)*3, 255, 30*3);
+    
+    // Configs validate up to 1024 bits
+    config.hash_size = 32;
+    err = phash_config_validate(&config);
+    assert(err == PHASH_OK);
+    int word_count = phash_hash_words(&config);
+    assert(word_count == 16);
+    config.dct_size = 64;
+    config.hash_size = 33;
+    err = phash_config_validate(&config);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    word_count = phash_hash_words(&config);
+    assert(word_count == 0);
+    
+    // Up to hash_size 8 the wide hash is the 64-bit one
+    for (int size = 2; size <= 8; size++) {
+        config = phash_config_default();
+        config.hash_size = size;
+        word_count = phash_hash_words(&config);
+        assert(word_count == 1);
+        err = phash_compute(&image, &config, &narrow);
+        assert(err == PHASH_OK);
+        err = phash_compute_wide(&image, &config, &hash);
+        assert(err == PHASH_OK);
+        assert(hash.word_count == 1 && hash.words[0] == narrow);
+    }
+    
+    // Every pipeline: deterministic, bits past hash_size^2 - 1 clear, and
+    // an edited image moves the hash. 64-bit entry points refuse the config.
+    for (int p = 0; p < 6; p++) {
+        for (int s = 0; s < 5; s++) {
+            config = phash_config_default();
+            config.hash_size = sizes[s];
+            config.use_high_precision = (p == 1);
+            config.use_fixed_point = (p == 2);
+            if (p == 3) config.dct_method = DCT_METHOD_NAIVE;
+            if (p == 4) config.dct_method = DCT_METHOD_AAN;
+            if (p == 5) config.dct_method = DCT_METHOD_LOOKUP;
+            const int bits = sizes[s]*sizes[s] - 1;
+            const int words = phash_hash_words(&config);
+            assert(words == (bits + 63) / 64);
+            
+            err = phash_compute_wide(&image, &config, &hash);
+            assert(err == PHASH_OK);
+            assert(hash.word_count == words);
+            for (int b = bits; b < PHASH_MAX_HASH_BITS; b++) {
+                assert(!((hash.words[b / 64] >> (b % 64)) & 1));
+            }
+            // Same hash with a caller workspace
+            void* workspace = malloc(phash_workspace_size(&config) + 1);
+            assert(workspace);
+            err = phash_compute_wide_ws(&image, &config, workspace, &again);
+            free(workspace);
+            assert(err == PHASH_OK);
+            err = phash_compare_wide(&hash, &again, &distance);
+            assert(err == PHASH_OK);
+            assert(distance == 0);
+            err = phash_compute_wide(&other, &config, &moved);
+            assert(err == PHASH_OK);
+            err = phash_compare_wide(&hash, &moved, &distance);
+            assert(err == PHASH_OK);
+            assert(distance > 0 && distance <= bits);
+            
+            err = phash_compute(&image, &config, &narrow);
+            assert(err == PHASH_ERR_INVALID_ARGUMENT);
+        }
+    }
+    
+    // The fixed-point pipeline stays bit-identical across SIMD levels
+    config = phash_config_default();
+    config.hash_size = 24;
+    config.use_fixed_point = 1;
+    err = phash_compute_wide(&image, &config, &hash);
+    assert(err == PHASH_OK);
+    for (int level = PHASH_SIMD_NONE; level <= PHASH_SIMD_NEON; level++) {
+        if (phash_set_simd_level((PhashSimdLevel)level) != PHASH_OK) continue;
+        err = phash_compute_wide(&image, &config, &again);
+        assert(err == PHASH_OK);
+        assert(memcmp(&hash, &again, sizeof(hash)) == 0);
+    }
+    err = phash_set_simd_level(detected);
+    assert(err == PHASH_OK);
+    
+    // Plans and batches give the same rows
+    {
+        static unsigned char patterns[IMAGES][WIDTH * HEIGHT * 3];
+        static PhashImage images[IMAGES];
+        static const PhashImage* items[IMAGES];
+        PhashError errors[IMAGES];
+        PhashBatchOptions options = { 3, errors };
+        PhashPlan* plan = NULL;
+        
+        config = phash_config_default();
+        config.hash_size = 16;
+        const int words = phash_hash_words(&config);
+        for (int i = 0; i < IMAGES; i++) {
+            fill_pattern(patterns[i], WIDTH, HEIGHT, 20 + i);
+            images[i] = (PhashImage){ patterns[i], WIDTH, HEIGHT, 3, 0 };
+            items[i] = &images[i];
+        }
+        items[7] = NULL;
+        
+        memset(rows, 0xFF, sizeof(rows));
+        err = phash_compute_batch_wide(items, IMAGES, &config, rows, &options);
+        assert(err == PHASH_ERR_NULL_POINTER);
+        err = phash_plan_create(&config, WIDTH, HEIGHT, 3, &plan);
+        assert(err == PHASH_OK);
+        for (int i = 0; i < IMAGES; i++) {
+            const uint64_t* row = rows + i*words;
+            if (i == 7) {
+                assert(errors[i] == PHASH_ERR_NULL_POINTER);
+                for (int w = 0; w < words; w++) assert(row[w] == 0);
+                continue;
+            }
+            assert(errors[i] == PHASH_OK);
+            err = phash_compute_wide(&images[i], &config, &hash);
+            assert(err == PHASH_OK);
+            assert(memcmp(row, hash.words, words*sizeof(uint64_t)) == 0);
+            err = phash_plan_execute_wide(plan, patterns[i], &again);
+            assert(err == PHASH_OK);
+            assert(memcmp(&hash, &again, sizeof(hash)) == 0);
+        }
+        err = phash_plan_execute(plan, patterns[0], &narrow);
+        assert(err == PHASH_ERR_INVALID_ARGUMENT);
+        err = phash_compute_batch(items, IMAGES, &config, rows, NULL);
+        assert(err == PHASH_ERR_INVALID_ARGUMENT);
+        phash_plan_destroy(plan);
+    }
+    
+    // One-vs-many distances and scans agree with a plain popcount on every
+    // level, for every width and a misaligned start
+    uint64_t state = 0x2545F4914F6CDD1DULL;
+    for (size_t i = 0; i < sizeof(rows) / sizeof(rows[0]); i++) {
+        rows[i] = next_random(&state);
+    }
+    for (int level = PHASH_SIMD_NONE; level <= PHASH_SIMD_NEON; level++) {
+        if (phash_set_simd_level((PhashSimdLevel)level) != PHASH_OK) continue;
+        for (int w = 0; w < 8; w++) {
+            const int words = word_counts[w];
+            const uint64_t* base = rows + 1;
+            PhashHash query = { .word_count = words };
+            memcpy(query.words, rows + 5*words + 1, words*sizeof(uint64_t));
+            query.words[0] ^= 0x11;   // Row 5 at distance 2
+            
+            err = phash_compare_many_wide(&query, base, COUNT, distances);
+            assert(err == PHASH_OK);
+            for (size_t i = 0; i < COUNT; i++) {
+                int expected = 0;
+                for (int k = 0; k < words; k++) {
+                    expected += __builtin_popcountll(query.words[k] ^ base[i*words + k]);
+                }
+                assert(distances[i] == expected);
+            }
+            assert(distances[5] == 2);
+            
+            for (int l = 0; l < 4; l++) {
+                size_t found = 0, next = 0;
+                err = phash_scan_within_wide(&query, base, COUNT, limits[l], indices, &found);
+                assert(err == PHASH_OK);
+                for (size_t i = 0; i < COUNT; i++) {
+                    if (distances[i] <= limits[l]) {
+                        assert(next < found && indices[next] == i);
+                        next++;
+                    }
+                }
+                assert(next == found);
+            }
+        }
+    }
+    err = phash_set_simd_level(detected);
+    assert(err == PHASH_OK);
+    
+    // Invalid arguments
+    hash.word_count = 4;
+    again.word_count = 3;
+    err = phash_compare_wide(&hash, &again, &distance);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    again.word_count = 0;
+    err = phash_compare_many_wide(&again, rows, 1, distances);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    err = phash_compare_wide(&hash, NULL, &distance);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    size_t found;
+    err = phash_scan_within_wide(&hash, rows, 1, -1, indices, &found);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    
+    printf("✓ Wide hash test passed\n");
+}
+
+void test_all_pairs() {
+    enum { COUNT_A = 1500, COUNT_B = 333 };   // Several row blocks, partial tiles
+    static uint64_t a[COUNT_A], b[COUNT_B];
+    static uint8_t matrix[COUNT_A * COUNT_B];
+    static const int threads[] = { 1, 4 };
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    PhashError err;
+    
+    // Clusters of near-duplicates among random hashes
+    for (int i = 0; i < COUNT_A; i++) {
+        const uint64_t r = next_random(&state);
+        a[i] = (i % 5 == 0 && i) ? a[i - 5] ^ (r & r >> 11 & r >> 29) : r;
+    }
+    for (int j = 0; j < COUNT_B; j++) {
+        const uint64_t r = next_random(&state);
+        b[j] = (j % 3 == 0) ? a[(j * 7) % COUNT_A] ^ (r & r >> 13) : r;
+    }
+    
+    for (int t = 0; t < 2; t++) {
+        PhashBatchOptions options = { .num_threads = threads[t] };
+        
+        err = phash_distance_matrix(a, COUNT_A, b, COUNT_B, matrix, &options);
+        assert(err == PHASH_OK);
+        for (int i = 0; i < COUNT_A; i++) {
+            for (int j = 0; j < COUNT_B; j++) {
+                int expected;
+                err = phash_compare(a[i], b[j], &expected);
+                assert(err == PHASH_OK);
+                assert(matrix[i*COUNT_B + j] == expected);
+            }
+        }
+        
+        // Self-join against brute force, in (a, b) order
+        PhashPair* pairs = NULL;
+        size_t count = 0, next = 0;
+        err = phash_pairs_within(a, COUNT_A, 10, &pairs, &count, &options);
+        assert(err == PHASH_OK && count > 0);
+        for (size_t i = 0; i < COUNT_A; i++) {
+            for (size_t j = i + 1; j < COUNT_A; j++) {
+                int d;
+                phash_compare(a[i], a[j], &d);
+                if (d > 10) continue;
+                assert(next < count);
+                assert(pairs[next].a == i && pairs[next].b == j && pairs[next].distance == d);
+                next++;
+            }
+        }
+        assert(next == count);
+        phash_pairs_free(pairs);
+        
+        // Join of two sets
+        next = 0;
+        err = phash_join_within(a, COUNT_A, b, COUNT_B, 12, &pairs, &count, &options);
+        assert(err == PHASH_OK && count > 0);
+        for (size_t i = 0; i < COUNT_A; i++) {
+            for (size_t j = 0; j < COUNT_B; j++) {
+                if (matrix[i*COUNT_B + j] > 12) continue;
+                assert(next < count);
+                assert(pairs[next].a == i && pairs[next].b == j &&
+                       pairs[next].distance == matrix[i*COUNT_B + j]);
+                next++;
+            }
+        }
+        assert(next == count);
+        phash_pairs_free(pairs);
+    }
+    
+    // Empty input and invalid arguments
+    PhashPair* pairs = (PhashPair*)1;
+    size_t count = 1;
+    err = phash_pairs_within(NULL, 0, 3, &pairs, &count, NULL);
+    assert(err == PHASH_OK);
+    assert(pairs == NULL && count == 0);
+    err = phash_join_within(a, COUNT_A, NULL, 0, 3, &pairs, &count, NULL);
+    assert(err == PHASH_OK);
+    assert(pairs == NULL && count == 0);
+    err = phash_distance_matrix(a, COUNT_A, NULL, 0, NULL, NULL);
+    assert(err == PHASH_OK);
+    err = phash_distance_matrix(a, 1, b, 1, NULL, NULL);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_pairs_within(a, 1, 3, NULL, &count, NULL);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_pairs_within(a, 1, -1, &pairs, &count, NULL);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    PhashBatchOptions bad = { .num_threads = -1 };
+    err = phash_pairs_within(a, 1, 3, &pairs, &count, &bad);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    
+    printf("✓ All-pairs test passed\n");
+}
+
+static int compare_match_distances(const void* x, const void* y) {
+    const PhashMatch* a = x;
+    const PhashMatch* b = y;
+    if (a->distance != b->distance) return a->distance - b->distance;
+    return (a->id > b->id) - (a->id < b->id);
+}
+
+static int compare_match_ids(const void* x, const void* y) {
+    const PhashMatch* a = x;
+    const PhashMatch* b = y;
+    return (a->id > b->id) - (a->id < b->id);
+}
+
+void test_knn() {
+    enum { COUNT = 200003, SMALL = 37 };   // Several blocks of the threaded scan
+    static uint64_t hashes[COUNT];
+    static PhashMatch expected[COUNT];
+    static size_t ids[COUNT + 5];
+    static uint8_t distances[COUNT + 5];
+    static const size_t ks[] = { 1, 5, 100, 1000 };
+    uint64_t state = 0xE7037ED1A0B428DBULL;
+    PhashError err;
+    
+    // Many exact duplicates and ties
+    for (int i = 0; i < COUNT; i++) {
+        const uint64_t r = next_random(&state);
+        hashes[i] = (i % 3 == 0 && i > 300) ? hashes[(r >> 20) % 300] ^ (r & r >> 23 & r >> 43)
+                                            : r;
+    }
+    
+    for (int q = 0; q < 6; q++) {
+        const uint64_t query = (q % 2) ? hashes[q * 50] : ~hashes[q];
+        for (int i = 0; i < COUNT; i++) {
+            int d;
+            phash_compare(query, hashes[i], &d);
+            expected[i] = (PhashMatch){ (size_t)i, d };
+        }
+        qsort(expected, COUNT, sizeof(PhashMatch), compare_match_distances);
+        
+        for (int v = 0; v < 4; v++) {
+            for (int threaded = 0; threaded < 2; threaded++) {
+                PhashBatchOptions options = { .num_threads = 4 };
+                size_t found = 0;
+                err = threaded
+                    ? phash_knn_threaded(query, hashes, COUNT, ks[v], ids, distances, &found, &options)
+                    : phash_knn(query, hashes, COUNT, ks[v], ids, distances, &found);
+                assert(err == PHASH_OK && found == ks[v]);
+                for (size_t k = 0; k < found; k++) {
+                    assert(ids[k] == expected[k].id && distances[k] == expected[k].distance);
+                }
+            }
+        }
+    }
+    
+    // k above count returns every hash, sorted
+    size_t found = 0;
+    err = phash_knn(hashes[0], hashes, SMALL, SMALL + 5, ids, NULL, &found);
+    assert(err == PHASH_OK);
+    assert(found == SMALL && ids[0] == 0);
+    err = phash_knn_threaded(hashes[0], hashes, SMALL, SMALL + 5, ids, distances, &found,
+                             NULL);
+    assert(err == PHASH_OK);
+    assert(found == SMALL && ids[0] == 0 && distances[0] == 0);
+    
+    // Empty input and invalid arguments
+    err = phash_knn(1, NULL, 0, 3, ids, distances, &found);
+    assert(err == PHASH_OK && found == 0);
+    err = phash_knn(1, hashes, COUNT, 0, NULL, NULL, &found);
+    assert(err == PHASH_OK && found == 0);
+    err = phash_knn(1, hashes, COUNT, 3, NULL, distances, &found);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_knn(1, hashes, COUNT, 3, ids, distances, NULL);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    
+    printf("✓ k-nearest-neighbor test passed\n");
+}
+
+void test_bktree() {
+    enum { COUNT = 5000 };
+    static uint64_t hashes[COUNT];
+    static PhashMatch matches[COUNT];
+    static size_t indices[COUNT];
+    static const int radii[] = { 0, 3, 10, 64 };
+    uint64_t state = 0x2545F4914F6CDD1DULL;
+    PhashBkTree* tree = NULL;
+    PhashError err;
+    
+    // Near-duplicate clusters and exact duplicates among random hashes
+    err = phash_bktree_create(&tree);
+    assert(err == PHASH_OK);
+    for (int i = 0; i < COUNT; i++) {
+        const uint64_t r = next_random(&state);
+        hashes[i] = (i % 4 == 0 && i) ? hashes[i - 4] ^ (r & r >> 17 & r >> 31)
+                  : (i % 50 == 1 && i > 1) ? hashes[i - 50] : r;
+        err = phash_bktree_insert(tree, hashes[i], (size_t)i);
+        assert(err == PHASH_OK);
+    }
+    const size_t size = phash_bktree_size(tree);
+    assert(size == COUNT);
+    
+    // Range queries agree with a linear scan, before and after the arena
+    // is reordered
+    for (int q = 0; q < 100; q++) {
+        if (q == 50) {
+            err = phash_bktree_optimize(tree);
+            assert(err == PHASH_OK);
+        }
+        const uint64_t query = (q % 2) ? hashes[q * 43] ^ (1ULL << (q % 64)) : hashes[q * 47];
+        for (int r = 0; r < 4; r++) {
+            size_t found = 0, expected = 0;
+            err = phash_bktree_query(tree, query, radii[r], matches, COUNT, &found);
+            assert(err == PHASH_OK);
+            err = phash_scan_within(query, hashes, COUNT, radii[r], indices, &expected);
+            assert(err == PHASH_OK);
+            assert(found == expected);
+            qsort(matches, found, sizeof(PhashMatch), compare_match_ids);
+            for (size_t k = 0; k < found; k++) {
+                int d;
+                phash_compare(query, hashes[indices[k]], &d);
+                assert(matches[k].id == indices[k] && matches[k].distance == d);
+            }
+        }
+        
+        // Nearest neighbor: smallest distance, lowest id among ties
+        PhashMatch best;
+        size_t best_id = 0;
+        int best_distance = 65;
+        for (size_t i = 0; i < COUNT; i++) {
+            int d;
+            phash_compare(query, hashes[i], &d);
+            if (d < best_distance) { best_distance = d; best_id = i; }
+        }
+        err = phash_bktree_nearest(tree, query, &best);
+        assert(err == PHASH_OK);
+        assert(best.id == best_id && best.distance == best_distance);
+    }
+    
+    // Inserts after optimizing
+    size_t found = 0;
+    err = phash_bktree_insert(tree, ~hashes[7], COUNT);
+    assert(err == PHASH_OK);
+    err = phash_bktree_query(tree, ~hashes[7], 0, matches, COUNT, &found);
+    assert(err == PHASH_OK);
+    assert(found >= 1);
+    
+    // Capacity limits what is written, not what is counted
+    err = phash_bktree_query(tree, hashes[0], 64, matches, 10, &found);
+    assert(err == PHASH_OK);
+    assert(found == COUNT + 1);
+    err = phash_bktree_query(tree, hashes[0], 64, NULL, 0, &found);
+    assert(err == PHASH_OK);
+    assert(found == COUNT + 1);
+    phash_bktree_destroy(tree);
+    
+    // Empty tree and invalid arguments
+    PhashMatch best;
+    err = phash_bktree_create(&tree);
+    assert(err == PHASH_OK);
+    err = phash_bktree_query(tree, 1, 5, matches, COUNT, &found);
+    assert(err == PHASH_OK && found == 0);
+    err = phash_bktree_nearest(tree, 1, &best);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    err = phash_bktree_optimize(tree);
+    assert(err == PHASH_OK);
+    err = phash_bktree_query(tree, 1, -1, matches, COUNT, &found);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    err = phash_bktree_query(tree, 1, 5, NULL, 1, &found);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_bktree_insert(NULL, 1, 0);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_bktree_create(NULL);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    phash_bktree_destroy(tree);
+    
+    printf("✓ BK-tree test passed\n");
+}
+
+void test_mih() {
+    enum { COUNT = 20000, QUERIES = 100 };
+    static uint64_t hashes[COUNT], queries[QUERIES];
+    static PhashMatch matches[COUNT];
+    static size_t indices[COUNT];
+    static bool removed[COUNT];
+    static const int substrings[] = { 0, 2, 5, 16 };
+    static const int radii[] = { 0, 3, 8, 10 };
+    uint64_t state = 0xD1B54A32D192ED03ULL;
+    PhashError err;
+    
+    for (int i = 0; i < COUNT; i++) {
+        const uint64_t r = next_random(&state);
+        hashes[i] = (i % 8 && i > 8) ? hashes[i - 8] ^ (r & r >> 19 & r >> 37)
+                                     : r;
+    }
+    for (int q = 0; q < QUERIES; q++) {
+        const uint64_t r = next_random(&state);
+        queries[q] = hashes[(q * 131) % COUNT] ^ (r & r >> 7 & r >> 41);
+    }
+    
+    for (int m = 0; m < 4; m++) {
+        PhashMihIndex* index = NULL;
+        err = phash_mih_create(substrings[m], &index);
+        assert(err == PHASH_OK);
+        for (int i = 0; i < COUNT; i++) {
+            err = phash_mih_insert(index, hashes[i], (size_t)i);
+            assert(err == PHASH_OK);
+        }
+        
+        // Remove a tenth of the entries, then put some back
+        memset(removed, 0, sizeof(removed));
+        for (int i = 3; i < COUNT; i += 10) {
+            err = phash_mih_remove(index, hashes[i], (size_t)i);
+            assert(err == PHASH_OK);
+            removed[i] = true;
+        }
+        err = phash_mih_remove(index, hashes[3], 3);
+        assert(err == PHASH_ERR_INVALID_ARGUMENT);
+        for (int i = 3; i < COUNT; i += 100) {
+            err = phash_mih_insert(index, hashes[i], (size_t)i);
+            assert(err == PHASH_OK);
+            removed[i] = false;
+        }
+        const size_t size = phash_mih_size(index);
+        assert(size == COUNT - (COUNT / 10) + COUNT / 100);
+        
+        for (int r = 0; r < 4; r++) {
+            PhashBatchOptions options = { .num_threads = 3 };
+            PhashPair* pairs = NULL;
+            size_t pair_count = 0, next = 0;
+            err = phash_mih_query_many(index, queries, QUERIES, radii[r], &pairs, &pair_count,
+                                       &options);
+            assert(err == PHASH_OK);
+            
+            // Every query agrees with a linear scan over the live entries
+            for (int q = 0; q < QUERIES; q++) {
+                size_t found = 0, scanned = 0, expected = 0;
+                err = phash_mih_query(index, queries[q], radii[r], matches, COUNT, &found);
+                assert(err == PHASH_OK);
+                err = phash_scan_within(queries[q], hashes, COUNT, radii[r], indices,
+                                        &scanned);
+                assert(err == PHASH_OK);
+                qsort(matches, found, sizeof(PhashMatch), compare_match_ids);
+                for (size_t k = 0; k < scanned; k++) {
+                    if (removed[indices[k]]) continue;
+                    int d;
+                    phash_compare(queries[q], hashes[indices[k]], &d);
+                    assert(expected < found);
+                    assert(matches[expected].id == indices[k] && matches[expected].distance == d);
+                    assert(next < pair_count && pairs[next].a == (size_t)q &&
+                           pairs[next].b == indices[k] && pairs[next].distance == d);
+                    expected++;
+                    next++;
+                }
+                assert(expected == found);
+            }
+            assert(next == pair_count);
+            phash_pairs_free(pairs);
+        }
+        phash_mih_destroy(index);
+    }
+    
+    // Invalid arguments
+    PhashMihIndex* index = NULL;
+    size_t found = 0;
+    err = phash_mih_create(17, &index);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    err = phash_mih_create(-1, &index);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    err = phash_mih_create(4, NULL);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_mih_create(4, &index);
+    assert(err == PHASH_OK);
+    err = phash_mih_query(index, 1, 5, matches, COUNT, &found);
+    assert(err == PHASH_OK && found == 0);
+    err = phash_mih_query(index, 1, -1, matches, COUNT, &found);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    err = phash_mih_remove(index, 1, 0);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    err = phash_mih_insert(NULL, 1, 0);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    phash_mih_destroy(index);
+    
+    // One 64-bit table would probe C(64, <= 10) keys at radius 10; the
+    // query scans its single entry instead
+    err = phash_mih_create(1, &index);
+    assert(err == PHASH_OK);
+    err = phash_mih_insert(index, 0x3FF, 7);
+    assert(err == PHASH_OK);
+    err = phash_mih_query(index, 0, 10, matches, COUNT, &found);
+    assert(err == PHASH_OK);
+    assert(found == 1 && matches[0].id == 7 && matches[0].distance == 10);
+    phash_mih_destroy(index);
+    
+    printf("✓ Multi-index hashing test passed\n");
+}
+
+static size_t find_root(size_t* parent, size_t x) {
+    while (parent[x] != x) x = parent[x];
+    return x;
+}
+
+void test_cluster() {
+    enum { COUNT = 6000 };
+    static uint64_t hashes[COUNT];
+    static size_t labels[COUNT], parent[COUNT], expected[COUNT];
+    static const int radii[] = { 0, 4, 10 };
+    static const int threads[] = { 1, 4 };
+    uint64_t state = 0x8BB84B93962EACC9ULL;
+    PhashError err;
+    
+    // Chains of near copies, so clusters also join through intermediates
+    for (int i = 0; i < COUNT; i++) {
+        const uint64_t r = next_random(&state);
+        hashes[i] = (i % 6 && i > 6) ? hashes[i - 1 - (r >> 60) % 6] ^
+                                       (r & r >> 11 & r >> 29)
+                                     : r;
+    }
+    
+    for (int r = 0; r < 3; r++) {
+        // Brute force: union-find over every pair within the radius
+        PhashPair* pairs = NULL;
+        size_t pair_count = 0, clusters = 0, next = 0;
+        err = phash_pairs_within(hashes, COUNT, radii[r], &pairs, &pair_count, NULL);
+        assert(err == PHASH_OK);
+        for (size_t i = 0; i < COUNT; i++) parent[i] = i;
+        for (size_t k = 0; k < pair_count; k++) {
+            const size_t a = find_root(parent, pairs[k].a), b = find_root(parent, pairs[k].b);
+            if (a != b) parent[(a > b) ? a : b] = (a < b) ? a : b;
+        }
+        phash_pairs_free(pairs);
+        for (size_t i = 0; i < COUNT; i++) {
+            const size_t root = find_root(parent, i);
+            expected[i] = (root == i) ? next++ : expected[root];
+        }
+        
+        for (int t = 0; t < 2; t++) {
+            PhashBatchOptions options = { .num_threads = threads[t] };
+            err = phash_cluster(hashes, COUNT, radii[r], labels, &clusters, &options);
+            assert(err == PHASH_OK);
+            assert(clusters == next);
+            assert(memcmp(labels, expected, sizeof(labels)) == 0);
+        }
+        if (radii[r] == 10) assert(clusters < COUNT / 2);
+    }
+    
+    // Empty input and invalid arguments
+    size_t clusters = 1;
+    err = phash_cluster(NULL, 0, 3, NULL, &clusters, NULL);
+    assert(err == PHASH_OK && clusters == 0);
+    err = phash_cluster(hashes, COUNT, -1, labels, &clusters, NULL);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    err = phash_cluster(hashes, COUNT, 3, NULL, &clusters, NULL);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    err = phash_cluster(hashes, COUNT, 3, labels, NULL, NULL);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    
+    printf("✓ Clustering test passed\n");
+}
+
+void test_index_file() {
+    enum { COUNT = 5000 };
+    static uint64_t hashes[COUNT], ids[COUNT];
+    static PhashMatch matches[COUNT];
+    static size_t indices[COUNT];
+    static const int substrings[] = { 0, 4, 3 };
+    const char* path = "test_phash_index.bin";
+    PhashConfig config = phash_config_default();
+    const uint64_t fingerprint = phash_config_fingerprint(&config);
+    uint64_t state = 0xA0761D6478BD642FULL;
+    PhashError err;
+    
+    for (int i = 0; i < COUNT; i++) {
+        const uint64_t r = next_random(&state);
+        hashes[i] = (i % 5 && i > 5) ? hashes[i - 5] ^ (r & r >> 13 & r >> 29)
+                                     : r;
+        ids[i] = (uint64_t)i * 3 + 7;
+    }
+    
+    for (int m = 0; m < 3; m++) {
+        PhashIndexFile* file = NULL;
+        err = phash_index_write(path, &config, hashes, (m == 2) ? NULL : ids, COUNT,
+                                substrings[m]);
+        assert(err == PHASH_OK);
+        err = phash_index_open(path, &config, &file);
+        assert(err == PHASH_OK);
+        const size_t stored_count = phash_index_count(file);
+        const uint64_t stored_fingerprint = phash_index_fingerprint(file);
+        assert(stored_count == COUNT);
+        assert(stored_fingerprint == fingerprint);
+        
+        // Columns are mapped aligned, as written
+        const uint64_t* stored = phash_index_hashes(file);
+        const uint64_t* stored_ids = phash_index_ids(file);
+        assert((uintptr_t)stored % 64 == 0 && (uintptr_t)stored_ids % 64 == 0);
+        assert(memcmp(stored, hashes, sizeof(hashes)) == 0);
+        for (int i = 0; i < COUNT; i++) assert(stored_ids[i] == ((m == 2) ? (uint64_t)i : ids[i]));
+        
+        // Queries, through the tables or the scan, match a linear scan
+        for (int q = 0; q < 40; q++) {
+            const uint64_t query = hashes[q * 101] ^ (1ULL << q);
+            for (int r = 0; r <= 12; r += 4) {
+                size_t found = 0, expected = 0;
+                err = phash_index_query(file, query, r, matches, COUNT, &found);
+                assert(err == PHASH_OK);
+                err = phash_scan_within(query, hashes, COUNT, r, indices, &expected);
+                assert(err == PHASH_OK);
+                assert(found == expected);
+                qsort(matches, found, sizeof(PhashMatch), compare_match_ids);
+                for (size_t k = 0; k < found; k++) {
+                    int d;
+                    phash_compare(query, hashes[indices[k]], &d);
+                    assert(matches[k].id == stored_ids[indices[k]] && matches[k].distance == d);
+                }
+            }
+        }
+        phash_index_close(file);
+    }
+    
+    // A file claiming one 64-bit table instead of four still answers a
+    // wide query, by scanning the hash column rather than probing
+    // C(64, <= 12) keys
+    PhashIndexFile* file = NULL;
+    uint32_t one_table = 1;
+    size_t found = 0, expected = 0;
+    err = phash_index_write(path, &config, hashes, ids, COUNT, 4);
+    assert(err == PHASH_OK);
+    FILE* f = fopen(path, "r+b");
+    assert(f);
+    fseek(f, 64, SEEK_SET);   // IndexHeader.mih_substrings
+    fwrite(&one_table, sizeof(one_table), 1, f);
+    fclose(f);
+    err = phash_index_open(path, &config, &file);
+    assert(err == PHASH_OK);
+    err = phash_index_query(file, hashes[0], 12, matches, COUNT, &found);
+    assert(err == PHASH_OK);
+    err = phash_scan_within(hashes[0], hashes, COUNT, 12, indices, &expected);
+    assert(err == PHASH_OK);
+    assert(found == expected && found > 0);
+    phash_index_close(file);
+    
+    // Config mismatches, damaged and missing files are rejected
+    PhashConfig other = config;
+    other.hash_size = 7;
+    const uint64_t other_fingerprint = phash_config_fingerprint(&other);
+    assert(other_fingerprint != fingerprint);
+    err = phash_index_open(path, &other, &file);
+    assert(err == PHASH_ERR_FORMAT);
+    err = phash_index_open(path, NULL, &file);
+    assert(err == PHASH_OK);
+    phash_index_close(file);
+    
+    f = fopen(path, "r+b");
+    assert(f);
+    fseek(f, 0, SEEK_END);
+    fputc(0, f);   // Size no longer matches the header
+    fclose(f);
+    err = phash_index_open(path, &config, &file);
+    assert(err == PHASH_ERR_FORMAT);
+    remove(path);
+    err = phash_index_open(path, &config, &file);
+    assert(err == PHASH_ERR_IO);
+    
+    // Empty index
+    found = 1;
+    err = phash_index_write(path, &config, NULL, NULL, 0, 4);
+    assert(err == PHASH_OK);
+    err = phash_index_open(path, &config, &file);
+    assert(err == PHASH_OK);
+    const size_t empty_count = phash_index_count(file);
+    assert(empty_count == 0);
+    err = phash_index_query(file, 1, 10, matches, COUNT, &found);
+    assert(err == PHASH_OK && found == 0);
+    phash_index_close(file);
+    remove(path);
+    
+    err = phash_index_write(path, &config, hashes, ids, COUNT, 17);
+    assert(err == PHASH_ERR_INVALID_ARGUMENT);
+    err = phash_index_write(NULL, &config, hashes, ids, COUNT, 0);
+    assert(err == PHASH_ERR_NULL_POINTER);
+    const uint64_t null_fingerprint = phash_config_fingerprint(NULL);
+    assert(null_fingerprint == 0);
+    
+    printf("✓ Index file test passed\n");
+}
+
 void test_error_handling() {
     assert(strcmp(phash_error_string(PHASH_OK), "Success") == 0);
     assert(phash_error_string(PHASH_ERR_NULL_POINTER) != NULL);
+    const char* format_error = phash_error_string(PHASH_ERR_FORMAT);
+    assert(strcmp(format_error, "Unknown error") != 0);
     printf("✓ Error handling test passed\n");
 }
 
@@ -96,7 +2205,32 @@ int main() {
     test_image_creation();
     test_config_validation();
     test_hash_computation();
+    test_dct_sizes();
+    test_truncated_dct();
+    test_dct_methods();
+    test_dct_reference();
+    test_fused_projection();
+    test_simd_dispatch();
+    test_single_precision();
+    test_fixed_point();
+    test_concurrent_compute();
+    test_plan();
+    test_workspace();
+    test_batch();
+    test_plan_many();
+    test_median_threshold();
+    test_multi_hash();
+    test_dihedral();
+    test_margins();
     test_hash_comparison();
+    test_compare_many();
+    test_wide_hash();
+    test_all_pairs();
+    test_knn();
+    test_bktree();
+    test_mih();
+    test_cluster();
+    test_index_file();
     test_error_handling();
     
     phash_terminate();